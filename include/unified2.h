@@ -5,6 +5,7 @@
  ******************************************************************************/
 
 #include <stdio.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 /** UNIFIED2 FILE STRUCTURES **************************************************/
@@ -128,6 +129,28 @@ typedef struct _Unified2ExtraData {
 } Unified2ExtraData;
 // 24 byes
 
+/* blob_length counts itself and data_type, the data is 8 bytes shorter. When
+ * read, the data immediately follows the Unified2ExtraData structure. */
+#define UNIFIED2_EXTRA_DATA_LENGTH(x) ((x)->blob_length - 8)
+#define UNIFIED2_EXTRA_DATA_BLOB(x) ((const uint8_t *)((x) + 1))
+
+/* Unified2ExtraData types */
+typedef enum _EXTRA_DATA_TYPE {
+    UNIFIED2_EXTRA_XFF_IPV4 = 1,
+    UNIFIED2_EXTRA_XFF_IPV6 = 2,
+    UNIFIED2_EXTRA_REVIEWED_BY = 3,
+    UNIFIED2_EXTRA_GZIP_DATA = 4,
+    UNIFIED2_EXTRA_SMTP_FILENAME = 5,
+    UNIFIED2_EXTRA_SMTP_MAILFROM = 6,
+    UNIFIED2_EXTRA_SMTP_RCPTTO = 7,
+    UNIFIED2_EXTRA_SMTP_EMAIL_HDRS = 8,
+    UNIFIED2_EXTRA_HTTP_URI = 9,
+    UNIFIED2_EXTRA_HTTP_HOSTNAME = 10,
+    UNIFIED2_EXTRA_IPV6_SRC = 11,
+    UNIFIED2_EXTRA_IPV6_DST = 12,
+    UNIFIED2_EXTRA_JSNORM_DATA = 13,
+} EXTRA_DATA_TYPE;
+
 typedef struct _DataBlob {
     uint32_t length;
     const uint8_t *data;
@@ -148,13 +171,117 @@ typedef struct _Unified2Entry {
     Unified2ExtraData       *extra_data;
 } Unified2Entry;
 
+/* A record as Unified2ReadNextRecord() leaves it: the header and a fixed body
+ * inline, tagged by record.type, in host order. What follows the body stays
+ * in the reader's buffer and is only valid until the next read on the handle:
+ * data is the packet data of a packet, the blob of extra data, and the whole
+ * body of a type not decoded. Nothing in it is allocated or needs freeing. */
+typedef struct _Unified2Record {
+    Unified2RecordHeader record;
+    union {
+        Unified2Event event;
+        Unified2Event_v2 event_v2;
+        Unified2Event6 event6;
+        Unified2Event6_v2 event6_v2;
+        Unified2Packet packet;
+    } body;
+    const uint8_t *data;
+    uint32_t data_length;
+
+    /* extra data, with the blob right after it like Unified2ReadExtraData() */
+    const Unified2ExtraData *extra_data;
+} Unified2Record;
+
+/* Unified2NormalizedEvent flags */
+#define UNIFIED2_EVENT_IPV6 0x1     /* the addresses are not IPv4 mapped */
+#define UNIFIED2_EVENT_V2   0x2     /* mpls_label, vlan_id and policy_id are set */
+
+/* Any of the event records, decoded by Unified2DecodeEvent() in one pass.
+ * Numbers are in host order; addresses stay in network order, IPv4 ones as
+ * IPv4 mapped IPv6 addresses. The fields filters and aggregates look at fill
+ * the first cache line, the rest follow in the second. */
+typedef struct _Unified2NormalizedEvent {
+    struct in6_addr ip_source;
+    struct in6_addr ip_destination;
+    uint32_t signature_id;
+    uint32_t generator_id;
+    uint32_t sensor_id;
+    uint32_t event_id;
+    uint32_t event_second;
+    uint32_t priority_id;
+    uint16_t sport_itype;
+    uint16_t dport_icode;
+    uint8_t  protocol;
+    uint8_t  packet_action;
+    uint8_t  flags;
+    uint8_t  pad;
+
+    uint32_t event_microsecond;
+    uint32_t signature_revision;
+    uint32_t classification_id;
+    uint32_t mpls_label;
+    uint16_t vlan_id;
+    uint16_t policy_id;
+    uint32_t type;              /* the record type it was decoded from */
+} __attribute__((aligned(64))) Unified2NormalizedEvent;
+// 128 bytes
+
 typedef enum _READ_MODE {
     NONE,
     STREAM,
     DESCRIPTOR,
     MEMORY,
+    DIRECT,
+    COMPRESSED,
+    DECOMPRESS,
+    SHARED_MEMORY,
+    MAPPED,
 } READ_MODE;
 
+typedef struct _Unified2Durability Unified2Durability;
+typedef struct _Unified2DirectWriter Unified2DirectWriter;
+typedef struct _Unified2Compressed Unified2Compressed;
+typedef struct _Unified2Decompressor Unified2Decompressor;
+typedef struct _Unified2Ring Unified2Ring;
+typedef struct _Unified2Summary Unified2Summary;
+typedef struct _Unified2Filter Unified2Filter;
+typedef struct _Unified2Search Unified2Search;
+typedef struct _Unified2Generator Unified2Generator;
+typedef struct _Unified2Stats Unified2Stats;
+typedef struct _Unified2Dispatcher Unified2Dispatcher;
+typedef struct _Unified2Pipeline Unified2Pipeline;
+typedef struct _Unified2Archive Unified2Archive;
+typedef struct _Unified2Diagnostics Unified2Diagnostics;
+
+/* Problems a handle runs into, see Unified2GetError() and Unified2Strerror() */
+typedef enum _UNIFIED2_DIAG {
+    UNIFIED2_DIAG_NONE,
+    UNIFIED2_DIAG_SKIPPED,      /* a record of a type not decoded */
+    UNIFIED2_DIAG_SHORT_RECORD, /* shorter than its type needs */
+    UNIFIED2_DIAG_TRUNCATED,    /* input ended inside a record */
+    UNIFIED2_DIAG_BAD_LENGTH,
+    UNIFIED2_DIAG_INVALID,      /* nothing that could be written */
+    UNIFIED2_DIAG_WRITE,
+    UNIFIED2_DIAG_NOMEM,
+    UNIFIED2_DIAGS
+} UNIFIED2_DIAG;
+
+/* One report of Unified2SetDiagnostics(), count problems of one kind */
+typedef struct _Unified2Diag {
+    UNIFIED2_DIAG code;
+    uint32_t type;              /* record type, 0 when there is none */
+    int err;                    /* errno, 0 when there is none */
+    uint64_t offset;            /* input offset of the first one */
+    uint64_t count;
+    uint64_t time;              /* _Unified2Now() when reported */
+    char message[160];
+} Unified2Diag;
+
+/* Reports kept for Unified2GetDiagnostics() */
+#define UNIFIED2_DIAG_RING 32
+
+typedef void (*Unified2DiagFunc)(const Unified2Diag *, void *);
+
 typedef struct _Unified2 {
     READ_MODE mode;
     FILE *fh;
@@ -163,8 +290,164 @@ typedef struct _Unified2 {
     int memory_size;
     int memory_offset;
     char *filename;
+    Unified2Durability *durability;
+    Unified2DirectWriter *direct;
+    Unified2Compressed *compressed;
+    Unified2Decompressor *decompressor;
+    Unified2Ring *ring;
+
+    /* file mapped by Unified2ReadOpenMapped() */
+    uint8_t *map;
+    uint64_t map_size;
+    uint64_t map_offset;
+
+    /* reusable record buffer for Unified2ReadRawRecord() */
+    uint8_t *raw;
+    uint32_t raw_size;
+
+    /* stdio buffer for files opened with Unified2ReadOpenFILE() */
+    void *stream_buffer;
+
+    /* UNIFIED2_READ_* flags, see Unified2SetReadFlags() */
+    int read_flags;
+
+    /* input offset of the next read, for tracing */
+    uint64_t offset;
+
+    /* counters kept when asked for, see Unified2EnableStats() */
+    Unified2Stats *stats;
+    int stats_flags;
+
+    /* last problem and reports, see Unified2SetDiagnostics() */
+    UNIFIED2_DIAG error;
+    Unified2Diagnostics *diag;
 } Unified2;
 
+/* Optional record types for Unified2ReadNextEntry() to decode rather than
+ * skip */
+#define UNIFIED2_READ_EXTRA_DATA 0x1
+
+/* Codecs for the seekable compressed container */
+typedef enum _UNIFIED2_CODEC {
+    UNIFIED2_CODEC_DEFAULT = 0,
+    UNIFIED2_CODEC_ZLIB = 1,
+    UNIFIED2_CODEC_ZSTD = 2,
+} UNIFIED2_CODEC;
+
+/* Output buffer for the text formatters, see Unified2BufferInit() */
+typedef struct _Unified2Buffer {
+    char *data;
+    uint32_t used;
+    uint32_t size;
+    int fd;
+    int fixed;      /* caller's memory, never grown or freed */
+} Unified2Buffer;
+
+/* Upper bound for the worker threads any library facility will start */
+#define UNIFIED2_MAX_THREADS 64
+
+/* Capture file formats for Unified2PcapOpen() */
+typedef enum _UNIFIED2_PCAP_FORMAT {
+    UNIFIED2_PCAP,
+    UNIFIED2_PCAPNG,
+} UNIFIED2_PCAP_FORMAT;
+
+typedef struct _Unified2PcapWriter Unified2PcapWriter;
+
+/* Packet size distributions for the generator */
+typedef enum _UNIFIED2_SIZES {
+    UNIFIED2_SIZES_UNIFORM,     /* packet_min to packet_max */
+    UNIFIED2_SIZES_IMIX,        /* 64, 576 and 1500 bytes, 7:4:1 */
+    UNIFIED2_SIZES_EXPONENTIAL, /* packet_mean on average */
+} UNIFIED2_SIZES;
+
+/* Workload for Unified2GeneratorNew(), see Unified2GeneratorDefaults() */
+typedef struct _Unified2GeneratorConfig {
+    uint64_t seed;
+    uint64_t events;            /* 0 never ends */
+    uint32_t mix[4];            /* weights of event, v2, IPv6 and IPv6 v2 */
+    double packets;             /* per event, on average */
+    UNIFIED2_SIZES sizes;
+    uint32_t packet_min;        /* packet sizes are kept within these */
+    uint32_t packet_max;
+    uint32_t packet_mean;
+    double extra;               /* share of events with extra data */
+    uint32_t sensors;
+    uint32_t signatures;
+    double signature_skew;      /* Zipf exponent, 0 for uniform */
+    uint32_t hosts;
+    double host_skew;
+    uint32_t start;             /* second of the first event */
+    double rate;                /* events per second, Poisson arrivals */
+    double corrupt;             /* share of records damaged */
+    int corrupt_framing;        /* damage may break record boundaries */
+} Unified2GeneratorConfig;
+
+/* Durability policies for writers, see Unified2SetDurability() */
+typedef enum _SYNC_MODE {
+    SYNC_NONE,          /* never sync, the page cache decides */
+    SYNC_RECORDS,       /* fdatasync every N records */
+    SYNC_BYTES,         /* fdatasync every N bytes */
+    SYNC_INTERVAL,      /* fdatasync at most N milliseconds after a write */
+    SYNC_GROUP,         /* every record is durable on return, concurrent
+                         * writers share one fdatasync */
+} SYNC_MODE;
+
+/* Log-linear latency histogram: values below 8 get their own bucket, above
+ * that every power of two is split into 8 sub buckets (12.5% precision). */
+#define UNIFIED2_HISTOGRAM_BUCKETS 496
+
+typedef struct _Unified2Histogram {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[UNIFIED2_HISTOGRAM_BUCKETS];
+} Unified2Histogram;
+
+typedef struct _Unified2SyncStats {
+    uint64_t syncs;             /* fdatasync calls issued */
+    uint64_t commits;           /* writes accounted for by the policy */
+    uint64_t shared;            /* commits satisfied by another writer's sync */
+    uint64_t failures;          /* fdatasync calls that failed */
+    Unified2Histogram latency;  /* fdatasync latency in nanoseconds */
+} Unified2SyncStats;
+
+/* What Unified2ArchiveRun() found, in all or for one log */
+typedef struct _Unified2ArchiveStats {
+    uint64_t logs;              /* read in full */
+    uint64_t damaged;           /* failed to open, or damaged records */
+    uint64_t ranges;            /* pieces split logs were read in */
+    uint64_t bytes;
+    uint64_t records;           /* read */
+    uint64_t matched;           /* through the stage and filter */
+    uint64_t steals;            /* work taken off another worker's queue */
+} Unified2ArchiveStats;
+
+/* What Unified2EnableStats() keeps for a handle */
+#define UNIFIED2_STATS_COUNTERS 0x1
+#define UNIFIED2_STATS_LATENCY  0x2     /* histograms too, a clock read per call */
+
+struct _Unified2Stats {
+    uint64_t events;            /* records read, by type */
+    uint64_t events_v2;
+    uint64_t events6;
+    uint64_t events6_v2;
+    uint64_t packets;
+    uint64_t extra_data;
+    uint64_t skipped;           /* records of unknown type stepped over */
+    uint64_t records_written;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls;          /* read, write and lseek on the descriptor */
+    uint64_t allocations;
+    uint64_t resyncs;           /* damaged records stepped over */
+    uint64_t errors;
+    Unified2Histogram read;     /* nanoseconds in each read of the input */
+    Unified2Histogram decode;   /* each Unified2ReadNextEntry(), reads excluded */
+    Unified2Histogram write;    /* each write of a record or buffer */
+};
+
 typedef enum _RECORD_TYPE {
     UNIFIED2_EVENT = 1,
     UNIFIED2_PACKET = 2,
@@ -189,6 +472,41 @@ typedef enum HRESULT {
     UNIFIED2_WARN
 } HRESULT;
 
+/* Appends one entry to a buffer, e.g. Unified2FormatCsv() */
+typedef HRESULT (*Unified2FormatFunc)(Unified2Buffer *, const Unified2Entry *);
+
+/* Takes one record of a dispatcher pass, decoded and as stored */
+typedef HRESULT (*Unified2SinkFunc)(const Unified2Entry *, const uint8_t *,
+    uint32_t, void *);
+
+/* Passes on (UNIFIED2_OK) or drops (UNIFIED2_WARN) a record before the sinks */
+typedef HRESULT (*Unified2StageFunc)(Unified2Entry *, const uint8_t *,
+    uint32_t, void *);
+
+/* Unified2DispatcherAdd() flags */
+#define UNIFIED2_SINK_THREAD    0x1     /* run the sink on a worker */
+
+/* Opens a handle to read a source, e.g. Unified2ReadOpenMapped() */
+typedef HRESULT (*Unified2OpenFunc)(Unified2 *, char *);
+
+/* What a library allocation is for, see Unified2SetAllocator() */
+typedef enum _UNIFIED2_ALLOC {
+    UNIFIED2_ALLOC_HANDLE,      /* handles, their names and private state */
+    UNIFIED2_ALLOC_RECORD,      /* entries and the records they point at */
+    UNIFIED2_ALLOC_BUFFER,      /* I/O, compression and output buffers */
+    UNIFIED2_ALLOC_ANALYSIS,    /* summaries, filters, searches, generators */
+    UNIFIED2_ALLOCS
+} UNIFIED2_ALLOC;
+
+/* Replaces malloc, realloc and free for everything the library allocates.
+ * Each gets the context and what the memory is for. */
+typedef struct _Unified2Allocator {
+    void *(*allocate)(void *, size_t, UNIFIED2_ALLOC);
+    void *(*reallocate)(void *, void *, size_t, UNIFIED2_ALLOC);
+    void (*release)(void *, void *, UNIFIED2_ALLOC);
+    void *context;
+} Unified2Allocator;
+
 
 
 /** PROTOTYPES *****************************************************************/
@@ -196,11 +514,13 @@ typedef enum HRESULT {
 /* unified2_util.c */
 Unified2Entry * Unified2EntryNew();
 HRESULT Unified2EntrySparseCleanup();
+void Unified2EntryFree(Unified2Entry *);
 Unified2 * Unified2New();
 HRESULT Unified2ReadOpenFILE(Unified2 *, char *);
 HRESULT Unified2ReadOpenFILE_2(Unified2 *u2, FILE *file);
 HRESULT Unified2ReadOpenFd(Unified2 *, char *);
 HRESULT Unified2ReadOpenMemory(Unified2 *, void *, int);
+HRESULT Unified2SetReadFlags(Unified2 *, int);
 HRESULT Unified2Free(Unified2 *);
 
 int Unified2Eof(Unified2 *);
@@ -209,6 +529,24 @@ int _Unified2MemSeek(Unified2 *, int, int);
 int Unified2Seek(Unified2 *, int, int);
 
 void warn( char *, ... );
+int _Unified2WriteAll(int, const void *, size_t);
+uint32_t _Unified2Field32(const uint8_t *, int);
+
+/* unified2_alloc.c */
+HRESULT Unified2SetAllocator(const Unified2Allocator *);
+void Unified2GetAllocator(Unified2Allocator *);
+void * _Unified2Malloc(size_t, UNIFIED2_ALLOC);
+void * _Unified2Calloc(size_t, size_t, UNIFIED2_ALLOC);
+void * _Unified2Realloc(void *, size_t, UNIFIED2_ALLOC);
+void _Unified2Free(void *, UNIFIED2_ALLOC);
+char * _Unified2Strdup(const char *, UNIFIED2_ALLOC);
+
+/* unified2_event.c */
+HRESULT Unified2DecodeEvent(Unified2NormalizedEvent *, const uint8_t *,
+    uint32_t);
+HRESULT Unified2EventFromEntry(Unified2NormalizedEvent *,
+    const Unified2Entry *);
+HRESULT Unified2ReadNextEvent(Unified2 *, Unified2NormalizedEvent *);
 
 /* unified2_read.c */
 Unified2RecordHeader * Unified2ReadRecordHeader(Unified2 *);
@@ -218,13 +556,292 @@ Unified2Event6 * Unified2ReadEvent6(Unified2 *);
 Unified2Event6_v2 * Unified2ReadEvent6_v2(Unified2 *);
 Unified2Packet * Unified2ReadPacket(Unified2 *);
 void * Unified2ReadPacketData(Unified2 *, Unified2Packet *);
+Unified2ExtraData * Unified2ReadExtraData(Unified2 *, uint32_t);
 
 HRESULT Unified2ReadNextEntry(Unified2 *, Unified2Entry *);
+HRESULT Unified2ReadRawRecord(Unified2 *, const uint8_t **, uint32_t *);
+uint8_t * _Unified2RawReserve(Unified2 *, uint32_t);
+
+/* unified2_record.c */
+HRESULT Unified2ReadNextRecord(Unified2 *, Unified2Record *);
+uint32_t Unified2RecordType(const Unified2Record *);
+const Unified2Event * Unified2RecordEvent(const Unified2Record *);
+const Unified2Event_v2 * Unified2RecordEvent_v2(const Unified2Record *);
+const Unified2Event6 * Unified2RecordEvent6(const Unified2Record *);
+const Unified2Event6_v2 * Unified2RecordEvent6_v2(const Unified2Record *);
+const Unified2Packet * Unified2RecordPacket(const Unified2Record *);
+const uint8_t * Unified2RecordPacketData(const Unified2Record *, uint32_t *);
+const Unified2ExtraData * Unified2RecordExtraData(const Unified2Record *);
+HRESULT Unified2RecordEntry(const Unified2Record *, Unified2Entry *);
+HRESULT _Unified2DecodeRecord(Unified2Record *, uint8_t *, uint32_t,
+    UNIFIED2_DIAG *);
 
 /* unified2_write.c */
 HRESULT Unified2WriteOpenFd(Unified2 *, char *);
 HRESULT Unified2Write(Unified2 *, void *, int);
+HRESULT Unified2WriteRecordHeader(Unified2 *, Unified2RecordHeader *);
+HRESULT Unified2WriteEvent(Unified2 *, Unified2Event *);
+HRESULT Unified2WriteEvent_v2(Unified2 *, Unified2Event_v2 *);
+HRESULT Unified2WriteEvent6(Unified2 *, Unified2Event6 *);
+HRESULT Unified2WriteEvent6_v2(Unified2 *, Unified2Event6_v2 *);
+HRESULT Unified2WritePacket(Unified2 *, Unified2Packet *);
+HRESULT Unified2WritePacketData(Unified2 *, void *, int);
 HRESULT Unified2WriteRecord(Unified2 *, const Unified2Entry *);
+int Unified2SerializeRecord(const Unified2Entry *, uint8_t *, int);
+
+/* unified2_direct.c */
+HRESULT Unified2WriteOpenDirect(Unified2 *, char *, int);
+int _Unified2DirectWrite(Unified2 *, const void *, int);
+HRESULT _Unified2DirectFlush(Unified2 *);
+HRESULT _Unified2DirectClose(Unified2 *);
+
+/* unified2_compress.c */
+HRESULT Unified2WriteOpenCompressed(Unified2 *, char *, int, int);
+HRESULT Unified2SetDecompressThreads(Unified2 *, int);
+int _Unified2IsCompressed(const void *, int);
+HRESULT _Unified2CompressedOpen(Unified2 *, int);
+int _Unified2CompressedWrite(Unified2 *, const void *, int);
+HRESULT _Unified2CompressedFlush(Unified2 *);
+int _Unified2CompressedRead(Unified2 *, void *, int);
+int _Unified2CompressedSeek(Unified2 *, int, int);
+uint64_t _Unified2CompressedTell(Unified2 *);
+int _Unified2CompressedEof(Unified2 *);
+HRESULT _Unified2CompressedClose(Unified2 *);
+
+/* unified2_inflate.c */
+int _Unified2CompressedFormat(const void *, int);
+HRESULT _Unified2DecompressOpen(Unified2 *, int, FILE *, int);
+int _Unified2DecompressRead(Unified2 *, void *, int);
+int _Unified2DecompressSeek(Unified2 *, int, int);
+int _Unified2DecompressEof(Unified2 *);
+HRESULT _Unified2DecompressClose(Unified2 *);
+
+/* unified2_shm.c */
+HRESULT Unified2WriteOpenShm(Unified2 *, char *, int);
+HRESULT Unified2ReadOpenShm(Unified2 *, char *);
+HRESULT Unified2ShmPeek(Unified2 *, const void **, uint32_t *);
+HRESULT Unified2ShmRelease(Unified2 *);
+HRESULT Unified2UnlinkShm(char *);
+int _Unified2ShmWrite(Unified2 *, const void *, int);
+int _Unified2ShmRead(Unified2 *, void *, int);
+int _Unified2ShmSeek(Unified2 *, int, int);
+int _Unified2ShmEof(Unified2 *);
+HRESULT _Unified2ShmClose(Unified2 *);
+
+/* unified2_mapped.c */
+HRESULT Unified2ReadOpenMapped(Unified2 *, char *);
+HRESULT Unified2ReadOpenMappedRange(Unified2 *, Unified2 *, uint64_t,
+    uint64_t);
+HRESULT Unified2CopyRecords(Unified2 *, const uint8_t *, uint64_t, int);
+int _Unified2MappedRead(Unified2 *, void *, int);
+int _Unified2MappedSeek(Unified2 *, int, int);
+int _Unified2MappedEof(Unified2 *);
+HRESULT _Unified2MappedClose(Unified2 *);
+
+/* unified2_pcap.c */
+Unified2PcapWriter * Unified2PcapOpen(char *, UNIFIED2_PCAP_FORMAT);
+HRESULT Unified2PcapWritePacket(Unified2PcapWriter *, const Unified2Packet *,
+    const void *);
+HRESULT Unified2PcapClose(Unified2PcapWriter *);
+
+/* unified2_format.c */
+HRESULT Unified2BufferInit(Unified2Buffer *, int, uint32_t);
+HRESULT Unified2BufferWrap(Unified2Buffer *, void *, uint32_t);
+char * Unified2BufferReserve(Unified2Buffer *, uint32_t);
+HRESULT Unified2BufferAppend(Unified2Buffer *, const void *, uint32_t);
+HRESULT Unified2BufferFlush(Unified2Buffer *);
+HRESULT Unified2BufferFree(Unified2Buffer *);
+HRESULT Unified2FormatCsv(Unified2Buffer *, const Unified2Entry *);
+HRESULT Unified2FormatCsvEvent(Unified2Buffer *,
+    const Unified2NormalizedEvent *);
+HRESULT Unified2FormatDump(Unified2Buffer *, const Unified2Entry *);
+HRESULT Unified2FormatJson(Unified2Buffer *, const Unified2Entry *);
+HRESULT Unified2FormatJsonHex(Unified2Buffer *, const Unified2Entry *);
+char * _Unified2FormatU32(char *, uint32_t);
+char * _Unified2FormatI32(char *, int32_t);
+char * _Unified2FormatIPv4(char *, uint32_t);
+char * _Unified2FormatIPv6(char *, const struct in6_addr *);
+
+/* unified2_parallel.c */
+HRESULT Unified2FormatParallel(Unified2 *, Unified2Buffer *, Unified2FormatFunc,
+    int, int);
+
+/* unified2_dispatch.c */
+Unified2Dispatcher * Unified2DispatcherNew();
+void Unified2DispatcherFree(Unified2Dispatcher *);
+int Unified2DispatcherAdd(Unified2Dispatcher *, Unified2SinkFunc, void *, int);
+int Unified2DispatcherAddFormat(Unified2Dispatcher *, Unified2FormatFunc,
+    Unified2Buffer *, int);
+int Unified2DispatcherAddWriter(Unified2Dispatcher *, Unified2 *, int);
+int Unified2DispatcherAddPcap(Unified2Dispatcher *, Unified2PcapWriter *, int);
+int Unified2DispatcherAddSummary(Unified2Dispatcher *, Unified2Summary *, int);
+HRESULT Unified2DispatcherFilter(Unified2Dispatcher *, int,
+    const Unified2Filter *);
+HRESULT Unified2DispatcherThreads(Unified2Dispatcher *, int);
+HRESULT Unified2DispatcherStage(Unified2Dispatcher *, Unified2StageFunc,
+    void *);
+HRESULT Unified2DispatcherStageFilter(Unified2Dispatcher *,
+    const Unified2Filter *);
+HRESULT Unified2DispatcherStageSample(Unified2Dispatcher *, uint32_t);
+HRESULT Unified2DispatcherRun(Unified2Dispatcher *, Unified2 *, int);
+HRESULT _Unified2DispatchRecords(Unified2Dispatcher *, Unified2 *, int *);
+
+/* unified2_pipeline.c */
+Unified2Pipeline * Unified2PipelineNew();
+void Unified2PipelineFree(Unified2Pipeline *);
+Unified2Dispatcher * Unified2PipelineDispatcher(Unified2Pipeline *);
+HRESULT Unified2PipelineDiagnostics(Unified2Pipeline *, Unified2DiagFunc,
+    void *, uint32_t);
+HRESULT Unified2PipelineSource(Unified2Pipeline *, Unified2OpenFunc,
+    const char *);
+HRESULT Unified2PipelineHandle(Unified2Pipeline *, Unified2 *);
+int Unified2PipelineSpool(Unified2Pipeline *, Unified2OpenFunc, const char *,
+    const char *);
+HRESULT Unified2PipelineRun(Unified2Pipeline *, int);
+
+/* unified2_archive.c */
+Unified2Archive * Unified2ArchiveNew();
+void Unified2ArchiveFree(Unified2Archive *);
+int Unified2ArchiveAdd(Unified2Archive *, const char *);
+HRESULT Unified2ArchiveThreads(Unified2Archive *, int, int);
+HRESULT Unified2ArchiveSplit(Unified2Archive *, uint64_t);
+HRESULT Unified2ArchiveFilter(Unified2Archive *, const Unified2Filter *);
+HRESULT Unified2ArchiveStage(Unified2Archive *, Unified2StageFunc, void *);
+HRESULT Unified2ArchiveOutput(Unified2Archive *, Unified2FormatFunc, int);
+HRESULT Unified2ArchiveSummary(Unified2Archive *, Unified2Summary *);
+HRESULT Unified2ArchiveDiagnostics(Unified2Archive *, Unified2DiagFunc,
+    void *, uint32_t);
+HRESULT Unified2ArchiveRun(Unified2Archive *, Unified2ArchiveStats *);
+const char * Unified2ArchiveLog(Unified2Archive *, int,
+    Unified2ArchiveStats *);
+
+/* unified2_summary.c */
+Unified2Summary * Unified2SummaryNew();
+void Unified2SummaryFree(Unified2Summary *);
+HRESULT Unified2SummaryAdd(Unified2Summary *, const uint8_t *, uint32_t);
+HRESULT Unified2SummaryMerge(Unified2Summary *, const Unified2Summary *);
+HRESULT Unified2SummaryFormat(Unified2Buffer *, const Unified2Summary *, int,
+    int);
+HRESULT Unified2SummaryParallel(Unified2 *, Unified2Summary *, int);
+
+/* unified2_filter.c */
+Unified2Filter * Unified2FilterCompile(const char *);
+void Unified2FilterFree(Unified2Filter *);
+int Unified2FilterMatch(const Unified2Filter *, const uint8_t *, uint32_t);
+
+/* unified2_search.c */
+typedef int (*Unified2SearchFunc)(uint32_t, uint32_t, void *);
+Unified2Search * Unified2SearchNew(int);
+void Unified2SearchFree(Unified2Search *);
+HRESULT Unified2SearchAdd(Unified2Search *, const uint8_t *, uint32_t, uint32_t);
+HRESULT Unified2SearchAddPattern(Unified2Search *, const char *, uint32_t);
+HRESULT Unified2SearchCompile(Unified2Search *);
+int Unified2SearchScan(const Unified2Search *, const uint8_t *, uint32_t,
+    Unified2SearchFunc, void *);
+int Unified2SearchPacket(const Unified2Search *, const uint8_t *, uint32_t,
+    Unified2SearchFunc, void *);
+
+/* unified2_generate.c */
+void Unified2GeneratorDefaults(Unified2GeneratorConfig *);
+Unified2Generator * Unified2GeneratorNew(const Unified2GeneratorConfig *);
+void Unified2GeneratorFree(Unified2Generator *);
+uint32_t Unified2GeneratorFill(Unified2Generator *, uint8_t *, uint32_t);
+HRESULT Unified2GeneratorWrite(Unified2Generator *, Unified2 *, uint64_t);
+
+/* unified2_diag.c */
+HRESULT Unified2SetDiagnostics(Unified2 *, Unified2DiagFunc, void *, uint32_t);
+HRESULT Unified2FlushDiagnostics(Unified2 *);
+int Unified2GetDiagnostics(Unified2 *, Unified2Diag *, int);
+UNIFIED2_DIAG Unified2GetError(Unified2 *);
+const char * Unified2Strerror(UNIFIED2_DIAG);
+void Unified2DiagStderr(const Unified2Diag *, void *);
+void _Unified2Diag(Unified2 *, UNIFIED2_DIAG, uint32_t, int);
+void _Unified2DiagFree(Unified2 *);
+
+/* unified2_stats.c */
+HRESULT Unified2EnableStats(Unified2 *, int);
+HRESULT Unified2GetStats(Unified2 *, Unified2Stats *);
+HRESULT Unified2ResetStats(Unified2 *);
+HRESULT Unified2FormatStats(Unified2Buffer *, const Unified2Stats *);
+void _Unified2StatsRecord(Unified2 *, uint32_t);
+void _Unified2StatsFree(Unified2 *);
+
+/* Statistics hooks for the library's hot paths. Without UNIFIED2_STATS they
+ * compile to nothing, with it they cost a branch unless the handle asked for
+ * statistics. The _SHARED ones are for the write path, which several threads
+ * may share under SYNC_GROUP; they update with relaxed atomics. */
+#ifdef UNIFIED2_STATS
+#define _UNIFIED2_COUNT(u2, counter, n) \
+    do { if( (u2)->stats ) (u2)->stats->counter += (n); } while( 0 )
+#define _UNIFIED2_RECORD(u2, type) \
+    do { if( (u2)->stats ) _Unified2StatsRecord((u2), (type)); } while( 0 )
+#define _UNIFIED2_CLOCK(u2) \
+    ((u2)->stats_flags & UNIFIED2_STATS_LATENCY ? _Unified2Now() : 0)
+#define _UNIFIED2_LATENCY(u2, histogram, start) \
+    do { if( start ) Unified2HistogramRecord(&(u2)->stats->histogram, \
+        _Unified2Now() - (start)); } while( 0 )
+#define _UNIFIED2_COUNT_SHARED(u2, counter, n) \
+    do { if( (u2)->stats ) __atomic_add_fetch(&(u2)->stats->counter, (n), \
+        __ATOMIC_RELAXED); } while( 0 )
+#define _UNIFIED2_LATENCY_SHARED(u2, histogram, start) \
+    do { if( start ) _Unified2HistogramRecordShared( \
+        &(u2)->stats->histogram, _Unified2Now() - (start)); } while( 0 )
+#else
+#define _UNIFIED2_COUNT(u2, counter, n) do { } while( 0 )
+#define _UNIFIED2_RECORD(u2, type) do { } while( 0 )
+#define _UNIFIED2_CLOCK(u2) 0
+#define _UNIFIED2_LATENCY(u2, histogram, start) do { (void)(start); } while( 0 )
+#define _UNIFIED2_COUNT_SHARED(u2, counter, n) do { } while( 0 )
+#define _UNIFIED2_LATENCY_SHARED(u2, histogram, start) \
+    do { (void)(start); } while( 0 )
+#endif
+
+/* Static tracepoints, provider libunified2, for perf and bpftrace. Built with
+ * --enable-usdt they are single nops until something attaches; otherwise
+ * they compile to nothing.
+ *
+ *      read__start(offset)                     Unified2ReadNextEntry() begins
+ *      read__end(type, length, offset, result) and returns
+ *      event, event_v2, event6, event6_v2,
+ *      packet, extra_data(length, offset)      a record of that type decoded
+ *      packet__data(length, offset)            packet data read
+ *      skip(type, length, offset)              a record stepped over
+ *      raw(type, length, offset)               Unified2ReadRawRecord()
+ *      seek(offset, whence, result)
+ *      eof(offset)                             end of input found
+ *      write(length, result)                   a buffer handed to the output
+ *      record__write(type, length)             a record written
+ *      sync__start(sequence)                   fdatasync for writes up to
+ *      sync__end(result, nanoseconds)          sequence begins, and ends
+ */
+#ifdef UNIFIED2_USDT
+#include <sys/sdt.h>
+#define _UNIFIED2_PROBE1(name, a) DTRACE_PROBE1(libunified2, name, a)
+#define _UNIFIED2_PROBE2(name, a, b) DTRACE_PROBE2(libunified2, name, a, b)
+#define _UNIFIED2_PROBE3(name, a, b, c) DTRACE_PROBE3(libunified2, name, a, b, c)
+#define _UNIFIED2_PROBE4(name, a, b, c, d) \
+    DTRACE_PROBE4(libunified2, name, a, b, c, d)
+#else
+#define _UNIFIED2_PROBE1(name, a) do { } while( 0 )
+#define _UNIFIED2_PROBE2(name, a, b) do { } while( 0 )
+#define _UNIFIED2_PROBE3(name, a, b, c) do { } while( 0 )
+#define _UNIFIED2_PROBE4(name, a, b, c, d) do { } while( 0 )
+#endif
+
+/* unified2_sync.c */
+HRESULT Unified2SetDurability(Unified2 *, SYNC_MODE, uint32_t);
+HRESULT Unified2Sync(Unified2 *);
+HRESULT Unified2GetSyncStats(Unified2 *, Unified2SyncStats *);
+HRESULT _Unified2SyncCommit(Unified2 *, int, int);
+void _Unified2SyncFree(Unified2 *);
+
+/* unified2_histogram.c */
+void Unified2HistogramReset(Unified2Histogram *);
+void Unified2HistogramRecord(Unified2Histogram *, uint64_t);
+void _Unified2HistogramRecordShared(Unified2Histogram *, uint64_t);
+void Unified2HistogramMerge(Unified2Histogram *, const Unified2Histogram *);
+uint64_t Unified2HistogramPercentile(const Unified2Histogram *, double);
+uint64_t _Unified2Now();
 
 /* unified2_config.c */
 const char * unified2_lib_version( );
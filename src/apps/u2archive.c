@@ -0,0 +1,417 @@
+/*******************************************************************************
+ * Reprocess whole archives of unified2 logs on every CPU.
+ *
+ * Files, directories and glob patterns name the logs; they are read on a
+ * pool of workers that steal work from each other, large logs in ranges (see
+ * unified2_archive.c). The matching records can be written out once, in log
+ * order, as CSV, text, JSON or unified2, and summarized; the counts are
+ * printed per log and in all.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+static struct option longopts[] = {
+    {"csv", required_argument, NULL, 'c' },
+    {"dump", required_argument, NULL, 'd' },
+    {"json", required_argument, NULL, 'J' },
+    {"write", required_argument, NULL, 'w' },
+    {"summary", required_argument, NULL, 's' },
+    {"filter", required_argument, NULL, 'f' },
+    {"jobs", required_argument, NULL, 'j' },
+    {"pin", no_argument, NULL, 'P' },
+    {"split", required_argument, NULL, 'S' },
+    {"list", no_argument, NULL, 'l' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    int jobs;
+    int pin;
+    int list;
+    int split;
+    int outputs;
+    char *output;
+    Unified2FormatFunc format;
+    char *summary;
+    char *expression;
+    char *program_name;
+} pv;
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vPlc:d:J:w:s:f:j:S:] file|directory|'glob' [...]\n"
+    "Options:\n"
+    "\t-c, --csv        Write CSV to this file, - for stdout\n"
+    "\t-d, --dump       Write text as u2dump does to this file\n"
+    "\t-J, --json       Write one JSON object per record to this file\n"
+    "\t-w, --write      Write the records to this unified2 file; only one of\n"
+    "\t                 -c, -d, -J and -w can be given\n"
+    "\t-s, --summary    Write a summary to this file\n"
+    "\t-f, --filter     Only count and write records this expression matches\n"
+    "\t-j, --jobs       Read on this many threads (default: one per CPU)\n"
+    "\t-P, --pin        Bind every thread to a CPU\n"
+    "\t-S, --split      Read logs larger than this many MB in ranges, 0 never\n"
+    "\t                 (default: 64)\n"
+    "\t-l, --list       Print the counts of every log\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int ch;
+
+    memset(&pv, 0x0, sizeof(pv));
+    pv.split = 64;
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "c:d:J:w:s:f:j:PS:l?v", longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'c':
+            pv.output = optarg;
+            pv.format = Unified2FormatCsv;
+            pv.outputs++;
+            break;
+
+            case 'd':
+            pv.output = optarg;
+            pv.format = Unified2FormatDump;
+            pv.outputs++;
+            break;
+
+            case 'J':
+            pv.output = optarg;
+            pv.format = Unified2FormatJson;
+            pv.outputs++;
+            break;
+
+            case 'w':
+            pv.output = optarg;
+            pv.format = NULL;
+            pv.outputs++;
+            break;
+
+            case 's':
+            pv.summary = optarg;
+            break;
+
+            case 'f':
+            pv.expression = optarg;
+            break;
+
+            case 'j':
+            pv.jobs = atoi(optarg);
+            break;
+
+            case 'P':
+            pv.pin = 1;
+            break;
+
+            case 'S':
+            pv.split = atoi(optarg);
+            if( pv.split < 0 || pv.split > 1024 ) {
+                fprintf(stderr, "%s: split must be 0 to 1024 MB\n",
+                    pv.program_name);
+                return -1;
+            }
+            break;
+
+            case 'l':
+            pv.list = 1;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( pv.outputs > 1 ) {
+        fprintf(stderr, "%s: only one of -c, -d, -J and -w can be given\n",
+            pv.program_name);
+        return -1;
+    }
+
+    if( optind >= argc ) {
+        print_help();
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: open_output
+ *
+ * Purpose: Open a file to write, - is stdout
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      int
+ */
+int open_output(const char *name) {
+    int fd;
+
+    if( strcmp(name, "-") == 0 )
+        return STDOUT_FILENO;
+
+    fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if( fd == -1 ) {
+        warn("u2archive: failed to open %s: %s\n", name, strerror(errno));
+    }
+
+    return fd;
+}
+
+/* Function: skip_extra_data
+ *
+ * Purpose: Archive stage dropping extra data, which has no CSV line and which
+ * u2dump does not print either
+ *
+ * Arguements:
+ *      Unified2Entry *
+ *      const uint8_t *
+ *      uint32_t
+ *      void *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT skip_extra_data(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    return entry->extra_data ? UNIFIED2_WARN : UNIFIED2_OK;
+}
+
+/* Function: print_counts
+ *
+ * Purpose: Print the counts of one log, or of all of them
+ *
+ * Arguements:
+ *      FILE *
+ *      const char *
+ *      const Unified2ArchiveStats *
+ *
+ * Returns:
+ *      void
+ */
+void print_counts(FILE *fp, const char *name,
+    const Unified2ArchiveStats *stats) {
+    fprintf(fp, "%-40s %12llu %12llu %12llu %8llu %s\n", name,
+        (unsigned long long)stats->bytes,
+        (unsigned long long)stats->records,
+        (unsigned long long)stats->matched,
+        (unsigned long long)stats->ranges,
+        stats->damaged ? "damaged" : "");
+}
+
+/* Function: archive_loop
+ *
+ * Purpose: Read every log named on the command line into the outputs
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *      Unified2Filter *
+ *
+ * Returns:
+ *      int
+ */
+int archive_loop(int argc, char *argv[], Unified2Filter *filter)
+{
+    static const char header[] =
+        "SID,GID,REV,SRC_IP,SRC_PORT,DST_IP,DST_PORT,PROTOCOL,ACTION\n";
+    Unified2ArchiveStats total;
+    Unified2ArchiveStats stats;
+    Unified2Summary *summary = NULL;
+    Unified2Archive *archive;
+    Unified2Buffer output;
+    const char *name;
+    char line[64];
+    FILE *report;
+    HRESULT r;
+    int rc = -1;
+    int fd = -1;
+    int i;
+
+    archive = Unified2ArchiveNew();
+    if( archive == NULL )
+        return -1;
+
+    for( i = optind; i < argc; i++ ) {
+        if( Unified2ArchiveAdd(archive, argv[i]) == -1 )
+            goto cleanup;
+    }
+
+    if( Unified2ArchiveLog(archive, 0, NULL) == NULL ) {
+        warn("u2archive: no logs found\n");
+        goto cleanup;
+    }
+
+    Unified2ArchiveDiagnostics(archive, Unified2DiagStderr, NULL, 1000);
+    Unified2ArchiveThreads(archive, pv.jobs, pv.pin);
+    Unified2ArchiveSplit(archive, (uint64_t)pv.split << 20);
+    Unified2ArchiveFilter(archive, filter);
+
+    if( pv.output ) {
+        fd = open_output(pv.output);
+        if( fd == -1 )
+            goto cleanup;
+
+        if( pv.format == Unified2FormatCsv &&
+            write(fd, header, sizeof(header) - 1) != sizeof(header) - 1 )
+            goto cleanup;
+
+        if( pv.format == Unified2FormatCsv || pv.format == Unified2FormatDump )
+            Unified2ArchiveStage(archive, skip_extra_data, NULL);
+
+        Unified2ArchiveOutput(archive, pv.format, fd);
+    }
+
+    if( pv.summary ) {
+        summary = Unified2SummaryNew();
+        if( summary == NULL )
+            goto cleanup;
+        Unified2ArchiveSummary(archive, summary);
+    }
+
+    r = Unified2ArchiveRun(archive, &total);
+    if( r == UNIFIED2_ERROR )
+        goto cleanup;
+    rc = 1;
+
+    /* Counts go wherever the records do not */
+    report = fd == STDOUT_FILENO ? stderr : stdout;
+    fprintf(report, "%-40s %12s %12s %12s %8s\n", "log", "bytes", "records",
+        "matched", "ranges");
+    for( i = 0; (name = Unified2ArchiveLog(archive, i, &stats)) != NULL; i++ ) {
+        if( pv.list || stats.damaged )
+            print_counts(report, name, &stats);
+    }
+    snprintf(line, sizeof(line), "%llu logs, %llu damaged, %llu steals",
+        (unsigned long long)(total.logs + total.damaged),
+        (unsigned long long)total.damaged,
+        (unsigned long long)total.steals);
+    print_counts(report, line, &total);
+
+    if( summary ) {
+        i = open_output(pv.summary);
+        if( i == -1 || Unified2BufferInit(&output, i, 0) != UNIFIED2_OK ||
+            Unified2SummaryFormat(&output, summary, 10, 0) != UNIFIED2_OK ||
+            Unified2BufferFree(&output) != UNIFIED2_OK )
+            rc = -1;
+        if( i != -1 && i != STDOUT_FILENO )
+            close(i);
+    }
+
+cleanup:
+    if( fd != -1 && fd != STDOUT_FILENO && close(fd) == -1 )
+        rc = -1;
+
+    Unified2SummaryFree(summary);
+    Unified2ArchiveFree(archive);
+
+    return rc;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Filter *filter = NULL;
+    int rc = 0;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    if( pv.expression ) {
+        filter = Unified2FilterCompile(pv.expression);
+        if( filter == NULL )
+            exit(1);
+    }
+
+    if( archive_loop(argc, argv, filter) != 1 )
+        rc = 1;
+
+    Unified2FilterFree(filter);
+
+    return rc;
+}
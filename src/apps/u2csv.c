@@ -27,11 +27,11 @@ extern int optreset;
 
 #include "unified2.h"
 
-#define TO_IP(x) x >> 24, (x >> 16) & 0xff, (x >> 8) & 0xff, x & 0xff
-
 static struct option longopts[] = {
     {"read", required_argument, NULL, 'r' },
     {"count", required_argument, NULL, 'n' },
+    {"jobs", required_argument, NULL, 'j' },
+    {"stats", no_argument, NULL, 's' },
     {"help", no_argument, NULL, '?' },
     {"version", no_argument, NULL, 'v' },
 
@@ -40,6 +40,8 @@ static struct option longopts[] = {
 
 struct progam_vars {
     int record_count;
+    int jobs;
+    int stats;
     char *filename;
     char *program_name;
 } pv;
@@ -71,10 +73,12 @@ void print_version( ) {
  */
 void print_help( ) {
     printf(
-    "Usage: %s [-?vr:n:] snort-unified2.log\n"
+    "Usage: %s [-?vsr:n:j:] snort-unified2.log\n"
     "Options:\n"
     "\t-r, --read       Specify file to read\n"
     "\t-n, --count      Number of records to print\n"
+    "\t-j, --jobs       Format on this many threads, 0 for one per CPU\n"
+    "\t-s, --stats      Print read and decode statistics to stderr\n"
     "\t-?, --help       This help\n"
     "\t-v, --version    Print version\n\n",
     pv.program_name
@@ -99,11 +103,13 @@ int parse_args( int argc, char *argv[] ) {
     int ch;
 
     pv.record_count = -1;
+    pv.jobs = 1;
+    pv.stats = 0;
     pv.filename = NULL;
     pv.program_name = argv[0];
 
     /* Get the options */
-    while((ch = getopt_long(argc, argv, "r:n:?v", longopts, NULL)) != -1 ) {
+    while((ch = getopt_long(argc, argv, "r:n:j:s?v", longopts, NULL)) != -1 ) {
         argi++;
         switch(ch) {
             case 'n':
@@ -114,6 +120,17 @@ int parse_args( int argc, char *argv[] ) {
             pv.filename = optarg;
             break;
 
+            case 'j':
+            pv.jobs = atoi(optarg);
+            if( pv.jobs <= 0 ) {
+                pv.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+
+            case 's':
+            pv.stats = 1;
+            break;
+
             case '?':
             default:
             print_help();
@@ -137,117 +154,29 @@ int parse_args( int argc, char *argv[] ) {
     return 1;
 }
 
-/* Function: print_record_csv
+/* Function: skip_extra_data
  *
- * Purpose: print a record as a CSV
+ * Purpose: Pipeline stage dropping extra data, which has no CSV line
  *
  * Arguements:
  *      Unified2Entry *
- * 
+ *      const uint8_t *
+ *      uint32_t
+ *      void *
+ *
  * Returns:
- *      void
+ *      HRESULT
  */
-HRESULT print_record_csv( Unified2Entry *entry ) {
-    char ip_source[INET6_ADDRSTRLEN+1];
-    char ip_destination[INET6_ADDRSTRLEN+1];
-
-    Unified2Event *event;
-    Unified2Event_v2 *event_v2;
-    Unified2Event6 *event6;
-    Unified2Event6_v2 *event6_v2;
-
-    if( entry == NULL || entry->record == NULL )
-        return UNIFIED2_ERROR;
-
-    switch( entry->record->type ) {
-        case UNIFIED2_IDS_EVENT:
-        event = entry->event;
-
-        printf("%d,%d,%d,%u.%u.%u.%u,%d,%u.%u.%u.%u,%d,%s,%s\n",
-            event->signature_id,
-            event->generator_id,
-            event->signature_revision,
-            TO_IP(event->ip_source),
-            event->sport_itype,
-            TO_IP(event->ip_destination),
-            event->dport_icode,
-            (event->protocol == 6   ? "TCP" :
-            (event->protocol == 17  ? "UDP" :
-            (event->protocol == 1   ? "ICMP" : "IP" ))),
-            (event->packet_action == 0x20 ? "Drop" : "Alert")
-            );
-        break;
-
-        case UNIFIED2_IDS_EVENT_V2:
-        event_v2 = entry->event_v2;
-
-        printf("%d,%d,%d,%u.%u.%u.%u,%d,%u.%u.%u.%u,%d,%s,%s\n",
-            event_v2->signature_id,
-            event_v2->generator_id,
-            event_v2->signature_revision,
-            TO_IP(event_v2->ip_source),
-            event_v2->sport_itype,
-            TO_IP(event_v2->ip_destination),
-            event_v2->dport_icode,
-            (event_v2->protocol == 6   ? "TCP" :
-            (event_v2->protocol == 17  ? "UDP" :
-            (event_v2->protocol == 1   ? "ICMP" : "IP" ))),
-            (event_v2->packet_action == 0x20 ? "Drop" : "Alert")
-            );
-        break;
-
-        case UNIFIED2_IDS_EVENT_IPV6:
-        event6 = entry->event6;
-
-        inet_ntop(AF_INET6, &event6->ip_source, ip_source, INET6_ADDRSTRLEN);
-        inet_ntop(AF_INET6, &event6->ip_destination, ip_destination,
-        INET6_ADDRSTRLEN);
-
-        printf("%d,%d,%d,%s,%d,%s,%d,%s,%s\n",
-            event6->signature_id,
-            event6->generator_id,
-            event6->signature_revision,
-            ip_source,
-            event6->sport_itype,
-            ip_destination,
-            event6->dport_icode,
-            (event6->protocol == 6   ? "TCP" :
-            (event6->protocol == 17  ? "UDP" :
-            (event6->protocol == 1   ? "ICMP" : "IP" ))),
-            (event6->packet_action == 0x20 ? "Drop" : "Alert")
-            );
-        break;
-
-
-        case UNIFIED2_IDS_EVENT_IPV6_V2:
-        event6_v2 = entry->event6_v2;
-
-        inet_ntop(AF_INET6, &event6_v2->ip_source, ip_source, INET6_ADDRSTRLEN);
-        inet_ntop(AF_INET6, &event6_v2->ip_destination, ip_destination,
-        INET6_ADDRSTRLEN);
-
-        printf("%d,%d,%d,%s,%d,%s,%d,%s,%s\n",
-            event6_v2->signature_id,
-            event6_v2->generator_id,
-            event6_v2->signature_revision,
-            ip_source,
-            event6_v2->sport_itype,
-            ip_destination,
-            event6_v2->dport_icode,
-            (event6_v2->protocol == 6   ? "TCP" :
-            (event6_v2->protocol == 17  ? "UDP" :
-            (event6_v2->protocol == 1   ? "ICMP" : "IP" ))),
-            (event6_v2->packet_action == 0x20 ? "Drop" : "Alert")
-            );
-        break;
-    }
-
-    return UNIFIED2_OK;
+HRESULT skip_extra_data(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    return entry->extra_data ? UNIFIED2_WARN : UNIFIED2_OK;
 }
 
 /* Function: unified2_loop
  *
- * Purpose: Open the unified2 and print its contents to stdout
+ * Purpose: Open the unified2 and print its contents to stdout: a pipeline of
+ * the file into a CSV formatter, run on pv.jobs workers
  *
  * Arguements:
  *      char *
@@ -258,37 +187,58 @@ HRESULT print_record_csv( Unified2Entry *entry ) {
  */
 int unified2_loop(char *filename, int loop_count)
 {
-    int r;
+    static const char header[] =
+        "SID,GID,REV,SRC_IP,SRC_PORT,DST_IP,DST_PORT,PROTOCOL,ACTION\n";
 
-    Unified2Entry *entry;
+    Unified2Pipeline *pipeline;
+    Unified2Dispatcher *dispatcher;
     Unified2 *unified2;
+    Unified2Buffer output;
+    Unified2Stats stats;
  
     unified2 = Unified2New();
-    entry = Unified2EntryNew();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
     Unified2ReadOpenFd(unified2, filename);
 
-    printf("SID,GID,REV,SRC_IP,SRC_PORT,DST_IP,DST_PORT,PROTOCOL,ACTION\n");
-
-    while( loop_count )
+    if( pv.stats )
     {
-        if( loop_count > 0 )
-        {
-            loop_count--;
-        }
+        Unified2EnableStats(unified2, UNIFIED2_STATS_LATENCY);
+    }
 
-        r = Unified2ReadNextEntry(unified2, entry);
+    if( Unified2BufferInit(&output, STDOUT_FILENO, 0) != UNIFIED2_OK )
+    {
+        Unified2Free(unified2);
+        return(-1);
+    }
 
-        if( r == UNIFIED2_EOF ) {
-            break;
-        }
+    Unified2BufferAppend(&output, header, sizeof(header) - 1);
+
+    pipeline = Unified2PipelineNew();
+    dispatcher = Unified2PipelineDispatcher(pipeline);
+    if( pipeline == NULL ||
+        Unified2PipelineHandle(pipeline, unified2) != UNIFIED2_OK ||
+        Unified2DispatcherStage(dispatcher, skip_extra_data, NULL)
+            != UNIFIED2_OK ||
+        Unified2DispatcherThreads(dispatcher, pv.jobs) != UNIFIED2_OK ||
+        Unified2DispatcherAddFormat(dispatcher, Unified2FormatCsv, &output,
+            pv.jobs > 1 ? UNIFIED2_SINK_THREAD : 0) == -1 )
+    {
+        Unified2PipelineFree(pipeline);
+        Unified2BufferFree(&output);
+        Unified2Free(unified2);
+        return(-1);
+    }
 
-        if( r == UNIFIED2_WARN ) {
-            break;
-        }
+    Unified2PipelineRun(pipeline, loop_count);
 
-        print_record_csv(entry);
+    Unified2PipelineFree(pipeline);
+    Unified2BufferFree(&output);
 
-        Unified2EntrySparseCleanup(entry);
+    if( pv.stats && Unified2GetStats(unified2, &stats) == UNIFIED2_OK &&
+        Unified2BufferInit(&output, STDERR_FILENO, 0) == UNIFIED2_OK )
+    {
+        Unified2FormatStats(&output, &stats);
+        Unified2BufferFree(&output);
     }
 
     Unified2Free(unified2);
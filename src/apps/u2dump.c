@@ -30,6 +30,9 @@ extern int optreset;
 static struct option longopts[] = {
     {"read", required_argument, NULL, 'r' },
     {"count", required_argument, NULL, 'n' },
+    {"jobs", required_argument, NULL, 'j' },
+    {"json", no_argument, NULL, 'J' },
+    {"hex", no_argument, NULL, 'x' },
     {"help", no_argument, NULL, '?' },
     {"version", no_argument, NULL, 'v' },
 
@@ -38,6 +41,9 @@ static struct option longopts[] = {
 
 struct progam_vars {
     int record_count;
+    int jobs;
+    int json;
+    int hex;
     char *filename;
     char *program_name;
 } pv;
@@ -69,10 +75,13 @@ void print_version( ) {
  */
 void print_help( ) {
     printf(
-    "Usage: %s [-?vr:n:] snort-unified2.log\n"
+    "Usage: %s [-?vJxr:n:j:] snort-unified2.log\n"
     "Options:\n"
     "\t-r, --read       Specify file to read\n"
     "\t-n, --count      Number of records to print\n"
+    "\t-j, --jobs       Format on this many threads, 0 for one per CPU\n"
+    "\t-J, --json       Print one JSON object per record (NDJSON)\n"
+    "\t-x, --hex        Hex instead of base64 payloads in JSON\n"
     "\t-?, --help       This help\n"
     "\t-v, --version    Print version\n\n",
     pv.program_name
@@ -97,11 +106,14 @@ int parse_args( int argc, char *argv[] ) {
     int ch;
 
     pv.record_count = -1;
+    pv.jobs = 1;
+    pv.json = 0;
+    pv.hex = 0;
     pv.filename = NULL;
     pv.program_name = argv[0];
 
     /* Get the options */
-    while((ch = getopt_long(argc, argv, "r:n:?v", longopts, NULL)) != -1 ) {
+    while((ch = getopt_long(argc, argv, "r:n:j:Jx?v", longopts, NULL)) != -1 ) {
         argi++;
         switch(ch) {
             case 'n':
@@ -112,6 +124,21 @@ int parse_args( int argc, char *argv[] ) {
             pv.filename = optarg;
             break;
 
+            case 'j':
+            pv.jobs = atoi(optarg);
+            if( pv.jobs <= 0 ) {
+                pv.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+
+            case 'J':
+            pv.json = 1;
+            break;
+
+            case 'x':
+            pv.hex = 1;
+            break;
+
             case '?':
             default:
             print_help();
@@ -135,9 +162,29 @@ int parse_args( int argc, char *argv[] ) {
     return 1;
 }
 
+/* Function: skip_extra_data
+ *
+ * Purpose: Pipeline stage dropping extra data, which the text dump leaves out
+ *
+ * Arguements:
+ *      Unified2Entry *
+ *      const uint8_t *
+ *      uint32_t
+ *      void *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT skip_extra_data(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    return entry->extra_data ? UNIFIED2_WARN : UNIFIED2_OK;
+}
+
 /* Function: unified2_loop
  *
- * Purpose: Open the unified2 and print its contents to stdout
+ * Purpose: Open the unified2 and print its contents to stdout: a pipeline of
+ * the file into a text or JSON formatter, run on pv.jobs workers
  *
  * Arguements:
  *      char *
@@ -148,40 +195,53 @@ int parse_args( int argc, char *argv[] ) {
  */
 int unified2_loop(char *filename, int loop_count)
 {
-    int r;
-
-    Unified2Entry *entry;
-    Unified2 *unified2;
- 
-    unified2 = Unified2New();
-    entry = Unified2EntryNew();
-    Unified2ReadOpenFd(unified2, filename);
+    Unified2Pipeline *pipeline;
+    Unified2Dispatcher *dispatcher;
+    Unified2Buffer output;
+    Unified2FormatFunc format = Unified2FormatDump;
+    int r = 1;
 
-    while( loop_count )
+    if( pv.json )
     {
-        if( loop_count > 0 ) {
-            loop_count--;
-        }
-
-        r = Unified2ReadNextEntry(unified2, entry);
-
-        if( r == UNIFIED2_EOF ) {
-            break;
-        }
+        format = pv.hex ? Unified2FormatJsonHex : Unified2FormatJson;
+    }
 
-        if( r == UNIFIED2_WARN ) {
-            break;
-        }
+    if( Unified2BufferInit(&output, STDOUT_FILENO, 0) != UNIFIED2_OK )
+    {
+        return(-1);
+    }
 
-        Unified2PrintRecord( entry );
+    pipeline = Unified2PipelineNew();
+    dispatcher = Unified2PipelineDispatcher(pipeline);
+    if( pipeline == NULL ||
+        Unified2PipelineDiagnostics(pipeline, Unified2DiagStderr, NULL, 1000)
+            != UNIFIED2_OK ||
+        Unified2PipelineSource(pipeline, Unified2ReadOpenFd, filename)
+            != UNIFIED2_OK ||
+        (!pv.json && Unified2DispatcherStage(dispatcher, skip_extra_data,
+            NULL) != UNIFIED2_OK) ||
+        Unified2DispatcherThreads(dispatcher, pv.jobs) != UNIFIED2_OK ||
+        Unified2DispatcherAddFormat(dispatcher, format, &output,
+            pv.jobs > 1 ? UNIFIED2_SINK_THREAD : 0) == -1 )
+    {
+        Unified2PipelineFree(pipeline);
+        Unified2BufferFree(&output);
+        return(-1);
+    }
 
-        Unified2EntrySparseCleanup(entry);
+    if( Unified2PipelineRun(pipeline, loop_count) == UNIFIED2_ERROR )
+    {
+        r = -1;
     }
 
-    Unified2Free(unified2);
-    printf("\n");
+    if( !pv.json )
+    {
+        Unified2BufferAppend(&output, "\n", 1);
+    }
+    Unified2PipelineFree(pipeline);
+    Unified2BufferFree(&output);
 
-    return(1);
+    return(r);
 }
 
 /* Function: main
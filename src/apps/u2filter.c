@@ -0,0 +1,430 @@
+/*******************************************************************************
+ * Copy the records of a unified2 log that match a filter expression.
+ *
+ * The expression is compiled once, see unified2_filter.c, and run over each
+ * raw record; matching records are copied out exactly as they were read.
+ * Packets and extra data follow the event they belong to, and are only tested
+ * on their own when that event has not been seen.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+/* Verdicts of this many recent events are remembered for their packets */
+#define EVENT_CACHE 65536
+
+static struct option longopts[] = {
+    {"read", required_argument, NULL, 'r' },
+    {"write", required_argument, NULL, 'w' },
+    {"expression", required_argument, NULL, 'e' },
+    {"invert", no_argument, NULL, 'i' },
+    {"count", no_argument, NULL, 'c' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    char *filename;
+    char *output;
+    char *expression;
+    int invert;
+    int count;
+    char *program_name;
+} pv;
+
+typedef struct _EventVerdict {
+    uint32_t sensor_id;
+    uint32_t event_id;
+    int seen;
+    int match;
+} EventVerdict;
+
+static EventVerdict verdicts[EVENT_CACHE];
+
+static inline uint32_t field(const uint8_t *body, int offset)
+{
+    uint32_t value;
+
+    memcpy(&value, body + offset, sizeof(value));
+    return ntohl(value);
+}
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vic] -r snort-unified2.log [-w out.log] expression\n"
+    "Options:\n"
+    "\t-r, --read       Specify file to read\n"
+    "\t-w, --write      Write matching records here (default: stdout)\n"
+    "\t-e, --expression Filter expression, instead of the arguements\n"
+    "\t-i, --invert     Copy the records that do not match\n"
+    "\t-c, --count      Only print the number of matching records\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n"
+    "Expressions test fields with == != < <= > >=, \"in {a..b, c}\" sets and\n"
+    "\"in 10.0.0.0/8\" prefixes, joined with and, or, not and parentheses:\n\n"
+    "\tsid in {2000001..2000999} and dst in 10.0.0.0/8 and proto == tcp\n\n"
+    "Fields: type sensor event second sid gid rev class priority src dst\n"
+    "sport dport proto action mpls vlan policy linktype\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: join_args
+ *
+ * Purpose: Make one expression of the remaining arguements, as tcpdump does
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      char *
+ */
+static char *join_args( int argc, char *argv[] ) {
+    size_t size = 1;
+    char *expression;
+    int i;
+
+    for( i = 0; i < argc; i++ )
+        size += strlen(argv[i]) + 1;
+
+    expression = calloc(1, size);
+    if( expression == NULL )
+        return NULL;
+
+    for( i = 0; i < argc; i++ ) {
+        if( i )
+            strcat(expression, " ");
+        strcat(expression, argv[i]);
+    }
+
+    return expression;
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int ch;
+
+    pv.filename = NULL;
+    pv.output = NULL;
+    pv.expression = NULL;
+    pv.invert = 0;
+    pv.count = 0;
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:w:e:ic?v", longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'w':
+            pv.output = optarg;
+            break;
+
+            case 'e':
+            pv.expression = optarg;
+            break;
+
+            case 'i':
+            pv.invert = 1;
+            break;
+
+            case 'c':
+            pv.count = 1;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( !pv.filename ) {
+        print_help();
+        return -1;
+    }
+
+    if( !pv.expression )
+        pv.expression = join_args(argc - optind, argv + optind);
+
+    if( !pv.expression )
+        return -1;
+
+    if( !pv.count && !pv.output && isatty(STDOUT_FILENO) ) {
+        fprintf(stderr, "%s: refusing to write unified2 to a terminal, use -w\n",
+            pv.program_name);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: record_match
+ *
+ * Purpose: Decide whether a raw record is copied
+ *
+ * Arguements:
+ *      const Unified2Filter *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      int
+ */
+static int record_match(const Unified2Filter *filter, const uint8_t *record,
+    uint32_t length)
+{
+    const uint8_t *body = record + sizeof(Unified2RecordHeader);
+    uint32_t left = length - sizeof(Unified2RecordHeader);
+    EventVerdict *cached;
+    uint32_t sensor_id, event_id;
+    int match;
+
+    switch( field(record, 0) ) {
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        match = Unified2FilterMatch(filter, record, length) != pv.invert;
+        if( left >= 8 ) {
+            cached = &verdicts[field(body, 4) % EVENT_CACHE];
+            cached->sensor_id = field(body, 0);
+            cached->event_id = field(body, 4);
+            cached->seen = 1;
+            cached->match = match;
+        }
+        return match;
+
+        case UNIFIED2_EXTRA_DATA:
+        body += sizeof(Unified2ExtraDataHdr);
+        left -= left < sizeof(Unified2ExtraDataHdr) ?
+            left : sizeof(Unified2ExtraDataHdr);
+        /* fall through */
+
+        case UNIFIED2_PACKET:
+        if( left >= 8 ) {
+            sensor_id = field(body, 0);
+            event_id = field(body, 4);
+            cached = &verdicts[event_id % EVENT_CACHE];
+            if( cached->seen && cached->event_id == event_id &&
+                cached->sensor_id == sensor_id )
+                return cached->match;
+        }
+        /* fall through */
+
+        default:
+        return Unified2FilterMatch(filter, record, length) != pv.invert;
+    }
+}
+
+/* Function: unified2_loop
+ *
+ * Purpose: Copy the matching records of a unified2 log to a descriptor.
+ * Mapped records are copied in runs of adjacent matches, anything else
+ * through a buffer.
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2Filter *
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int unified2_loop(char *filename, const Unified2Filter *filter, int fd)
+{
+    Unified2 *unified2;
+    Unified2Buffer staging;
+    const uint8_t *record;
+    const uint8_t *run = NULL;
+    uint64_t run_length = 0;
+    uint64_t matched = 0;
+    uint32_t length;
+    int in_place;
+    int rc = 1;
+    int r;
+
+    unified2 = Unified2New();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenMapped(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    in_place = unified2->mode == MAPPED;
+
+    if( !pv.count && !in_place &&
+        Unified2BufferInit(&staging, fd, 0) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    for( ;; )
+    {
+        r = Unified2ReadRawRecord(unified2, &record, &length);
+        if( r == UNIFIED2_EOF )
+            break;
+
+        if( r != UNIFIED2_OK ) {
+            rc = -1;
+            break;
+        }
+
+        if( !record_match(filter, record, length) )
+            continue;
+
+        matched++;
+        if( pv.count )
+            continue;
+
+        if( !in_place ) {
+            if( Unified2BufferAppend(&staging, record, length) != UNIFIED2_OK ) {
+                rc = -1;
+                break;
+            }
+        }
+        else if( run != NULL && record == run + run_length ) {
+            run_length += length;
+        }
+        else {
+            if( run != NULL &&
+                Unified2CopyRecords(unified2, run, run_length, fd) != UNIFIED2_OK ) {
+                rc = -1;
+                break;
+            }
+            run = record;
+            run_length = length;
+        }
+    }
+
+    if( pv.count ) {
+        printf("%llu\n", (unsigned long long)matched);
+    }
+    else if( in_place ) {
+        if( run != NULL &&
+            Unified2CopyRecords(unified2, run, run_length, fd) != UNIFIED2_OK )
+            rc = -1;
+    }
+    else if( Unified2BufferFree(&staging) != UNIFIED2_OK ) {
+        rc = -1;
+    }
+
+    Unified2Free(unified2);
+
+    return rc;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Filter *filter;
+    int fd = STDOUT_FILENO;
+    int rc = 0;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    filter = Unified2FilterCompile(pv.expression);
+    if( filter == NULL )
+        exit(1);
+
+    if( pv.output && !pv.count ) {
+        fd = open(pv.output, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if( fd == -1 ) {
+            warn("u2filter: failed to open %s: %s\n", pv.output,
+            strerror(errno));
+            Unified2FilterFree(filter);
+            exit(1);
+        }
+    }
+
+    if( unified2_loop(pv.filename, filter, fd) != 1 )
+        rc = 1;
+
+    if( fd != STDOUT_FILENO && close(fd) == -1 ) {
+        warn("u2filter: failed to close %s: %s\n", pv.output, strerror(errno));
+        rc = 1;
+    }
+
+    Unified2FilterFree(filter);
+
+    return rc;
+}
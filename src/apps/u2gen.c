@@ -0,0 +1,372 @@
+/*******************************************************************************
+ * Generate synthetic unified2 logs for load and benchmark testing.
+ *
+ * The records come from the library's generator, see unified2_generate.c;
+ * this only turns the command line into a workload. The same arguements and
+ * seed always produce the same file.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+static struct option longopts[] = {
+    {"write", required_argument, NULL, 'w' },
+    {"seed", required_argument, NULL, 's' },
+    {"events", required_argument, NULL, 'n' },
+    {"bytes", required_argument, NULL, 'b' },
+    {"mix", required_argument, NULL, 'm' },
+    {"packets", required_argument, NULL, 'p' },
+    {"sizes", required_argument, NULL, 'S' },
+    {"extra", required_argument, NULL, 'x' },
+    {"sensors", required_argument, NULL, 'N' },
+    {"signatures", required_argument, NULL, 'g' },
+    {"hosts", required_argument, NULL, 'H' },
+    {"start", required_argument, NULL, 't' },
+    {"rate", required_argument, NULL, 'R' },
+    {"corrupt", required_argument, NULL, 'C' },
+    {"corrupt-framing", no_argument, NULL, 'F' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    char *output;
+    uint64_t bytes;
+    Unified2GeneratorConfig config;
+    char *program_name;
+} pv;
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vF] [-w out.log] [options]\n"
+    "Options:\n"
+    "\t-w, --write            Write here instead of stdout\n"
+    "\t-s, --seed             Random seed (default: 1)\n"
+    "\t-n, --events           Events to generate, 0 for no end (default: 1000000)\n"
+    "\t-b, --bytes            Stop before this many bytes, k, m or g suffix\n"
+    "\t-m, --mix              Weights of event, v2, IPv6 and IPv6 v2 events\n"
+    "\t                       (default: 10:60:5:25)\n"
+    "\t-p, --packets          Packets per event on average (default: 1.5)\n"
+    "\t-S, --sizes            Packet sizes: imix, uniform:MIN:MAX or exp:MEAN\n"
+    "\t                       (default: imix)\n"
+    "\t-x, --extra            Share of events with extra data (default: 0.1)\n"
+    "\t-N, --sensors          Number of sensors (default: 4)\n"
+    "\t-g, --signatures       Signatures and their Zipf skew (default: 2000:1.1)\n"
+    "\t-H, --hosts            Hosts and their Zipf skew (default: 100000:0.9)\n"
+    "\t-t, --start            Second of the first event (default: 1300000000)\n"
+    "\t-R, --rate             Events per second (default: 1000)\n"
+    "\t-C, --corrupt          Share of records to damage (default: 0)\n"
+    "\t-F, --corrupt-framing  Damage may also break record lengths\n"
+    "\t-?, --help             This help\n"
+    "\t-v, --version          Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_size
+ *
+ * Purpose: Parse a byte count with an optional k, m or g suffix
+ *
+ * Arguements:
+ *      char *
+ *
+ * Returns:
+ *      uint64_t    0 when it is not a size
+ */
+uint64_t parse_size( char *arg ) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+
+    switch( tolower((unsigned char)*end) ) {
+        case 'g':
+        size <<= 10;
+        /* fall through */
+        case 'm':
+        size <<= 10;
+        /* fall through */
+        case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    return *end == '\0' ? size : 0;
+}
+
+/* Function: parse_count_skew
+ *
+ * Purpose: Parse "N" or "N:SKEW"
+ *
+ * Arguements:
+ *      char *
+ *      uint32_t *
+ *      double *
+ *
+ * Returns:
+ *      int
+ */
+int parse_count_skew( char *arg, uint32_t *count, double *skew ) {
+    char *end;
+
+    *count = strtoul(arg, &end, 0);
+    if( *end == ':' )
+        *skew = strtod(end + 1, &end);
+
+    return *end == '\0' && *count > 0 ? 0 : -1;
+}
+
+/* Function: parse_sizes
+ *
+ * Purpose: Parse the packet size distribution
+ *
+ * Arguements:
+ *      char *
+ *
+ * Returns:
+ *      int
+ */
+int parse_sizes( char *arg ) {
+    Unified2GeneratorConfig *c = &pv.config;
+    char *end;
+
+    if( strcmp(arg, "imix") == 0 ) {
+        c->sizes = UNIFIED2_SIZES_IMIX;
+        return 0;
+    }
+
+    if( strncmp(arg, "uniform:", 8) == 0 ) {
+        c->sizes = UNIFIED2_SIZES_UNIFORM;
+        c->packet_min = strtoul(arg + 8, &end, 0);
+        if( *end != ':' )
+            return -1;
+        c->packet_max = strtoul(end + 1, &end, 0);
+        return *end == '\0' && c->packet_min <= c->packet_max ? 0 : -1;
+    }
+
+    if( strncmp(arg, "exp:", 4) == 0 ) {
+        c->sizes = UNIFIED2_SIZES_EXPONENTIAL;
+        c->packet_min = 0;
+        c->packet_mean = strtoul(arg + 4, &end, 0);
+        return *end == '\0' && c->packet_mean > 0 ? 0 : -1;
+    }
+
+    return -1;
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    Unified2GeneratorConfig *c = &pv.config;
+    int ch;
+
+    pv.output = NULL;
+    pv.bytes = 0;
+    pv.program_name = argv[0];
+    Unified2GeneratorDefaults(c);
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "w:s:n:b:m:p:S:x:N:g:H:t:R:C:F?v",
+        longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'w':
+            pv.output = optarg;
+            break;
+
+            case 's':
+            c->seed = strtoull(optarg, NULL, 0);
+            break;
+
+            case 'n':
+            c->events = strtoull(optarg, NULL, 0);
+            break;
+
+            case 'b':
+            pv.bytes = parse_size(optarg);
+            if( pv.bytes == 0 ) {
+                print_help();
+                return -1;
+            }
+            break;
+
+            case 'm':
+            if( sscanf(optarg, "%u:%u:%u:%u", &c->mix[0], &c->mix[1],
+                &c->mix[2], &c->mix[3]) != 4 ) {
+                print_help();
+                return -1;
+            }
+            break;
+
+            case 'p':
+            c->packets = strtod(optarg, NULL);
+            break;
+
+            case 'S':
+            if( parse_sizes(optarg) == -1 ) {
+                print_help();
+                return -1;
+            }
+            break;
+
+            case 'x':
+            c->extra = strtod(optarg, NULL);
+            break;
+
+            case 'N':
+            c->sensors = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'g':
+            if( parse_count_skew(optarg, &c->signatures, &c->signature_skew) ) {
+                print_help();
+                return -1;
+            }
+            break;
+
+            case 'H':
+            if( parse_count_skew(optarg, &c->hosts, &c->host_skew) ) {
+                print_help();
+                return -1;
+            }
+            break;
+
+            case 't':
+            c->start = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'R':
+            c->rate = strtod(optarg, NULL);
+            break;
+
+            case 'C':
+            c->corrupt = strtod(optarg, NULL);
+            break;
+
+            case 'F':
+            c->corrupt_framing = 1;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( !pv.output && isatty(STDOUT_FILENO) ) {
+        fprintf(stderr, "%s: refusing to write unified2 to a terminal, use -w\n",
+            pv.program_name);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Generator *gen;
+    Unified2 *unified2;
+    int rc = 0;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    gen = Unified2GeneratorNew(&pv.config);
+    if( gen == NULL )
+        exit(1);
+
+    /* Plain descriptors, readable by everyone like any other log */
+    unified2 = Unified2New();
+    unified2->fd = pv.output ? open(pv.output, O_WRONLY|O_CREAT|O_TRUNC, 0644) :
+        dup(STDOUT_FILENO);
+    if( unified2->fd == -1 ) {
+        warn("u2gen: failed to open %s: %s\n", pv.output ? pv.output : "stdout",
+        strerror(errno));
+        Unified2Free(unified2);
+        Unified2GeneratorFree(gen);
+        exit(1);
+    }
+    unified2->mode = DESCRIPTOR;
+
+    if( Unified2GeneratorWrite(gen, unified2, pv.bytes) != UNIFIED2_OK )
+        rc = 1;
+
+    if( Unified2Free(unified2) != UNIFIED2_OK )
+        rc = 1;
+
+    Unified2GeneratorFree(gen);
+
+    return rc;
+}
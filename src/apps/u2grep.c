@@ -0,0 +1,520 @@
+/*******************************************************************************
+ * Search the packet data of a unified2 log for many patterns at once.
+ *
+ * Every pattern goes into one automaton, see unified2_search.c, and each
+ * packet is scanned once for all of them. Matches are reported by event, or
+ * the matching packets are copied, with their events, to a unified2 file.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+/* Recent events kept to go out with their packets */
+#define EVENT_CACHE 4096
+#define EVENT_MAX   128
+
+static struct option longopts[] = {
+    {"read", required_argument, NULL, 'r' },
+    {"write", required_argument, NULL, 'w' },
+    {"pattern", required_argument, NULL, 'e' },
+    {"file", required_argument, NULL, 'f' },
+    {"ignore-case", no_argument, NULL, 'i' },
+    {"list", no_argument, NULL, 'l' },
+    {"count", no_argument, NULL, 'c' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    char *filename;
+    char *output;
+    int nocase;
+    int list;
+    int count;
+    char *program_name;
+
+    /* pattern texts, indexed by pattern id */
+    char **patterns;
+    uint32_t npatterns;
+} pv;
+
+typedef struct _CachedEvent {
+    uint32_t sensor_id;
+    uint32_t event_id;
+    uint32_t length;        /* 0 when empty */
+    int written;
+    uint8_t record[EVENT_MAX];
+} CachedEvent;
+
+static CachedEvent events[EVENT_CACHE];
+
+/* State of the packet being scanned */
+struct packet_matches {
+    uint64_t packet;
+    uint64_t *seen;         /* per pattern, last packet it was reported for */
+    uint32_t sensor_id;
+    uint32_t event_id;
+    int found;
+};
+
+static inline uint32_t field(const uint8_t *body, int offset)
+{
+    uint32_t value;
+
+    memcpy(&value, body + offset, sizeof(value));
+    return ntohl(value);
+}
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vilc] -r snort-unified2.log [-w out.log] [-e pattern]... [-f file] [pattern]\n"
+    "Options:\n"
+    "\t-r, --read         Specify file to read\n"
+    "\t-w, --write        Copy matching packets and their events here\n"
+    "\t-e, --pattern      Search for this pattern, may be repeated\n"
+    "\t-f, --file         Search for the patterns in this file, one per line\n"
+    "\t-i, --ignore-case  Match ASCII letters in either case\n"
+    "\t-l, --list         Only list the events of matching packets\n"
+    "\t-c, --count        Only print the number of matching packets\n"
+    "\t-?, --help         This help\n"
+    "\t-v, --version      Print version\n\n"
+    "Patterns are text with hex bytes between pipes, \"GET |2f 2e 2e|\".\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: add_pattern
+ *
+ * Purpose: Remember a pattern text
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      int
+ */
+static int add_pattern( const char *text ) {
+    char **patterns;
+
+    patterns = realloc(pv.patterns, (pv.npatterns + 1) * sizeof(char *));
+    if( patterns == NULL )
+        return -1;
+
+    pv.patterns = patterns;
+    pv.patterns[pv.npatterns] = strdup(text);
+    if( pv.patterns[pv.npatterns] == NULL )
+        return -1;
+
+    pv.npatterns++;
+
+    return 0;
+}
+
+/* Function: read_patterns
+ *
+ * Purpose: Add the patterns of a file, one per line, skipping empty lines
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      int
+ */
+static int read_patterns( const char *filename ) {
+    char line[4096];
+    size_t n;
+    FILE *fp;
+    int rc = 0;
+
+    fp = fopen(filename, "r");
+    if( fp == NULL ) {
+        warn("u2grep: failed to open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while( rc == 0 && fgets(line, sizeof(line), fp) ) {
+        n = strlen(line);
+        while( n && (line[n - 1] == '\n' || line[n - 1] == '\r') )
+            line[--n] = '\0';
+
+        if( n && add_pattern(line) == -1 )
+            rc = -1;
+    }
+
+    fclose(fp);
+
+    return rc;
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int ch;
+
+    pv.filename = NULL;
+    pv.output = NULL;
+    pv.nocase = 0;
+    pv.list = 0;
+    pv.count = 0;
+    pv.program_name = argv[0];
+    pv.patterns = NULL;
+    pv.npatterns = 0;
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:w:e:f:ilc?v", longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'w':
+            pv.output = optarg;
+            break;
+
+            case 'e':
+            if( add_pattern(optarg) == -1 )
+                return -1;
+            break;
+
+            case 'f':
+            if( read_patterns(optarg) == -1 )
+                return -1;
+            break;
+
+            case 'i':
+            pv.nocase = 1;
+            break;
+
+            case 'l':
+            pv.list = 1;
+            break;
+
+            case 'c':
+            pv.count = 1;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    /* Like grep, the first arguement is the pattern when there is no other */
+    if( pv.npatterns == 0 && optind < argc ) {
+        if( add_pattern(argv[optind++]) == -1 )
+            return -1;
+    }
+
+    if( !pv.filename || pv.npatterns == 0 ) {
+        print_help();
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: on_match
+ *
+ * Purpose: Report a pattern once per packet
+ *
+ * Arguements:
+ *      uint32_t
+ *      uint32_t
+ *      void *
+ *
+ * Returns:
+ *      int         non zero to stop scanning the packet
+ */
+static int on_match( uint32_t id, uint32_t offset, void *arg ) {
+    struct packet_matches *pm = arg;
+
+    (void)offset;
+
+    if( pm->seen[id] == pm->packet )
+        return 0;
+    pm->seen[id] = pm->packet;
+
+    if( !pm->found && pv.list )
+        printf("%u:%u\n", pm->sensor_id, pm->event_id);
+    else if( !pv.list && !pv.count && !pv.output )
+        printf("%u:%u\t%s\n", pm->sensor_id, pm->event_id, pv.patterns[id]);
+
+    pm->found = 1;
+
+    /* One match is all that is needed unless every pattern is printed */
+    return pv.list || pv.count || pv.output;
+}
+
+/* Function: write_packet
+ *
+ * Purpose: Copy a matching packet, after its event when that is known and
+ * has not been written yet
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const uint8_t *
+ *      uint32_t
+ *      const struct packet_matches *
+ *
+ * Returns:
+ *      int
+ */
+static int write_packet( Unified2Buffer *out, const uint8_t *record,
+    uint32_t length, const struct packet_matches *pm ) {
+    CachedEvent *cached = &events[pm->event_id % EVENT_CACHE];
+
+    if( cached->length && !cached->written &&
+        cached->sensor_id == pm->sensor_id &&
+        cached->event_id == pm->event_id ) {
+        if( Unified2BufferAppend(out, cached->record, cached->length)
+            != UNIFIED2_OK )
+            return -1;
+        cached->written = 1;
+    }
+
+    if( Unified2BufferAppend(out, record, length) != UNIFIED2_OK )
+        return -1;
+
+    return 0;
+}
+
+/* Function: unified2_loop
+ *
+ * Purpose: Scan the packets of a unified2 log
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2Search *
+ *      Unified2Buffer *        NULL unless writing records
+ *
+ * Returns:
+ *      int
+ */
+int unified2_loop(char *filename, const Unified2Search *search,
+    Unified2Buffer *out)
+{
+    struct packet_matches pm;
+    Unified2 *unified2;
+    const uint8_t *record;
+    CachedEvent *cached;
+    uint64_t matched = 0;
+    uint32_t length;
+    int rc = 1;
+    int r;
+
+    memset(&pm, 0x0, sizeof(pm));
+    pm.seen = calloc(pv.npatterns, sizeof(uint64_t));
+    if( pm.seen == NULL )
+        return -1;
+
+    unified2 = Unified2New();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenMapped(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        free(pm.seen);
+        return -1;
+    }
+
+    for( ;; )
+    {
+        r = Unified2ReadRawRecord(unified2, &record, &length);
+        if( r == UNIFIED2_EOF )
+            break;
+
+        if( r != UNIFIED2_OK ) {
+            rc = -1;
+            break;
+        }
+
+        switch( field(record, 0) ) {
+            case UNIFIED2_IDS_EVENT:
+            case UNIFIED2_IDS_EVENT_MPLS:
+            case UNIFIED2_IDS_EVENT_V2:
+            case UNIFIED2_IDS_EVENT_IPV6:
+            case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+            case UNIFIED2_IDS_EVENT_IPV6_V2:
+            if( out == NULL || length > EVENT_MAX ||
+                length < sizeof(Unified2RecordHeader) + 8 )
+                break;
+
+            /* Records are only valid until the next read */
+            cached = &events[field(record, 12) % EVENT_CACHE];
+            cached->sensor_id = field(record, 8);
+            cached->event_id = field(record, 12);
+            cached->length = length;
+            cached->written = 0;
+            memcpy(cached->record, record, length);
+            break;
+
+            case UNIFIED2_PACKET:
+            if( length < sizeof(Unified2RecordHeader) + 8 )
+                break;
+
+            pm.packet++;
+            pm.sensor_id = field(record, 8);
+            pm.event_id = field(record, 12);
+            pm.found = 0;
+
+            Unified2SearchPacket(search, record, length, on_match, &pm);
+            if( !pm.found )
+                break;
+
+            matched++;
+            if( out != NULL && write_packet(out, record, length, &pm) == -1 )
+                rc = -1;
+            break;
+
+            default:
+            break;
+        }
+
+        if( rc != 1 )
+            break;
+    }
+
+    if( pv.count )
+        printf("%llu\n", (unsigned long long)matched);
+
+    Unified2Free(unified2);
+    free(pm.seen);
+
+    return rc;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Search *search;
+    Unified2Buffer output;
+    Unified2Buffer *out = NULL;
+    uint32_t i;
+    int rc = 0;
+    int fd = -1;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    search = Unified2SearchNew(pv.nocase);
+    if( search == NULL )
+        exit(1);
+
+    for( i = 0; i < pv.npatterns; i++ ) {
+        if( Unified2SearchAddPattern(search, pv.patterns[i], i) != UNIFIED2_OK ) {
+            Unified2SearchFree(search);
+            exit(1);
+        }
+    }
+
+    if( Unified2SearchCompile(search) != UNIFIED2_OK ) {
+        Unified2SearchFree(search);
+        exit(1);
+    }
+
+    if( pv.output ) {
+        fd = open(pv.output, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if( fd == -1 ) {
+            warn("u2grep: failed to open %s: %s\n", pv.output, strerror(errno));
+            Unified2SearchFree(search);
+            exit(1);
+        }
+
+        if( Unified2BufferInit(&output, fd, 0) != UNIFIED2_OK ) {
+            close(fd);
+            Unified2SearchFree(search);
+            exit(1);
+        }
+        out = &output;
+    }
+
+    if( unified2_loop(pv.filename, search, out) != 1 )
+        rc = 1;
+
+    if( out != NULL ) {
+        if( Unified2BufferFree(out) != UNIFIED2_OK )
+            rc = 1;
+        if( close(fd) == -1 ) {
+            warn("u2grep: failed to close %s: %s\n", pv.output, strerror(errno));
+            rc = 1;
+        }
+    }
+
+    Unified2SearchFree(search);
+    for( i = 0; i < pv.npatterns; i++ )
+        free(pv.patterns[i]);
+    free(pv.patterns);
+
+    return rc;
+}
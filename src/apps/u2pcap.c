@@ -1,8 +1,384 @@
+/*******************************************************************************
+ * Extract the packets of a unified2 log into a pcap or pcapng file.
+ *
+ * Records are read raw and only packet headers are decoded, so the cost per
+ * packet is a copy into the output buffer. Event records are remembered just
+ * long enough to filter packets on the signature of the event they belong to.
+ ******************************************************************************/
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+/* Packets follow their event closely, remember the most recent ones */
+#define EVENT_CACHE 4096
+
+static struct option longopts[] = {
+    {"read", required_argument, NULL, 'r' },
+    {"write", required_argument, NULL, 'w' },
+    {"pcapng", no_argument, NULL, 'g' },
+    {"sid", required_argument, NULL, 'S' },
+    {"sensor", required_argument, NULL, 's' },
+    {"event", required_argument, NULL, 'e' },
+    {"after", required_argument, NULL, 'a' },
+    {"before", required_argument, NULL, 'b' },
+    {"count", required_argument, NULL, 'n' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    int record_count;
+    char *filename;
+    char *output;
+    char *program_name;
+    UNIFIED2_PCAP_FORMAT format;
+
+    /* filters, a negative value matches anything */
+    int64_t sid;
+    int64_t sensor;
+    int64_t event;
+    int64_t after;
+    int64_t before;
+} pv;
+
+typedef struct _EventKey {
+    uint32_t sensor_id;
+    uint32_t event_id;
+    uint32_t signature_id;
+    uint32_t valid;
+} EventKey;
+
+static EventKey events[EVENT_CACHE];
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vgr:w:S:s:e:a:b:n:] snort-unified2.log\n"
+    "Options:\n"
+    "\t-r, --read       Specify file to read\n"
+    "\t-w, --write      Capture file to write (default: stdout)\n"
+    "\t-g, --pcapng     Write pcapng instead of pcap\n"
+    "\t-S, --sid        Only packets of events with this signature id\n"
+    "\t-s, --sensor     Only packets from this sensor id\n"
+    "\t-e, --event      Only packets of this event id\n"
+    "\t-a, --after      Only packets at or after this time (epoch seconds)\n"
+    "\t-b, --before     Only packets before this time (epoch seconds)\n"
+    "\t-n, --count      Number of packets to write\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int argi = 1;
+    int ch;
+
+    pv.record_count = -1;
+    pv.filename = NULL;
+    pv.output = NULL;
+    pv.program_name = argv[0];
+    pv.format = UNIFIED2_PCAP;
+    pv.sid = pv.sensor = pv.event = pv.after = pv.before = -1;
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:w:gS:s:e:a:b:n:?v", longopts, NULL)) != -1 ) {
+        argi++;
+        switch(ch) {
+            case 'n':
+            pv.record_count = atoi(optarg);
+            break;
+
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'w':
+            pv.output = optarg;
+            break;
+
+            case 'g':
+            pv.format = UNIFIED2_PCAPNG;
+            break;
+
+            case 'S':
+            pv.sid = strtoul(optarg, NULL, 0);
+            break;
+
+            case 's':
+            pv.sensor = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'e':
+            pv.event = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'a':
+            pv.after = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'b':
+            pv.before = strtoul(optarg, NULL, 0);
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( argi < argc && argc > 1 && !pv.filename ) {
+        pv.filename = argv[argc-1];
+    }
+
+    if( !pv.filename ) {
+        print_help();
+        return -1;
+    }
+
+    if( pv.output == NULL && isatty(STDOUT_FILENO) ) {
+        fprintf(stderr, "%s: refusing to write a capture to a terminal, "
+        "use -w\n", pv.program_name);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: remember_event
+ *
+ * Purpose: Keep the signature id of an event for the packets that follow it.
+ * All event record types start with sensor, event id, two time stamps and the
+ * signature id.
+ *
+ * Arguements:
+ *      const uint8_t *
+ *
+ * Returns:
+ *      void
+ */
+void remember_event(const uint8_t *body) {
+    EventKey *key;
+    uint32_t event_id = _Unified2Field32(body, 4);
+
+    key = &events[event_id % EVENT_CACHE];
+    key->sensor_id = _Unified2Field32(body, 0);
+    key->event_id = event_id;
+    key->signature_id = _Unified2Field32(body, 16);
+    key->valid = 1;
+}
+
+/* Function: packet_matches
+ *
+ * Purpose: Apply the command line filters to a decoded packet header
+ *
+ * Arguements:
+ *      const Unified2Packet *
+ *
+ * Returns:
+ *      int
+ */
+int packet_matches(const Unified2Packet *packet) {
+    EventKey *key;
+
+    if( pv.sensor >= 0 && packet->sensor_id != pv.sensor )
+        return 0;
+
+    if( pv.event >= 0 && packet->event_id != pv.event )
+        return 0;
+
+    if( pv.after >= 0 && packet->packet_second < pv.after )
+        return 0;
+
+    if( pv.before >= 0 && packet->packet_second >= pv.before )
+        return 0;
+
+    if( pv.sid >= 0 ) {
+        key = &events[packet->event_id % EVENT_CACHE];
+        if( !key->valid || key->event_id != packet->event_id ||
+            key->sensor_id != packet->sensor_id ||
+            key->signature_id != pv.sid )
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Function: unified2_loop
+ *
+ * Purpose: Copy the matching packets of a unified2 log to a capture file
+ *
+ * Arguements:
+ *      char *
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int unified2_loop(char *filename, int loop_count)
+{
+    Unified2 *unified2;
+    Unified2PcapWriter *pcap;
+    Unified2Packet packet;
+    const uint8_t *record;
+    const uint8_t *body;
+    uint32_t length;
+    uint32_t type;
+    int r;
+
+    unified2 = Unified2New();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenFILE(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    pcap = Unified2PcapOpen(pv.output, pv.format);
+    if( pcap == NULL ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    while( loop_count )
+    {
+        r = Unified2ReadRawRecord(unified2, &record, &length);
+        if( r != UNIFIED2_OK )
+            break;
+
+        type = _Unified2Field32(record, 0);
+        body = record + sizeof(Unified2RecordHeader);
+        length -= sizeof(Unified2RecordHeader);
+
+        switch( type ) {
+            case UNIFIED2_IDS_EVENT:
+            case UNIFIED2_IDS_EVENT_V2:
+            case UNIFIED2_IDS_EVENT_IPV6:
+            case UNIFIED2_IDS_EVENT_IPV6_V2:
+            if( pv.sid >= 0 && length >= 20 )
+                remember_event(body);
+            continue;
+
+            case UNIFIED2_PACKET:
+            break;
+
+            default:
+            continue;
+        }
+
+        if( length < sizeof(Unified2Packet) )
+            continue;
+
+        packet.sensor_id = _Unified2Field32(body, 0);
+        packet.event_id = _Unified2Field32(body, 4);
+        packet.event_second = _Unified2Field32(body, 8);
+        packet.packet_second = _Unified2Field32(body, 12);
+        packet.packet_microsecond = _Unified2Field32(body, 16);
+        packet.linktype = _Unified2Field32(body, 20);
+        packet.packet_length = _Unified2Field32(body, 24);
+
+        if( packet.packet_length > length - sizeof(Unified2Packet) ) {
+            warn("u2pcap: packet of event %u is longer than its record\n",
+            packet.event_id);
+            continue;
+        }
+
+        if( !packet_matches(&packet) )
+            continue;
+
+        if( Unified2PcapWritePacket(pcap, &packet,
+            body + sizeof(Unified2Packet)) == UNIFIED2_ERROR )
+            break;
+
+        if( loop_count > 0 )
+            loop_count--;
+    }
+
+    r = Unified2PcapClose(pcap);
+    Unified2Free(unified2);
+
+    return r == UNIFIED2_OK ? 1 : -1;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    if( unified2_loop(pv.filename, pv.record_count) != 1 )
+        exit(1);
 
-int main( ) {
     return 0;
 }
@@ -4,6 +4,18 @@
  * Date:    September 4, 2010
  ******************************************************************************/
 
+/*
+ * Records are never decoded: only the record headers are walked and the
+ * bytes between split points are copied as they are, so every record type
+ * survives, known or not. Plain files are mapped and their records copied in
+ * runs by the kernel; anything else is staged through one output buffer.
+ *
+ * With a partition key every distinct key value gets its own file instead,
+ * and packets and extra data follow the event they belong to. Each partition
+ * buffers its records, or just remembers a run of adjacent mapped records,
+ * and only a bounded number of partition files are kept open at a time.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -12,10 +24,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #ifdef MACOS
 extern char *optarg;
@@ -27,156 +43,1182 @@ extern int optreset;
 
 
 #include "unified2.h"
- 
+
+/* Partitions remember this many recent events for their packets */
+#define EVENT_CACHE         65536
+
+/* Partition buffers grow from PARTITION_MIN to PARTITION_BUFFER; once all of
+ * them together hold PARTITION_BUDGET they are all written out and freed */
+#define PARTITION_MIN       4096
+#define PARTITION_BUFFER    (64 << 10)
+#define PARTITION_BUDGET    (64 << 20)
+
+/* Descriptors kept back from RLIMIT_NOFILE for everything else */
+#define RESERVED_FDS        16
+
+typedef enum _PARTITION_KEY {
+    KEY_NONE,
+    KEY_SENSOR,
+    KEY_SIGNATURE,
+    KEY_DESTINATION,
+    KEY_HOUR,
+} PARTITION_KEY;
 
 static struct option longopts[] = {
     {"read", required_argument, NULL, 'r' },
     {"prefix", required_argument, NULL, 'w' },
     {"count", required_argument, NULL, 'n' },
+    {"bytes", required_argument, NULL, 'b' },
+    {"seconds", required_argument, NULL, 't' },
+    {"key", required_argument, NULL, 'k' },
+    {"max-open", required_argument, NULL, 'F' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
 
     {NULL, 0, NULL, 0}
 };
 
+struct progam_vars {
+    char *filename;
+    char *prefix;
+    char *program_name;
 
-int open_next( Unified2 *unified2, char *prefix )
-{
-    static int count = 0;
-    int string_size = strlen(prefix)+7;
+    /* split points, 0 for none */
+    uint64_t records;
+    uint64_t bytes;
+    uint32_t seconds;
+
+    PARTITION_KEY key;
+    int max_open;
+} pv;
+
+/* The file being written */
+struct output {
+    int fd;
+    int index;
+    uint64_t records;
+    uint64_t bytes;
+
+    /* time bucket of the records in it, -1 until one had a time stamp */
+    int64_t bucket;
+};
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vr:w:n:b:t:k:F:] snort-unified2.log\n"
+    "Options:\n"
+    "\t-r, --read       Specify file to read\n"
+    "\t-w, --prefix     Write prefix_00000, prefix_00001, ...\n"
+    "\t-n, --count      Records per file\n"
+    "\t-b, --bytes      Bytes per file, k, m and g suffixes are understood\n"
+    "\t-t, --seconds    Start a new file every this many seconds of event time\n"
+    "\t-k, --key        Write one file per sensor, signature, destination (/24\n"
+    "\t                 or /64) or hour instead: prefix_<key>\n"
+    "\t-F, --max-open   Partition files to keep open at once\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_size
+ *
+ * Purpose: Parse a byte count with an optional k, m or g suffix
+ *
+ * Arguements:
+ *      char *
+ *
+ * Returns:
+ *      uint64_t    0 when it is not a size
+ */
+uint64_t parse_size( char *arg ) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+
+    switch( tolower((unsigned char)*end) ) {
+        case 'g':
+        size <<= 10;
+        /* fall through */
+        case 'm':
+        size <<= 10;
+        /* fall through */
+        case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    return *end == '\0' ? size : 0;
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int argi = 1;
+    int ch;
+
+    memset(&pv, 0x0, sizeof(pv));
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:w:n:b:t:k:F:?v", longopts, NULL)) != -1 ) {
+        argi++;
+        switch(ch) {
+            case 'n':
+            pv.records = strtoull(optarg, NULL, 0);
+            break;
+
+            case 'b':
+            pv.bytes = parse_size(optarg);
+            if( pv.bytes == 0 ) {
+                fprintf(stderr, "%s: bad size %s\n", pv.program_name, optarg);
+                return -1;
+            }
+            break;
+
+            case 't':
+            pv.seconds = strtoul(optarg, NULL, 0);
+            break;
+
+            case 'k':
+            if( strcmp(optarg, "sensor") == 0 )
+                pv.key = KEY_SENSOR;
+            else if( strcmp(optarg, "signature") == 0 || strcmp(optarg, "sid") == 0 )
+                pv.key = KEY_SIGNATURE;
+            else if( strcmp(optarg, "destination") == 0 || strcmp(optarg, "dst") == 0 )
+                pv.key = KEY_DESTINATION;
+            else if( strcmp(optarg, "hour") == 0 )
+                pv.key = KEY_HOUR;
+            else {
+                fprintf(stderr, "%s: unknown key %s, use sensor, signature, "
+                "destination or hour\n", pv.program_name, optarg);
+                return -1;
+            }
+            break;
+
+            case 'F':
+            pv.max_open = atoi(optarg);
+            break;
+
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'w':
+            pv.prefix = optarg;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( argi < argc && argc > 1 && !pv.filename ) {
+        pv.filename = argv[argc-1];
+    }
+
+    if( !pv.filename || !pv.prefix ) {
+        print_help();
+        return -1;
+    }
+
+    if( pv.key != KEY_NONE && (pv.records || pv.bytes || pv.seconds) ) {
+        fprintf(stderr, "%s: -k can not be combined with -n, -b or -t\n",
+        pv.program_name);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: record_second
+ *
+ * Purpose: Find the event time of a raw record. Events and packets carry it
+ * after the sensor and event ids, extra data after its own 8 byte header.
+ *
+ * Arguements:
+ *      const uint8_t *
+ *      uint32_t
+ *      uint32_t *
+ *
+ * Returns:
+ *      int         0 for records without a time stamp
+ */
+int record_second( const uint8_t *record, uint32_t length, uint32_t *second ) {
+    int offset;
+
+    switch( _Unified2Field32(record, 0) ) {
+        case UNIFIED2_PACKET:
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        offset = sizeof(Unified2RecordHeader) + 8;
+        break;
+
+        case UNIFIED2_EXTRA_DATA:
+        offset = sizeof(Unified2RecordHeader) + sizeof(Unified2ExtraDataHdr) + 8;
+        break;
+
+        default:
+        return 0;
+    }
+
+    if( length < offset + sizeof(uint32_t) )
+        return 0;
+
+    *second = _Unified2Field32(record, offset);
+
+    return 1;
+}
+
+/* Function: open_next
+ *
+ * Purpose: Close the current output and create the next one
+ *
+ * Arguements:
+ *      struct output *
+ *
+ * Returns:
+ *      int
+ */
+int open_next( struct output *out ) {
+    int string_size = strlen(pv.prefix)+16;
     char *filename = malloc(string_size);
 
-    snprintf(filename, string_size, "%s_%05d", prefix, count);
+    if( out->fd != -1 && close(out->fd) == -1 ) {
+        warn("u2split: failed to close %s_%05d: %s\n", pv.prefix,
+        out->index - 1, strerror(errno));
+        free(filename);
+        return -1;
+    }
+
+    snprintf(filename, string_size, "%s_%05d", pv.prefix, out->index);
+
+    out->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if( out->fd == -1 ) {
+        warn("u2split: failed to open the file %s: %s\n", filename,
+        strerror(errno));
+        free(filename);
+        return -1;
+    }
 
-    Unified2WriteOpenFd(unified2, filename);
-    
     free(filename);
-    count++;
+    out->index++;
+    out->records = 0;
+    out->bytes = 0;
+    out->bucket = -1;
+
+    return 0;
+}
+
+/* Function: split_here
+ *
+ * Purpose: Decide if a record starts a new file
+ *
+ * Arguements:
+ *      struct output *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      int
+ */
+int split_here( struct output *out, const uint8_t *record, uint32_t length ) {
+    uint32_t second;
+    int64_t bucket;
+
+    if( pv.seconds && record_second(record, length, &second) ) {
+        bucket = second / pv.seconds;
+        if( out->bucket == -1 )
+            out->bucket = bucket;
+        else if( bucket != out->bucket && out->records )
+            return 1;
+    }
+
+    if( out->records == 0 )
+        return 0;
+
+    if( pv.records && out->records >= pv.records )
+        return 1;
+
+    if( pv.bytes && out->bytes + length > pv.bytes )
+        return 1;
 
     return 0;
 }
 
 /* Function: unified2_loop
  *
- * Purpose: Open the unified2 and print its contents to stdout
+ * Purpose: Split a unified2 log into files along record boundaries
  *
  * Arguements:
  *      char *
- *      int
  *
  * Returns:
  *      int
  */
-int unified2_loop(char *filename, char *prefix, int count)
+int unified2_loop(char *filename)
 {
-    int loop_count = count;
-    int r = 1;
+    Unified2 *unified2;
+    Unified2Buffer staging;
+    struct output out;
+    const uint8_t *record;
+    const uint8_t *run = NULL;
+    uint64_t run_length = 0;
+    uint32_t length;
+    uint32_t second;
+    int in_place;
+    int rc = 1;
+    int r;
 
-    Unified2Entry *entry;
-    Unified2 *unified2, *write2;
- 
     unified2 = Unified2New();
-    entry = Unified2EntryNew();
-    Unified2ReadOpenFd(unified2, filename);
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenMapped(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    /* Mapped records stay put, so adjacent ones are copied as one run */
+    in_place = unified2->mode == MAPPED;
+
+    memset(&out, 0x0, sizeof(out));
+    out.fd = -1;
+    if( open_next(&out) == -1 ) {
+        Unified2Free(unified2);
+        return -1;
+    }
 
-    while( r != UNIFIED2_EOF )
+    if( !in_place && Unified2BufferInit(&staging, out.fd, 0) != UNIFIED2_OK ) {
+        close(out.fd);
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    for( ;; )
     {
-        loop_count = count;
-        write2 = Unified2New();
-        open_next(write2, prefix);
-
-        while( loop_count )
-        {
-            if( loop_count > 0 )
-            {
-                loop_count--;
-            }
+        r = Unified2ReadRawRecord(unified2, &record, &length);
+        if( r == UNIFIED2_EOF )
+            break;
 
-            r = Unified2ReadNextEntry(unified2, entry);
+        if( r != UNIFIED2_OK ) {
+            rc = -1;
+            break;
+        }
 
-            if( r == UNIFIED2_EOF )
-            {
-                warn("EOF\n");
+        if( split_here(&out, record, length) ) {
+            if( in_place ) {
+                r = Unified2CopyRecords(unified2, run, run_length, out.fd);
+                run = NULL;
+                run_length = 0;
+            }
+            else {
+                r = Unified2BufferFlush(&staging);
+            }
+
+            if( r != UNIFIED2_OK || open_next(&out) == -1 ) {
+                rc = -1;
                 break;
             }
+            staging.fd = out.fd;
 
-            if( r == UNIFIED2_WARN )
-            {
-                warn("WARNING\n");
+            if( pv.seconds && record_second(record, length, &second) )
+                out.bucket = second / pv.seconds;
+        }
+
+        if( !in_place ) {
+            if( Unified2BufferAppend(&staging, record, length) != UNIFIED2_OK ) {
+                rc = -1;
+                break;
+            }
+        }
+        else if( run != NULL && record == run + run_length ) {
+            run_length += length;
+        }
+        else {
+            if( run != NULL &&
+                Unified2CopyRecords(unified2, run, run_length, out.fd) != UNIFIED2_OK ) {
+                rc = -1;
                 break;
             }
+            run = record;
+            run_length = length;
+        }
+
+        out.records++;
+        out.bytes += length;
+    }
 
-            if( Unified2WriteRecord(write2, entry) == UNIFIED2_ERROR )
-            {
-                r = UNIFIED2_EOF;
-                warn("error writing\n");
+    if( in_place ) {
+        if( run != NULL &&
+            Unified2CopyRecords(unified2, run, run_length, out.fd) != UNIFIED2_OK )
+            rc = -1;
+    }
+    else if( Unified2BufferFree(&staging) != UNIFIED2_OK ) {
+        rc = -1;
+    }
+
+    if( out.fd != -1 && close(out.fd) == -1 ) {
+        warn("u2split: failed to close %s_%05d: %s\n", pv.prefix,
+        out.index - 1, strerror(errno));
+        rc = -1;
+    }
+
+    Unified2Free(unified2);
+
+    return rc;
+}
+
+typedef struct _Partition {
+    uint64_t key;
+    int ipv6;               /* key is an IPv6 /64 rather than anything else */
+    char *filename;
+
+    int fd;                 /* -1 while closed */
+    int created;            /* truncated on first open, appended to after */
+
+    uint8_t *buffer;
+    uint32_t used;
+    uint32_t size;
+
+    /* mapped records not copied yet, they come after the buffer */
+    const uint8_t *run;
+    uint64_t run_length;
+
+    /* open files, most recently used first */
+    struct _Partition *newer;
+    struct _Partition *older;
+} Partition;
+
+typedef struct _EventPartition {
+    uint32_t sensor_id;
+    uint32_t event_id;
+    Partition *partition;
+} EventPartition;
+
+static struct {
+    Unified2 *input;
+    int in_place;
+
+    Partition **list;
+    uint32_t count;
+    uint32_t allocated;
+
+    /* open addressing, index into list plus one */
+    uint32_t *table;
+    uint32_t table_size;
+
+    /* records that can not be placed, and the last record placed */
+    Partition *other;
+    Partition *last;
+
+    Partition *newest;
+    Partition *oldest;
+    int open;
+
+    uint64_t buffered;
+} parts;
+
+static EventPartition event_partitions[EVENT_CACHE];
+
+/* Function: partition_filename
+ *
+ * Purpose: Name the file of a partition after its key
+ *
+ * Arguements:
+ *      Partition *
+ *
+ * Returns:
+ *      char *
+ */
+char * partition_filename( Partition *p ) {
+    char name[64];
+    uint8_t addr[16];
+    time_t hour;
+    struct tm tm;
+    uint32_t v4;
+    char *filename;
+    int size;
+
+    if( p == parts.other ) {
+        snprintf(name, sizeof(name), "other");
+    }
+    else switch( pv.key ) {
+        case KEY_SENSOR:
+        snprintf(name, sizeof(name), "%u", (uint32_t)p->key);
+        break;
+
+        case KEY_SIGNATURE:
+        snprintf(name, sizeof(name), "%u-%u", (uint32_t)(p->key >> 32),
+        (uint32_t)p->key);
+        break;
+
+        case KEY_DESTINATION:
+        memset(addr, 0x0, sizeof(addr));
+        if( p->ipv6 ) {
+            for( size = 0; size < 8; size++ )
+                addr[size] = p->key >> (56 - size * 8);
+            inet_ntop(AF_INET6, addr, name, sizeof(name));
+        }
+        else {
+            v4 = htonl((uint32_t)p->key);
+            inet_ntop(AF_INET, &v4, name, sizeof(name));
+        }
+        break;
+
+        case KEY_HOUR:
+        default:
+        hour = (time_t)p->key * 3600;
+        gmtime_r(&hour, &tm);
+        strftime(name, sizeof(name), "%Y%m%d%H", &tm);
+        break;
+    }
+
+    size = strlen(pv.prefix) + strlen(name) + 2;
+    filename = malloc(size);
+    if( filename != NULL )
+        snprintf(filename, size, "%s_%s", pv.prefix, name);
+
+    return filename;
+}
+
+static uint32_t partition_hash( uint64_t key, int ipv6 ) {
+    key ^= (uint64_t)ipv6 << 63;
+    key *= 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(key >> 32);
+}
+
+/* Function: partition_new
+ *
+ * Purpose: Create an empty partition, the file is only created once there
+ * is something to write to it
+ *
+ * Arguements:
+ *      uint64_t
+ *      int
+ *
+ * Returns:
+ *      Partition *
+ */
+Partition * partition_new( uint64_t key, int ipv6 ) {
+    Partition **list;
+    Partition *p;
+
+    if( parts.count == parts.allocated ) {
+        parts.allocated = parts.allocated ? parts.allocated * 2 : 64;
+        list = realloc(parts.list, parts.allocated * sizeof(Partition *));
+        if( list == NULL ) {
+            warn("u2split: failed to malloc: %s\n", strerror(errno));
+            return NULL;
+        }
+        parts.list = list;
+    }
+
+    p = calloc(1, sizeof(Partition));
+    if( p == NULL ) {
+        warn("u2split: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    p->key = key;
+    p->ipv6 = ipv6;
+    p->fd = -1;
+
+    parts.list[parts.count++] = p;
+
+    return p;
+}
+
+/* Function: partition_find
+ *
+ * Purpose: Look up the partition of a key, creating it the first time
+ *
+ * Arguements:
+ *      uint64_t
+ *      int
+ *
+ * Returns:
+ *      Partition *
+ */
+Partition * partition_find( uint64_t key, int ipv6 ) {
+    uint32_t *table;
+    uint32_t size;
+    uint32_t i, j;
+    Partition *p;
+
+    if( parts.count * 2 >= parts.table_size ) {
+        size = parts.table_size ? parts.table_size * 2 : 256;
+        table = calloc(size, sizeof(uint32_t));
+        if( table == NULL ) {
+            warn("u2split: failed to malloc: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        for( i = 0; i < parts.table_size; i++ ) {
+            if( parts.table[i] == 0 )
+                continue;
+            p = parts.list[parts.table[i] - 1];
+            j = partition_hash(p->key, p->ipv6) & (size - 1);
+            while( table[j] )
+                j = (j + 1) & (size - 1);
+            table[j] = parts.table[i];
+        }
+
+        free(parts.table);
+        parts.table = table;
+        parts.table_size = size;
+    }
+
+    i = partition_hash(key, ipv6) & (parts.table_size - 1);
+    while( parts.table[i] ) {
+        p = parts.list[parts.table[i] - 1];
+        if( p->key == key && p->ipv6 == ipv6 )
+            return p;
+        i = (i + 1) & (parts.table_size - 1);
+    }
+
+    p = partition_new(key, ipv6);
+    if( p != NULL )
+        parts.table[i] = parts.count;
+
+    return p;
+}
+
+/* Function: partition_open
+ *
+ * Purpose: Make sure the file of a partition is open, closing the least
+ * recently used one when too many are
+ *
+ * Arguements:
+ *      Partition *
+ *
+ * Returns:
+ *      int
+ */
+int partition_open( Partition *p ) {
+    Partition *victim;
+
+    if( p->fd != -1 ) {
+        if( p == parts.newest )
+            return 0;
+
+        /* unlink, it goes back in at the front below */
+        p->newer->older = p->older;
+        if( p->older )
+            p->older->newer = p->newer;
+        else
+            parts.oldest = p->newer;
+    }
+    else {
+        if( parts.open >= pv.max_open ) {
+            victim = parts.oldest;
+            parts.oldest = victim->newer;
+            if( parts.oldest )
+                parts.oldest->older = NULL;
+            else
+                parts.newest = NULL;
+
+            if( close(victim->fd) == -1 ) {
+                warn("u2split: failed to close %s: %s\n", victim->filename,
+                strerror(errno));
+                return -1;
             }
+            victim->fd = -1;
+            parts.open--;
+        }
+
+        if( p->filename == NULL ) {
+            p->filename = partition_filename(p);
+            if( p->filename == NULL )
+                return -1;
+        }
+
+        p->fd = open(p->filename,
+            p->created ? O_WRONLY : O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if( p->fd == -1 ) {
+            warn("u2split: failed to open the file %s: %s\n", p->filename,
+            strerror(errno));
+            return -1;
+        }
 
-            Unified2EntrySparseCleanup(entry);
+        /* Not O_APPEND, the kernel copies refuse to write to those */
+        if( p->created && lseek(p->fd, 0, SEEK_END) == -1 ) {
+            warn("u2split: failed to seek %s: %s\n", p->filename,
+            strerror(errno));
+            close(p->fd);
+            p->fd = -1;
+            return -1;
         }
 
-        Unified2Free(write2);
+        p->created = 1;
+        parts.open++;
     }
 
-    Unified2Free(unified2);
-    printf("\n");
+    p->older = parts.newest;
+    p->newer = NULL;
+    if( parts.newest )
+        parts.newest->newer = p;
+    else
+        parts.oldest = p;
+    parts.newest = p;
 
-    return(1);
+    return 0;
 }
 
-/* Function: main
+/* Function: partition_copy
  *
- * Purpose: Its main yo!
+ * Purpose: Write records straight to the file of a partition
+ *
+ * Arguements:
+ *      Partition *
+ *      const uint8_t *
+ *      uint64_t
+ *
+ * Returns:
+ *      int
+ */
+int partition_copy( Partition *p, const uint8_t *data, uint64_t length ) {
+    if( length == 0 )
+        return 0;
+
+    if( partition_open(p) == -1 )
+        return -1;
+
+    if( Unified2CopyRecords(parts.input, data, length, p->fd) != UNIFIED2_OK )
+        return -1;
+
+    return 0;
+}
+
+/* Function: partition_flush
+ *
+ * Purpose: Write out what a partition has buffered, then its pending run
  *
  * Arguements:
+ *      Partition *
+ *
+ * Returns:
  *      int
- *      char **
+ */
+int partition_flush( Partition *p ) {
+    if( partition_copy(p, p->buffer, p->used) == -1 )
+        return -1;
+    p->used = 0;
+
+    if( partition_copy(p, p->run, p->run_length) == -1 )
+        return -1;
+    p->run = NULL;
+    p->run_length = 0;
+
+    return 0;
+}
+
+/* Function: partition_sweep
+ *
+ * Purpose: Write out and free every buffer once they use too much memory
+ *
+ * Arguements:
+ *      void
  *
  * Returns:
  *      int
  */
-int main( int argc, char *argv[] ) {
-   int ch, i = -1;
-    char *filename = NULL;
-    char *prefix = NULL;
+int partition_sweep( ) {
+    uint32_t i;
+    Partition *p;
 
-    /* Get the options */
-    while((ch = getopt_long(argc, argv, "r:w:n:", longopts, NULL)) != -1 )
+    for( i = 0; i < parts.count; i++ ) {
+        p = parts.list[i];
+        if( p->used && partition_copy(p, p->buffer, p->used) == -1 )
+            return -1;
+
+        free(p->buffer);
+        p->buffer = NULL;
+        p->used = p->size = 0;
+    }
+    parts.buffered = 0;
+
+    return 0;
+}
+
+/* Function: partition_append
+ *
+ * Purpose: Buffer records for a partition; anything too large to be worth
+ * buffering is written directly
+ *
+ * Arguements:
+ *      Partition *
+ *      const uint8_t *
+ *      uint64_t
+ *
+ * Returns:
+ *      int
+ */
+int partition_append( Partition *p, const uint8_t *data, uint64_t length ) {
+    uint8_t *buffer;
+    uint32_t size;
+
+    if( p->used + length > PARTITION_BUFFER ) {
+        if( partition_copy(p, p->buffer, p->used) == -1 )
+            return -1;
+        p->used = 0;
+
+        if( length > PARTITION_BUFFER / 2 )
+            return partition_copy(p, data, length);
+    }
+
+    if( p->used + length > p->size ) {
+        size = p->size ? p->size : PARTITION_MIN;
+        while( size < p->used + length )
+            size *= 2;
+
+        buffer = realloc(p->buffer, size);
+        if( buffer == NULL ) {
+            warn("u2split: failed to malloc: %s\n", strerror(errno));
+            return -1;
+        }
+        parts.buffered += size - p->size;
+        p->buffer = buffer;
+        p->size = size;
+    }
+
+    memcpy(p->buffer + p->used, data, length);
+    p->used += length;
+
+    if( parts.buffered > PARTITION_BUDGET )
+        return partition_sweep();
+
+    return 0;
+}
+
+/* Function: partition_put
+ *
+ * Purpose: Add a record to a partition. Mapped records are only remembered
+ * as long as they continue the partition's current run.
+ *
+ * Arguements:
+ *      Partition *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      int
+ */
+int partition_put( Partition *p, const uint8_t *record, uint32_t length ) {
+    const uint8_t *run;
+    uint64_t run_length;
+
+    if( !parts.in_place )
+        return partition_append(p, record, length);
+
+    if( p->run != NULL && record == p->run + p->run_length ) {
+        p->run_length += length;
+        return 0;
+    }
+
+    run = p->run;
+    run_length = p->run_length;
+    p->run = record;
+    p->run_length = length;
+
+    if( run == NULL )
+        return 0;
+
+    if( run_length >= PARTITION_BUFFER ) {
+        if( partition_copy(p, p->buffer, p->used) == -1 )
+            return -1;
+        p->used = 0;
+        return partition_copy(p, run, run_length);
+    }
+
+    return partition_append(p, run, run_length);
+}
+
+/* Function: event_key
+ *
+ * Purpose: Compute the partition key of an event record body
+ *
+ * Arguements:
+ *      const uint8_t *
+ *      uint32_t
+ *      int             IPv6 event
+ *      uint64_t *
+ *      int *
+ *
+ * Returns:
+ *      int         0 when the event is too short to have one
+ */
+int event_key( const uint8_t *body, uint32_t length, int ipv6, uint64_t *key,
+    int *key_ipv6 ) {
+    int i;
+
+    *key_ipv6 = 0;
+
+    switch( pv.key ) {
+        case KEY_SENSOR:
+        *key = _Unified2Field32(body, 0);
+        break;
+
+        case KEY_SIGNATURE:
+        if( length < 24 )
+            return 0;
+        *key = (uint64_t)_Unified2Field32(body, 20) << 32 |
+            _Unified2Field32(body, 16);
+        break;
+
+        case KEY_DESTINATION:
+        if( ipv6 ) {
+            if( length < 60 )
+                return 0;
+            *key = 0;
+            for( i = 0; i < 8; i++ )
+                *key = *key << 8 | body[52 + i];
+            *key_ipv6 = 1;
+        }
+        else {
+            if( length < 44 )
+                return 0;
+            *key = _Unified2Field32(body, 40) & 0xffffff00;
+        }
+        break;
+
+        case KEY_HOUR:
+        default:
+        *key = _Unified2Field32(body, 8) / 3600;
+        break;
+    }
+
+    return 1;
+}
+
+/* Function: record_partition
+ *
+ * Purpose: Find the partition a raw record goes to. Events are placed by
+ * key; packets and extra data go wherever their event went, and records of
+ * unknown types stay with the record before them.
+ *
+ * Arguements:
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      Partition *
+ */
+Partition * record_partition( const uint8_t *record, uint32_t length ) {
+    const uint8_t *body = record + sizeof(Unified2RecordHeader);
+    EventPartition *cached;
+    uint32_t sensor_id, event_id;
+    uint64_t key;
+    int key_ipv6;
+    int ipv6 = 0;
+    Partition *p;
+
+    length -= sizeof(Unified2RecordHeader);
+
+    switch( _Unified2Field32(record, 0) ) {
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        ipv6 = 1;
+        /* fall through */
+
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        if( length < 12 || !event_key(body, length, ipv6, &key, &key_ipv6) )
+            return parts.other;
+
+        p = partition_find(key, key_ipv6);
+        if( p != NULL ) {
+            cached = &event_partitions[_Unified2Field32(body, 4) % EVENT_CACHE];
+            cached->sensor_id = _Unified2Field32(body, 0);
+            cached->event_id = _Unified2Field32(body, 4);
+            cached->partition = p;
+        }
+        return p;
+
+        case UNIFIED2_EXTRA_DATA:
+        body += sizeof(Unified2ExtraDataHdr);
+        length -= length < sizeof(Unified2ExtraDataHdr) ?
+            length : sizeof(Unified2ExtraDataHdr);
+        /* fall through */
+
+        case UNIFIED2_PACKET:
+        if( length < 12 )
+            return parts.other;
+
+        sensor_id = _Unified2Field32(body, 0);
+        event_id = _Unified2Field32(body, 4);
+        cached = &event_partitions[event_id % EVENT_CACHE];
+        if( cached->partition != NULL && cached->event_id == event_id &&
+            cached->sensor_id == sensor_id )
+            return cached->partition;
+
+        /* Event long gone, place it on its own when the key allows */
+        if( pv.key == KEY_SENSOR )
+            return partition_find(sensor_id, 0);
+        if( pv.key == KEY_HOUR )
+            return partition_find(_Unified2Field32(body, 8) / 3600, 0);
+        return parts.other;
+
+        default:
+        return parts.last ? parts.last : parts.other;
+    }
+}
+
+/* Function: partition_loop
+ *
+ * Purpose: Split a unified2 log into one file per partition key
+ *
+ * Arguements:
+ *      char *
+ *
+ * Returns:
+ *      int
+ */
+int partition_loop(char *filename)
+{
+    struct rlimit limit;
+    const uint8_t *record;
+    uint32_t length;
+    Partition *p;
+    uint32_t i;
+    int rc = 1;
+    int r;
+
+    if( pv.max_open <= 0 ) {
+        pv.max_open = 256;
+        if( getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur != RLIM_INFINITY )
+            pv.max_open = (int)limit.rlim_cur - RESERVED_FDS;
+        if( pv.max_open < 1 )
+            pv.max_open = 1;
+    }
+
+    parts.input = Unified2New();
+    Unified2SetDiagnostics(parts.input, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenMapped(parts.input, filename) != UNIFIED2_OK ) {
+        Unified2Free(parts.input);
+        return -1;
+    }
+    parts.in_place = parts.input->mode == MAPPED;
+
+    parts.other = partition_new(0, 0);
+    if( parts.other == NULL ) {
+        Unified2Free(parts.input);
+        return -1;
+    }
+
+    for( ;; )
     {
-        switch(ch)
-        {
-            case 'n':
-            i = atoi(optarg);
+        r = Unified2ReadRawRecord(parts.input, &record, &length);
+        if( r == UNIFIED2_EOF )
             break;
 
-            case 'r':
-            filename = strdup(optarg);
+        if( r != UNIFIED2_OK ) {
+            rc = -1;
             break;
+        }
 
-            case 'w':
-            prefix = strdup(optarg);
+        p = record_partition(record, length);
+        if( p == NULL || partition_put(p, record, length) == -1 ) {
+            rc = -1;
             break;
-
-            case '?':
-            default:
-            warn("Usage: %s -n count -r unified2.log\n\n", argv[0]);
-            goto DONE;
         }
+        parts.last = p;
     }
 
-    /* Check required */
-    if( !filename || !prefix )
-    {
-        warn("Usage: %s -n count -r unified2.log\n\n", argv[0]);
-        exit(1);
+    for( i = 0; i < parts.count && rc == 1; i++ ) {
+        if( partition_flush(parts.list[i]) == -1 )
+            rc = -1;
     }
 
-    /* Loop */
-    unified2_loop(filename, prefix, i);
+    for( i = 0; i < parts.count; i++ ) {
+        p = parts.list[i];
+        if( p->fd != -1 && close(p->fd) == -1 ) {
+            warn("u2split: failed to close %s: %s\n", p->filename,
+            strerror(errno));
+            rc = -1;
+        }
 
-    /* Finish */
-    DONE:
-    if( filename )
-    {
-        free(filename);
+        free(p->filename);
+        free(p->buffer);
+        free(p);
     }
+
+    free(parts.list);
+    free(parts.table);
+    Unified2Free(parts.input);
+
+    return rc;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    if( pv.key != KEY_NONE ) {
+        if( partition_loop(pv.filename) != 1 )
+            exit(1);
+    }
+    else if( unified2_loop(pv.filename) != 1 )
+        exit(1);
+
     return 0;
 }
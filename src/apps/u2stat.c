@@ -0,0 +1,222 @@
+/*******************************************************************************
+ * Aggregate statistics over unified2 logs in one pass.
+ *
+ * Records are read raw and summarized on worker threads, each into a summary
+ * of its own; see unified2_summary.c for what is counted and how.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+static struct option longopts[] = {
+    {"read", required_argument, NULL, 'r' },
+    {"jobs", required_argument, NULL, 'j' },
+    {"top", required_argument, NULL, 't' },
+    {"json", no_argument, NULL, 'J' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    int jobs;
+    int top;
+    int json;
+    char *filename;
+    char *program_name;
+} pv;
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vJr:j:t:] snort-unified2.log [...]\n"
+    "Options:\n"
+    "\t-r, --read       Specify file to read\n"
+    "\t-j, --jobs       Summarize on this many threads, 0 for one per CPU\n"
+    "\t-t, --top        Entries per top list (default: 10)\n"
+    "\t-J, --json       Write one JSON object instead of text\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int ch;
+
+    pv.jobs = 1;
+    pv.top = 10;
+    pv.json = 0;
+    pv.filename = NULL;
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:j:t:J?v", longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'j':
+            pv.jobs = atoi(optarg);
+            if( pv.jobs <= 0 ) {
+                pv.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
+
+            case 't':
+            pv.top = atoi(optarg);
+            break;
+
+            case 'J':
+            pv.json = 1;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( !pv.filename && optind == argc ) {
+        print_help();
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: unified2_loop
+ *
+ * Purpose: Add the records of a unified2 log to a summary
+ *
+ * Arguements:
+ *      char *
+ *      Unified2Summary *
+ *
+ * Returns:
+ *      int
+ */
+int unified2_loop(char *filename, Unified2Summary *summary)
+{
+    Unified2 *unified2;
+    HRESULT r;
+
+    unified2 = Unified2New();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenMapped(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    r = Unified2SummaryParallel(unified2, summary, pv.jobs);
+    Unified2Free(unified2);
+
+    return r == UNIFIED2_OK ? 1 : -1;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Summary *summary;
+    Unified2Buffer output;
+    int rc = 0;
+    int i;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    summary = Unified2SummaryNew();
+    if( summary == NULL )
+        exit(1);
+
+    if( pv.filename && unified2_loop(pv.filename, summary) != 1 )
+        rc = 1;
+
+    for( i = optind; i < argc && rc == 0; i++ ) {
+        if( unified2_loop(argv[i], summary) != 1 )
+            rc = 1;
+    }
+
+    if( rc == 0 ) {
+        if( Unified2BufferInit(&output, STDOUT_FILENO, 0) != UNIFIED2_OK ||
+            Unified2SummaryFormat(&output, summary, pv.top, pv.json)
+            != UNIFIED2_OK ||
+            Unified2BufferFree(&output) != UNIFIED2_OK )
+            rc = 1;
+    }
+
+    Unified2SummaryFree(summary);
+
+    return rc;
+}
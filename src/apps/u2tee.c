@@ -0,0 +1,419 @@
+/*******************************************************************************
+ * Read a unified2 log once and write it out several ways at the same time.
+ *
+ * Every output is a sink of one dispatcher (see unified2_dispatch.c): records
+ * are read and decoded once, and CSV, text, JSON, pcap, a copy of the log and
+ * a summary are all written from that single pass. With -t every output runs
+ * in a thread of its own, with -j on a pool of threads that also share the
+ * formatting.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+/* One per kind of text output */
+#define TEXT_OUTPUTS 3
+
+static struct option longopts[] = {
+    {"read", required_argument, NULL, 'r' },
+    {"csv", required_argument, NULL, 'c' },
+    {"dump", required_argument, NULL, 'd' },
+    {"json", required_argument, NULL, 'J' },
+    {"pcap", required_argument, NULL, 'p' },
+    {"write", required_argument, NULL, 'w' },
+    {"summary", required_argument, NULL, 's' },
+    {"filter", required_argument, NULL, 'f' },
+    {"threads", no_argument, NULL, 't' },
+    {"jobs", required_argument, NULL, 'j' },
+    {"count", required_argument, NULL, 'n' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    int record_count;
+    int flags;
+    int jobs;
+    char *filename;
+    char *text[TEXT_OUTPUTS];
+    char *pcap;
+    char *write;
+    char *summary;
+    char *expression;
+    char *program_name;
+} pv;
+
+static const Unified2FormatFunc formats[TEXT_OUTPUTS] = {
+    Unified2FormatCsv,
+    Unified2FormatDump,
+    Unified2FormatJson,
+};
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?vtr:c:d:J:p:w:s:f:j:n:] snort-unified2.log\n"
+    "Options:\n"
+    "\t-r, --read       Specify file to read\n"
+    "\t-c, --csv        Write CSV to this file, - for stdout\n"
+    "\t-d, --dump       Write text as u2dump does to this file\n"
+    "\t-J, --json       Write one JSON object per record to this file\n"
+    "\t-p, --pcap       Write the packets to this capture file\n"
+    "\t-w, --write      Write the records to this unified2 file\n"
+    "\t-s, --summary    Write a summary to this file\n"
+    "\t-f, --filter     Only write records this expression matches\n"
+    "\t-t, --threads    Run every output in a thread of its own\n"
+    "\t-j, --jobs       Run the outputs on this many threads, 0 for one per CPU\n"
+    "\t-n, --count      Number of records to read\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int argi = 1;
+    int ch;
+
+    memset(&pv, 0x0, sizeof(pv));
+    pv.record_count = -1;
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "r:c:d:J:p:w:s:f:tj:n:?v", longopts, NULL)) != -1 ) {
+        argi++;
+        switch(ch) {
+            case 'n':
+            pv.record_count = atoi(optarg);
+            break;
+
+            case 'r':
+            pv.filename = optarg;
+            break;
+
+            case 'c':
+            pv.text[0] = optarg;
+            break;
+
+            case 'd':
+            pv.text[1] = optarg;
+            break;
+
+            case 'J':
+            pv.text[2] = optarg;
+            break;
+
+            case 'p':
+            pv.pcap = optarg;
+            break;
+
+            case 'w':
+            pv.write = optarg;
+            break;
+
+            case 's':
+            pv.summary = optarg;
+            break;
+
+            case 'f':
+            pv.expression = optarg;
+            break;
+
+            case 't':
+            pv.flags = UNIFIED2_SINK_THREAD;
+            break;
+
+            case 'j':
+            pv.jobs = atoi(optarg);
+            if( pv.jobs <= 0 ) {
+                pv.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            pv.flags = UNIFIED2_SINK_THREAD;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( argi < argc && argc > 1 && !pv.filename ) {
+        pv.filename = argv[argc-1];
+    }
+
+    if( !pv.filename ) {
+        print_help();
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Function: open_output
+ *
+ * Purpose: Open a file to write, - is stdout
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      int
+ */
+int open_output(const char *name) {
+    int fd;
+
+    if( strcmp(name, "-") == 0 )
+        return STDOUT_FILENO;
+
+    fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if( fd == -1 ) {
+        warn("u2tee: failed to open %s: %s\n", name, strerror(errno));
+    }
+
+    return fd;
+}
+
+/* Function: close_output
+ *
+ * Purpose: Flush and close a text output
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *
+ * Returns:
+ *      int
+ */
+int close_output(Unified2Buffer *output) {
+    int fd = output->fd;
+    int rc = 1;
+
+    if( Unified2BufferFree(output) != UNIFIED2_OK )
+        rc = -1;
+
+    if( fd != STDOUT_FILENO && close(fd) == -1 )
+        rc = -1;
+
+    return rc;
+}
+
+/* Function: unified2_loop
+ *
+ * Purpose: Set up a sink per output and run one pass over the log
+ *
+ * Arguements:
+ *      char *
+ *      Unified2Filter *
+ *
+ * Returns:
+ *      int
+ */
+int unified2_loop(char *filename, Unified2Filter *filter)
+{
+    static const char header[] =
+        "SID,GID,REV,SRC_IP,SRC_PORT,DST_IP,DST_PORT,PROTOCOL,ACTION\n";
+    Unified2Buffer text[TEXT_OUTPUTS];
+    Unified2Dispatcher *dispatcher;
+    Unified2PcapWriter *pcap = NULL;
+    Unified2Summary *summary = NULL;
+    Unified2 *writer = NULL;
+    Unified2 *unified2;
+    Unified2Buffer output;
+    int opened = 0;
+    int rc = -1;
+    int fd;
+    int i;
+
+    unified2 = Unified2New();
+    Unified2SetDiagnostics(unified2, Unified2DiagStderr, NULL, 1000);
+    if( Unified2ReadOpenFILE(unified2, filename) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+
+    dispatcher = Unified2DispatcherNew();
+    if( dispatcher == NULL ) {
+        Unified2Free(unified2);
+        return -1;
+    }
+    Unified2DispatcherThreads(dispatcher, pv.jobs);
+
+    for( opened = 0; opened < TEXT_OUTPUTS; opened++ ) {
+        if( pv.text[opened] == NULL )
+            continue;
+
+        fd = open_output(pv.text[opened]);
+        if( fd == -1 )
+            goto cleanup;
+
+        if( Unified2BufferInit(&text[opened], fd, 0) != UNIFIED2_OK ) {
+            if( fd != STDOUT_FILENO )
+                close(fd);
+            goto cleanup;
+        }
+
+        if( formats[opened] == Unified2FormatCsv )
+            Unified2BufferAppend(&text[opened], header, sizeof(header) - 1);
+
+        if( Unified2DispatcherFilter(dispatcher,
+            Unified2DispatcherAddFormat(dispatcher, formats[opened],
+            &text[opened], pv.flags), filter) != UNIFIED2_OK )
+        {
+            opened++;
+            goto cleanup;
+        }
+    }
+
+    if( pv.pcap ) {
+        pcap = Unified2PcapOpen(pv.pcap, UNIFIED2_PCAP);
+        if( pcap == NULL ||
+            Unified2DispatcherFilter(dispatcher,
+            Unified2DispatcherAddPcap(dispatcher, pcap, pv.flags), filter) !=
+            UNIFIED2_OK )
+            goto cleanup;
+    }
+
+    if( pv.write ) {
+        writer = Unified2New();
+        if( writer == NULL ||
+            Unified2WriteOpenFd(writer, pv.write) != UNIFIED2_OK ||
+            Unified2DispatcherFilter(dispatcher,
+            Unified2DispatcherAddWriter(dispatcher, writer, pv.flags),
+            filter) != UNIFIED2_OK )
+            goto cleanup;
+    }
+
+    if( pv.summary ) {
+        summary = Unified2SummaryNew();
+        if( summary == NULL ||
+            Unified2DispatcherFilter(dispatcher,
+            Unified2DispatcherAddSummary(dispatcher, summary, pv.flags),
+            filter) != UNIFIED2_OK )
+            goto cleanup;
+    }
+
+    if( Unified2DispatcherRun(dispatcher, unified2, pv.record_count) ==
+        UNIFIED2_OK )
+        rc = 1;
+
+    if( summary ) {
+        fd = open_output(pv.summary);
+        if( fd == -1 || Unified2BufferInit(&output, fd, 0) != UNIFIED2_OK ||
+            Unified2SummaryFormat(&output, summary, 10, 0) != UNIFIED2_OK ||
+            close_output(&output) != 1 )
+            rc = -1;
+    }
+
+cleanup:
+    for( i = 0; i < opened; i++ ) {
+        if( pv.text[i] && close_output(&text[i]) != 1 )
+            rc = -1;
+    }
+
+    if( pcap && Unified2PcapClose(pcap) != UNIFIED2_OK )
+        rc = -1;
+
+    if( writer && Unified2Free(writer) != UNIFIED2_OK )
+        rc = -1;
+
+    Unified2SummaryFree(summary);
+    Unified2DispatcherFree(dispatcher);
+    Unified2Free(unified2);
+
+    return rc;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Unified2Filter *filter = NULL;
+    int rc = 0;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    if( pv.expression ) {
+        filter = Unified2FilterCompile(pv.expression);
+        if( filter == NULL )
+            exit(1);
+    }
+
+    if( unified2_loop(pv.filename, filter) != 1 )
+        rc = 1;
+
+    Unified2FilterFree(filter);
+
+    return rc;
+}
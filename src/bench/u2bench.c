@@ -0,0 +1,1280 @@
+/*******************************************************************************
+ * Benchmarks for the hot paths of libunified2.
+ *
+ * A fixed corpus is generated with Unified2Generator, so every run of every
+ * build measures the same bytes. Each benchmark is run a number of times and
+ * reported as records and bytes per second, with the min, median and max
+ * run time, as one JSON object. A handful of runs has no meaningful 99th
+ * percentile, so the slowest one is reported as is.
+ *
+ * Given a baseline, a previous run's output, any benchmark whose median got
+ * slower by more than the tolerance is reported and the run fails.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef MACOS
+extern char *optarg;
+extern int optind;
+extern int optopt;
+extern int opterr;
+extern int optreset;
+#endif
+
+#include "unified2.h"
+
+/* Longest benchmark name */
+#define NAME_MAX_LENGTH 64
+
+static struct option longopts[] = {
+    {"events", required_argument, NULL, 'n' },
+    {"runs", required_argument, NULL, 'r' },
+    {"filter", required_argument, NULL, 'f' },
+    {"baseline", required_argument, NULL, 'b' },
+    {"tolerance", required_argument, NULL, 't' },
+    {"output", required_argument, NULL, 'o' },
+    {"help", no_argument, NULL, '?' },
+    {"version", no_argument, NULL, 'v' },
+
+    {NULL, 0, NULL, 0}
+};
+
+struct progam_vars {
+    uint64_t events;
+    int runs;
+    char *filter;
+    char *baseline;
+    double tolerance;
+    char *output;
+    char *program_name;
+} pv;
+
+/* The corpus, as bytes, as files and as decoded entries */
+struct corpus {
+    uint8_t *data;
+    uint32_t size;
+    uint64_t records;
+
+    char dir[256];
+    char plain[300];
+    char container[300];
+    char gzip[300];
+    char scratch[300];
+
+    Unified2Entry *entries;
+    uint64_t nentries;
+} corpus;
+
+/* One run of a benchmark: the records and bytes it went through, or
+ * UINT64_MAX records when it can not run here */
+typedef uint64_t (*BenchFunc)(uint64_t *bytes);
+
+typedef struct _Bench {
+    const char *name;
+    BenchFunc func;
+} Bench;
+
+typedef struct _Result {
+    char name[NAME_MAX_LENGTH];
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t min;
+    uint64_t median;
+    uint64_t max;
+} Result;
+
+/* Function: print_version
+ *
+ * Purpose: print the version dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_version( ) {
+    printf("%s\n", unified2_lib_string());
+    printf("Report bugs to <%s>\n", unified2_lib_bugreport());
+}
+
+/* Function: print_help
+ *
+ * Purpose: print the help dialog
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      void
+ */
+void print_help( ) {
+    printf(
+    "Usage: %s [-?v] [-n events] [-r runs] [-f filter] [-b baseline.json]\n"
+    "Options:\n"
+    "\t-n, --events     Events in the corpus (default: 50000)\n"
+    "\t-r, --runs       Runs of each benchmark (default: 7)\n"
+    "\t-f, --filter     Only run benchmarks whose name contains this\n"
+    "\t-b, --baseline   Fail when slower than this earlier output\n"
+    "\t-t, --tolerance  Percent slower than the baseline allowed (default: 15)\n"
+    "\t-o, --output     Write the JSON here instead of stdout\n"
+    "\t-?, --help       This help\n"
+    "\t-v, --version    Print version\n\n",
+    pv.program_name
+    );
+
+    print_version( );
+}
+
+/* Function: parse_args
+ *
+ * Purpose: abstract arguement parsing outside of main
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int parse_args( int argc, char *argv[] ) {
+    int ch;
+
+    pv.events = 50000;
+    pv.runs = 7;
+    pv.filter = NULL;
+    pv.baseline = NULL;
+    pv.tolerance = 15.0;
+    pv.output = NULL;
+    pv.program_name = argv[0];
+
+    /* Get the options */
+    while((ch = getopt_long(argc, argv, "n:r:f:b:t:o:?v", longopts, NULL)) != -1 ) {
+        switch(ch) {
+            case 'n':
+            pv.events = strtoull(optarg, NULL, 0);
+            break;
+
+            case 'r':
+            pv.runs = atoi(optarg);
+            break;
+
+            case 'f':
+            pv.filter = optarg;
+            break;
+
+            case 'b':
+            pv.baseline = optarg;
+            break;
+
+            case 't':
+            pv.tolerance = strtod(optarg, NULL);
+            break;
+
+            case 'o':
+            pv.output = optarg;
+            break;
+
+            case '?':
+            default:
+            print_help();
+            return -1;
+
+            case 'v':
+            print_version();
+            return -1;
+        }
+    }
+
+    if( pv.events == 0 || pv.runs <= 0 ) {
+        print_help();
+        return -1;
+    }
+
+    return 1;
+}
+
+/** CORPUS *********************************************************************/
+
+static int write_file( const char *path, const void *data, uint32_t size ) {
+    FILE *fp = fopen(path, "wb");
+
+    if( fp == NULL )
+        return -1;
+
+    if( fwrite(data, 1, size, fp) != size ) {
+        fclose(fp);
+        return -1;
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Function: corpus_init
+ *
+ * Purpose: Generate the corpus and every form of it the benchmarks read
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      int
+ */
+static int corpus_init( ) {
+    Unified2GeneratorConfig config;
+    Unified2Generator *gen;
+    Unified2Entry entry;
+    Unified2 *unified2;
+    const char *tmp = getenv("TMPDIR");
+    uint64_t capacity = 0;
+    void *memory;
+    int r;
+
+    /* The default workload, which has every record type in it */
+    Unified2GeneratorDefaults(&config);
+    config.events = pv.events;
+
+    gen = Unified2GeneratorNew(&config);
+    if( gen == NULL )
+        return -1;
+
+    for( ;; ) {
+        if( corpus.size + (1 << 20) > capacity ) {
+            capacity = capacity ? capacity * 2 : 16 << 20;
+            if( capacity > INT32_MAX ) {
+                warn("u2bench: corpus over 2GB, use fewer events\n");
+                Unified2GeneratorFree(gen);
+                return -1;
+            }
+            memory = realloc(corpus.data, capacity);
+            if( memory == NULL ) {
+                Unified2GeneratorFree(gen);
+                return -1;
+            }
+            corpus.data = memory;
+        }
+
+        r = Unified2GeneratorFill(gen, corpus.data + corpus.size, 1 << 20);
+        if( r == 0 )
+            break;
+        corpus.size += r;
+    }
+    Unified2GeneratorFree(gen);
+
+    snprintf(corpus.dir, sizeof(corpus.dir), "%s/u2bench.XXXXXX",
+        tmp ? tmp : "/tmp");
+    if( mkdtemp(corpus.dir) == NULL ) {
+        warn("u2bench: failed to make a directory: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(corpus.plain, sizeof(corpus.plain), "%s/plain.u2", corpus.dir);
+    snprintf(corpus.container, sizeof(corpus.container), "%s/container.u2", corpus.dir);
+    snprintf(corpus.gzip, sizeof(corpus.gzip), "%s/plain.u2.gz", corpus.dir);
+    snprintf(corpus.scratch, sizeof(corpus.scratch), "%s/scratch.u2", corpus.dir);
+
+    if( write_file(corpus.plain, corpus.data, corpus.size) == -1 ) {
+        warn("u2bench: failed to write %s: %s\n", corpus.plain, strerror(errno));
+        return -1;
+    }
+
+    /* The seekable container, when a codec was built in */
+    unified2 = Unified2New();
+    if( Unified2WriteOpenCompressed(unified2, corpus.container,
+        UNIFIED2_CODEC_DEFAULT, 0) == UNIFIED2_OK ) {
+        if( Unified2Write(unified2, corpus.data, corpus.size) != (int)corpus.size )
+            unlink(corpus.container);
+    }
+    Unified2Free(unified2);
+
+#ifdef HAVE_LIBZ
+    {
+        gzFile gz = gzopen(corpus.gzip, "wb");
+
+        if( gz != NULL ) {
+            if( gzwrite(gz, corpus.data, corpus.size) != (int)corpus.size )
+                unlink(corpus.gzip);
+            gzclose(gz);
+        }
+    }
+#endif
+
+    /* Decoded once for the writers and formatters */
+    memory = malloc(corpus.size);
+    if( memory == NULL )
+        return -1;
+    memcpy(memory, corpus.data, corpus.size);
+
+    unified2 = Unified2New();
+    Unified2ReadOpenMemory(unified2, memory, corpus.size);
+    Unified2SetReadFlags(unified2, UNIFIED2_READ_EXTRA_DATA);
+
+    capacity = 0;
+    do {
+        memset(&entry, 0x0, sizeof(entry));
+        r = Unified2ReadNextEntry(unified2, &entry);
+        if( entry.record == NULL )
+            break;
+
+        if( corpus.nentries == capacity ) {
+            capacity = capacity ? capacity * 2 : 65536;
+            memory = realloc(corpus.entries, capacity * sizeof(Unified2Entry));
+            if( memory == NULL ) {
+                Unified2Free(unified2);
+                return -1;
+            }
+            corpus.entries = memory;
+        }
+        corpus.entries[corpus.nentries++] = entry;
+    } while( r == UNIFIED2_OK || r == UNIFIED2_WARN );
+
+    Unified2Free(unified2);
+    corpus.records = corpus.nentries;
+
+    return 0;
+}
+
+static void corpus_free( ) {
+    uint64_t i;
+
+    for( i = 0; i < corpus.nentries; i++ )
+        Unified2EntrySparseCleanup(&corpus.entries[i]);
+
+    free(corpus.entries);
+    free(corpus.data);
+
+    unlink(corpus.plain);
+    unlink(corpus.container);
+    unlink(corpus.gzip);
+    unlink(corpus.scratch);
+    rmdir(corpus.dir);
+}
+
+/** READERS ********************************************************************/
+
+/* Function: read_entries
+ *
+ * Purpose: Decode every record of an opened reader
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t    records decoded
+ */
+static uint64_t read_entries( Unified2 *unified2, uint64_t *bytes ) {
+    Unified2Entry entry;
+    uint64_t records = 0;
+    int r;
+
+    Unified2SetReadFlags(unified2, UNIFIED2_READ_EXTRA_DATA);
+
+    do {
+        memset(&entry, 0x0, sizeof(entry));
+        r = Unified2ReadNextEntry(unified2, &entry);
+        if( entry.record == NULL )
+            break;
+        records++;
+        Unified2EntrySparseCleanup(&entry);
+    } while( r == UNIFIED2_OK || r == UNIFIED2_WARN );
+
+    Unified2Free(unified2);
+    *bytes = corpus.size;
+
+    return records;
+}
+
+static uint64_t bench_read_stream( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2ReadOpenFILE(unified2, corpus.plain) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return read_entries(unified2, bytes);
+}
+
+static uint64_t bench_read_descriptor( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2ReadOpenFd(unified2, corpus.plain) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return read_entries(unified2, bytes);
+}
+
+static uint64_t bench_read_memory( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+    void *memory = malloc(corpus.size);
+
+    /* The reader owns the memory and frees it */
+    if( memory == NULL ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+    memcpy(memory, corpus.data, corpus.size);
+    Unified2ReadOpenMemory(unified2, memory, corpus.size);
+
+    return read_entries(unified2, bytes);
+}
+
+static uint64_t bench_read_mapped( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2ReadOpenMapped(unified2, corpus.plain) != UNIFIED2_OK ||
+        unified2->mode != MAPPED ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return read_entries(unified2, bytes);
+}
+
+static uint64_t bench_read_compressed( uint64_t *bytes ) {
+    Unified2 *unified2;
+
+    if( access(corpus.container, R_OK) != 0 )
+        return UINT64_MAX;
+
+    unified2 = Unified2New();
+    if( Unified2ReadOpenFd(unified2, corpus.container) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return read_entries(unified2, bytes);
+}
+
+static uint64_t bench_read_decompress( uint64_t *bytes ) {
+    Unified2 *unified2;
+
+    if( access(corpus.gzip, R_OK) != 0 )
+        return UINT64_MAX;
+
+    unified2 = Unified2New();
+    if( Unified2ReadOpenFd(unified2, corpus.gzip) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return read_entries(unified2, bytes);
+}
+
+/* Feeds a shared memory ring from another thread */
+static void *ring_writer( void *arg ) {
+    Unified2 *unified2 = arg;
+    uint32_t offset = 0;
+    uint32_t length;
+
+    while( offset + sizeof(Unified2RecordHeader) <= corpus.size ) {
+        memcpy(&length, corpus.data + offset + 4, sizeof(length));
+        length = ntohl(length) + sizeof(Unified2RecordHeader);
+        if( Unified2Write(unified2, corpus.data + offset, length) != (int)length )
+            break;
+        offset += length;
+    }
+
+    Unified2Free(unified2);
+
+    return NULL;
+}
+
+static uint64_t bench_read_shared_memory( uint64_t *bytes ) {
+    Unified2 *writer, *reader;
+    char name[64];
+    pthread_t thread;
+    uint64_t records;
+
+    snprintf(name, sizeof(name), "u2bench.%d", (int)getpid());
+    Unified2UnlinkShm(name);
+
+    writer = Unified2New();
+    reader = Unified2New();
+    if( Unified2WriteOpenShm(writer, name, 0) != UNIFIED2_OK ||
+        Unified2ReadOpenShm(reader, name) != UNIFIED2_OK ||
+        pthread_create(&thread, NULL, ring_writer, writer) != 0 ) {
+        Unified2Free(writer);
+        Unified2Free(reader);
+        Unified2UnlinkShm(name);
+        return UINT64_MAX;
+    }
+
+    records = read_entries(reader, bytes);
+    pthread_join(thread, NULL);
+    Unified2UnlinkShm(name);
+
+    return records;
+}
+
+static uint64_t bench_raw_mapped( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+    const uint8_t *record;
+    uint64_t records = 0;
+    uint32_t length;
+
+    if( Unified2ReadOpenMapped(unified2, corpus.plain) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    while( Unified2ReadRawRecord(unified2, &record, &length) == UNIFIED2_OK )
+        records++;
+
+    Unified2Free(unified2);
+    *bytes = corpus.size;
+
+    return records;
+}
+
+static uint64_t bench_events_mapped( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+    Unified2NormalizedEvent event;
+    uint64_t events = 0;
+
+    if( Unified2ReadOpenMapped(unified2, corpus.plain) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    while( Unified2ReadNextEvent(unified2, &event) == UNIFIED2_OK )
+        events++;
+
+    Unified2Free(unified2);
+    *bytes = corpus.size;
+
+    return events;
+}
+
+static uint64_t bench_records_mapped( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+    Unified2Record record;
+    uint64_t records = 0;
+    HRESULT r;
+
+    if( Unified2ReadOpenMapped(unified2, corpus.plain) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    while( (r = Unified2ReadNextRecord(unified2, &record)) == UNIFIED2_OK ||
+        r == UNIFIED2_WARN )
+        records++;
+
+    Unified2Free(unified2);
+    *bytes = corpus.size;
+
+    return records;
+}
+
+/** WRITERS ********************************************************************/
+
+static Unified2 *open_null( ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2WriteOpenFd(unified2, "/dev/null") != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return NULL;
+    }
+
+    return unified2;
+}
+
+/* Function: write_typed
+ *
+ * Purpose: Write every record of one type with its own writer function, the
+ * header first, the way Snort's output plugin does
+ *
+ * Arguements:
+ *      uint32_t
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t write_typed( uint32_t type, uint64_t *bytes ) {
+    Unified2RecordHeader header;
+    Unified2Event event;
+    Unified2Event_v2 event_v2;
+    Unified2Event6 event6;
+    Unified2Event6_v2 event6_v2;
+    Unified2Packet packet;
+    const Unified2Entry *e;
+    Unified2 *unified2;
+    uint64_t records = 0;
+    uint64_t i;
+    HRESULT r = UNIFIED2_OK;
+
+    unified2 = open_null();
+    if( unified2 == NULL )
+        return UINT64_MAX;
+
+    *bytes = 0;
+    for( i = 0; i < corpus.nentries && r == UNIFIED2_OK; i++ ) {
+        e = &corpus.entries[i];
+        if( e->record->type != type )
+            continue;
+
+        /* The writers convert in place, write copies */
+        header = *e->record;
+        r = Unified2WriteRecordHeader(unified2, &header);
+
+        switch( type ) {
+            case UNIFIED2_IDS_EVENT:
+            event = *e->event;
+            r |= Unified2WriteEvent(unified2, &event);
+            break;
+
+            case UNIFIED2_IDS_EVENT_V2:
+            event_v2 = *e->event_v2;
+            r |= Unified2WriteEvent_v2(unified2, &event_v2);
+            break;
+
+            case UNIFIED2_IDS_EVENT_IPV6:
+            event6 = *e->event6;
+            r |= Unified2WriteEvent6(unified2, &event6);
+            break;
+
+            case UNIFIED2_IDS_EVENT_IPV6_V2:
+            event6_v2 = *e->event6_v2;
+            r |= Unified2WriteEvent6_v2(unified2, &event6_v2);
+            break;
+
+            case UNIFIED2_PACKET:
+            packet = *e->packet;
+            r |= Unified2WritePacket(unified2, &packet);
+            if( e->packet->packet_length )
+                r |= Unified2WritePacketData(unified2, e->packet_data,
+                    e->packet->packet_length);
+            break;
+        }
+
+        records++;
+        *bytes += sizeof(Unified2RecordHeader) + e->record->length;
+    }
+
+    Unified2Free(unified2);
+
+    return r == UNIFIED2_OK ? records : UINT64_MAX;
+}
+
+static uint64_t bench_write_event( uint64_t *bytes ) {
+    return write_typed(UNIFIED2_IDS_EVENT, bytes);
+}
+
+static uint64_t bench_write_event_v2( uint64_t *bytes ) {
+    return write_typed(UNIFIED2_IDS_EVENT_V2, bytes);
+}
+
+static uint64_t bench_write_event6( uint64_t *bytes ) {
+    return write_typed(UNIFIED2_IDS_EVENT_IPV6, bytes);
+}
+
+static uint64_t bench_write_event6_v2( uint64_t *bytes ) {
+    return write_typed(UNIFIED2_IDS_EVENT_IPV6_V2, bytes);
+}
+
+static uint64_t bench_write_packet( uint64_t *bytes ) {
+    return write_typed(UNIFIED2_PACKET, bytes);
+}
+
+/* Function: write_records
+ *
+ * Purpose: Write the whole corpus with Unified2WriteRecord()
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t write_records( Unified2 *unified2, uint64_t *bytes ) {
+    uint64_t i;
+    HRESULT r = UNIFIED2_OK;
+
+    *bytes = 0;
+    for( i = 0; i < corpus.nentries && r == UNIFIED2_OK; i++ ) {
+        r = Unified2WriteRecord(unified2, &corpus.entries[i]);
+        *bytes += sizeof(Unified2RecordHeader) + corpus.entries[i].record->length;
+    }
+
+    if( Unified2Free(unified2) != UNIFIED2_OK )
+        r = UNIFIED2_ERROR;
+
+    return r == UNIFIED2_OK ? corpus.nentries : UINT64_MAX;
+}
+
+static uint64_t bench_write_record( uint64_t *bytes ) {
+    Unified2 *unified2 = open_null();
+
+    return unified2 ? write_records(unified2, bytes) : UINT64_MAX;
+}
+
+static uint64_t bench_write_direct( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2WriteOpenDirect(unified2, corpus.scratch, 0) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return write_records(unified2, bytes);
+}
+
+static uint64_t bench_write_compressed( uint64_t *bytes ) {
+    Unified2 *unified2 = Unified2New();
+
+    if( Unified2WriteOpenCompressed(unified2, corpus.scratch,
+        UNIFIED2_CODEC_DEFAULT, 0) != UNIFIED2_OK ) {
+        Unified2Free(unified2);
+        return UINT64_MAX;
+    }
+
+    return write_records(unified2, bytes);
+}
+
+static uint64_t bench_write_serialize( uint64_t *bytes ) {
+    uint8_t buf[sizeof(Unified2RecordHeader) + sizeof(Unified2Packet) + 65536];
+    uint64_t i;
+    int length;
+
+    *bytes = 0;
+    for( i = 0; i < corpus.nentries; i++ ) {
+        length = Unified2SerializeRecord(&corpus.entries[i], buf, sizeof(buf));
+        if( length == -1 )
+            return UINT64_MAX;
+        *bytes += length;
+    }
+
+    return corpus.nentries;
+}
+
+static uint64_t bench_generate( uint64_t *bytes ) {
+    Unified2GeneratorConfig config;
+    Unified2Generator *gen;
+    uint8_t *buf = malloc(1 << 20);
+    uint32_t used;
+
+    Unified2GeneratorDefaults(&config);
+    config.events = pv.events;
+    gen = Unified2GeneratorNew(&config);
+    if( gen == NULL || buf == NULL ) {
+        Unified2GeneratorFree(gen);
+        free(buf);
+        return UINT64_MAX;
+    }
+
+    *bytes = 0;
+    while( (used = Unified2GeneratorFill(gen, buf, 1 << 20)) > 0 )
+        *bytes += used;
+
+    Unified2GeneratorFree(gen);
+    free(buf);
+
+    return corpus.records;
+}
+
+/** OUTPUT *********************************************************************/
+
+static uint64_t bench_print_record( uint64_t *bytes ) {
+    uint64_t i;
+    int saved, null;
+
+    /* Unified2PrintRecord() only knows stdout */
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null = open("/dev/null", O_WRONLY);
+    if( saved == -1 || null == -1 )
+        return UINT64_MAX;
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    for( i = 0; i < corpus.nentries; i++ )
+        Unified2PrintRecord(&corpus.entries[i]);
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    *bytes = corpus.size;
+
+    return corpus.nentries;
+}
+
+static uint64_t format_entries( Unified2FormatFunc format, uint64_t *bytes ) {
+    Unified2Buffer buffer;
+    uint64_t i;
+    int fd = open("/dev/null", O_WRONLY);
+
+    if( fd == -1 || Unified2BufferInit(&buffer, fd, 0) != UNIFIED2_OK ) {
+        if( fd != -1 )
+            close(fd);
+        return UINT64_MAX;
+    }
+
+    for( i = 0; i < corpus.nentries; i++ )
+        format(&buffer, &corpus.entries[i]);
+
+    Unified2BufferFree(&buffer);
+    close(fd);
+    *bytes = corpus.size;
+
+    return corpus.nentries;
+}
+
+static uint64_t bench_format_csv( uint64_t *bytes ) {
+    return format_entries(Unified2FormatCsv, bytes);
+}
+
+static uint64_t bench_format_dump( uint64_t *bytes ) {
+    return format_entries(Unified2FormatDump, bytes);
+}
+
+static uint64_t bench_format_json( uint64_t *bytes ) {
+    return format_entries(Unified2FormatJson, bytes);
+}
+
+/** RAW RECORD TOOLS ***********************************************************/
+
+/* Function: each_raw
+ *
+ * Purpose: Walk the raw records of the corpus in memory
+ *
+ * Arguements:
+ *      int (*)(const uint8_t *, uint32_t, void *)
+ *      void *
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t each_raw( int (*func)(const uint8_t *, uint32_t, void *),
+    void *arg, uint64_t *bytes ) {
+    uint64_t records = 0;
+    uint32_t offset = 0;
+    uint32_t length;
+
+    while( offset + sizeof(Unified2RecordHeader) <= corpus.size ) {
+        memcpy(&length, corpus.data + offset + 4, sizeof(length));
+        length = ntohl(length) + sizeof(Unified2RecordHeader);
+        func(corpus.data + offset, length, arg);
+        offset += length;
+        records++;
+    }
+    *bytes = corpus.size;
+
+    return records;
+}
+
+static int filter_one( const uint8_t *record, uint32_t length, void *arg ) {
+    return Unified2FilterMatch(arg, record, length);
+}
+
+static uint64_t bench_filter( uint64_t *bytes ) {
+    Unified2Filter *filter;
+    uint64_t records;
+
+    filter = Unified2FilterCompile("sid in {1000000..1000099} and "
+        "(dst in 10.0.0.0/8 or dst in 2001:db8::/32) and proto == tcp");
+    if( filter == NULL )
+        return UINT64_MAX;
+
+    records = each_raw(filter_one, filter, bytes);
+    Unified2FilterFree(filter);
+
+    return records;
+}
+
+static int search_one( const uint8_t *record, uint32_t length, void *arg ) {
+    return Unified2SearchPacket(arg, record, length, NULL, NULL);
+}
+
+static uint64_t bench_search( uint64_t *bytes ) {
+    static const char *patterns[] = {
+        "EVILPAYLOAD", "/etc/passwd", "|de ad be ef|", "cmd.exe", "SELECT ",
+    };
+    Unified2Search *search = Unified2SearchNew(0);
+    uint64_t records;
+    uint32_t i;
+
+    if( search == NULL )
+        return UINT64_MAX;
+
+    for( i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++ )
+        Unified2SearchAddPattern(search, patterns[i], i);
+
+    if( Unified2SearchCompile(search) != UNIFIED2_OK ) {
+        Unified2SearchFree(search);
+        return UINT64_MAX;
+    }
+
+    records = each_raw(search_one, search, bytes);
+    Unified2SearchFree(search);
+
+    return records;
+}
+
+static int summary_one( const uint8_t *record, uint32_t length, void *arg ) {
+    return Unified2SummaryAdd(arg, record, length);
+}
+
+static uint64_t bench_summary( uint64_t *bytes ) {
+    Unified2Summary *summary = Unified2SummaryNew();
+    uint64_t records;
+
+    if( summary == NULL )
+        return UINT64_MAX;
+
+    records = each_raw(summary_one, summary, bytes);
+    Unified2SummaryFree(summary);
+
+    return records;
+}
+
+/** DISPATCH *******************************************************************/
+
+static HRESULT count_one( const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg ) {
+    (*(uint64_t *)arg)++;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: bench_fanout
+ *
+ * Purpose: One pass over the corpus into CSV, JSON and a summary, each output
+ * in a thread of its own
+ *
+ * Arguements:
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t bench_fanout( uint64_t *bytes ) {
+    Unified2Dispatcher *dispatcher = Unified2DispatcherNew();
+    Unified2Summary *summary = Unified2SummaryNew();
+    Unified2 *unified2 = Unified2New();
+    Unified2Buffer csv, json;
+    uint64_t records = 0;
+    int fd = open("/dev/null", O_WRONLY);
+    HRESULT r = UNIFIED2_ERROR;
+
+    if( fd != -1 && dispatcher != NULL && summary != NULL &&
+        Unified2ReadOpenMapped(unified2, corpus.plain) == UNIFIED2_OK &&
+        Unified2BufferInit(&csv, fd, 0) == UNIFIED2_OK ) {
+        if( Unified2BufferInit(&json, fd, 0) == UNIFIED2_OK ) {
+            Unified2DispatcherAdd(dispatcher, count_one, &records, 0);
+            Unified2DispatcherAddFormat(dispatcher, Unified2FormatCsv, &csv,
+                UNIFIED2_SINK_THREAD);
+            Unified2DispatcherAddFormat(dispatcher, Unified2FormatJson, &json,
+                UNIFIED2_SINK_THREAD);
+            Unified2DispatcherAddSummary(dispatcher, summary,
+                UNIFIED2_SINK_THREAD);
+            r = Unified2DispatcherRun(dispatcher, unified2, -1);
+            Unified2BufferFree(&json);
+        }
+        Unified2BufferFree(&csv);
+    }
+
+    if( fd != -1 )
+        close(fd);
+    Unified2Free(unified2);
+    Unified2SummaryFree(summary);
+    Unified2DispatcherFree(dispatcher);
+    *bytes = corpus.size;
+
+    return r == UNIFIED2_OK ? records : UINT64_MAX;
+}
+
+/* Function: bench_archive
+ *
+ * Purpose: The corpus read as an archive, split in ranges over a worker per
+ * CPU, into a summary
+ *
+ * Arguements:
+ *      uint64_t *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t bench_archive( uint64_t *bytes ) {
+    Unified2Archive *archive = Unified2ArchiveNew();
+    Unified2Summary *summary = Unified2SummaryNew();
+    Unified2ArchiveStats stats;
+    HRESULT r = UNIFIED2_ERROR;
+
+    if( archive != NULL && summary != NULL &&
+        Unified2ArchiveAdd(archive, corpus.plain) == 1 ) {
+        Unified2ArchiveSplit(archive, corpus.size / 4 + 1);
+        Unified2ArchiveSummary(archive, summary);
+        r = Unified2ArchiveRun(archive, &stats);
+    }
+
+    Unified2SummaryFree(summary);
+    Unified2ArchiveFree(archive);
+    *bytes = corpus.size;
+
+    return r == UNIFIED2_OK ? stats.records : UINT64_MAX;
+}
+
+static const Bench benches[] = {
+    { "read/stream", bench_read_stream },
+    { "read/descriptor", bench_read_descriptor },
+    { "read/memory", bench_read_memory },
+    { "read/mapped", bench_read_mapped },
+    { "read/compressed", bench_read_compressed },
+    { "read/decompress", bench_read_decompress },
+    { "read/shared_memory", bench_read_shared_memory },
+    { "read/raw_mapped", bench_raw_mapped },
+    { "read/events_mapped", bench_events_mapped },
+    { "read/records_mapped", bench_records_mapped },
+    { "write/event", bench_write_event },
+    { "write/event_v2", bench_write_event_v2 },
+    { "write/event6", bench_write_event6 },
+    { "write/event6_v2", bench_write_event6_v2 },
+    { "write/packet", bench_write_packet },
+    { "write/record", bench_write_record },
+    { "write/serialize", bench_write_serialize },
+    { "write/direct", bench_write_direct },
+    { "write/compressed", bench_write_compressed },
+    { "write/generate", bench_generate },
+    { "print/record", bench_print_record },
+    { "format/csv", bench_format_csv },
+    { "format/dump", bench_format_dump },
+    { "format/json", bench_format_json },
+    { "raw/filter", bench_filter },
+    { "raw/search", bench_search },
+    { "raw/summary", bench_summary },
+    { "dispatch/fanout", bench_fanout },
+    { "archive/split", bench_archive },
+};
+
+/** RUNNING ********************************************************************/
+
+static int time_order( const void *a, const void *b ) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Function: run_bench
+ *
+ * Purpose: Run a benchmark pv.runs times, after one untimed warm up run
+ *
+ * Arguements:
+ *      const Bench *
+ *      Result *
+ *
+ * Returns:
+ *      int         -1 when it can not run here
+ */
+static int run_bench( const Bench *bench, Result *result ) {
+    uint64_t *times;
+    uint64_t start;
+    int i;
+
+    memset(result, 0x0, sizeof(Result));
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+
+    if( bench->func(&result->bytes) == UINT64_MAX )
+        return -1;
+
+    times = calloc(pv.runs, sizeof(uint64_t));
+    if( times == NULL )
+        return -1;
+
+    for( i = 0; i < pv.runs; i++ ) {
+        start = _Unified2Now();
+        result->records = bench->func(&result->bytes);
+        times[i] = _Unified2Now() - start;
+
+        if( result->records == UINT64_MAX ) {
+            free(times);
+            return -1;
+        }
+    }
+
+    qsort(times, pv.runs, sizeof(uint64_t), time_order);
+    result->min = times[0];
+    result->median = times[pv.runs / 2];
+    result->max = times[pv.runs - 1];
+    free(times);
+
+    return 0;
+}
+
+/* Function: print_results
+ *
+ * Purpose: Write the results as JSON, one benchmark per line
+ *
+ * Arguements:
+ *      FILE *
+ *      const Result *
+ *      int
+ *
+ * Returns:
+ *      void
+ */
+static void print_results( FILE *fp, const Result *results, int n ) {
+    double seconds;
+    int i;
+
+    fprintf(fp, "{\"version\":\"%s\",\"corpus\":{\"events\":%llu,"
+        "\"records\":%llu,\"bytes\":%u},\"runs\":%d,\"benchmarks\":[\n",
+        unified2_lib_version(), (unsigned long long)pv.events,
+        (unsigned long long)corpus.records, corpus.size, pv.runs);
+
+    for( i = 0; i < n; i++ ) {
+        seconds = results[i].median / 1e9;
+        fprintf(fp, "{\"name\":\"%s\",\"records\":%llu,\"bytes\":%llu,"
+            "\"min_ns\":%llu,\"median_ns\":%llu,\"max_ns\":%llu,"
+            "\"records_per_sec\":%.0f,\"bytes_per_sec\":%.0f}%s\n",
+            results[i].name,
+            (unsigned long long)results[i].records,
+            (unsigned long long)results[i].bytes,
+            (unsigned long long)results[i].min,
+            (unsigned long long)results[i].median,
+            (unsigned long long)results[i].max,
+            seconds > 0 ? results[i].records / seconds : 0,
+            seconds > 0 ? results[i].bytes / seconds : 0,
+            i + 1 < n ? "," : "");
+    }
+
+    fprintf(fp, "]}\n");
+}
+
+/* Function: compare_baseline
+ *
+ * Purpose: Compare medians with an earlier output of this program
+ *
+ * Arguements:
+ *      const Result *
+ *      int
+ *
+ * Returns:
+ *      int         number of regressions, -1 when the baseline is unreadable
+ */
+static int compare_baseline( const Result *results, int n ) {
+    char line[1024];
+    char name[NAME_MAX_LENGTH];
+    unsigned long long median;
+    const char *p;
+    double change;
+    int regressions = 0;
+    FILE *fp;
+    int i;
+
+    fp = fopen(pv.baseline, "r");
+    if( fp == NULL ) {
+        warn("u2bench: failed to open %s: %s\n", pv.baseline, strerror(errno));
+        return -1;
+    }
+
+    while( fgets(line, sizeof(line), fp) ) {
+        p = strstr(line, "{\"name\":\"");
+        if( p == NULL || sscanf(p, "{\"name\":\"%63[^\"]\"", name) != 1 )
+            continue;
+
+        p = strstr(line, "\"median_ns\":");
+        if( p == NULL || sscanf(p, "\"median_ns\":%llu", &median) != 1 ||
+            median == 0 )
+            continue;
+
+        for( i = 0; i < n; i++ ) {
+            if( strcmp(results[i].name, name) != 0 )
+                continue;
+
+            change = 100.0 * ((double)results[i].median - median) / median;
+            if( change > pv.tolerance ) {
+                fprintf(stderr, "%s: %s regressed %.1f%%: median %llu ns, "
+                    "baseline %llu ns\n", pv.program_name, name, change,
+                    (unsigned long long)results[i].median, median);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return regressions;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    Result results[sizeof(benches) / sizeof(benches[0])];
+    FILE *fp = stdout;
+    int n = 0;
+    int rc = 0;
+    size_t i;
+
+    if( parse_args(argc, argv) != 1 )
+        exit(1);
+
+    if( corpus_init() == -1 ) {
+        corpus_free();
+        exit(1);
+    }
+
+    for( i = 0; i < sizeof(benches) / sizeof(benches[0]); i++ ) {
+        if( pv.filter && strstr(benches[i].name, pv.filter) == NULL )
+            continue;
+
+        if( run_bench(&benches[i], &results[n]) == -1 ) {
+            fprintf(stderr, "%s: %s skipped, not supported here\n",
+                pv.program_name, benches[i].name);
+            continue;
+        }
+        n++;
+    }
+
+    corpus_free();
+
+    if( pv.output ) {
+        fp = fopen(pv.output, "w");
+        if( fp == NULL ) {
+            warn("u2bench: failed to open %s: %s\n", pv.output, strerror(errno));
+            exit(1);
+        }
+    }
+
+    print_results(fp, results, n);
+
+    if( fp != stdout && fclose(fp) != 0 )
+        rc = 1;
+
+    if( pv.baseline && compare_baseline(results, n) != 0 )
+        rc = 1;
+
+    return rc;
+}
@@ -0,0 +1,210 @@
+/*******************************************************************************
+ * Library allocations.
+ *
+ * Everything the library allocates, handles, entries and the records they
+ * point at, I/O buffers and the state of the analysis helpers, goes through
+ * the functions here. By default they are malloc, realloc and free; an
+ * application can install its own with Unified2SetAllocator(), e.g. jemalloc
+ * arenas, hugepage backed pools or per-thread bump allocators, and each call
+ * says which part of the library it is for so they can be counted or served
+ * from different pools.
+ *
+ * The allocator is process wide rather than per handle: an entry outlives the
+ * handle it was read from and Unified2EntrySparseCleanup() has no handle to
+ * ask. Install it before the first handle is created and do not change it
+ * while anything the library allocated is still alive.
+ *
+ * Exceptions are buffers given to Unified2ReadOpenMemory(), which the caller
+ * allocated with malloc and the handle frees with free, the aligned buffers of
+ * Unified2WriteOpenDirect(), and whatever zlib and zstd allocate themselves.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "unified2.h"
+
+static Unified2Allocator allocator;
+
+/* Function: Unified2SetAllocator
+ *
+ * Purpose: Install the allocator every library allocation goes through
+ *
+ * Arguements:
+ *      const Unified2Allocator *   NULL for malloc, realloc and free
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SetAllocator(const Unified2Allocator *a)
+{
+    if( a == NULL )
+    {
+        memset(&allocator, 0x0, sizeof(Unified2Allocator));
+        return UNIFIED2_OK;
+    }
+
+    if( a->allocate == NULL || a->reallocate == NULL || a->release == NULL )
+    {
+        warn("Unified2SetAllocator: allocate, reallocate and release are all "
+            "needed\n");
+        return UNIFIED2_ERROR;
+    }
+
+    allocator = *a;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2GetAllocator
+ *
+ * Purpose: Copy out the installed allocator, all NULL when it is libc's
+ *
+ * Arguements:
+ *      Unified2Allocator *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2GetAllocator(Unified2Allocator *a)
+{
+    *a = allocator;
+}
+
+/* Function: _Unified2Malloc
+ *
+ * Purpose: Allocate memory for a part of the library
+ *
+ * Arguements:
+ *      size_t
+ *      UNIFIED2_ALLOC
+ *
+ * Returns:
+ *      void *
+ */
+void *_Unified2Malloc(size_t size, UNIFIED2_ALLOC subsystem)
+{
+    if( allocator.allocate == NULL )
+    {
+        return malloc(size);
+    }
+
+    return allocator.allocate(allocator.context, size, subsystem);
+}
+
+/* Function: _Unified2Calloc
+ *
+ * Purpose: Allocate zeroed memory for a part of the library
+ *
+ * Arguements:
+ *      size_t
+ *      size_t
+ *      UNIFIED2_ALLOC
+ *
+ * Returns:
+ *      void *
+ */
+void *_Unified2Calloc(size_t count, size_t size, UNIFIED2_ALLOC subsystem)
+{
+    void *memory;
+
+    if( allocator.allocate == NULL )
+    {
+        return calloc(count, size);
+    }
+
+    if( size != 0 && count > SIZE_MAX / size )
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memory = allocator.allocate(allocator.context, count * size, subsystem);
+    if( memory != NULL )
+    {
+        memset(memory, 0x0, count * size);
+    }
+
+    return memory;
+}
+
+/* Function: _Unified2Realloc
+ *
+ * Purpose: Resize memory of a part of the library
+ *
+ * Arguements:
+ *      void *
+ *      size_t
+ *      UNIFIED2_ALLOC
+ *
+ * Returns:
+ *      void *
+ */
+void *_Unified2Realloc(void *memory, size_t size, UNIFIED2_ALLOC subsystem)
+{
+    if( allocator.reallocate == NULL )
+    {
+        return realloc(memory, size);
+    }
+
+    return allocator.reallocate(allocator.context, memory, size, subsystem);
+}
+
+/* Function: _Unified2Free
+ *
+ * Purpose: Release memory of a part of the library, NULL is ignored
+ *
+ * Arguements:
+ *      void *
+ *      UNIFIED2_ALLOC
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2Free(void *memory, UNIFIED2_ALLOC subsystem)
+{
+    if( memory == NULL )
+    {
+        return;
+    }
+
+    if( allocator.release == NULL )
+    {
+        free(memory);
+        return;
+    }
+
+    allocator.release(allocator.context, memory, subsystem);
+}
+
+/* Function: _Unified2Strdup
+ *
+ * Purpose: Copy a string for a part of the library
+ *
+ * Arguements:
+ *      const char *
+ *      UNIFIED2_ALLOC
+ *
+ * Returns:
+ *      char *
+ */
+char *_Unified2Strdup(const char *s, UNIFIED2_ALLOC subsystem)
+{
+    size_t size = strlen(s) + 1;
+    char *copy;
+
+    copy = (char *)_Unified2Malloc(size, subsystem);
+    if( copy != NULL )
+    {
+        memcpy(copy, s, size);
+    }
+
+    return copy;
+}
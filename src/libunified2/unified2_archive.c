@@ -0,0 +1,1565 @@
+/*******************************************************************************
+ * Archives: many logs read at once.
+ *
+ * Reprocessing an archive, a spool per sensor and weeks of it, one file after
+ * the other leaves all but one CPU idle. An archive takes files, directories
+ * and glob patterns and reads the logs they name on a pool of workers, one
+ * per CPU unless told otherwise.
+ *
+ * Every worker has a queue of its own and the logs are dealt out over the
+ * queues in turn. A worker takes from its own queue and, once that is empty,
+ * steals the oldest work of whichever worker has the most bytes left, so a
+ * few large logs do not keep one worker busy while the others idle. Logs
+ * larger than the split size are walked first: the worker that maps one
+ * follows its record headers and queues ranges of about the split size as it
+ * goes, each starting at an event so packets stay with their events, and
+ * idle workers steal them while the walk goes on. Work comes in whole logs or
+ * ranges of megabytes, so one lock over all the queues is plenty.
+ *
+ * Each log or range is read by a dispatcher of its own (see
+ * unified2_dispatch.c) through the archive's stage and filter, and the
+ * results are reduced as they come in:
+ *
+ *  counts      records read and matched, per log and in all
+ *  output      the matching records, formatted or as unified2, written in
+ *              the order of the logs as one reader would have written them.
+ *              Whatever is next in line writes straight through, the rest is
+ *              held in memory until its turn. Once more than ARCHIVE_HOLD
+ *              is held, workers only take walks and the span next in line,
+ *              so one slow log early on does not pile up the output of all
+ *              the others; what is being read is not counted, so up to a
+ *              span's output per worker comes on top.
+ *  summary     every worker keeps one, merged into the caller's at the end
+ *
+ * Pinned workers are bound to a CPU each. Pages of a log land on the memory
+ * node of whoever touches them first, which is the pinned worker that maps
+ * the log, so whole logs are read from local memory, and the ranges of a
+ * split log are queued with the worker that walked it.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "unified2.h"
+
+#define ARCHIVE_SPLIT       (64ULL << 20)   /* larger logs are split */
+#define ARCHIVE_MAX_SPLIT   (1ULL << 30)
+#define ARCHIVE_HOLD        (256ULL << 20)  /* output held for its turn */
+
+typedef struct _Log Log;
+typedef struct _Span Span;
+
+/* A piece of work: a whole log, a range of one, or the walk that finds the
+ * ranges of a large one */
+struct _Span {
+    Log *log;
+    uint64_t start;
+    uint64_t length;            /* 0 for the whole log */
+    int walk;
+    int stream;                 /* writes straight to the archive's output */
+    int done;
+    uint64_t records;
+    uint64_t matched;
+    Unified2Buffer output;
+    Span *next;                 /* the log's next span, in file order */
+    Span *queued;               /* next in a worker's queue */
+};
+
+struct _Log {
+    char *path;
+    uint64_t size;
+    Unified2 *map;              /* the mapping the ranges of a split log read */
+    Span *first;                /* what is read, in file order */
+    Span *last;
+    Span *unwritten;            /* first span whose output is not written */
+    int walked;                 /* every span of it is known */
+    int reading;                /* spans not done yet */
+    int damaged;
+    uint64_t ranges;
+    Unified2ArchiveStats stats; /* of the last run */
+};
+
+typedef struct _Worker {
+    Unified2Archive *archive;
+    int id;
+    Span *head;                 /* queue, taken from the head */
+    Span *tail;
+    uint64_t queued;            /* bytes in the queue */
+    Unified2Summary *summary;
+    pthread_t thread;
+} Worker;
+
+struct _Unified2Archive {
+    Log *logs;
+    int nlogs;
+    int size;
+
+    int threads;                /* 0 for one per CPU */
+    int pin;
+    uint64_t split;
+    const Unified2Filter *filter;
+    Unified2StageFunc stage;
+    void *stage_arg;
+    Unified2Summary *summary;
+
+    /* see Unified2ArchiveOutput() */
+    int fd;
+    Unified2FormatFunc format;
+
+    /* for the handles the archive opens */
+    Unified2DiagFunc diag;
+    void *diag_context;
+    uint32_t diag_interval;
+
+    /* while running */
+    Worker *workers;
+    int nworkers;
+    int outstanding;            /* spans queued or being read */
+    int written;                /* logs whose output is all written */
+    int writing;                /* a worker is writing output */
+    uint64_t held;              /* output of done spans not written yet */
+    int failed;
+    uint64_t steals;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* idle workers wait for spans */
+};
+
+/* Function: Unified2ArchiveNew
+ *
+ * Purpose: Allocate an archive without logs. It splits logs larger than 64MB,
+ * runs a worker per CPU and has no output.
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      Unified2Archive *
+ */
+Unified2Archive * Unified2ArchiveNew()
+{
+    Unified2Archive *a;
+
+    a = (Unified2Archive *)_Unified2Calloc(1, sizeof(Unified2Archive),
+        UNIFIED2_ALLOC_HANDLE);
+    if( a == NULL )
+    {
+        warn("Unified2ArchiveNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    a->split = ARCHIVE_SPLIT;
+    a->fd = -1;
+
+    return a;
+}
+
+/* Function: Unified2ArchiveFree
+ *
+ * Purpose: Release an archive. The filter, the summary and the output are
+ * the caller's and left alone.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2ArchiveFree(Unified2Archive *a)
+{
+    int i;
+
+    if( a == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < a->nlogs; i++ )
+    {
+        _Unified2Free(a->logs[i].path, UNIFIED2_ALLOC_HANDLE);
+    }
+
+    _Unified2Free(a->logs, UNIFIED2_ALLOC_HANDLE);
+    _Unified2Free(a, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: add_log
+ *
+ * Purpose: Append a log to read
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      const char *
+ *      uint64_t
+ *
+ * Returns:
+ *      int         1, -1 on error
+ */
+static int add_log(Unified2Archive *a, const char *path, uint64_t size)
+{
+    Log *grown;
+    int n;
+
+    if( a->nlogs == a->size )
+    {
+        n = a->size ? a->size * 2 : 64;
+        grown = (Log *)_Unified2Realloc(a->logs, n * sizeof(Log),
+            UNIFIED2_ALLOC_HANDLE);
+        if( grown == NULL )
+        {
+            warn("Unified2ArchiveAdd: failed to malloc: %s\n", strerror(errno));
+            return -1;
+        }
+        a->logs = grown;
+        a->size = n;
+    }
+
+    grown = &a->logs[a->nlogs];
+    memset(grown, 0x0, sizeof(Log));
+
+    grown->path = _Unified2Strdup(path, UNIFIED2_ALLOC_HANDLE);
+    if( grown->path == NULL )
+    {
+        return -1;
+    }
+    grown->size = size;
+    a->nlogs++;
+
+    return 1;
+}
+
+static int name_order(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Function: add_directory
+ *
+ * Purpose: Append every regular file of a directory, in name order. Hidden
+ * files and subdirectories are left out.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      const char *
+ *
+ * Returns:
+ *      int         the logs added, -1 on error
+ */
+static int add_directory(Unified2Archive *a, const char *directory)
+{
+    char **names = NULL;
+    char **grown;
+    struct dirent *de;
+    struct stat st;
+    size_t path_size;
+    char *path;
+    DIR *dir;
+    int nnames = 0;
+    int size = 0;
+    int added = 0;
+    int i;
+
+    dir = opendir(directory);
+    if( dir == NULL )
+    {
+        warn("Unified2ArchiveAdd: failed to open %s: %s\n", directory,
+            strerror(errno));
+        return -1;
+    }
+
+    while( (de = readdir(dir)) != NULL )
+    {
+        if( de->d_name[0] == '.' )
+        {
+            continue;
+        }
+
+        if( nnames == size )
+        {
+            size = size ? size * 2 : 64;
+            grown = (char **)_Unified2Realloc(names, size * sizeof(char *),
+                UNIFIED2_ALLOC_HANDLE);
+            if( grown == NULL )
+            {
+                warn("Unified2ArchiveAdd: failed to malloc: %s\n",
+                    strerror(errno));
+                added = -1;
+                break;
+            }
+            names = grown;
+        }
+
+        names[nnames] = _Unified2Strdup(de->d_name, UNIFIED2_ALLOC_HANDLE);
+        if( names[nnames] == NULL )
+        {
+            added = -1;
+            break;
+        }
+        nnames++;
+    }
+    closedir(dir);
+
+    if( added != -1 && nnames )
+    {
+        qsort(names, nnames, sizeof(char *), name_order);
+    }
+
+    for( i = 0; i < nnames; i++ )
+    {
+        path_size = strlen(directory) + strlen(names[i]) + 2;
+        path = (char *)_Unified2Malloc(path_size, UNIFIED2_ALLOC_HANDLE);
+
+        if( added != -1 && path != NULL )
+        {
+            snprintf(path, path_size, "%s/%s", directory, names[i]);
+            if( stat(path, &st) == 0 && S_ISREG(st.st_mode) )
+            {
+                added = add_log(a, path, st.st_size) == 1 ? added + 1 : -1;
+            }
+        }
+        else
+        {
+            added = -1;
+        }
+
+        _Unified2Free(path, UNIFIED2_ALLOC_HANDLE);
+        _Unified2Free(names[i], UNIFIED2_ALLOC_HANDLE);
+    }
+    _Unified2Free(names, UNIFIED2_ALLOC_HANDLE);
+
+    return added;
+}
+
+/* Function: add_path
+ *
+ * Purpose: Append a log, or the logs of a directory
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      const char *
+ *
+ * Returns:
+ *      int         the logs added, -1 on error
+ */
+static int add_path(Unified2Archive *a, const char *path)
+{
+    struct stat st;
+
+    if( stat(path, &st) == -1 )
+    {
+        warn("Unified2ArchiveAdd: failed to stat %s: %s\n", path,
+            strerror(errno));
+        return -1;
+    }
+
+    if( S_ISDIR(st.st_mode) )
+    {
+        return add_directory(a, path);
+    }
+
+    return add_log(a, path, S_ISREG(st.st_mode) ? st.st_size : 0);
+}
+
+/* Function: Unified2ArchiveAdd
+ *
+ * Purpose: Add logs to read: a file, every regular file of a directory in
+ * name order, or whatever a glob pattern matches, directories included
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      const char *
+ *
+ * Returns:
+ *      int         the logs added, -1 on error
+ */
+int Unified2ArchiveAdd(Unified2Archive *a, const char *path)
+{
+    glob_t matches;
+    int added = 0;
+    size_t i;
+    int r;
+
+    if( a == NULL || path == NULL )
+    {
+        return -1;
+    }
+
+    if( strpbrk(path, "*?[") == NULL )
+    {
+        return add_path(a, path);
+    }
+
+    r = glob(path, 0, NULL, &matches);
+    if( r == GLOB_NOMATCH )
+    {
+        return 0;
+    }
+
+    if( r != 0 )
+    {
+        warn("Unified2ArchiveAdd: failed to expand %s\n", path);
+        return -1;
+    }
+
+    for( i = 0; i < matches.gl_pathc && added != -1; i++ )
+    {
+        r = add_path(a, matches.gl_pathv[i]);
+        added = r == -1 ? -1 : added + r;
+    }
+    globfree(&matches);
+
+    return added;
+}
+
+/* Function: Unified2ArchiveThreads
+ *
+ * Purpose: Choose the number of workers, 0 or less for one per CPU, and
+ * whether to bind each to a CPU of its own
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      int
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveThreads(Unified2Archive *a, int threads, int pin)
+{
+    if( a == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->threads = threads > 0 ? threads : 0;
+    a->pin = pin;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveSplit
+ *
+ * Purpose: Read logs larger than this many bytes in ranges of about that size
+ * on several workers, 0 to always read a log whole. At most 1GB.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      uint64_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveSplit(Unified2Archive *a, uint64_t bytes)
+{
+    if( a == NULL || bytes > ARCHIVE_MAX_SPLIT )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->split = bytes;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveFilter
+ *
+ * Purpose: Only count, write and summarize what a filter matches. Packets and
+ * extra data go where their event went.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      const Unified2Filter *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveFilter(Unified2Archive *a, const Unified2Filter *filter)
+{
+    if( a == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->filter = filter;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveStage
+ *
+ * Purpose: Pass every record through a stage before the filter, see
+ * Unified2DispatcherStage(). Workers call it at the same time, each for the
+ * records of a different log or range, so it must keep no state between
+ * records.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Unified2StageFunc
+ *      void *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveStage(Unified2Archive *a, Unified2StageFunc func,
+    void *arg)
+{
+    if( a == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->stage = func;
+    a->stage_arg = arg;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveOutput
+ *
+ * Purpose: Write the matching records to a file descriptor, formatted, or as
+ * unified2 when the formatter is NULL
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Unified2FormatFunc
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveOutput(Unified2Archive *a, Unified2FormatFunc format,
+    int fd)
+{
+    if( a == NULL || fd < 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->format = format;
+    a->fd = fd;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveSummary
+ *
+ * Purpose: Add the matching records to a summary
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Unified2Summary *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveSummary(Unified2Archive *a, Unified2Summary *s)
+{
+    if( a == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->summary = s;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ArchiveDiagnostics
+ *
+ * Purpose: Report the problems of the logs the archive reads, see
+ * Unified2SetDiagnostics(). The callback is called from the workers.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Unified2DiagFunc
+ *      void *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ArchiveDiagnostics(Unified2Archive *a, Unified2DiagFunc func,
+    void *context, uint32_t interval)
+{
+    if( a == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    a->diag = func;
+    a->diag_context = context;
+    a->diag_interval = interval;
+
+    return UNIFIED2_OK;
+}
+
+/** QUEUES *********************************************************************/
+
+static uint64_t span_bytes(const Span *span)
+{
+    return span->length ? span->length : span->log->size;
+}
+
+static Span *new_span(Log *log, uint64_t start, uint64_t length, int walk)
+{
+    Span *span;
+
+    span = (Span *)_Unified2Calloc(1, sizeof(Span), UNIFIED2_ALLOC_ANALYSIS);
+    if( span == NULL )
+    {
+        warn("Unified2ArchiveRun: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    span->log = log;
+    span->start = start;
+    span->length = length;
+    span->walk = walk;
+
+    return span;
+}
+
+/* Function: push
+ *
+ * Purpose: Queue a span with a worker, the lock held
+ *
+ * Arguements:
+ *      Worker *
+ *      Span *
+ *
+ * Returns:
+ *      void
+ */
+static void push(Worker *w, Span *span)
+{
+    Unified2Archive *a = w->archive;
+
+    if( w->tail )
+        w->tail->queued = span;
+    else
+        w->head = span;
+    w->tail = span;
+    w->queued += span_bytes(span);
+
+    a->outstanding++;
+    pthread_cond_broadcast(&a->work);
+}
+
+/* Function: append
+ *
+ * Purpose: Add a span to be read to the end of its log, the lock held
+ *
+ * Arguements:
+ *      Span *
+ *
+ * Returns:
+ *      void
+ */
+static void append(Span *span)
+{
+    Log *log = span->log;
+
+    if( log->last )
+        log->last->next = span;
+    else
+        log->first = span;
+    log->last = span;
+
+    if( log->unwritten == NULL )
+    {
+        log->unwritten = span;
+    }
+    log->reading++;
+}
+
+static Span *next_to_write(Unified2Archive *a);
+
+/* Function: unqueue
+ *
+ * Purpose: Take a span out of a worker's queue, the lock held
+ *
+ * Arguements:
+ *      Worker *    whose queue it is in
+ *      Worker *    the taker
+ *      Span *      the one before it, NULL at the head
+ *      Span *
+ *
+ * Returns:
+ *      Span *
+ */
+static Span *unqueue(Worker *victim, Worker *w, Span *prev, Span *span)
+{
+    if( prev )
+        prev->queued = span->queued;
+    else
+        victim->head = span->queued;
+    if( victim->tail == span )
+    {
+        victim->tail = prev;
+    }
+    victim->queued -= span_bytes(span);
+    span->queued = NULL;
+
+    if( victim != w )
+    {
+        w->archive->steals++;
+    }
+
+    return span;
+}
+
+/* Function: take_next
+ *
+ * Purpose: With too much output held, take only a walk or the span next in
+ * line, from whichever queue has it. The lock is held.
+ *
+ * Arguements:
+ *      Worker *
+ *
+ * Returns:
+ *      Span *      NULL when neither is queued
+ */
+static Span *take_next(Worker *w)
+{
+    Unified2Archive *a = w->archive;
+    Span *next = next_to_write(a);
+    Worker *victim;
+    Span *prev;
+    Span *span;
+    int i;
+
+    for( i = 0; i < a->nworkers; i++ )
+    {
+        victim = &a->workers[(w->id + i) % a->nworkers];
+        for( prev = NULL, span = victim->head; span != NULL;
+             prev = span, span = span->queued )
+        {
+            if( span->walk || span == next )
+            {
+                return unqueue(victim, w, prev, span);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Function: take_work
+ *
+ * Purpose: Take the oldest span of a worker's own queue or, when that is
+ * empty, of the queue with the most bytes left. The lock is held.
+ *
+ * Arguements:
+ *      Worker *
+ *
+ * Returns:
+ *      Span *      NULL when every queue is empty, or nothing queued may be
+ *                  read while output is held back
+ */
+static Span *take_work(Worker *w)
+{
+    Unified2Archive *a = w->archive;
+    Worker *victim = w;
+    int i;
+
+    if( a->fd != -1 && a->held > ARCHIVE_HOLD )
+    {
+        return take_next(w);
+    }
+
+    if( w->head == NULL )
+    {
+        for( i = 0; i < a->nworkers; i++ )
+        {
+            if( a->workers[i].queued > victim->queued ||
+                (victim->head == NULL && a->workers[i].head != NULL) )
+            {
+                victim = &a->workers[i];
+            }
+        }
+    }
+
+    if( victim->head == NULL )
+    {
+        return NULL;
+    }
+
+    return unqueue(victim, w, NULL, victim->head);
+}
+
+/** OUTPUT *********************************************************************/
+
+/* Function: next_to_write
+ *
+ * Purpose: Find the span whose output is to be written next, moving past the
+ * logs all written. The lock is held.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *
+ * Returns:
+ *      Span *      NULL when it is not known yet or all is written
+ */
+static Span *next_to_write(Unified2Archive *a)
+{
+    Log *log;
+
+    while( a->written < a->nlogs )
+    {
+        log = &a->logs[a->written];
+        if( log->unwritten != NULL || !log->walked )
+        {
+            return log->unwritten;
+        }
+        a->written++;
+    }
+
+    return NULL;
+}
+
+/* Function: write_ready
+ *
+ * Purpose: Write out every span that is done and next in line. Called with
+ * the lock and a->writing held, which it gives up when there is nothing left
+ * it can write.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *
+ * Returns:
+ *      void
+ */
+static void write_ready(Unified2Archive *a)
+{
+    Span *span;
+    HRESULT r;
+
+    while( !a->failed && (span = next_to_write(a)) != NULL && span->done )
+    {
+        span->log->unwritten = span->next;
+        span->output.fd = a->fd;
+        a->held -= span->output.used;
+
+        pthread_mutex_unlock(&a->lock);
+        r = Unified2BufferFree(&span->output);
+        pthread_mutex_lock(&a->lock);
+
+        if( r != UNIFIED2_OK )
+        {
+            a->failed = 1;
+        }
+
+        /* Workers held back by the output may go on */
+        pthread_cond_broadcast(&a->work);
+    }
+
+    a->writing = 0;
+}
+
+/** READING ********************************************************************/
+
+static int is_event(uint32_t type)
+{
+    switch( type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        return 1;
+    }
+
+    return 0;
+}
+
+static HRESULT count_record(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    ((Span *)arg)->records++;
+
+    return UNIFIED2_OK;
+}
+
+static HRESULT count_match(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    ((Span *)arg)->matched++;
+
+    return UNIFIED2_OK;
+}
+
+static HRESULT copy_record(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    return Unified2BufferAppend((Unified2Buffer *)arg, record, length);
+}
+
+static Unified2 *open_handle(Unified2Archive *a)
+{
+    Unified2 *u2 = Unified2New();
+
+    if( u2 != NULL && a->diag != NULL )
+    {
+        Unified2SetDiagnostics(u2, a->diag, a->diag_context, a->diag_interval);
+    }
+
+    return u2;
+}
+
+/* Function: read_span
+ *
+ * Purpose: Read a log or a range of one through a dispatcher of its own into
+ * the counts of the span, its output and the summary of the worker
+ *
+ * Arguements:
+ *      Worker *
+ *      Span *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when the log did not open or had damage
+ */
+static HRESULT read_span(Worker *w, Span *span)
+{
+    Unified2Archive *a = w->archive;
+    Unified2Dispatcher *d;
+    Unified2 *u2;
+    int count = -1;
+    HRESULT r;
+
+    if( a->fd != -1 &&
+        Unified2BufferInit(&span->output, span->stream ? a->fd : -1, 0) !=
+        UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    u2 = open_handle(a);
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( span->length )
+        r = Unified2ReadOpenMappedRange(u2, span->log->map, span->start,
+            span->length);
+    else
+        r = Unified2ReadOpenMapped(u2, span->log->path);
+
+    if( r != UNIFIED2_OK )
+    {
+        warn("Unified2ArchiveRun: failed to open %s\n", span->log->path);
+        Unified2Free(u2);
+        return UNIFIED2_WARN;
+    }
+
+    d = Unified2DispatcherNew();
+    if( d == NULL ||
+        Unified2DispatcherStage(d, count_record, span) != UNIFIED2_OK ||
+        (a->stage != NULL &&
+         Unified2DispatcherStage(d, a->stage, a->stage_arg) != UNIFIED2_OK) ||
+        (a->filter != NULL &&
+         Unified2DispatcherStageFilter(d, a->filter) != UNIFIED2_OK) ||
+        Unified2DispatcherAdd(d, count_match, span, 0) == -1 ||
+        (w->summary != NULL &&
+         Unified2DispatcherAddSummary(d, w->summary, 0) == -1) ||
+        (a->fd != -1 && a->format != NULL &&
+         Unified2DispatcherAddFormat(d, a->format, &span->output, 0) == -1) ||
+        (a->fd != -1 && a->format == NULL &&
+         Unified2DispatcherAdd(d, copy_record, &span->output, 0) == -1) )
+    {
+        r = UNIFIED2_ERROR;
+    }
+    else
+    {
+        r = _Unified2DispatchRecords(d, u2, &count);
+    }
+
+    /* Records stepped over after a bad length count as damage too */
+    if( r == UNIFIED2_OK && Unified2GetError(u2) != UNIFIED2_DIAG_NONE &&
+        Unified2GetError(u2) != UNIFIED2_DIAG_SKIPPED )
+    {
+        r = UNIFIED2_WARN;
+    }
+
+    Unified2DispatcherFree(d);
+    Unified2Free(u2);
+
+    return r;
+}
+
+/* Function: queue_range
+ *
+ * Purpose: Queue a range of a log being walked with the walking worker
+ *
+ * Arguements:
+ *      Worker *
+ *      Log *
+ *      uint64_t
+ *      uint64_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT queue_range(Worker *w, Log *log, uint64_t start,
+    uint64_t length)
+{
+    Unified2Archive *a = w->archive;
+    Span *range;
+
+    range = new_span(log, start, length, 0);
+
+    pthread_mutex_lock(&a->lock);
+    if( range == NULL )
+    {
+        a->failed = 1;
+        pthread_cond_broadcast(&a->work);
+    }
+    else
+    {
+        append(range);
+        push(w, range);
+        log->ranges++;
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return range == NULL ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
+
+/* Function: walk_log
+ *
+ * Purpose: Map a large log and follow its record headers, queueing a range
+ * whenever one of at least the split size ends before an event. Where the
+ * headers stop making sense the last range takes the rest, and reading it
+ * reports the damage. Logs that can not be mapped are read whole.
+ *
+ * Arguements:
+ *      Worker *
+ *      Span *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT walk_log(Worker *w, Span *span)
+{
+    Unified2Archive *a = w->archive;
+    Log *log = span->log;
+    uint64_t start = 0;
+    uint64_t p = 0;
+    uint64_t size;
+    uint32_t length;
+    const uint8_t *map;
+    Unified2 *u2;
+    Span *whole;
+
+    u2 = open_handle(a);
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( Unified2ReadOpenMapped(u2, log->path) != UNIFIED2_OK )
+    {
+        warn("Unified2ArchiveRun: failed to open %s\n", log->path);
+        Unified2Free(u2);
+        pthread_mutex_lock(&a->lock);
+        log->damaged = 1;
+        pthread_mutex_unlock(&a->lock);
+        return UNIFIED2_OK;
+    }
+
+    if( u2->mode != MAPPED )
+    {
+        Unified2Free(u2);
+        whole = new_span(log, 0, 0, 0);
+
+        pthread_mutex_lock(&a->lock);
+        if( whole != NULL )
+        {
+            append(whole);
+            push(w, whole);
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        return whole == NULL ? UNIFIED2_ERROR : UNIFIED2_OK;
+    }
+
+    /* Nothing reads the mapping before the first range is queued */
+    log->map = u2;
+    map = u2->map;
+    size = u2->map_size;
+
+    while( size - p >= sizeof(Unified2RecordHeader) )
+    {
+        length = _Unified2Field32(map + p, 4);
+        if( length > size - p - sizeof(Unified2RecordHeader) )
+        {
+            break;
+        }
+
+        if( p - start >= a->split && is_event(_Unified2Field32(map + p, 0)) )
+        {
+            if( queue_range(w, log, start, p - start) != UNIFIED2_OK )
+            {
+                return UNIFIED2_ERROR;
+            }
+            start = p;
+        }
+
+        p += sizeof(Unified2RecordHeader) + length;
+    }
+
+    if( start < size )
+    {
+        /* Ranges are read through int sized reads; past damage nothing
+         * further is read anyway */
+        return queue_range(w, log, start, size - start > INT32_MAX ?
+            INT32_MAX : size - start);
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: finish
+ *
+ * Purpose: Account for a span that has been read or walked and write out what
+ * that made ready. The lock is held.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Span *
+ *      HRESULT
+ *
+ * Returns:
+ *      void
+ */
+static void finish(Unified2Archive *a, Span *span, HRESULT r)
+{
+    Log *log = span->log;
+
+    if( r == UNIFIED2_ERROR )
+    {
+        a->failed = 1;
+        pthread_cond_broadcast(&a->work);
+    }
+
+    if( span->walk )
+    {
+        log->walked = 1;
+    }
+    else
+    {
+        span->done = 1;
+        a->held += span->output.used;
+        log->reading--;
+        if( r == UNIFIED2_WARN )
+        {
+            log->damaged = 1;
+        }
+    }
+
+    if( log->walked && log->reading == 0 && log->map != NULL )
+    {
+        Unified2Free(log->map);
+        log->map = NULL;
+    }
+
+    if( a->fd != -1 && (span->stream || !a->writing) )
+    {
+        a->writing = 1;
+        write_ready(a);
+    }
+}
+
+/* Function: pin
+ *
+ * Purpose: Bind the calling worker to a CPU of its own
+ *
+ * Arguements:
+ *      Worker *
+ *
+ * Returns:
+ *      void
+ */
+static void pin(Worker *w)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpus;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if( n < 1 )
+    {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->id % n, &cpus);
+    if( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 )
+    {
+        warn("Unified2ArchiveRun: failed to pin worker %d\n", w->id);
+    }
+#endif
+}
+
+static void *archive_thread(void *arg)
+{
+    Worker *w = arg;
+    Unified2Archive *a = w->archive;
+    Span *span;
+    HRESULT r;
+
+    if( a->pin )
+    {
+        pin(w);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    while( !a->failed )
+    {
+        span = take_work(w);
+        if( span == NULL )
+        {
+            if( a->outstanding == 0 )
+            {
+                break;
+            }
+            pthread_cond_wait(&a->work, &a->lock);
+            continue;
+        }
+
+        /* Nothing before it is left to write, so it can write as it goes */
+        if( a->fd != -1 && !span->walk && !a->writing &&
+            span == next_to_write(a) )
+        {
+            span->stream = 1;
+            a->writing = 1;
+        }
+        pthread_mutex_unlock(&a->lock);
+
+        r = span->walk ? walk_log(w, span) : read_span(w, span);
+
+        pthread_mutex_lock(&a->lock);
+        finish(a, span, r);
+        if( span->walk )
+        {
+            _Unified2Free(span, UNIFIED2_ALLOC_ANALYSIS);
+        }
+
+        if( --a->outstanding == 0 )
+        {
+            pthread_cond_broadcast(&a->work);
+        }
+    }
+    pthread_cond_broadcast(&a->work);
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+/* Function: prepare
+ *
+ * Purpose: Set up the workers and deal the logs out over their queues, split
+ * logs as walks and the others whole
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT prepare(Unified2Archive *a, int workers)
+{
+    Span *span;
+    Log *log;
+    int i;
+
+    a->workers = (Worker *)_Unified2Calloc(workers, sizeof(Worker),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( a->workers == NULL )
+    {
+        warn("Unified2ArchiveRun: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    a->nworkers = workers;
+    a->outstanding = 0;
+    a->written = 0;
+    a->writing = 0;
+    a->held = 0;
+    a->failed = 0;
+    a->steals = 0;
+
+    for( i = 0; i < workers; i++ )
+    {
+        a->workers[i].archive = a;
+        a->workers[i].id = i;
+
+        if( a->summary != NULL )
+        {
+            a->workers[i].summary = Unified2SummaryNew();
+            if( a->workers[i].summary == NULL )
+            {
+                return UNIFIED2_ERROR;
+            }
+        }
+    }
+
+    for( i = 0; i < a->nlogs; i++ )
+    {
+        log = &a->logs[i];
+        log->first = log->last = log->unwritten = NULL;
+        log->reading = 0;
+        log->damaged = 0;
+        log->ranges = 0;
+
+        span = new_span(log, 0, 0, a->split && log->size > a->split);
+        if( span == NULL )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        log->walked = !span->walk;
+        if( !span->walk )
+        {
+            append(span);
+        }
+        push(&a->workers[i % workers], span);
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: cleanup
+ *
+ * Purpose: Release the workers and spans of a run, and any mapping or output
+ * a failed run left behind
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *
+ * Returns:
+ *      void
+ */
+static void cleanup(Unified2Archive *a)
+{
+    Span *span;
+    Span *next;
+    Log *log;
+    int i;
+
+    for( i = 0; i < a->nworkers; i++ )
+    {
+        /* Walks not taken, the spans they are for are not in any log */
+        for( span = a->workers[i].head; span != NULL; span = next )
+        {
+            next = span->queued;
+            if( span->walk )
+                _Unified2Free(span, UNIFIED2_ALLOC_ANALYSIS);
+        }
+        Unified2SummaryFree(a->workers[i].summary);
+    }
+
+    for( i = 0; i < a->nlogs; i++ )
+    {
+        log = &a->logs[i];
+        for( span = log->first; span != NULL; span = next )
+        {
+            next = span->next;
+            if( span->output.data != NULL )
+            {
+                span->output.fd = -1;
+                Unified2BufferFree(&span->output);
+            }
+            _Unified2Free(span, UNIFIED2_ALLOC_ANALYSIS);
+        }
+        log->first = log->last = log->unwritten = NULL;
+
+        if( log->map != NULL )
+        {
+            Unified2Free(log->map);
+            log->map = NULL;
+        }
+    }
+
+    _Unified2Free(a->workers, UNIFIED2_ALLOC_ANALYSIS);
+    a->workers = NULL;
+    a->nworkers = 0;
+}
+
+/* Function: log_stats
+ *
+ * Purpose: Sum up what was read of a log
+ *
+ * Arguements:
+ *      const Log *
+ *      Unified2ArchiveStats *
+ *
+ * Returns:
+ *      void
+ */
+static void log_stats(const Log *log, Unified2ArchiveStats *stats)
+{
+    const Span *span;
+
+    memset(stats, 0x0, sizeof(Unified2ArchiveStats));
+    stats->logs = !log->damaged;
+    stats->damaged = log->damaged;
+    stats->ranges = log->ranges;
+    stats->bytes = log->size;
+
+    for( span = log->first; span != NULL; span = span->next )
+    {
+        stats->records += span->records;
+        stats->matched += span->matched;
+    }
+}
+
+/* Function: Unified2ArchiveRun
+ *
+ * Purpose: Read every log added, on the workers, into the output and the
+ * summary. A log that does not open or is damaged is reported and read as far
+ * as it goes; failing to write or to allocate stops the run.
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      Unified2ArchiveStats *  the counts in all, may be NULL
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when a log could not be read in full
+ */
+HRESULT Unified2ArchiveRun(Unified2Archive *a, Unified2ArchiveStats *stats)
+{
+    Unified2ArchiveStats total;
+    Unified2ArchiveStats *one;
+    int workers;
+    int started;
+    HRESULT r;
+    int i;
+
+    if( a == NULL || a->nlogs == 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    workers = a->threads ? a->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if( workers < 1 )
+        workers = 1;
+    if( workers > UNIFIED2_MAX_THREADS )
+        workers = UNIFIED2_MAX_THREADS;
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->work, NULL);
+
+    r = prepare(a, workers);
+    if( r == UNIFIED2_OK && workers == 1 && !a->pin )
+    {
+        archive_thread(&a->workers[0]);
+    }
+    else if( r == UNIFIED2_OK )
+    {
+        for( started = 0; started < workers; started++ )
+        {
+            if( pthread_create(&a->workers[started].thread, NULL,
+                archive_thread, &a->workers[started]) != 0 )
+            {
+                break;
+            }
+        }
+
+        /* The queues of workers that did not start are stolen from */
+        if( started == 0 )
+        {
+            warn("Unified2ArchiveRun: failed to start a worker\n");
+            r = UNIFIED2_ERROR;
+        }
+
+        for( i = 0; i < started; i++ )
+        {
+            pthread_join(a->workers[i].thread, NULL);
+        }
+    }
+
+    if( r == UNIFIED2_OK && a->failed )
+    {
+        r = UNIFIED2_ERROR;
+    }
+
+    for( i = 0; i < a->nworkers && r == UNIFIED2_OK && a->summary; i++ )
+    {
+        r = Unified2SummaryMerge(a->summary, a->workers[i].summary);
+    }
+
+    memset(&total, 0x0, sizeof(total));
+    total.steals = a->steals;
+    for( i = 0; i < a->nlogs; i++ )
+    {
+        one = &a->logs[i].stats;
+        log_stats(&a->logs[i], one);
+        total.logs += one->logs;
+        total.damaged += one->damaged;
+        total.ranges += one->ranges;
+        total.bytes += one->bytes;
+        total.records += one->records;
+        total.matched += one->matched;
+    }
+
+    if( stats != NULL )
+    {
+        *stats = total;
+    }
+
+    cleanup(a);
+    pthread_cond_destroy(&a->work);
+    pthread_mutex_destroy(&a->lock);
+
+    if( r == UNIFIED2_OK && total.damaged )
+    {
+        r = UNIFIED2_WARN;
+    }
+
+    return r;
+}
+
+/* Function: Unified2ArchiveLog
+ *
+ * Purpose: Get the name of a log and what the last run read of it
+ *
+ * Arguements:
+ *      Unified2Archive *
+ *      int                     from 0, in the order the logs were added
+ *      Unified2ArchiveStats *  may be NULL
+ *
+ * Returns:
+ *      const char *    NULL past the last log
+ */
+const char * Unified2ArchiveLog(Unified2Archive *a, int i,
+    Unified2ArchiveStats *stats)
+{
+    if( a == NULL || i < 0 || i >= a->nlogs )
+    {
+        return NULL;
+    }
+
+    if( stats != NULL )
+    {
+        *stats = a->logs[i].stats;
+    }
+
+    return a->logs[i].path;
+}
@@ -0,0 +1,1195 @@
+/*******************************************************************************
+ * Seekable compressed unified2 container.
+ *
+ * Unified2 logs compress very well, but a plain compressed stream has to be
+ * decompressed from the start to reach any record. This container cuts the log
+ * into independently compressed frames of about 1MB and keeps an index of
+ * them, so a reader only decompresses the frames it touches and several frames
+ * can be decompressed at once.
+ *
+ * Layout, all integers in network byte order:
+ *
+ *      file header     "U2SF" version frame_size reserved          16 bytes
+ *      frame           "U2FR" codec compressed_size raw_size       16 bytes
+ *                      compressed data
+ *      ...
+ *      seek table      { offset(64) compressed_size raw_size }     16 bytes each
+ *      footer          table_offset(64) frame_count "U2SE"         16 bytes
+ *
+ * Every frame carries its own header, so a file whose writer died before the
+ * seek table was written can still be read by walking the frames.
+ *
+ * The reader plugs in behind Unified2Read()/Unified2Seek()/Unified2Eof(), and
+ * Unified2ReadOpenFd()/Unified2ReadOpenFILE() switch to it when they see the
+ * file header, so every tool reads compressed logs unchanged.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_ZLIB 1
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD 1
+#include <zstd.h>
+#endif
+
+#include "unified2.h"
+
+#define CONTAINER_MAGIC     "U2SF"
+#define FRAME_MAGIC         "U2FR"
+#define FOOTER_MAGIC        "U2SE"
+#define CONTAINER_VERSION   1
+
+#define HEADER_SIZE         16
+#define FRAME_HEADER_SIZE   16
+#define TABLE_ENTRY_SIZE    16
+#define FOOTER_SIZE         16
+
+#define DEFAULT_FRAME_SIZE  (1 << 20)
+#define MAX_FRAME_SIZE      (64 << 20)
+
+typedef struct _Frame {
+    uint64_t offset;        /* of the frame header in the file */
+    uint64_t raw_start;     /* logical offset of the first byte */
+    uint32_t compressed_size;
+    uint32_t raw_size;
+} Frame;
+
+typedef struct _FrameSlot {
+    int64_t frame;          /* frame index held, -1 when empty */
+    uint64_t used;          /* last use, for eviction */
+    uint8_t *data;
+} FrameSlot;
+
+struct _Unified2Compressed {
+    int writing;
+    uint32_t frame_size;
+
+    Frame *frames;
+    uint32_t frame_count;
+    uint32_t frame_alloc;
+
+    /* reader */
+    uint64_t total_size;
+    uint64_t position;
+    FrameSlot *slots;
+    int slot_count;
+    int threads;
+    uint64_t clock;
+    FrameSlot *current;
+
+    /* writer, the lock keeps a sync on another thread out of the frame */
+    pthread_mutex_t lock;
+    int codec;
+    int level;
+    uint8_t *raw;
+    uint32_t fill;
+    uint8_t *packed;
+    size_t packed_size;
+    uint64_t file_offset;
+};
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+    put32(p, (uint32_t)(v >> 32));
+    put32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return ((uint64_t)get32(p) << 32) | get32(p + 4);
+}
+
+static int pread_all(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t r;
+    size_t total = 0;
+
+    while( total < len )
+    {
+        r = pread(fd, buf + total, len - total, offset + total);
+        if( r > 0 )
+            total += r;
+        else if( r == 0 || errno != EINTR )
+            return -1;
+    }
+
+    return 0;
+}
+
+/** CODECS ********************************************************************/
+
+static size_t codec_bound(int codec, size_t size)
+{
+    switch( codec )
+    {
+#ifdef USE_ZLIB
+        case UNIFIED2_CODEC_ZLIB:
+        return compressBound(size);
+#endif
+#ifdef USE_ZSTD
+        case UNIFIED2_CODEC_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+        default:
+        return 0;
+    }
+}
+
+static long codec_compress(int codec, int level, const uint8_t *src,
+    size_t size, uint8_t *dst, size_t capacity)
+{
+#ifdef USE_ZLIB
+    uLongf packed = capacity;
+#endif
+#ifdef USE_ZSTD
+    size_t r;
+#endif
+
+    switch( codec )
+    {
+#ifdef USE_ZLIB
+        case UNIFIED2_CODEC_ZLIB:
+        if( compress2(dst, &packed, src, size,
+            level ? level : Z_DEFAULT_COMPRESSION) != Z_OK )
+            return -1;
+        return packed;
+#endif
+#ifdef USE_ZSTD
+        case UNIFIED2_CODEC_ZSTD:
+        r = ZSTD_compress(dst, capacity, src, size, level ? level : 3);
+        if( ZSTD_isError(r) )
+            return -1;
+        return r;
+#endif
+        default:
+        return -1;
+    }
+}
+
+static int codec_decompress(int codec, const uint8_t *src, size_t size,
+    uint8_t *dst, size_t raw_size)
+{
+#ifdef USE_ZLIB
+    uLongf unpacked = raw_size;
+#endif
+#ifdef USE_ZSTD
+    size_t r;
+#endif
+
+    switch( codec )
+    {
+#ifdef USE_ZLIB
+        case UNIFIED2_CODEC_ZLIB:
+        if( uncompress(dst, &unpacked, src, size) != Z_OK ||
+            unpacked != raw_size )
+            return -1;
+        return 0;
+#endif
+#ifdef USE_ZSTD
+        case UNIFIED2_CODEC_ZSTD:
+        r = ZSTD_decompress(dst, raw_size, src, size);
+        if( ZSTD_isError(r) || r != raw_size )
+            return -1;
+        return 0;
+#endif
+        default:
+        return -1;
+    }
+}
+
+/** WRITER ********************************************************************/
+
+static int add_frame(Unified2Compressed *c, uint64_t offset,
+    uint32_t compressed_size, uint32_t raw_size)
+{
+    Frame *frames;
+    uint32_t alloc;
+
+    if( c->frame_count == c->frame_alloc )
+    {
+        alloc = c->frame_alloc ? c->frame_alloc * 2 : 64;
+        frames = (Frame *)_Unified2Realloc(c->frames, alloc * sizeof(Frame),
+            UNIFIED2_ALLOC_BUFFER);
+        if( frames == NULL )
+        {
+            return -1;
+        }
+        c->frames = frames;
+        c->frame_alloc = alloc;
+    }
+
+    c->frames[c->frame_count].offset = offset;
+    c->frames[c->frame_count].compressed_size = compressed_size;
+    c->frames[c->frame_count].raw_size = raw_size;
+    c->frames[c->frame_count].raw_start = c->total_size;
+    c->total_size += raw_size;
+    c->frame_count++;
+
+    return 0;
+}
+
+static void compressed_free(Unified2Compressed *c)
+{
+    int i;
+
+    if( c->slots != NULL )
+    {
+        for( i = 0; i < c->slot_count; i++ )
+        {
+            _Unified2Free(c->slots[i].data, UNIFIED2_ALLOC_BUFFER);
+        }
+        _Unified2Free(c->slots, UNIFIED2_ALLOC_BUFFER);
+    }
+
+    _Unified2Free(c->frames, UNIFIED2_ALLOC_BUFFER);
+    _Unified2Free(c->raw, UNIFIED2_ALLOC_BUFFER);
+    _Unified2Free(c->packed, UNIFIED2_ALLOC_BUFFER);
+    if( c->writing )
+    {
+        pthread_mutex_destroy(&c->lock);
+    }
+    _Unified2Free(c, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: flush_frame
+ *
+ * Purpose: Compress whatever is buffered into a frame of its own and write it.
+ * Must be called with the lock held.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_ERROR with errno set, 0 when the codec failed
+ */
+static HRESULT flush_frame(Unified2 *u2)
+{
+    Unified2Compressed *c = u2->compressed;
+    long packed;
+
+    if( c->fill == 0 )
+    {
+        return UNIFIED2_OK;
+    }
+
+    packed = codec_compress(c->codec, c->level, c->raw, c->fill,
+        c->packed + FRAME_HEADER_SIZE, c->packed_size - FRAME_HEADER_SIZE);
+    if( packed < 0 )
+    {
+        errno = 0;
+        return UNIFIED2_ERROR;
+    }
+
+    memcpy(c->packed, FRAME_MAGIC, 4);
+    put32(c->packed + 4, c->codec);
+    put32(c->packed + 8, packed);
+    put32(c->packed + 12, c->fill);
+
+    if( _Unified2WriteAll(u2->fd, c->packed,
+            FRAME_HEADER_SIZE + packed) == -1 ||
+        add_frame(c, c->file_offset, packed, c->fill) == -1 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    c->file_offset += FRAME_HEADER_SIZE + packed;
+    c->fill = 0;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2CompressedFlush
+ *
+ * Purpose: Compress whatever is buffered into a frame of its own and write it.
+ * Called before a sync, possibly from the durability helper thread.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_ERROR with errno set, 0 when the codec failed, for
+ *                  the caller to report
+ */
+HRESULT _Unified2CompressedFlush(Unified2 *u2)
+{
+    Unified2Compressed *c = u2->compressed;
+    HRESULT r;
+
+    if( c == NULL || !c->writing )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    r = flush_frame(u2);
+    pthread_mutex_unlock(&c->lock);
+
+    return r;
+}
+
+/* Function: Unified2WriteOpenCompressed
+ *
+ * Purpose: Open a file for writing as a seekable compressed container. codec
+ * is one of UNIFIED2_CODEC_*, UNIFIED2_CODEC_DEFAULT picks the best one this
+ * library was built with; level 0 uses the codec's default.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      char *
+ *      int         codec
+ *      int         level
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2WriteOpenCompressed(Unified2 *u2, char *filename, int codec, int level)
+{
+    Unified2Compressed *c;
+    uint8_t header[HEADER_SIZE];
+
+    if( u2 == NULL || filename == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( codec == UNIFIED2_CODEC_DEFAULT )
+    {
+#if defined(USE_ZSTD)
+        codec = UNIFIED2_CODEC_ZSTD;
+#elif defined(USE_ZLIB)
+        codec = UNIFIED2_CODEC_ZLIB;
+#endif
+    }
+
+    if( codec_bound(codec, DEFAULT_FRAME_SIZE) == 0 )
+    {
+        warn("Unified2WriteOpenCompressed: codec %d is not supported\n", codec);
+        return UNIFIED2_ERROR;
+    }
+
+    c = (Unified2Compressed *)_Unified2Malloc(sizeof(Unified2Compressed),
+        UNIFIED2_ALLOC_HANDLE);
+    if( c == NULL )
+    {
+        warn("Unified2WriteOpenCompressed: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    memset(c, 0x0, sizeof(Unified2Compressed));
+
+    c->writing = 1;
+    pthread_mutex_init(&c->lock, NULL);
+    c->codec = codec;
+    c->level = level;
+    c->frame_size = DEFAULT_FRAME_SIZE;
+    c->packed_size = FRAME_HEADER_SIZE + codec_bound(codec, c->frame_size);
+    c->raw = (uint8_t *)_Unified2Malloc(c->frame_size, UNIFIED2_ALLOC_BUFFER);
+    c->packed = (uint8_t *)_Unified2Malloc(c->packed_size,
+        UNIFIED2_ALLOC_BUFFER);
+    if( c->raw == NULL || c->packed == NULL )
+    {
+        warn("Unified2WriteOpenCompressed: failed to malloc: %s\n", strerror(errno));
+        compressed_free(c);
+        return UNIFIED2_ERROR;
+    }
+
+    u2->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if( u2->fd == -1 )
+    {
+        warn("Unified2WriteOpenCompressed: failed to open the file %s: %s\n",
+        filename, strerror(errno));
+        compressed_free(c);
+        return UNIFIED2_ERROR;
+    }
+
+    memcpy(header, CONTAINER_MAGIC, 4);
+    put32(header + 4, CONTAINER_VERSION);
+    put32(header + 8, c->frame_size);
+    put32(header + 12, 0);
+    if( _Unified2WriteAll(u2->fd, header, HEADER_SIZE) == -1 )
+    {
+        warn("Unified2WriteOpenCompressed: failed to write to the file %s: %s\n",
+        filename, strerror(errno));
+        close(u2->fd);
+        u2->fd = -1;
+        compressed_free(c);
+        return UNIFIED2_ERROR;
+    }
+    c->file_offset = HEADER_SIZE;
+
+    u2->mode = COMPRESSED;
+    u2->compressed = c;
+    u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2CompressedWrite
+ *
+ * Purpose: Buffer data for the current frame, compressing full frames.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int         bytes accepted, or UNIFIED2_ERROR
+ */
+int _Unified2CompressedWrite(Unified2 *u2, const void *buf, int size)
+{
+    Unified2Compressed *c = u2->compressed;
+    const uint8_t *data = buf;
+    uint32_t chunk;
+    int left = size;
+
+    if( c == NULL || !c->writing )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while( left > 0 )
+    {
+        chunk = c->frame_size - c->fill;
+        if( chunk > (uint32_t)left )
+        {
+            chunk = left;
+        }
+
+        memcpy(c->raw + c->fill, data, chunk);
+        c->fill += chunk;
+        data += chunk;
+        left -= chunk;
+
+        if( c->fill == c->frame_size && flush_frame(u2) != UNIFIED2_OK )
+        {
+            pthread_mutex_unlock(&c->lock);
+            return UNIFIED2_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return size;
+}
+
+/* Function: write_seek_table
+ *
+ * Purpose: Append the seek table and footer after the last frame
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT write_seek_table(Unified2 *u2)
+{
+    Unified2Compressed *c = u2->compressed;
+    uint8_t *table;
+    size_t size;
+    uint32_t i;
+    int r;
+
+    size = (size_t)c->frame_count * TABLE_ENTRY_SIZE + FOOTER_SIZE;
+    table = (uint8_t *)_Unified2Malloc(size, UNIFIED2_ALLOC_BUFFER);
+    if( table == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0; i < c->frame_count; i++ )
+    {
+        put64(table + i * TABLE_ENTRY_SIZE, c->frames[i].offset);
+        put32(table + i * TABLE_ENTRY_SIZE + 8, c->frames[i].compressed_size);
+        put32(table + i * TABLE_ENTRY_SIZE + 12, c->frames[i].raw_size);
+    }
+
+    put64(table + size - FOOTER_SIZE, c->file_offset);
+    put32(table + size - FOOTER_SIZE + 8, c->frame_count);
+    memcpy(table + size - FOOTER_SIZE + 12, FOOTER_MAGIC, 4);
+
+    r = _Unified2WriteAll(u2->fd, table, size);
+    _Unified2Free(table, UNIFIED2_ALLOC_BUFFER);
+
+    return r == -1 ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
+
+/** READER ********************************************************************/
+
+/* Function: _Unified2IsCompressed
+ *
+ * Purpose: Check whether the first bytes of a file are a container header
+ *
+ * Arguements:
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2IsCompressed(const void *buf, int size)
+{
+    return size >= 4 && memcmp(buf, CONTAINER_MAGIC, 4) == 0;
+}
+
+/* Function: load_seek_table
+ *
+ * Purpose: Read the seek table through the footer
+ *
+ * Arguements:
+ *      Unified2Compressed *
+ *      int
+ *      uint64_t    file size
+ *
+ * Returns:
+ *      int         0, or -1 when there is no usable table
+ */
+static int load_seek_table(Unified2Compressed *c, int fd, uint64_t file_size)
+{
+    uint8_t footer[FOOTER_SIZE];
+    uint8_t *table;
+    uint64_t table_offset;
+    uint32_t count;
+    uint32_t i;
+    int r = 0;
+
+    if( file_size < HEADER_SIZE + FOOTER_SIZE ||
+        pread_all(fd, footer, FOOTER_SIZE, file_size - FOOTER_SIZE) == -1 ||
+        memcmp(footer + 12, FOOTER_MAGIC, 4) != 0 )
+    {
+        return -1;
+    }
+
+    table_offset = get64(footer);
+    count = get32(footer + 8);
+    if( table_offset < HEADER_SIZE ||
+        table_offset + (uint64_t)count * TABLE_ENTRY_SIZE + FOOTER_SIZE != file_size )
+    {
+        return -1;
+    }
+
+    table = (uint8_t *)_Unified2Malloc((size_t)count * TABLE_ENTRY_SIZE + 1,
+        UNIFIED2_ALLOC_BUFFER);
+    if( table == NULL ||
+        pread_all(fd, table, (size_t)count * TABLE_ENTRY_SIZE, table_offset) == -1 )
+    {
+        _Unified2Free(table, UNIFIED2_ALLOC_BUFFER);
+        return -1;
+    }
+
+    for( i = 0; i < count && r == 0; i++ )
+    {
+        r = add_frame(c, get64(table + i * TABLE_ENTRY_SIZE),
+            get32(table + i * TABLE_ENTRY_SIZE + 8),
+            get32(table + i * TABLE_ENTRY_SIZE + 12));
+    }
+    _Unified2Free(table, UNIFIED2_ALLOC_BUFFER);
+
+    return r;
+}
+
+/* Function: scan_frames
+ *
+ * Purpose: Rebuild the seek table by walking frame headers, for containers
+ * whose writer never got to write one.
+ *
+ * Arguements:
+ *      Unified2Compressed *
+ *      int
+ *      uint64_t    file size
+ *
+ * Returns:
+ *      int
+ */
+static int scan_frames(Unified2Compressed *c, int fd, uint64_t file_size)
+{
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint64_t offset = HEADER_SIZE;
+    uint32_t packed;
+
+    while( offset + FRAME_HEADER_SIZE <= file_size )
+    {
+        if( pread_all(fd, header, FRAME_HEADER_SIZE, offset) == -1 ||
+            memcmp(header, FRAME_MAGIC, 4) != 0 )
+        {
+            break;
+        }
+
+        packed = get32(header + 8);
+        if( offset + FRAME_HEADER_SIZE + packed > file_size ||
+            get32(header + 12) > MAX_FRAME_SIZE )
+        {
+            /* Torn final frame */
+            break;
+        }
+
+        if( add_frame(c, offset, packed, get32(header + 12)) == -1 )
+        {
+            return -1;
+        }
+
+        offset += FRAME_HEADER_SIZE + packed;
+    }
+
+    return 0;
+}
+
+static int alloc_slots(Unified2Compressed *c, int count)
+{
+    FrameSlot *slots;
+    int i;
+
+    slots = (FrameSlot *)_Unified2Malloc(count * sizeof(FrameSlot),
+        UNIFIED2_ALLOC_BUFFER);
+    if( slots == NULL )
+    {
+        return -1;
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        slots[i].frame = -1;
+        slots[i].used = 0;
+        slots[i].data = (uint8_t *)_Unified2Malloc(c->frame_size,
+            UNIFIED2_ALLOC_BUFFER);
+        if( slots[i].data == NULL )
+        {
+            while( i-- )
+                _Unified2Free(slots[i].data, UNIFIED2_ALLOC_BUFFER);
+            _Unified2Free(slots, UNIFIED2_ALLOC_BUFFER);
+            return -1;
+        }
+    }
+
+    if( c->slots != NULL )
+    {
+        for( i = 0; i < c->slot_count; i++ )
+        {
+            _Unified2Free(c->slots[i].data, UNIFIED2_ALLOC_BUFFER);
+        }
+        _Unified2Free(c->slots, UNIFIED2_ALLOC_BUFFER);
+    }
+
+    c->slots = slots;
+    c->slot_count = count;
+    c->current = NULL;
+
+    return 0;
+}
+
+/* Function: _Unified2CompressedOpen
+ *
+ * Purpose: Start reading an already opened container. Takes ownership of fd.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2CompressedOpen(Unified2 *u2, int fd)
+{
+    Unified2Compressed *c;
+    uint8_t header[HEADER_SIZE];
+    struct stat st;
+    uint32_t i;
+
+    if( fstat(fd, &st) == -1 || pread_all(fd, header, HEADER_SIZE, 0) == -1 ||
+        !_Unified2IsCompressed(header, HEADER_SIZE) ||
+        get32(header + 4) != CONTAINER_VERSION )
+    {
+        warn("Unified2ReadOpen: not a supported compressed container\n");
+        return UNIFIED2_ERROR;
+    }
+
+    c = (Unified2Compressed *)_Unified2Malloc(sizeof(Unified2Compressed),
+        UNIFIED2_ALLOC_HANDLE);
+    if( c == NULL )
+    {
+        warn("Unified2ReadOpen: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    memset(c, 0x0, sizeof(Unified2Compressed));
+
+    if( load_seek_table(c, fd, st.st_size) == -1 )
+    {
+        c->frame_count = 0;
+        c->total_size = 0;
+        if( scan_frames(c, fd, st.st_size) == -1 )
+        {
+            warn("Unified2ReadOpen: failed to index %s\n", u2->filename);
+            compressed_free(c);
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    /* Size the frame buffers for the largest frame actually present */
+    c->frame_size = 1;
+    for( i = 0; i < c->frame_count; i++ )
+    {
+        if( c->frames[i].raw_size > MAX_FRAME_SIZE )
+        {
+            warn("Unified2ReadOpen: corrupt seek table\n");
+            compressed_free(c);
+            return UNIFIED2_ERROR;
+        }
+        if( c->frames[i].raw_size > c->frame_size )
+        {
+            c->frame_size = c->frames[i].raw_size;
+        }
+    }
+
+    c->threads = 1;
+    if( alloc_slots(c, 2) == -1 )
+    {
+        warn("Unified2ReadOpen: failed to malloc: %s\n", strerror(errno));
+        compressed_free(c);
+        return UNIFIED2_ERROR;
+    }
+
+    u2->mode = COMPRESSED;
+    u2->fd = fd;
+    u2->compressed = c;
+
+    return UNIFIED2_OK;
+}
+
+typedef struct _DecompressJob {
+    int fd;
+    const Frame *frame;
+    uint8_t *dst;
+    int result;
+} DecompressJob;
+
+static void *decompress_job(void *arg)
+{
+    DecompressJob *job = arg;
+    uint8_t *packed;
+    uint32_t size = FRAME_HEADER_SIZE + job->frame->compressed_size;
+
+    job->result = -1;
+
+    packed = (uint8_t *)_Unified2Malloc(size, UNIFIED2_ALLOC_BUFFER);
+    if( packed == NULL )
+    {
+        return NULL;
+    }
+
+    if( pread_all(job->fd, packed, size, job->frame->offset) == 0 &&
+        memcmp(packed, FRAME_MAGIC, 4) == 0 &&
+        get32(packed + 12) == job->frame->raw_size )
+    {
+        job->result = codec_decompress(get32(packed + 4),
+            packed + FRAME_HEADER_SIZE, job->frame->compressed_size,
+            job->dst, job->frame->raw_size);
+    }
+
+    _Unified2Free(packed, UNIFIED2_ALLOC_BUFFER);
+
+    return NULL;
+}
+
+static FrameSlot *find_slot(Unified2Compressed *c, uint32_t frame)
+{
+    int i;
+
+    for( i = 0; i < c->slot_count; i++ )
+    {
+        if( c->slots[i].frame == frame )
+        {
+            return &c->slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Function: load_frame
+ *
+ * Purpose: Make frame the current one. With more than one thread configured
+ * the frames following it are decompressed at the same time, one per thread,
+ * so a sequential reader finds them ready.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint32_t
+ *
+ * Returns:
+ *      int
+ */
+static int load_frame(Unified2 *u2, uint32_t frame)
+{
+    Unified2Compressed *c = u2->compressed;
+    DecompressJob jobs[UNIFIED2_MAX_THREADS];
+    pthread_t threads[UNIFIED2_MAX_THREADS];
+    int started[UNIFIED2_MAX_THREADS];
+    FrameSlot *slot;
+    int count = 0;
+    int i, j, victim;
+    int r = 0;
+
+    slot = find_slot(c, frame);
+    if( slot != NULL )
+    {
+        slot->used = ++c->clock;
+        c->current = slot;
+        return 0;
+    }
+
+    /* Pick the frames to decompress and a slot for each, evicting the
+     * least recently used slots that are not part of this batch. */
+    for( i = 0; i < c->threads && frame + i < c->frame_count; i++ )
+    {
+        if( i > 0 && find_slot(c, frame + i) != NULL )
+        {
+            continue;
+        }
+
+        victim = -1;
+        for( j = 0; j < c->slot_count; j++ )
+        {
+            if( c->slots[j].frame >= frame &&
+                c->slots[j].frame < (int64_t)frame + c->threads )
+            {
+                continue;
+            }
+            if( victim == -1 || c->slots[j].used < c->slots[victim].used )
+            {
+                victim = j;
+            }
+        }
+
+        if( victim == -1 )
+        {
+            break;
+        }
+
+        c->slots[victim].frame = frame + i;
+        c->slots[victim].used = ++c->clock;
+        jobs[count].fd = u2->fd;
+        jobs[count].frame = &c->frames[frame + i];
+        jobs[count].dst = c->slots[victim].data;
+        count++;
+    }
+
+    for( i = 1; i < count; i++ )
+    {
+        started[i] = pthread_create(&threads[i], NULL, decompress_job,
+            &jobs[i]) == 0;
+        if( !started[i] )
+        {
+            decompress_job(&jobs[i]);
+        }
+    }
+
+    decompress_job(&jobs[0]);
+
+    for( i = 1; i < count; i++ )
+    {
+        if( started[i] )
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    for( i = 0; i < count; i++ )
+    {
+        if( jobs[i].result != 0 )
+        {
+            slot = find_slot(c, jobs[i].frame - c->frames);
+            slot->frame = -1;
+            if( i == 0 )
+            {
+                r = -1;
+            }
+        }
+    }
+
+    if( r == -1 )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, 0, 0);
+        c->current = NULL;
+        return -1;
+    }
+
+    c->current = find_slot(c, frame);
+
+    return 0;
+}
+
+/* Function: find_frame
+ *
+ * Purpose: Binary search the frame holding a logical offset
+ *
+ * Arguements:
+ *      Unified2Compressed *
+ *      uint64_t
+ *
+ * Returns:
+ *      uint32_t
+ */
+static uint32_t find_frame(Unified2Compressed *c, uint64_t position)
+{
+    uint32_t lo = 0;
+    uint32_t hi = c->frame_count;
+    uint32_t mid;
+
+    while( hi - lo > 1 )
+    {
+        mid = lo + (hi - lo) / 2;
+        if( c->frames[mid].raw_start <= position )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Function: _Unified2CompressedRead
+ *
+ * Purpose: Copy decompressed data out of the frames under the read position
+ *
+ * Arguements:
+ *      Unified2 *
+ *      void *
+ *      int
+ *
+ * Returns:
+ *      int         bytes read
+ */
+int _Unified2CompressedRead(Unified2 *u2, void *buf, int size)
+{
+    Unified2Compressed *c = u2->compressed;
+    const Frame *frame;
+    uint8_t *out = buf;
+    uint32_t index;
+    uint64_t offset;
+    uint64_t chunk;
+    int total = 0;
+
+    while( total < size && c->position < c->total_size )
+    {
+        if( c->current != NULL )
+        {
+            frame = &c->frames[c->current->frame];
+            if( c->position < frame->raw_start ||
+                c->position >= frame->raw_start + frame->raw_size )
+            {
+                c->current = NULL;
+            }
+        }
+
+        if( c->current == NULL )
+        {
+            index = find_frame(c, c->position);
+            if( load_frame(u2, index) == -1 )
+            {
+                break;
+            }
+        }
+
+        frame = &c->frames[c->current->frame];
+        offset = c->position - frame->raw_start;
+        chunk = frame->raw_size - offset;
+        if( chunk > (uint64_t)(size - total) )
+        {
+            chunk = size - total;
+        }
+
+        memcpy(out + total, c->current->data + offset, chunk);
+        total += chunk;
+        c->position += chunk;
+    }
+
+    return total;
+}
+
+/* Function: _Unified2CompressedSeek
+ *
+ * Purpose: Move the logical read position. Nothing is decompressed until the
+ * next read.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2CompressedSeek(Unified2 *u2, int offset, int whence)
+{
+    Unified2Compressed *c = u2->compressed;
+    int64_t position;
+
+    switch( whence )
+    {
+        case SEEK_SET:
+        position = offset;
+        break;
+
+        case SEEK_CUR:
+        position = (int64_t)c->position + offset;
+        break;
+
+        case SEEK_END:
+        position = (int64_t)c->total_size + offset;
+        break;
+
+        default:
+        return -1;
+    }
+
+    if( position < 0 || (uint64_t)position > c->total_size )
+    {
+        return -1;
+    }
+
+    c->position = position;
+
+    return 0;
+}
+
+/* Function: _Unified2CompressedTell
+ *
+ * Purpose: Return the logical read position
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      uint64_t
+ */
+uint64_t _Unified2CompressedTell(Unified2 *u2)
+{
+    return u2->compressed->position;
+}
+
+/* Function: _Unified2CompressedEof
+ *
+ * Purpose: Check whether the logical read position reached the end
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2CompressedEof(Unified2 *u2)
+{
+    return u2->compressed->position >= u2->compressed->total_size;
+}
+
+/* Function: Unified2SetDecompressThreads
+ *
+ * Purpose: Decompress up to threads frames at once when the reader moves on
+ * to a frame that is not cached yet.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SetDecompressThreads(Unified2 *u2, int threads)
+{
+    Unified2Compressed *c;
+
+    if( u2 == NULL || u2->mode != COMPRESSED || u2->compressed == NULL ||
+        u2->compressed->writing || threads < 1 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    c = u2->compressed;
+    if( threads > UNIFIED2_MAX_THREADS )
+    {
+        threads = UNIFIED2_MAX_THREADS;
+    }
+
+    if( alloc_slots(c, threads + 1) == -1 )
+    {
+        warn("Unified2SetDecompressThreads: failed to malloc: %s\n",
+        strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    c->threads = threads;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2CompressedClose
+ *
+ * Purpose: Finish a container (last frame and seek table when writing) and
+ * close it.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2CompressedClose(Unified2 *u2)
+{
+    Unified2Compressed *c = u2->compressed;
+    HRESULT r = UNIFIED2_OK;
+
+    if( c == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( c->writing )
+    {
+        pthread_mutex_lock(&c->lock);
+        if( flush_frame(u2) != UNIFIED2_OK ||
+            write_seek_table(u2) != UNIFIED2_OK )
+        {
+            warn("Unified2Free: failed to finish %s\n", u2->filename);
+            r = UNIFIED2_ERROR;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    close(u2->fd);
+    u2->fd = -1;
+    u2->compressed = NULL;
+    compressed_free(c);
+
+    return r;
+}
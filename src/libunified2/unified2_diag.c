@@ -0,0 +1,499 @@
+/*******************************************************************************
+ * Per-handle diagnostics.
+ *
+ * Problems a handle runs into while reading or writing, a skipped record, a
+ * truncated one, a failed write, are recorded here instead of printed. Each
+ * sets the handle's error code, see Unified2GetError(), and is counted against
+ * its code and record type. The first of a kind is reported right away; the
+ * ones that follow within the rate limit interval are only counted, and
+ * reported as one aggregate ("skipped 1.2M records of type 110") once the
+ * interval has passed or the handle is freed.
+ *
+ * Reports go to the most recent UNIFIED2_DIAG_RING entries of a ring that
+ * Unified2GetDiagnostics() reads, and to the callback given to
+ * Unified2SetDiagnostics(), if any. There is none by default, so a bad log
+ * costs a counter increment per record rather than a trip through stdio.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "unified2.h"
+
+/* Kinds of problem aggregated at once, the oldest is reported when full */
+#define DIAG_KINDS 16
+
+/* Default rate limit interval */
+#define DIAG_INTERVAL 1000
+
+typedef struct _DiagKind {
+    UNIFIED2_DIAG code;
+    uint32_t type;
+    int err;
+    uint64_t offset;        /* of the first one not yet reported */
+    uint64_t pending;       /* counted, not yet reported */
+    uint64_t reported;      /* when it was last reported, 0 never */
+} DiagKind;
+
+struct _Unified2Diagnostics {
+    Unified2DiagFunc func;
+    void *arg;
+    uint64_t interval;      /* nanoseconds */
+
+    DiagKind kinds[DIAG_KINDS];
+    int nkinds;
+
+    Unified2Diag ring[UNIFIED2_DIAG_RING];
+    uint64_t ring_next;
+};
+
+static const char *descriptions[UNIFIED2_DIAGS] = {
+    "no error",
+    "record skipped",
+    "record too short",
+    "truncated record",
+    "bogus record length",
+    "invalid argument",
+    "write failed",
+    "out of memory",
+};
+
+/* Function: diag_state
+ *
+ * Purpose: Get a handle's diagnostics, allocating them on first use
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      Unified2Diagnostics *
+ */
+static Unified2Diagnostics *diag_state(Unified2 *u2)
+{
+    if( u2->diag == NULL )
+    {
+        u2->diag = (Unified2Diagnostics *)_Unified2Calloc(
+            1, sizeof(Unified2Diagnostics), UNIFIED2_ALLOC_HANDLE);
+        if( u2->diag != NULL )
+        {
+            u2->diag->interval = DIAG_INTERVAL * 1000000ULL;
+        }
+    }
+
+    return u2->diag;
+}
+
+/* Function: format_count
+ *
+ * Purpose: Shorten large counts to 1.2k, 3.4M and 5.6G
+ *
+ * Arguements:
+ *      char *
+ *      size_t
+ *      uint64_t
+ *
+ * Returns:
+ *      void
+ */
+static void format_count(char *buf, size_t size, uint64_t count)
+{
+    static const char suffixes[] = "kMGT";
+    double value = count;
+    int i = -1;
+
+    if( count < 10000 )
+    {
+        snprintf(buf, size, "%llu", (unsigned long long)count);
+        return;
+    }
+
+    while( value >= 1000.0 && i < 3 )
+    {
+        value /= 1000.0;
+        i++;
+    }
+
+    snprintf(buf, size, "%.1f%c", value, suffixes[i]);
+}
+
+/* Function: describe
+ *
+ * Purpose: Write the message of a report
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Diag *
+ *
+ * Returns:
+ *      void
+ */
+static void describe(Unified2 *u2, Unified2Diag *d)
+{
+    char count[32];
+    char *p = d->message;
+    size_t left = sizeof(d->message);
+    int n;
+
+    format_count(count, sizeof(count), d->count);
+
+    n = snprintf(p, left, "%s: ", u2->filename ? u2->filename : "unified2");
+    if( n > 0 && (size_t)n < left )
+    {
+        p += n;
+        left -= n;
+    }
+
+    switch( d->code )
+    {
+        case UNIFIED2_DIAG_SKIPPED:
+        if( d->count == 1 )
+            n = snprintf(p, left, "skipped a record of type %u", d->type);
+        else
+            n = snprintf(p, left, "skipped %s records of type %u", count, d->type);
+        break;
+
+        case UNIFIED2_DIAG_SHORT_RECORD:
+        case UNIFIED2_DIAG_TRUNCATED:
+        case UNIFIED2_DIAG_BAD_LENGTH:
+        case UNIFIED2_DIAG_INVALID:
+        if( d->count == 1 )
+            n = snprintf(p, left, "%s, type %u", descriptions[d->code], d->type);
+        else
+            n = snprintf(p, left, "%s times %s, type %u", count,
+                descriptions[d->code], d->type);
+        break;
+
+        default:
+        if( d->count == 1 )
+            n = snprintf(p, left, "%s", descriptions[d->code]);
+        else
+            n = snprintf(p, left, "%s times %s", count, descriptions[d->code]);
+        break;
+    }
+
+    if( n > 0 && (size_t)n < left )
+    {
+        p += n;
+        left -= n;
+    }
+
+    if( d->count == 1 && d->code != UNIFIED2_DIAG_WRITE )
+    {
+        n = snprintf(p, left, " at offset %llu", (unsigned long long)d->offset);
+        if( n > 0 && (size_t)n < left )
+        {
+            p += n;
+            left -= n;
+        }
+    }
+
+    if( d->err )
+    {
+        snprintf(p, left, ": %s", strerror(d->err));
+    }
+}
+
+/* Function: report
+ *
+ * Purpose: Report what a kind has pending, to the ring and the callback
+ *
+ * Arguements:
+ *      Unified2 *
+ *      DiagKind *
+ *      uint64_t        now
+ *
+ * Returns:
+ *      void
+ */
+static void report(Unified2 *u2, DiagKind *kind, uint64_t now)
+{
+    Unified2Diagnostics *diag = u2->diag;
+    Unified2Diag *d;
+
+    d = &diag->ring[diag->ring_next++ % UNIFIED2_DIAG_RING];
+    d->code = kind->code;
+    d->type = kind->type;
+    d->err = kind->err;
+    d->offset = kind->offset;
+    d->count = kind->pending;
+    d->time = now;
+    describe(u2, d);
+
+    kind->pending = 0;
+    kind->reported = now;
+
+    if( diag->func != NULL )
+    {
+        diag->func(d, diag->arg);
+    }
+}
+
+/* Function: _Unified2Diag
+ *
+ * Purpose: Record a problem with a handle
+ *
+ * Arguements:
+ *      Unified2 *
+ *      UNIFIED2_DIAG
+ *      uint32_t        record type, 0 when there is none
+ *      int             errno, 0 when there is none
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2Diag(Unified2 *u2, UNIFIED2_DIAG code, uint32_t type, int err)
+{
+    Unified2Diagnostics *diag;
+    DiagKind *kind = NULL;
+    uint64_t now;
+    int oldest = 0;
+    int i;
+
+    u2->error = code;
+
+    diag = diag_state(u2);
+    if( diag == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < diag->nkinds; i++ )
+    {
+        if( diag->kinds[i].code == code && diag->kinds[i].type == type )
+        {
+            kind = &diag->kinds[i];
+            break;
+        }
+
+        if( diag->kinds[i].reported < diag->kinds[oldest].reported )
+        {
+            oldest = i;
+        }
+    }
+
+    now = _Unified2Now();
+
+    if( kind == NULL )
+    {
+        if( diag->nkinds < DIAG_KINDS )
+        {
+            kind = &diag->kinds[diag->nkinds++];
+        }
+        else
+        {
+            kind = &diag->kinds[oldest];
+            if( kind->pending )
+            {
+                report(u2, kind, now);
+            }
+        }
+
+        memset(kind, 0x0, sizeof(DiagKind));
+        kind->code = code;
+        kind->type = type;
+    }
+
+    if( kind->pending == 0 )
+    {
+        kind->offset = u2->offset;
+    }
+    kind->err = err;
+    kind->pending++;
+
+    if( kind->reported == 0 || now - kind->reported >= diag->interval )
+    {
+        report(u2, kind, now);
+    }
+}
+
+/* Function: Unified2SetDiagnostics
+ *
+ * Purpose: Have a handle's diagnostics reported to a callback, at most one
+ * report per kind of problem every interval milliseconds. Unified2DiagStderr
+ * prints them.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2DiagFunc    NULL for none
+ *      void *              passed to the callback
+ *      uint32_t            interval, 0 to report every single problem
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SetDiagnostics(Unified2 *u2, Unified2DiagFunc func, void *arg,
+    uint32_t interval)
+{
+    Unified2Diagnostics *diag;
+
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    diag = diag_state(u2);
+    if( diag == NULL )
+    {
+        warn("Unified2SetDiagnostics: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    diag->func = func;
+    diag->arg = arg;
+    diag->interval = interval * 1000000ULL;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2FlushDiagnostics
+ *
+ * Purpose: Report everything counted but not yet reported, regardless of the
+ * rate limit. Unified2Free() does this.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FlushDiagnostics(Unified2 *u2)
+{
+    uint64_t now;
+    int i;
+
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( u2->diag == NULL )
+    {
+        return UNIFIED2_OK;
+    }
+
+    now = _Unified2Now();
+    for( i = 0; i < u2->diag->nkinds; i++ )
+    {
+        if( u2->diag->kinds[i].pending )
+        {
+            report(u2, &u2->diag->kinds[i], now);
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2GetDiagnostics
+ *
+ * Purpose: Copy out the most recent reports, oldest first
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Diag *
+ *      int             room in the array
+ *
+ * Returns:
+ *      int             reports copied
+ */
+int Unified2GetDiagnostics(Unified2 *u2, Unified2Diag *diags, int max)
+{
+    Unified2Diagnostics *diag;
+    uint64_t first;
+    int n = 0;
+
+    if( u2 == NULL || diags == NULL || max <= 0 || u2->diag == NULL )
+    {
+        return 0;
+    }
+
+    diag = u2->diag;
+    first = diag->ring_next > UNIFIED2_DIAG_RING ?
+        diag->ring_next - UNIFIED2_DIAG_RING : 0;
+    if( diag->ring_next - first > (uint64_t)max )
+    {
+        first = diag->ring_next - max;
+    }
+
+    while( first < diag->ring_next )
+    {
+        diags[n++] = diag->ring[first++ % UNIFIED2_DIAG_RING];
+    }
+
+    return n;
+}
+
+/* Function: Unified2GetError
+ *
+ * Purpose: The last problem a handle ran into
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      UNIFIED2_DIAG
+ */
+UNIFIED2_DIAG Unified2GetError(Unified2 *u2)
+{
+    return u2 != NULL ? u2->error : UNIFIED2_DIAG_INVALID;
+}
+
+/* Function: Unified2Strerror
+ *
+ * Purpose: Describe a diagnostic code
+ *
+ * Arguements:
+ *      UNIFIED2_DIAG
+ *
+ * Returns:
+ *      const char *
+ */
+const char * Unified2Strerror(UNIFIED2_DIAG code)
+{
+    if( code < 0 || code >= UNIFIED2_DIAGS )
+    {
+        return "unknown error";
+    }
+
+    return descriptions[code];
+}
+
+/* Function: Unified2DiagStderr
+ *
+ * Purpose: A diagnostics callback that prints each report on stderr
+ *
+ * Arguements:
+ *      const Unified2Diag *
+ *      void *          unused
+ *
+ * Returns:
+ *      void
+ */
+void Unified2DiagStderr(const Unified2Diag *diag, void *arg)
+{
+    fprintf(stderr, "%s\n", diag->message);
+}
+
+/* Function: _Unified2DiagFree
+ *
+ * Purpose: Report what is pending and release a handle's diagnostics
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2DiagFree(Unified2 *u2)
+{
+    Unified2FlushDiagnostics(u2);
+
+    _Unified2Free(u2->diag, UNIFIED2_ALLOC_HANDLE);
+    u2->diag = NULL;
+}
@@ -0,0 +1,465 @@
+/*******************************************************************************
+ * Preallocated, direct I/O writer.
+ *
+ * Many small appends through the page cache fragment files and push other
+ * sensors' data out of memory. This writer instead:
+ *
+ *  - reserves disk space an extent at a time with fallocate() ahead of the
+ *    data, so files stay contiguous;
+ *  - stages writes in two aligned buffers; while the caller fills one, a
+ *    flusher thread writes the other with O_DIRECT, bypassing the page cache;
+ *  - on close writes the final partial block padded to the alignment and
+ *    truncates the file back to its logical length.
+ *
+ * Filesystems that refuse O_DIRECT (tmpfs, some network filesystems) still get
+ * the preallocation and large aligned writes, just through the page cache.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "unified2.h"
+
+#define DIRECT_ALIGNMENT    4096
+#define DIRECT_BUFFER_SIZE  (1 << 20)
+#define DIRECT_EXTENT_SIZE  (64 << 20)
+
+struct _Unified2DirectWriter {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t flusher;
+
+    uint8_t *buffers[2];
+    size_t buffer_size;
+    size_t alignment;
+
+    /* buffer being filled by the caller and where it lands in the file */
+    int active;
+    size_t fill;
+    uint64_t offset;
+
+    /* buffer handed to the flusher thread */
+    int inflight;
+    int queued;
+    uint64_t queued_offset;
+
+    uint64_t allocated;
+    uint64_t extent;
+    int preallocate;
+
+    int stopping;
+    int error;
+};
+
+static int pwrite_all(int fd, const uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t r;
+    size_t total = 0;
+
+    while( total < len )
+    {
+        r = pwrite(fd, buf + total, len - total, offset + total);
+        if( r > 0 )
+            total += r;
+        else if( r == 0 || errno != EINTR )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Function: reserve
+ *
+ * Purpose: Make sure the file has space allocated up to end, growing it a
+ * whole extent at a time. Filesystems without fallocate just skip this.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2DirectWriter *
+ *      uint64_t
+ *
+ * Returns:
+ *      void
+ */
+static void reserve(Unified2 *u2, Unified2DirectWriter *dw, uint64_t end)
+{
+#ifdef HAVE_FALLOCATE
+    uint64_t want;
+
+    if( !dw->preallocate || end <= dw->allocated )
+    {
+        return;
+    }
+
+    want = ((end + dw->extent - 1) / dw->extent) * dw->extent;
+    if( fallocate(u2->fd, FALLOC_FL_KEEP_SIZE, dw->allocated,
+        want - dw->allocated) == -1 )
+    {
+        /* EOPNOTSUPP and friends: carry on without preallocation */
+        dw->preallocate = 0;
+        return;
+    }
+
+    dw->allocated = want;
+#endif
+}
+
+/* Function: flusher_thread
+ *
+ * Purpose: Write out every full buffer the caller hands over.
+ *
+ * Arguements:
+ *      void *      Unified2 *
+ *
+ * Returns:
+ *      void *
+ */
+static void *flusher_thread(void *arg)
+{
+    Unified2 *u2 = arg;
+    Unified2DirectWriter *dw = u2->direct;
+    uint64_t offset;
+    int index;
+    int r;
+
+    pthread_mutex_lock(&dw->lock);
+    for( ;; )
+    {
+        while( dw->queued == -1 && !dw->stopping )
+        {
+            pthread_cond_wait(&dw->cond, &dw->lock);
+        }
+
+        if( dw->queued == -1 )
+        {
+            break;
+        }
+
+        index = dw->queued;
+        offset = dw->queued_offset;
+        dw->queued = -1;
+        pthread_mutex_unlock(&dw->lock);
+
+        reserve(u2, dw, offset + dw->buffer_size);
+        r = pwrite_all(u2->fd, dw->buffers[index], dw->buffer_size, offset);
+
+        pthread_mutex_lock(&dw->lock);
+        if( r == -1 && !dw->error )
+        {
+            dw->error = errno;
+        }
+        dw->inflight = 0;
+        pthread_cond_broadcast(&dw->cond);
+    }
+    pthread_mutex_unlock(&dw->lock);
+
+    return NULL;
+}
+
+/* Function: wait_idle
+ *
+ * Purpose: Wait, with the lock held, until the flusher has no buffer.
+ *
+ * Arguements:
+ *      Unified2DirectWriter *
+ *
+ * Returns:
+ *      void
+ */
+static void wait_idle(Unified2DirectWriter *dw)
+{
+    while( dw->inflight )
+    {
+        pthread_cond_wait(&dw->cond, &dw->lock);
+    }
+}
+
+static void direct_writer_free(Unified2DirectWriter *dw)
+{
+    /* posix_memalign()ed, the allocator hooks can not promise alignment */
+    free(dw->buffers[0]);
+    free(dw->buffers[1]);
+    pthread_cond_destroy(&dw->cond);
+    pthread_mutex_destroy(&dw->lock);
+    _Unified2Free(dw, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: Unified2WriteOpenDirect
+ *
+ * Purpose: Open a file for high rate writing: space is preallocated extent
+ * bytes at a time (0 for the default of 64MB) and data is written in large
+ * aligned blocks with O_DIRECT from a double buffered staging area.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      char *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2WriteOpenDirect(Unified2 *unified2, char *filename, int extent)
+{
+    Unified2DirectWriter *dw;
+    struct stat st;
+    int flags = O_WRONLY|O_CREAT|O_TRUNC;
+    int i;
+
+    if( unified2 == NULL || filename == NULL || extent < 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+#ifdef O_DIRECT
+    unified2->fd = open(filename, flags|O_DIRECT, 0644);
+    if( unified2->fd == -1 && errno == EINVAL )
+#endif
+    {
+        unified2->fd = open(filename, flags, 0644);
+    }
+
+    if( unified2->fd == -1 )
+    {
+        warn("Unified2WriteOpenDirect: failed to open the file %s: %s\n",
+        filename, strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+#ifdef F_NOCACHE
+    fcntl(unified2->fd, F_NOCACHE, 1);
+#endif
+
+    dw = (Unified2DirectWriter *)_Unified2Malloc(sizeof(Unified2DirectWriter),
+        UNIFIED2_ALLOC_HANDLE);
+    if( dw == NULL )
+    {
+        warn("Unified2WriteOpenDirect: failed to malloc: %s\n", strerror(errno));
+        close(unified2->fd);
+        unified2->fd = -1;
+        return UNIFIED2_ERROR;
+    }
+    memset(dw, 0x0, sizeof(Unified2DirectWriter));
+
+    /* Honour larger device blocks, O_DIRECT needs the whole transfer aligned */
+    dw->alignment = DIRECT_ALIGNMENT;
+    if( fstat(unified2->fd, &st) == 0 && st.st_blksize > DIRECT_ALIGNMENT &&
+        st.st_blksize <= DIRECT_BUFFER_SIZE &&
+        (st.st_blksize & (st.st_blksize - 1)) == 0 )
+    {
+        dw->alignment = st.st_blksize;
+    }
+
+    dw->buffer_size = DIRECT_BUFFER_SIZE;
+    dw->extent = extent ? extent : DIRECT_EXTENT_SIZE;
+    dw->extent = ((dw->extent + dw->buffer_size - 1) / dw->buffer_size) *
+        dw->buffer_size;
+    dw->preallocate = 1;
+    dw->queued = -1;
+    pthread_mutex_init(&dw->lock, NULL);
+    pthread_cond_init(&dw->cond, NULL);
+
+    for( i = 0; i < 2; i++ )
+    {
+        if( posix_memalign((void **)&dw->buffers[i], dw->alignment,
+            dw->buffer_size) != 0 )
+        {
+            warn("Unified2WriteOpenDirect: failed to allocate staging buffers\n");
+            direct_writer_free(dw);
+            close(unified2->fd);
+            unified2->fd = -1;
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    unified2->direct = dw;
+    if( pthread_create(&dw->flusher, NULL, flusher_thread, unified2) != 0 )
+    {
+        warn("Unified2WriteOpenDirect: failed to start the flusher thread\n");
+        unified2->direct = NULL;
+        direct_writer_free(dw);
+        close(unified2->fd);
+        unified2->fd = -1;
+        return UNIFIED2_ERROR;
+    }
+
+    unified2->mode = DIRECT;
+    unified2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2DirectWrite
+ *
+ * Purpose: Copy data into the staging area, handing full buffers to the
+ * flusher thread.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int         bytes accepted, or UNIFIED2_ERROR
+ */
+int _Unified2DirectWrite(Unified2 *unified2, const void *buf, int size)
+{
+    Unified2DirectWriter *dw = unified2->direct;
+    const uint8_t *data = buf;
+    size_t left = size;
+    size_t chunk;
+
+    pthread_mutex_lock(&dw->lock);
+
+    /* Reported, rate limited, by the caller */
+    if( dw->error )
+    {
+        pthread_mutex_unlock(&dw->lock);
+        errno = dw->error;
+        return UNIFIED2_ERROR;
+    }
+
+    while( left )
+    {
+        chunk = dw->buffer_size - dw->fill;
+        if( chunk > left )
+        {
+            chunk = left;
+        }
+
+        memcpy(dw->buffers[dw->active] + dw->fill, data, chunk);
+        dw->fill += chunk;
+        data += chunk;
+        left -= chunk;
+
+        if( dw->fill == dw->buffer_size )
+        {
+            /* The other buffer must be on disk before we refill it */
+            wait_idle(dw);
+
+            dw->inflight = 1;
+            dw->queued = dw->active;
+            dw->queued_offset = dw->offset;
+            pthread_cond_broadcast(&dw->cond);
+
+            dw->active ^= 1;
+            dw->offset += dw->buffer_size;
+            dw->fill = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&dw->lock);
+
+    return size;
+}
+
+/* Function: _Unified2DirectFlush
+ *
+ * Purpose: Put everything staged so far on disk. The partial last block is
+ * written zero padded and stays in the staging buffer, to be rewritten once
+ * more data arrives.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_ERROR with errno set, for the caller to report
+ */
+HRESULT _Unified2DirectFlush(Unified2 *unified2)
+{
+    Unified2DirectWriter *dw = unified2->direct;
+    size_t padded;
+    HRESULT r = UNIFIED2_OK;
+
+    if( dw == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_lock(&dw->lock);
+    wait_idle(dw);
+
+    if( dw->fill )
+    {
+        padded = ((dw->fill + dw->alignment - 1) / dw->alignment) * dw->alignment;
+        memset(dw->buffers[dw->active] + dw->fill, 0x0, padded - dw->fill);
+
+        reserve(unified2, dw, dw->offset + dw->buffer_size);
+        if( pwrite_all(unified2->fd, dw->buffers[dw->active], padded,
+            dw->offset) == -1 && !dw->error )
+        {
+            dw->error = errno;
+        }
+    }
+
+    if( dw->error )
+    {
+        errno = dw->error;
+        r = UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_unlock(&dw->lock);
+
+    return r;
+}
+
+/* Function: _Unified2DirectClose
+ *
+ * Purpose: Flush, stop the flusher thread, trim the preallocated tail and
+ * padding off the file and close it.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2DirectClose(Unified2 *unified2)
+{
+    Unified2DirectWriter *dw = unified2->direct;
+    HRESULT r;
+
+    if( dw == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    r = _Unified2DirectFlush(unified2);
+    if( r != UNIFIED2_OK )
+    {
+        warn("Unified2Free: failed to finish %s: %s\n", unified2->filename,
+        strerror(errno));
+    }
+
+    pthread_mutex_lock(&dw->lock);
+    dw->stopping = 1;
+    pthread_cond_broadcast(&dw->cond);
+    pthread_mutex_unlock(&dw->lock);
+    pthread_join(dw->flusher, NULL);
+
+    if( ftruncate(unified2->fd, dw->offset + dw->fill) == -1 )
+    {
+        warn("Unified2WriteOpenDirect: failed to truncate %s: %s\n",
+        unified2->filename, strerror(errno));
+        r = UNIFIED2_ERROR;
+    }
+
+    close(unified2->fd);
+    unified2->fd = -1;
+    unified2->direct = NULL;
+    direct_writer_free(dw);
+
+    return r;
+}
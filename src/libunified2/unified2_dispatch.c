@@ -0,0 +1,1511 @@
+/*******************************************************************************
+ * One read pass, many outputs.
+ *
+ * A dispatcher reads a log once and hands every record to each of its sinks:
+ * formatters, unified2 writers, pcap writers, summaries or any callback. A
+ * record is read raw, decoded once into inline storage (see unified2_record.c)
+ * and given to all sinks as the same immutable entry, together with the
+ * record as stored for the sinks that work on that.
+ *
+ * Before any sink sees a record it goes through the stages, in the order they
+ * were added: filters, sampling, or callbacks that enrich or correlate. Stages
+ * run in the reading thread and see every record in order, so they can keep
+ * state; each may drop the record. Each sink can also be given a filter of its
+ * own and then only sees what matches. As with u2filter, packets and extra
+ * data go where their event went.
+ *
+ * Sinks either run in the reading thread or on a pool of worker threads.
+ * Records travel in batches through a fixed ring, as in unified2_parallel.c,
+ * and a batch is refilled only once every threaded sink is done with it, so
+ * memory stays bounded and the slowest sink sets the pace. A sink keeps its
+ * order, one batch at a time, but workers take whatever sink has a batch
+ * waiting. Formatters are the exception: any number of workers format their
+ * batches at once into buffers of the batch, and whoever finishes the oldest
+ * one writes out all that are ready in order, so the output is the same as
+ * formatting one record after the other.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "unified2.h"
+
+#define DISPATCH_SINKS      16      /* one bit each in Slot.skip */
+#define DISPATCH_STAGES     16
+#define DISPATCH_BATCHES    8       /* at least, two per worker beyond that */
+#define DISPATCH_RECORDS    256
+#define DISPATCH_OUTPUT     (64 << 10)
+#define DISPATCH_VERDICTS   4096    /* events remembered for their packets */
+
+typedef struct _Slot {
+    uint8_t *raw;               /* the record as stored */
+    uint32_t raw_size;
+    uint32_t length;
+    uint8_t *extra;             /* extra data records, decoded in place */
+    uint32_t extra_size;
+    uint32_t skip;              /* sinks whose filter did not match */
+    Unified2Record record;
+    Unified2Entry entry;        /* points into record */
+} Slot;
+
+typedef struct _DispatchBatch {
+    int count;
+    int pending;                /* threaded sinks not done with it yet */
+    uint32_t formatted;         /* formatters whose output is ready */
+    Unified2Buffer output[DISPATCH_SINKS];
+    Slot slots[DISPATCH_RECORDS];
+} DispatchBatch;
+
+typedef struct _EventVerdict {
+    uint32_t sensor_id;
+    uint32_t event_id;
+    int seen;
+    int match;
+} EventVerdict;
+
+typedef struct _Stage {
+    Unified2StageFunc func;
+    void *arg;
+
+    /* the built in stages */
+    const Unified2Filter *filter;
+    EventVerdict *verdicts;
+    uint32_t every;
+    uint32_t seen;
+} Stage;
+
+typedef struct _Sink {
+    Unified2SinkFunc func;
+    void *arg;
+    const Unified2Filter *filter;
+    EventVerdict *verdicts;
+    int threaded;
+    int parallel;               /* a formatter, batches in any order */
+    int busy;                   /* a worker has a batch of it */
+    uint64_t next;              /* sequence of the next batch to take */
+    uint64_t next_flush;        /* formatters: next batch to write out */
+    int flushing;
+
+    /* what the built in sinks write to */
+    Unified2FormatFunc format;
+    void *target;
+} Sink;
+
+struct _Unified2Dispatcher {
+    Sink sinks[DISPATCH_SINKS];
+    int nsinks;
+    int nthreaded;
+
+    Stage stages[DISPATCH_STAGES];
+    int nstages;
+
+    int threads;                /* workers, 0 for one per threaded sink */
+
+    DispatchBatch *batches;
+    int nbatches;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* workers wait for a batch to take */
+    pthread_cond_t freed;       /* reader waits for a batch to refill */
+
+    uint64_t next_fill;         /* sequence of the next batch to read */
+    int done;                   /* reader has queued its last batch */
+    int failed;                 /* a sink failed, everybody stops */
+};
+
+/* Function: Unified2DispatcherNew
+ *
+ * Purpose: Allocate a dispatcher without sinks
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      Unified2Dispatcher *
+ */
+Unified2Dispatcher * Unified2DispatcherNew()
+{
+    Unified2Dispatcher *d;
+
+    d = (Unified2Dispatcher *)_Unified2Calloc(1, sizeof(Unified2Dispatcher),
+        UNIFIED2_ALLOC_HANDLE);
+    if( d == NULL )
+    {
+        warn("Unified2DispatcherNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->work, NULL);
+    pthread_cond_init(&d->freed, NULL);
+
+    return d;
+}
+
+/* Function: free_batches
+ *
+ * Purpose: Release the batch ring
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *
+ * Returns:
+ *      void
+ */
+static void free_batches(Unified2Dispatcher *d)
+{
+    DispatchBatch *batch;
+    int i, j;
+
+    if( d->batches == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < d->nbatches; i++ )
+    {
+        batch = &d->batches[i];
+        for( j = 0; j < DISPATCH_RECORDS; j++ )
+        {
+            _Unified2Free(batch->slots[j].raw, UNIFIED2_ALLOC_BUFFER);
+            _Unified2Free(batch->slots[j].extra, UNIFIED2_ALLOC_BUFFER);
+        }
+        for( j = 0; j < DISPATCH_SINKS; j++ )
+        {
+            if( batch->output[j].data != NULL )
+            {
+                Unified2BufferFree(&batch->output[j]);
+            }
+        }
+    }
+
+    _Unified2Free(d->batches, UNIFIED2_ALLOC_BUFFER);
+    d->batches = NULL;
+    d->nbatches = 0;
+}
+
+/* Function: Unified2DispatcherFree
+ *
+ * Purpose: Release a dispatcher. What its sinks write to is left alone.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2DispatcherFree(Unified2Dispatcher *d)
+{
+    int i;
+
+    if( d == NULL )
+    {
+        return;
+    }
+
+    free_batches(d);
+
+    for( i = 0; i < d->nsinks; i++ )
+    {
+        _Unified2Free(d->sinks[i].verdicts, UNIFIED2_ALLOC_ANALYSIS);
+    }
+
+    for( i = 0; i < d->nstages; i++ )
+    {
+        _Unified2Free(d->stages[i].verdicts, UNIFIED2_ALLOC_ANALYSIS);
+    }
+
+    pthread_cond_destroy(&d->freed);
+    pthread_cond_destroy(&d->work);
+    pthread_mutex_destroy(&d->lock);
+    _Unified2Free(d, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: Unified2DispatcherThreads
+ *
+ * Purpose: Set how many workers run the threaded sinks. By default there is
+ * one per threaded sink; more only help formatters, which any number of
+ * workers can share.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      int             0 for one per threaded sink, negative for one per CPU
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2DispatcherThreads(Unified2Dispatcher *d, int threads)
+{
+    if( d == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( threads < 0 )
+    {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if( threads > UNIFIED2_MAX_THREADS )
+    {
+        threads = UNIFIED2_MAX_THREADS;
+    }
+
+    d->threads = threads;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2DispatcherAdd
+ *
+ * Purpose: Add a sink that gets every record: the decoded entry, which it
+ * must not change or keep, and the record as stored, header included
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2SinkFunc
+ *      void *          passed to the sink
+ *      int             UNIFIED2_SINK_THREAD to run it on a worker
+ *
+ * Returns:
+ *      int             the sink, -1 on error
+ */
+int Unified2DispatcherAdd(Unified2Dispatcher *d, Unified2SinkFunc func,
+    void *arg, int flags)
+{
+    Sink *sink;
+
+    if( d == NULL || func == NULL )
+    {
+        return -1;
+    }
+
+    if( d->nsinks == DISPATCH_SINKS )
+    {
+        warn("Unified2DispatcherAdd: at most %d sinks\n", DISPATCH_SINKS);
+        return -1;
+    }
+
+    sink = &d->sinks[d->nsinks];
+    memset(sink, 0x0, sizeof(Sink));
+    sink->func = func;
+    sink->arg = arg;
+    sink->threaded = (flags & UNIFIED2_SINK_THREAD) != 0;
+
+    if( sink->threaded )
+    {
+        d->nthreaded++;
+    }
+
+    return d->nsinks++;
+}
+
+static HRESULT sink_format(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Sink *sink = arg;
+
+    return sink->format((Unified2Buffer *)sink->target, entry);
+}
+
+static HRESULT sink_writer(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Sink *sink = arg;
+
+    if( Unified2Write((Unified2 *)sink->target, (void *)record, length) !=
+        (int)length )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+static HRESULT sink_pcap(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Sink *sink = arg;
+
+    if( entry->packet == NULL )
+    {
+        return UNIFIED2_OK;
+    }
+
+    return Unified2PcapWritePacket((Unified2PcapWriter *)sink->target,
+        entry->packet, entry->packet_data);
+}
+
+static HRESULT sink_summary(const Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Sink *sink = arg;
+
+    if( Unified2SummaryAdd((Unified2Summary *)sink->target, record, length) ==
+        UNIFIED2_ERROR )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: add_builtin
+ *
+ * Purpose: Add one of the sinks below, which get their own Sink as argument
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2SinkFunc
+ *      void *          what it writes to
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+static int add_builtin(Unified2Dispatcher *d, Unified2SinkFunc func,
+    void *target, int flags)
+{
+    int id;
+
+    if( target == NULL )
+    {
+        return -1;
+    }
+
+    id = Unified2DispatcherAdd(d, func, NULL, flags);
+    if( id != -1 )
+    {
+        d->sinks[id].arg = &d->sinks[id];
+        d->sinks[id].target = target;
+    }
+
+    return id;
+}
+
+/* Function: Unified2DispatcherAddFormat
+ *
+ * Purpose: Add a sink that formats every record into a buffer, e.g. with
+ * Unified2FormatCsv. Flushing and freeing the buffer is up to the caller.
+ * Threaded, it is formatted by as many workers as are free.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2FormatFunc
+ *      Unified2Buffer *
+ *      int
+ *
+ * Returns:
+ *      int             the sink, -1 on error
+ */
+int Unified2DispatcherAddFormat(Unified2Dispatcher *d, Unified2FormatFunc format,
+    Unified2Buffer *buffer, int flags)
+{
+    int id;
+
+    if( format == NULL )
+    {
+        return -1;
+    }
+
+    id = add_builtin(d, sink_format, buffer, flags);
+    if( id != -1 )
+    {
+        d->sinks[id].format = format;
+        d->sinks[id].parallel = d->sinks[id].threaded;
+    }
+
+    return id;
+}
+
+/* Function: Unified2DispatcherAddWriter
+ *
+ * Purpose: Add a sink that writes every record, as it was stored, to a handle
+ * opened for writing
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2 *
+ *      int
+ *
+ * Returns:
+ *      int             the sink, -1 on error
+ */
+int Unified2DispatcherAddWriter(Unified2Dispatcher *d, Unified2 *writer,
+    int flags)
+{
+    return add_builtin(d, sink_writer, writer, flags);
+}
+
+/* Function: Unified2DispatcherAddPcap
+ *
+ * Purpose: Add a sink that writes every packet to a capture file
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2PcapWriter *
+ *      int
+ *
+ * Returns:
+ *      int             the sink, -1 on error
+ */
+int Unified2DispatcherAddPcap(Unified2Dispatcher *d, Unified2PcapWriter *pcap,
+    int flags)
+{
+    return add_builtin(d, sink_pcap, pcap, flags);
+}
+
+/* Function: Unified2DispatcherAddSummary
+ *
+ * Purpose: Add a sink that counts every record into a summary
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2Summary *
+ *      int
+ *
+ * Returns:
+ *      int             the sink, -1 on error
+ */
+int Unified2DispatcherAddSummary(Unified2Dispatcher *d, Unified2Summary *s,
+    int flags)
+{
+    return add_builtin(d, sink_summary, s, flags);
+}
+
+/* Function: new_verdicts
+ *
+ * Purpose: Allocate the event verdicts of a filter or sampler
+ *
+ * Arguements:
+ *      EventVerdict **
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT new_verdicts(EventVerdict **verdicts)
+{
+    if( *verdicts != NULL )
+    {
+        return UNIFIED2_OK;
+    }
+
+    *verdicts = (EventVerdict *)_Unified2Calloc(DISPATCH_VERDICTS,
+        sizeof(EventVerdict), UNIFIED2_ALLOC_ANALYSIS);
+    if( *verdicts == NULL )
+    {
+        warn("Unified2Dispatcher: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2DispatcherFilter
+ *
+ * Purpose: Only give a sink the records a filter matches
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      int                     the sink
+ *      const Unified2Filter *  NULL for all records
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2DispatcherFilter(Unified2Dispatcher *d, int id,
+    const Unified2Filter *filter)
+{
+    Sink *sink;
+
+    if( d == NULL || id < 0 || id >= d->nsinks )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    sink = &d->sinks[id];
+    if( filter != NULL && new_verdicts(&sink->verdicts) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    sink->filter = filter;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: add_stage
+ *
+ * Purpose: Append a stage
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *
+ * Returns:
+ *      Stage *
+ */
+static Stage *add_stage(Unified2Dispatcher *d)
+{
+    Stage *stage;
+
+    if( d == NULL )
+    {
+        return NULL;
+    }
+
+    if( d->nstages == DISPATCH_STAGES )
+    {
+        warn("Unified2DispatcherStage: at most %d stages\n", DISPATCH_STAGES);
+        return NULL;
+    }
+
+    stage = &d->stages[d->nstages++];
+    memset(stage, 0x0, sizeof(Stage));
+
+    return stage;
+}
+
+/* Function: Unified2DispatcherStage
+ *
+ * Purpose: Add a stage every record goes through before the sinks, e.g. to
+ * enrich the decoded entry or to correlate records. The record as stored is
+ * not to be changed.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2StageFunc   UNIFIED2_OK to pass the record on, UNIFIED2_WARN to
+ *                          drop it, UNIFIED2_ERROR to stop
+ *      void *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2DispatcherStage(Unified2Dispatcher *d, Unified2StageFunc func,
+    void *arg)
+{
+    Stage *stage;
+
+    if( func == NULL || (stage = add_stage(d)) == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    stage->func = func;
+    stage->arg = arg;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: event_verdict
+ *
+ * Purpose: Find where the verdict of the event a record belongs to is kept.
+ * Events, packets and extra data name their event after their own header.
+ *
+ * Arguements:
+ *      EventVerdict *
+ *      const uint8_t *
+ *      uint32_t
+ *      const uint8_t **    set to the sensor and event id
+ *      int *               set for events
+ *
+ * Returns:
+ *      EventVerdict *  NULL when the record names no event
+ */
+static EventVerdict *event_verdict(EventVerdict *verdicts,
+    const uint8_t *record, uint32_t length, const uint8_t **ids, int *event)
+{
+    const uint8_t *body = record + sizeof(Unified2RecordHeader);
+    uint32_t left = length - sizeof(Unified2RecordHeader);
+
+    *event = 0;
+    switch( _Unified2Field32(record, 0) )
+    {
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        *event = 1;
+        break;
+
+        case UNIFIED2_EXTRA_DATA:
+        if( left < sizeof(Unified2ExtraDataHdr) )
+        {
+            return NULL;
+        }
+        body += sizeof(Unified2ExtraDataHdr);
+        left -= sizeof(Unified2ExtraDataHdr);
+        break;
+
+        case UNIFIED2_PACKET:
+        break;
+
+        default:
+        return NULL;
+    }
+
+    if( left < 8 )
+    {
+        return NULL;
+    }
+
+    *ids = body;
+
+    return &verdicts[_Unified2Field32(body, 4) % DISPATCH_VERDICTS];
+}
+
+/* Function: follow_event
+ *
+ * Purpose: Decide on a record the way its event was decided. Events get a
+ * fresh verdict and have it remembered, packets and extra data reuse that of
+ * their event and only get one of their own when it has not been seen.
+ *
+ * Arguements:
+ *      EventVerdict *
+ *      const uint8_t *
+ *      uint32_t
+ *      int (*)(void *, const uint8_t *, uint32_t)
+ *      void *
+ *
+ * Returns:
+ *      int
+ */
+static int follow_event(EventVerdict *verdicts, const uint8_t *record,
+    uint32_t length, int (*decide)(void *, const uint8_t *, uint32_t),
+    void *arg)
+{
+    const uint8_t *ids;
+    EventVerdict *cached;
+    int event;
+
+    cached = event_verdict(verdicts, record, length, &ids, &event);
+    if( cached == NULL )
+    {
+        return decide(arg, record, length);
+    }
+
+    if( event )
+    {
+        cached->sensor_id = _Unified2Field32(ids, 0);
+        cached->event_id = _Unified2Field32(ids, 4);
+        cached->seen = 1;
+        cached->match = decide(arg, record, length);
+        return cached->match;
+    }
+
+    if( cached->seen && cached->sensor_id == _Unified2Field32(ids, 0) &&
+        cached->event_id == _Unified2Field32(ids, 4) )
+    {
+        return cached->match;
+    }
+
+    return decide(arg, record, length);
+}
+
+static int decide_filter(void *arg, const uint8_t *record, uint32_t length)
+{
+    return Unified2FilterMatch((const Unified2Filter *)arg, record, length);
+}
+
+static int decide_sample(void *arg, const uint8_t *record, uint32_t length)
+{
+    Stage *stage = arg;
+
+    return stage->seen++ % stage->every == 0;
+}
+
+static HRESULT stage_filter(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Stage *stage = arg;
+
+    return follow_event(stage->verdicts, record, length, decide_filter,
+        (void *)stage->filter) ? UNIFIED2_OK : UNIFIED2_WARN;
+}
+
+static HRESULT stage_sample(Unified2Entry *entry, const uint8_t *record,
+    uint32_t length, void *arg)
+{
+    Stage *stage = arg;
+
+    return follow_event(stage->verdicts, record, length, decide_sample,
+        stage) ? UNIFIED2_OK : UNIFIED2_WARN;
+}
+
+/* Function: Unified2DispatcherStageFilter
+ *
+ * Purpose: Add a stage that drops what a filter does not match. Packets and
+ * extra data go where their event went.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      const Unified2Filter *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2DispatcherStageFilter(Unified2Dispatcher *d,
+    const Unified2Filter *filter)
+{
+    Stage *stage;
+
+    if( filter == NULL || (stage = add_stage(d)) == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( new_verdicts(&stage->verdicts) != UNIFIED2_OK )
+    {
+        d->nstages--;
+        return UNIFIED2_ERROR;
+    }
+
+    stage->func = stage_filter;
+    stage->arg = stage;
+    stage->filter = filter;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2DispatcherStageSample
+ *
+ * Purpose: Add a stage that passes on one event in every so many, with its
+ * packets and extra data, and drops the others
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2DispatcherStageSample(Unified2Dispatcher *d, uint32_t every)
+{
+    Stage *stage;
+
+    if( every == 0 || (stage = add_stage(d)) == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( new_verdicts(&stage->verdicts) != UNIFIED2_OK )
+    {
+        d->nstages--;
+        return UNIFIED2_ERROR;
+    }
+
+    stage->func = stage_sample;
+    stage->arg = stage;
+    stage->every = every;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: feed
+ *
+ * Purpose: Give a sink a batch
+ *
+ * Arguements:
+ *      Sink *
+ *      DispatchBatch *
+ *      uint32_t        the sink's bit in Slot.skip
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT feed(Sink *sink, DispatchBatch *batch, uint32_t bit)
+{
+    Slot *slot;
+    int i;
+
+    for( i = 0; i < batch->count; i++ )
+    {
+        slot = &batch->slots[i];
+
+        if( slot->skip & bit )
+        {
+            continue;
+        }
+
+        if( sink->func(&slot->entry, slot->raw, slot->length, sink->arg) ==
+            UNIFIED2_ERROR )
+        {
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: format_batch
+ *
+ * Purpose: Format a batch for a formatter into the batch's own buffer
+ *
+ * Arguements:
+ *      Sink *
+ *      DispatchBatch *
+ *      int             the sink
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT format_batch(Sink *sink, DispatchBatch *batch, int id)
+{
+    Unified2Buffer *output = &batch->output[id];
+    Slot *slot;
+    int i;
+
+    output->used = 0;
+    for( i = 0; i < batch->count; i++ )
+    {
+        slot = &batch->slots[i];
+
+        if( slot->skip & (1u << id) )
+        {
+            continue;
+        }
+
+        if( sink->format(output, &slot->entry) == UNIFIED2_ERROR )
+        {
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: fail
+ *
+ * Purpose: Stop everybody. Called with the lock held.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *
+ * Returns:
+ *      void
+ */
+static void fail(Unified2Dispatcher *d)
+{
+    d->failed = 1;
+    pthread_cond_broadcast(&d->work);
+    pthread_cond_broadcast(&d->freed);
+}
+
+/* Function: release
+ *
+ * Purpose: Let go of a batch for one sink. Called with the lock held.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      DispatchBatch *
+ *
+ * Returns:
+ *      void
+ */
+static void release(Unified2Dispatcher *d, DispatchBatch *batch)
+{
+    if( --batch->pending == 0 )
+    {
+        pthread_cond_signal(&d->freed);
+    }
+}
+
+/* Function: flush_formatted
+ *
+ * Purpose: Write out the batches of a formatter that are ready, oldest first.
+ * Called with the lock held, which is dropped around the writes; only one
+ * worker at a time flushes a sink and it picks up what others finish
+ * meanwhile.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      int             the sink
+ *
+ * Returns:
+ *      void
+ */
+static void flush_formatted(Unified2Dispatcher *d, int id)
+{
+    Sink *sink = &d->sinks[id];
+    Unified2Buffer *target = sink->target;
+    Unified2Buffer *output;
+    DispatchBatch *batch;
+    HRESULT r;
+
+    if( sink->flushing )
+    {
+        return;
+    }
+
+    sink->flushing = 1;
+    while( !d->failed && sink->next_flush < sink->next )
+    {
+        batch = &d->batches[sink->next_flush % d->nbatches];
+        if( !(batch->formatted & (1u << id)) )
+        {
+            break;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        output = &batch->output[id];
+        if( target->fd != -1 )
+        {
+            /* Straight from the batch, after what the target holds */
+            r = Unified2BufferFlush(target);
+            if( r == UNIFIED2_OK )
+            {
+                output->fd = target->fd;
+                r = Unified2BufferFlush(output);
+                output->fd = -1;
+            }
+        }
+        else
+        {
+            r = Unified2BufferAppend(target, output->data, output->used);
+        }
+        output->used = 0;
+
+        pthread_mutex_lock(&d->lock);
+        if( r != UNIFIED2_OK )
+        {
+            fail(d);
+        }
+
+        batch->formatted &= ~(1u << id);
+        sink->next_flush++;
+        release(d, batch);
+    }
+    sink->flushing = 0;
+}
+
+/* Function: take_work
+ *
+ * Purpose: Find a sink with a batch waiting. Sinks that keep their order go
+ * first, as only one worker at a time can serve each; formatters then take
+ * the oldest batch any of them has. Called with the lock held.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      uint64_t *      the batch
+ *
+ * Returns:
+ *      int             the sink, -1 when there is nothing to do
+ */
+static int take_work(Unified2Dispatcher *d, uint64_t *sequence)
+{
+    Sink *sink;
+    int best = -1;
+    int i;
+
+    for( i = 0; i < d->nsinks; i++ )
+    {
+        sink = &d->sinks[i];
+        if( !sink->threaded || sink->next == d->next_fill )
+        {
+            continue;
+        }
+
+        if( !sink->parallel )
+        {
+            if( sink->busy )
+            {
+                continue;
+            }
+            sink->busy = 1;
+            *sequence = sink->next;
+            return i;
+        }
+
+        if( best == -1 || sink->next < d->sinks[best].next )
+        {
+            best = i;
+        }
+    }
+
+    if( best != -1 )
+    {
+        *sequence = d->sinks[best].next++;
+    }
+
+    return best;
+}
+
+/* Function: all_taken
+ *
+ * Purpose: Check whether every batch has been taken by every threaded sink
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *
+ * Returns:
+ *      int
+ */
+static int all_taken(Unified2Dispatcher *d)
+{
+    int i;
+
+    for( i = 0; i < d->nsinks; i++ )
+    {
+        if( d->sinks[i].threaded && (d->sinks[i].next != d->next_fill ||
+            d->sinks[i].busy) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void *worker_thread(void *arg)
+{
+    Unified2Dispatcher *d = arg;
+    DispatchBatch *batch;
+    uint64_t sequence;
+    Sink *sink;
+    HRESULT r;
+    int id;
+
+    pthread_mutex_lock(&d->lock);
+    for( ;; )
+    {
+        id = d->failed ? -1 : take_work(d, &sequence);
+        if( id == -1 )
+        {
+            if( d->failed || (d->done && all_taken(d)) )
+            {
+                /* the others may be waiting for the same */
+                pthread_cond_broadcast(&d->work);
+                break;
+            }
+            pthread_cond_wait(&d->work, &d->lock);
+            continue;
+        }
+
+        sink = &d->sinks[id];
+        batch = &d->batches[sequence % d->nbatches];
+        pthread_mutex_unlock(&d->lock);
+
+        if( sink->parallel )
+        {
+            r = format_batch(sink, batch, id);
+        }
+        else
+        {
+            r = feed(sink, batch, 1u << id);
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if( r != UNIFIED2_OK )
+        {
+            fail(d);
+        }
+
+        if( sink->parallel )
+        {
+            batch->formatted |= 1u << id;
+            flush_formatted(d, id);
+        }
+        else
+        {
+            sink->busy = 0;
+            sink->next++;
+            release(d, batch);
+
+            /* Its next batch may be waiting already */
+            pthread_cond_signal(&d->work);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/* Function: reserve
+ *
+ * Purpose: Grow a slot buffer
+ *
+ * Arguements:
+ *      uint8_t **
+ *      uint32_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT reserve(uint8_t **buffer, uint32_t *size, uint32_t length)
+{
+    uint8_t *grown;
+
+    if( length <= *size )
+    {
+        return UNIFIED2_OK;
+    }
+
+    grown = (uint8_t *)_Unified2Realloc(*buffer, length, UNIFIED2_ALLOC_BUFFER);
+    if( grown == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    *buffer = grown;
+    *size = length;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: pass_stages
+ *
+ * Purpose: Run a decoded record through the stages and the sink filters
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Slot *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when a stage dropped it
+ */
+static HRESULT pass_stages(Unified2Dispatcher *d, Slot *slot)
+{
+    Stage *stage;
+    Sink *sink;
+    HRESULT r;
+    int i;
+
+    for( i = 0; i < d->nstages; i++ )
+    {
+        stage = &d->stages[i];
+        r = stage->func(&slot->entry, slot->raw, slot->length, stage->arg);
+        if( r != UNIFIED2_OK )
+        {
+            return r;
+        }
+    }
+
+    slot->skip = 0;
+    for( i = 0; i < d->nsinks; i++ )
+    {
+        sink = &d->sinks[i];
+        if( sink->filter != NULL && !follow_event(sink->verdicts, slot->raw,
+            slot->length, decide_filter, (void *)sink->filter) )
+        {
+            slot->skip |= 1u << i;
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: fill_batch
+ *
+ * Purpose: Read and decode records into a batch and put them through the
+ * stages. Records too short to decode are reported and left out.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2 *
+ *      DispatchBatch *
+ *      int *           records left to pass on, negative for all
+ *      HRESULT *       set to UNIFIED2_ERROR when the input is damaged or a
+ *                      stage failed
+ *
+ * Returns:
+ *      int             0 once the input is exhausted
+ */
+static int fill_batch(Unified2Dispatcher *d, Unified2 *u2,
+    DispatchBatch *batch, int *count, HRESULT *result)
+{
+    Unified2RecordHeader header;
+    UNIFIED2_DIAG problem;
+    const uint8_t *record;
+    uint8_t *decode;
+    uint32_t length;
+    Slot *slot;
+    HRESULT r;
+
+    batch->count = 0;
+    while( batch->count < DISPATCH_RECORDS && *count )
+    {
+        r = Unified2ReadRawRecord(u2, &record, &length);
+        if( r != UNIFIED2_OK )
+        {
+            *result = r == UNIFIED2_EOF ? UNIFIED2_OK : r;
+            return 0;
+        }
+
+        slot = &batch->slots[batch->count];
+        if( reserve(&slot->raw, &slot->raw_size, length) != UNIFIED2_OK )
+        {
+            _Unified2Diag(u2, UNIFIED2_DIAG_NOMEM, 0, errno);
+            *result = UNIFIED2_ERROR;
+            return 0;
+        }
+        memcpy(slot->raw, record, length);
+        slot->length = length;
+
+        /* Sinks that take the record as stored must not see it converted */
+        decode = slot->raw;
+        memcpy(&header, record, sizeof(header));
+        if( ntohl(header.type) == UNIFIED2_EXTRA_DATA )
+        {
+            if( reserve(&slot->extra, &slot->extra_size, length) !=
+                UNIFIED2_OK )
+            {
+                _Unified2Diag(u2, UNIFIED2_DIAG_NOMEM, 0, errno);
+                *result = UNIFIED2_ERROR;
+                return 0;
+            }
+            memcpy(slot->extra, record, length);
+            decode = slot->extra;
+        }
+
+        r = _Unified2DecodeRecord(&slot->record, decode, length, &problem);
+        if( r == UNIFIED2_WARN )
+        {
+            _Unified2Diag(u2, problem, slot->record.record.type, 0);
+            if( problem == UNIFIED2_DIAG_SHORT_RECORD )
+            {
+                continue;
+            }
+        }
+
+        Unified2RecordEntry(&slot->record, &slot->entry);
+
+        r = pass_stages(d, slot);
+        if( r == UNIFIED2_ERROR )
+        {
+            *result = UNIFIED2_ERROR;
+            return 0;
+        }
+
+        if( r == UNIFIED2_OK )
+        {
+            batch->count++;
+            if( *count > 0 )
+            {
+                (*count)--;
+            }
+        }
+    }
+
+    return *count != 0;
+}
+
+/* Function: prepare
+ *
+ * Purpose: Size the batch ring for the workers and give the formatters their
+ * buffers in every batch
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      int             workers
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT prepare(Unified2Dispatcher *d, int workers)
+{
+    int nbatches = workers * 2 + 2;
+    int i, j;
+
+    if( nbatches < DISPATCH_BATCHES )
+    {
+        nbatches = DISPATCH_BATCHES;
+    }
+
+    if( d->batches != NULL && d->nbatches != nbatches )
+    {
+        free_batches(d);
+    }
+
+    if( d->batches == NULL )
+    {
+        d->batches = (DispatchBatch *)_Unified2Calloc(nbatches,
+            sizeof(DispatchBatch), UNIFIED2_ALLOC_BUFFER);
+        if( d->batches == NULL )
+        {
+            warn("Unified2DispatcherRun: failed to malloc: %s\n",
+                strerror(errno));
+            return UNIFIED2_ERROR;
+        }
+        d->nbatches = nbatches;
+    }
+
+    for( i = 0; i < d->nbatches; i++ )
+    {
+        d->batches[i].pending = 0;
+        d->batches[i].formatted = 0;
+
+        for( j = 0; j < d->nsinks; j++ )
+        {
+            if( d->sinks[j].parallel && d->batches[i].output[j].data == NULL &&
+                Unified2BufferInit(&d->batches[i].output[j], -1,
+                DISPATCH_OUTPUT) != UNIFIED2_OK )
+            {
+                return UNIFIED2_ERROR;
+            }
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2DispatchRecords
+ *
+ * Purpose: Read the records left in u2 and give each to every sink, until
+ * *count of them (negative for all) made it through the stages. Sinks in the
+ * reading thread see a batch before the threaded ones are handed it. Returns
+ * once every sink has seen everything, or at the first sink or stage that
+ * fails.
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2 *
+ *      int *           records left to pass on, counted down
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_ERROR when a sink or stage failed, UNIFIED2_WARN
+ *                  when the input is damaged
+ */
+HRESULT _Unified2DispatchRecords(Unified2Dispatcher *d, Unified2 *u2,
+    int *count)
+{
+    pthread_t threads[UNIFIED2_MAX_THREADS];
+    DispatchBatch *batch;
+    HRESULT result = UNIFIED2_OK;
+    int workers = 0;
+    int started = 0;
+    int more = 1;
+    int i;
+
+    if( d == NULL || u2 == NULL || d->nsinks == 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( d->nthreaded )
+    {
+        workers = d->threads ? d->threads : d->nthreaded;
+    }
+
+    if( prepare(d, workers) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    d->next_fill = 0;
+    d->done = 0;
+    d->failed = 0;
+    for( i = 0; i < d->nsinks; i++ )
+    {
+        d->sinks[i].next = 0;
+        d->sinks[i].next_flush = 0;
+        d->sinks[i].busy = 0;
+        d->sinks[i].flushing = 0;
+    }
+
+    for( started = 0; started < workers; started++ )
+    {
+        if( pthread_create(&threads[started], NULL, worker_thread, d) != 0 )
+        {
+            warn("Unified2DispatcherRun: failed to start a worker\n");
+            break;
+        }
+    }
+
+    if( workers && !started )
+    {
+        d->failed = 1;
+    }
+
+    while( more && !d->failed )
+    {
+        pthread_mutex_lock(&d->lock);
+        batch = &d->batches[d->next_fill % d->nbatches];
+        while( batch->pending && !d->failed )
+        {
+            pthread_cond_wait(&d->freed, &d->lock);
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        if( d->failed )
+        {
+            break;
+        }
+
+        more = fill_batch(d, u2, batch, count, &result);
+        if( result == UNIFIED2_ERROR && batch->count == 0 )
+        {
+            break;
+        }
+
+        for( i = 0; i < d->nsinks && batch->count; i++ )
+        {
+            if( !d->sinks[i].threaded &&
+                feed(&d->sinks[i], batch, 1u << i) != UNIFIED2_OK )
+            {
+                pthread_mutex_lock(&d->lock);
+                fail(d);
+                pthread_mutex_unlock(&d->lock);
+                break;
+            }
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if( batch->count && d->nthreaded && !d->failed )
+        {
+            batch->pending = d->nthreaded;
+            batch->formatted = 0;
+            d->next_fill++;
+            pthread_cond_broadcast(&d->work);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->done = 1;
+    pthread_cond_broadcast(&d->work);
+    pthread_mutex_unlock(&d->lock);
+
+    for( i = 0; i < started; i++ )
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if( d->failed )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return result == UNIFIED2_OK ? UNIFIED2_OK : UNIFIED2_WARN;
+}
+
+/* Function: Unified2DispatcherRun
+ *
+ * Purpose: Read the records left in u2, up to count through the stages
+ * (negative for all), and give each to every sink, see
+ * _Unified2DispatchRecords()
+ *
+ * Arguements:
+ *      Unified2Dispatcher *
+ *      Unified2 *
+ *      int
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_ERROR when a sink failed or the input is damaged
+ */
+HRESULT Unified2DispatcherRun(Unified2Dispatcher *d, Unified2 *u2, int count)
+{
+    return _Unified2DispatchRecords(d, u2, &count) == UNIFIED2_OK ?
+        UNIFIED2_OK : UNIFIED2_ERROR;
+}
@@ -0,0 +1,335 @@
+/*******************************************************************************
+ * Normalized events.
+ *
+ * The four event records, and the two MPLS ones laid out like the v2 records,
+ * differ in address width and in whether MPLS, VLAN and policy follow. A
+ * consumer of Unified2Entry has to switch on the type and chase one of four
+ * pointers for every field. Unified2NormalizedEvent holds any of them: one
+ * 64 byte aligned layout, addresses inline and 16 bytes wide, a flag for the
+ * family and for the v2 fields.
+ *
+ * Unified2DecodeEvent() fills it straight from the record as stored, one pass
+ * over the bytes and no allocation, which makes Unified2ReadNextEvent() on top
+ * of Unified2ReadRawRecord() the cheapest way to walk the events of a log.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "unified2.h"
+
+/* Offsets in the record bodies, past the addresses for the IPv6 ones */
+#define EVENT_IP_SOURCE     36
+#define EVENT_PORTS         44
+#define EVENT6_PORTS        68
+#define EVENT_V2_FIELDS     8       /* after packet_action and pad */
+
+static uint32_t field32(const uint8_t *body, int offset)
+{
+    uint32_t value;
+
+    memcpy(&value, body + offset, sizeof(value));
+
+    return ntohl(value);
+}
+
+static uint16_t field16(const uint8_t *body, int offset)
+{
+    uint16_t value;
+
+    memcpy(&value, body + offset, sizeof(value));
+
+    return ntohs(value);
+}
+
+/* Function: map_ipv4
+ *
+ * Purpose: Store an IPv4 address, as it is stored, IPv4 mapped
+ *
+ * Arguements:
+ *      struct in6_addr *
+ *      const void *
+ *
+ * Returns:
+ *      void
+ */
+static void map_ipv4(struct in6_addr *address, const void *ipv4)
+{
+    memset(address->s6_addr, 0x0, 10);
+    address->s6_addr[10] = 0xff;
+    address->s6_addr[11] = 0xff;
+    memcpy(address->s6_addr + 12, ipv4, 4);
+}
+
+/* Function: Unified2DecodeEvent
+ *
+ * Purpose: Decode an event record as Unified2ReadRawRecord() returns it,
+ * header included and in network byte order
+ *
+ * Arguements:
+ *      Unified2NormalizedEvent *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when it is not an event, UNIFIED2_ERROR when
+ *                  too short for its type
+ */
+HRESULT Unified2DecodeEvent(Unified2NormalizedEvent *event,
+    const uint8_t *record, uint32_t length)
+{
+    const uint8_t *body = record + sizeof(Unified2RecordHeader);
+    uint32_t need;
+    int ports;
+
+    if( event == NULL || record == NULL ||
+        length < sizeof(Unified2RecordHeader) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    event->type = field32(record, 0);
+    length -= sizeof(Unified2RecordHeader);
+
+    switch( event->type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        event->flags = 0;
+        need = sizeof(Unified2Event);
+        break;
+
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        event->flags = UNIFIED2_EVENT_V2;
+        need = sizeof(Unified2Event_v2);
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        event->flags = UNIFIED2_EVENT_IPV6;
+        need = sizeof(Unified2Event6);
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        event->flags = UNIFIED2_EVENT_IPV6 | UNIFIED2_EVENT_V2;
+        need = sizeof(Unified2Event6_v2);
+        break;
+
+        default:
+        return UNIFIED2_WARN;
+    }
+
+    if( length < need )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    event->sensor_id = field32(body, 0);
+    event->event_id = field32(body, 4);
+    event->event_second = field32(body, 8);
+    event->event_microsecond = field32(body, 12);
+    event->signature_id = field32(body, 16);
+    event->generator_id = field32(body, 20);
+    event->signature_revision = field32(body, 24);
+    event->classification_id = field32(body, 28);
+    event->priority_id = field32(body, 32);
+
+    if( event->flags & UNIFIED2_EVENT_IPV6 )
+    {
+        memcpy(&event->ip_source, body + EVENT_IP_SOURCE, 16);
+        memcpy(&event->ip_destination, body + EVENT_IP_SOURCE + 16, 16);
+        ports = EVENT6_PORTS;
+    }
+    else
+    {
+        map_ipv4(&event->ip_source, body + EVENT_IP_SOURCE);
+        map_ipv4(&event->ip_destination, body + EVENT_IP_SOURCE + 4);
+        ports = EVENT_PORTS;
+    }
+
+    event->sport_itype = field16(body, ports);
+    event->dport_icode = field16(body, ports + 2);
+    event->protocol = body[ports + 4];
+    event->packet_action = body[ports + 5];
+    event->pad = 0;
+
+    if( event->flags & UNIFIED2_EVENT_V2 )
+    {
+        event->mpls_label = field32(body, ports + EVENT_V2_FIELDS);
+        event->vlan_id = field16(body, ports + EVENT_V2_FIELDS + 4);
+        event->policy_id = field16(body, ports + EVENT_V2_FIELDS + 6);
+    }
+    else
+    {
+        event->mpls_label = 0;
+        event->vlan_id = 0;
+        event->policy_id = 0;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2EventFromEntry
+ *
+ * Purpose: Normalize an event Unified2ReadNextEntry() already decoded
+ *
+ * Arguements:
+ *      Unified2NormalizedEvent *
+ *      const Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when it is not an event
+ */
+HRESULT Unified2EventFromEntry(Unified2NormalizedEvent *event,
+    const Unified2Entry *entry)
+{
+    const Unified2Event6_v2 *event6 = NULL;
+    const Unified2Event_v2 *event4 = NULL;
+
+    if( event == NULL || entry == NULL || entry->record == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    /* The v2 records only add fields at the end */
+    switch( entry->record->type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        event4 = (const Unified2Event_v2 *)entry->event;
+        event->flags = 0;
+        break;
+
+        case UNIFIED2_IDS_EVENT_V2:
+        event4 = entry->event_v2;
+        event->flags = UNIFIED2_EVENT_V2;
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        event6 = (const Unified2Event6_v2 *)entry->event6;
+        event->flags = UNIFIED2_EVENT_IPV6;
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        event6 = entry->event6_v2;
+        event->flags = UNIFIED2_EVENT_IPV6 | UNIFIED2_EVENT_V2;
+        break;
+
+        default:
+        return UNIFIED2_WARN;
+    }
+
+    if( event4 == NULL && event6 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    event->type = entry->record->type;
+    event->pad = 0;
+    event->mpls_label = 0;
+    event->vlan_id = 0;
+    event->policy_id = 0;
+
+    if( event6 != NULL )
+    {
+        event->sensor_id = event6->sensor_id;
+        event->event_id = event6->event_id;
+        event->event_second = event6->event_second;
+        event->event_microsecond = event6->event_microsecond;
+        event->signature_id = event6->signature_id;
+        event->generator_id = event6->generator_id;
+        event->signature_revision = event6->signature_revision;
+        event->classification_id = event6->classification_id;
+        event->priority_id = event6->priority_id;
+        event->ip_source = event6->ip_source;
+        event->ip_destination = event6->ip_destination;
+        event->sport_itype = event6->sport_itype;
+        event->dport_icode = event6->dport_icode;
+        event->protocol = event6->protocol;
+        event->packet_action = event6->packet_action;
+
+        if( event->flags & UNIFIED2_EVENT_V2 )
+        {
+            event->mpls_label = event6->mpls_label;
+            event->vlan_id = event6->vlan_id;
+            event->policy_id = event6->policy_id;
+        }
+    }
+    else if( event4 != NULL )
+    {
+        event->sensor_id = event4->sensor_id;
+        event->event_id = event4->event_id;
+        event->event_second = event4->event_second;
+        event->event_microsecond = event4->event_microsecond;
+        event->signature_id = event4->signature_id;
+        event->generator_id = event4->generator_id;
+        event->signature_revision = event4->signature_revision;
+        event->classification_id = event4->classification_id;
+        event->priority_id = event4->priority_id;
+        map_ipv4(&event->ip_source, &event4->ip_source);
+        map_ipv4(&event->ip_destination, &event4->ip_destination);
+        event->sport_itype = event4->sport_itype;
+        event->dport_icode = event4->dport_icode;
+        event->protocol = event4->protocol;
+        event->packet_action = event4->packet_action;
+
+        if( event->flags & UNIFIED2_EVENT_V2 )
+        {
+            event->mpls_label = event4->mpls_label;
+            event->vlan_id = event4->vlan_id;
+            event->policy_id = event4->policy_id;
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ReadNextEvent
+ *
+ * Purpose: Read up to and decode the next event, stepping over packets, extra
+ * data and anything else. Nothing is allocated per record.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2NormalizedEvent *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_EOF at the end, UNIFIED2_ERROR on a record too
+ *                  short to decode
+ */
+HRESULT Unified2ReadNextEvent(Unified2 *u2, Unified2NormalizedEvent *event)
+{
+    const uint8_t *record;
+    uint32_t length;
+    HRESULT r;
+
+    if( u2 == NULL || event == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    do
+    {
+        r = Unified2ReadRawRecord(u2, &record, &length);
+        if( r != UNIFIED2_OK )
+        {
+            return r;
+        }
+
+        r = Unified2DecodeEvent(event, record, length);
+    }
+    while( r == UNIFIED2_WARN );
+
+    if( r == UNIFIED2_ERROR )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_SHORT_RECORD, field32(record, 0), 0);
+    }
+
+    return r;
+}
@@ -0,0 +1,1032 @@
+/*******************************************************************************
+ * Compiled record filters.
+ *
+ * An expression such as
+ *
+ *      sid in {2000001..2000999} and dst in 10.0.0.0/8 and proto == tcp
+ *
+ * is parsed once into a small program of tests, each of which jumps to one
+ * of two successors, the way BPF does it. and, or and not cost nothing at run
+ * time: they only decide where the jumps of the tests go, so a record needs
+ * no more than one pass over the tests on the way to accept or reject and
+ * stops as soon as the answer is known.
+ *
+ * Tests read fields straight out of the raw, network order record, as
+ * returned by Unified2ReadRawRecord(); nothing is decoded or allocated. A
+ * test of a field the record does not have is false, whatever the operator.
+ *
+ * Grammar:
+ *
+ *      expr    := term { ("or" | "||") term }
+ *      term    := factor { ("and" | "&&") factor }
+ *      factor  := ("not" | "!") factor | "(" expr ")" | test
+ *      test    := field op value | field ["not"] "in" (set | address)
+ *      set     := "{" item { "," item } "}"
+ *      item    := value [".." value] | address
+ *      op      := "==" | "=" | "!=" | "<" | "<=" | ">" | ">="
+ *
+ * Values are decimal or hex numbers, protocol names, or IPv4 and IPv6
+ * addresses with an optional prefix length.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "unified2.h"
+
+#define ACCEPT  -1
+#define REJECT  -2
+
+/* Layouts fields are found at, by record type */
+typedef enum _LAYOUT {
+    LAYOUT_EVENT,
+    LAYOUT_EVENT_V2,
+    LAYOUT_EVENT6,
+    LAYOUT_EVENT6_V2,
+    LAYOUT_PACKET,
+    LAYOUT_EXTRA,
+    LAYOUT_OTHER,
+    LAYOUTS,
+} LAYOUT;
+
+typedef enum _FIELD {
+    FIELD_TYPE,
+    FIELD_SENSOR,
+    FIELD_EVENT,
+    FIELD_SECOND,
+    FIELD_SID,
+    FIELD_GID,
+    FIELD_REV,
+    FIELD_CLASS,
+    FIELD_PRIORITY,
+    FIELD_SRC,
+    FIELD_DST,
+    FIELD_SPORT,
+    FIELD_DPORT,
+    FIELD_PROTO,
+    FIELD_ACTION,
+    FIELD_MPLS,
+    FIELD_VLAN,
+    FIELD_POLICY,
+    FIELD_LINKTYPE,
+    FIELDS,
+} FIELD;
+
+typedef struct _FieldInfo {
+    const char *name;
+    uint8_t width;              /* bytes, 16 for addresses */
+    int16_t offset[LAYOUTS];    /* into the record, -1 when absent */
+} FieldInfo;
+
+#define H(x) ((x) + 8)          /* skip the record header */
+#define X(x) ((x) + 16)         /* and the extra data header */
+#define NA -1
+
+static const FieldInfo fields[FIELDS] = {
+    /*                              event   v2      event6  v6_v2   packet  extra   other */
+    { "type",       4,  {           0,      0,      0,      0,      0,      0,      0 } },
+    { "sensor",     4,  {           H(0),   H(0),   H(0),   H(0),   H(0),   X(0),   NA } },
+    { "event",      4,  {           H(4),   H(4),   H(4),   H(4),   H(4),   X(4),   NA } },
+    { "second",     4,  {           H(8),   H(8),   H(8),   H(8),   H(8),   X(8),   NA } },
+    { "sid",        4,  {           H(16),  H(16),  H(16),  H(16),  NA,     NA,     NA } },
+    { "gid",        4,  {           H(20),  H(20),  H(20),  H(20),  NA,     NA,     NA } },
+    { "rev",        4,  {           H(24),  H(24),  H(24),  H(24),  NA,     NA,     NA } },
+    { "class",      4,  {           H(28),  H(28),  H(28),  H(28),  NA,     NA,     NA } },
+    { "priority",   4,  {           H(32),  H(32),  H(32),  H(32),  NA,     NA,     NA } },
+    { "src",        16, {           H(36),  H(36),  H(36),  H(36),  NA,     NA,     NA } },
+    { "dst",        16, {           H(40),  H(40),  H(52),  H(52),  NA,     NA,     NA } },
+    { "sport",      2,  {           H(44),  H(44),  H(68),  H(68),  NA,     NA,     NA } },
+    { "dport",      2,  {           H(46),  H(46),  H(70),  H(70),  NA,     NA,     NA } },
+    { "proto",      1,  {           H(48),  H(48),  H(72),  H(72),  NA,     NA,     NA } },
+    { "action",     1,  {           H(49),  H(49),  H(73),  H(73),  NA,     NA,     NA } },
+    { "mpls",       4,  {           NA,     H(52),  NA,     H(76),  NA,     NA,     NA } },
+    { "vlan",       2,  {           NA,     H(56),  NA,     H(80),  NA,     NA,     NA } },
+    { "policy",     2,  {           NA,     H(58),  NA,     H(82),  NA,     NA,     NA } },
+    { "linktype",   4,  {           NA,     NA,     NA,     NA,     H(20),  NA,     NA } },
+};
+
+static const struct {
+    const char *name;
+    FIELD field;
+} field_aliases[] = {
+    { "signature", FIELD_SID },
+    { "generator", FIELD_GID },
+    { "protocol", FIELD_PROTO },
+    { "src_port", FIELD_SPORT },
+    { "dst_port", FIELD_DPORT },
+    { "time", FIELD_SECOND },
+};
+
+static const struct {
+    const char *name;
+    uint32_t value;
+} value_names[] = {
+    { "icmp", 1 },
+    { "igmp", 2 },
+    { "tcp", 6 },
+    { "udp", 17 },
+    { "gre", 47 },
+    { "esp", 50 },
+    { "ah", 51 },
+    { "icmp6", 58 },
+    { "sctp", 132 },
+};
+
+typedef enum _OPCODE {
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_SET,                     /* value in ranges[a], b of them */
+    OP_PREFIX,                  /* address in prefixes[a] */
+} OPCODE;
+
+typedef struct _Insn {
+    uint8_t op;
+    uint8_t field;
+    uint16_t pad;
+    uint32_t a;
+    uint32_t b;
+    int32_t jt;
+    int32_t jf;
+} Insn;
+
+typedef struct _Range {
+    uint32_t lo;
+    uint32_t hi;
+} Range;
+
+typedef struct _Prefix {
+    uint8_t addr[16];           /* IPv4 in the first four bytes */
+    uint8_t ipv6;
+    uint8_t bits;
+} Prefix;
+
+struct _Unified2Filter {
+    Insn *insns;
+    uint32_t ninsns;
+    int32_t entry;
+
+    Range *ranges;
+    uint32_t nranges;
+
+    Prefix *prefixes;
+    uint32_t nprefixes;
+};
+
+/** PARSING ********************************************************************/
+
+typedef enum _NODE_TYPE {
+    NODE_AND,
+    NODE_OR,
+    NODE_NOT,
+    NODE_TEST,
+} NODE_TYPE;
+
+typedef struct _Node {
+    NODE_TYPE type;
+    struct _Node *left;
+    struct _Node *right;
+    Insn test;
+} Node;
+
+typedef struct _Parser {
+    const char *text;
+    const char *p;
+    char token[128];
+    Unified2Filter *filter;
+    int failed;
+} Parser;
+
+static void parse_error(Parser *ps, const char *what)
+{
+    if( !ps->failed )
+    {
+        warn("Unified2FilterCompile: %s at offset %d: %s\n", what,
+        (int)(ps->p - ps->text), ps->text);
+    }
+    ps->failed = 1;
+}
+
+static void skip_space(Parser *ps)
+{
+    while( isspace((unsigned char)*ps->p) )
+        ps->p++;
+}
+
+/* Function: next_token
+ *
+ * Purpose: Copy the next token into ps->token and step over it. Words,
+ * numbers, addresses and ranges are all one run of [0-9A-Za-z_.:/].
+ *
+ * Arguements:
+ *      Parser *
+ *
+ * Returns:
+ *      int         length of the token, 0 at the end
+ */
+static int next_token(Parser *ps)
+{
+    static const char *operators[] = {
+        "==", "!=", "<=", ">=", "&&", "||", "<", ">", "=", "!",
+        "(", ")", "{", "}", ",", NULL
+    };
+    const char *start;
+    size_t n;
+    int i;
+
+    skip_space(ps);
+    start = ps->p;
+
+    for( i = 0; operators[i]; i++ )
+    {
+        n = strlen(operators[i]);
+        if( strncmp(ps->p, operators[i], n) == 0 )
+        {
+            memcpy(ps->token, operators[i], n + 1);
+            ps->p += n;
+            return (int)n;
+        }
+    }
+
+    while( isalnum((unsigned char)*ps->p) || *ps->p == '_' || *ps->p == '.' ||
+           *ps->p == ':' || *ps->p == '/' )
+    {
+        ps->p++;
+    }
+
+    n = ps->p - start;
+    if( n >= sizeof(ps->token) )
+    {
+        parse_error(ps, "token too long");
+        n = 0;
+    }
+
+    memcpy(ps->token, start, n);
+    ps->token[n] = '\0';
+
+    if( n == 0 && *ps->p )
+    {
+        parse_error(ps, "unexpected character");
+    }
+
+    return (int)n;
+}
+
+static int peek(Parser *ps, const char *token)
+{
+    const char *save = ps->p;
+    int match;
+
+    next_token(ps);
+    match = strcmp(ps->token, token) == 0;
+    ps->p = save;
+
+    return match;
+}
+
+static int accept_token(Parser *ps, const char *token)
+{
+    if( peek(ps, token) )
+    {
+        next_token(ps);
+        return 1;
+    }
+
+    return 0;
+}
+
+static Node *node_new(Parser *ps, NODE_TYPE type, Node *left, Node *right)
+{
+    Node *node = (Node *)_Unified2Calloc(1, sizeof(Node),
+        UNIFIED2_ALLOC_ANALYSIS);
+
+    if( node == NULL )
+    {
+        parse_error(ps, "out of memory");
+        return NULL;
+    }
+
+    node->type = type;
+    node->left = left;
+    node->right = right;
+
+    return node;
+}
+
+static void node_free(Node *node)
+{
+    if( node != NULL )
+    {
+        node_free(node->left);
+        node_free(node->right);
+        _Unified2Free(node, UNIFIED2_ALLOC_ANALYSIS);
+    }
+}
+
+static int parse_number(const char *s, uint32_t *value)
+{
+    unsigned long long v;
+    char *end;
+    size_t i;
+
+    for( i = 0; i < sizeof(value_names) / sizeof(value_names[0]); i++ )
+    {
+        if( strcmp(s, value_names[i].name) == 0 )
+        {
+            *value = value_names[i].value;
+            return 0;
+        }
+    }
+
+    if( !isdigit((unsigned char)*s) )
+        return -1;
+
+    errno = 0;
+    v = strtoull(s, &end, 0);
+    if( *end || errno || v > UINT32_MAX )
+        return -1;
+
+    *value = (uint32_t)v;
+
+    return 0;
+}
+
+static int parse_prefix(const char *s, Prefix *prefix)
+{
+    char addr[64];
+    const char *slash = strchr(s, '/');
+    size_t n = slash ? (size_t)(slash - s) : strlen(s);
+    char *end;
+    long bits;
+
+    if( n >= sizeof(addr) )
+        return -1;
+
+    memcpy(addr, s, n);
+    addr[n] = '\0';
+    memset(prefix, 0x0, sizeof(Prefix));
+
+    if( inet_pton(AF_INET, addr, prefix->addr) == 1 )
+    {
+        prefix->bits = 32;
+    }
+    else if( inet_pton(AF_INET6, addr, prefix->addr) == 1 )
+    {
+        prefix->ipv6 = 1;
+        prefix->bits = 128;
+    }
+    else
+    {
+        return -1;
+    }
+
+    if( slash )
+    {
+        bits = strtol(slash + 1, &end, 10);
+        if( *end || slash[1] == '\0' || bits < 0 || bits > prefix->bits )
+            return -1;
+        prefix->bits = (uint8_t)bits;
+    }
+
+    return 0;
+}
+
+static int add_range(Parser *ps, uint32_t lo, uint32_t hi)
+{
+    Range *ranges;
+
+    ranges = (Range *)_Unified2Realloc(ps->filter->ranges,
+        (ps->filter->nranges + 1) * sizeof(Range), UNIFIED2_ALLOC_ANALYSIS);
+    if( ranges == NULL )
+    {
+        parse_error(ps, "out of memory");
+        return -1;
+    }
+
+    ranges[ps->filter->nranges].lo = lo;
+    ranges[ps->filter->nranges].hi = hi;
+    ps->filter->ranges = ranges;
+    ps->filter->nranges++;
+
+    return 0;
+}
+
+static Node *prefix_test(Parser *ps, FIELD field, const char *s)
+{
+    Prefix *prefixes;
+    Node *node;
+
+    prefixes = (Prefix *)_Unified2Realloc(ps->filter->prefixes,
+        (ps->filter->nprefixes + 1) * sizeof(Prefix), UNIFIED2_ALLOC_ANALYSIS);
+    if( prefixes == NULL )
+    {
+        parse_error(ps, "out of memory");
+        return NULL;
+    }
+    ps->filter->prefixes = prefixes;
+
+    if( parse_prefix(s, &prefixes[ps->filter->nprefixes]) )
+    {
+        parse_error(ps, "bad address");
+        return NULL;
+    }
+
+    node = node_new(ps, NODE_TEST, NULL, NULL);
+    if( node != NULL )
+    {
+        node->test.op = OP_PREFIX;
+        node->test.field = field;
+        node->test.a = ps->filter->nprefixes;
+    }
+    ps->filter->nprefixes++;
+
+    return node;
+}
+
+static int range_order(const void *a, const void *b)
+{
+    const Range *x = a;
+    const Range *y = b;
+
+    return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/* Function: parse_set
+ *
+ * Purpose: Parse the braces of "field in {...}". Numbers become one sorted
+ * run of merged ranges for a binary search; addresses become an or of
+ * prefix tests.
+ *
+ * Arguements:
+ *      Parser *
+ *      FIELD
+ *
+ * Returns:
+ *      Node *
+ */
+static Node *parse_set(Parser *ps, FIELD field)
+{
+    uint32_t first = ps->filter->nranges;
+    uint32_t lo, hi;
+    uint32_t i, n;
+    Node *node = NULL;
+    Node *test;
+    char *dots;
+
+    do
+    {
+        if( !next_token(ps) )
+        {
+            parse_error(ps, "expected a value");
+            break;
+        }
+
+        if( fields[field].width == 16 )
+        {
+            test = prefix_test(ps, field, ps->token);
+            node = node ? node_new(ps, NODE_OR, node, test) : test;
+            continue;
+        }
+
+        dots = strstr(ps->token, "..");
+        if( dots )
+            *dots = '\0';
+
+        if( parse_number(ps->token, &lo) ||
+            (dots && parse_number(dots + 2, &hi)) )
+        {
+            parse_error(ps, "bad number");
+            break;
+        }
+
+        if( !dots )
+            hi = lo;
+
+        if( hi < lo )
+        {
+            parse_error(ps, "empty range");
+            break;
+        }
+
+        add_range(ps, lo, hi);
+    } while( !ps->failed && accept_token(ps, ",") );
+
+    if( !ps->failed && !accept_token(ps, "}") )
+    {
+        parse_error(ps, "expected }");
+    }
+
+    if( ps->failed || fields[field].width == 16 )
+    {
+        return node;
+    }
+
+    /* Sort and merge this set's ranges in place */
+    n = ps->filter->nranges - first;
+    qsort(ps->filter->ranges + first, n, sizeof(Range), range_order);
+    for( i = 1, lo = first; i < n; i++ )
+    {
+        Range *r = &ps->filter->ranges[first + i];
+        Range *last = &ps->filter->ranges[lo];
+
+        if( r->lo <= last->hi || r->lo == last->hi + 1 )
+        {
+            if( r->hi > last->hi )
+                last->hi = r->hi;
+        }
+        else
+        {
+            ps->filter->ranges[++lo] = *r;
+        }
+    }
+    ps->filter->nranges = n ? lo + 1 : first;
+
+    node = node_new(ps, NODE_TEST, NULL, NULL);
+    if( node != NULL )
+    {
+        node->test.op = OP_SET;
+        node->test.field = field;
+        node->test.a = first;
+        node->test.b = ps->filter->nranges - first;
+    }
+
+    return node;
+}
+
+static Node *parse_test(Parser *ps)
+{
+    static const char *ops[] = { "==", "!=", "<", "<=", ">", ">=" };
+    Node *node = NULL;
+    int negate = 0;
+    int field = -1;
+    size_t i;
+    int op;
+
+    for( i = 0; i < FIELDS; i++ )
+    {
+        if( strcmp(ps->token, fields[i].name) == 0 )
+            field = (int)i;
+    }
+
+    for( i = 0; field == -1 && i < sizeof(field_aliases) / sizeof(field_aliases[0]); i++ )
+    {
+        if( strcmp(ps->token, field_aliases[i].name) == 0 )
+            field = field_aliases[i].field;
+    }
+
+    if( field == -1 )
+    {
+        parse_error(ps, "unknown field");
+        return NULL;
+    }
+
+    if( accept_token(ps, "not") )
+    {
+        negate = 1;
+        if( !peek(ps, "in") )
+        {
+            parse_error(ps, "expected in");
+            return NULL;
+        }
+    }
+
+    if( accept_token(ps, "in") )
+    {
+        if( accept_token(ps, "{") )
+        {
+            node = parse_set(ps, (FIELD)field);
+        }
+        else if( fields[field].width == 16 && next_token(ps) )
+        {
+            node = prefix_test(ps, (FIELD)field, ps->token);
+        }
+        else
+        {
+            parse_error(ps, "expected {");
+        }
+
+        return negate && node ? node_new(ps, NODE_NOT, node, NULL) : node;
+    }
+
+    next_token(ps);
+    if( strcmp(ps->token, "=") == 0 )
+        strcpy(ps->token, "==");
+
+    for( op = 0; op < 6; op++ )
+    {
+        if( strcmp(ps->token, ops[op]) == 0 )
+            break;
+    }
+
+    if( op == 6 )
+    {
+        parse_error(ps, "expected an operator");
+        return NULL;
+    }
+
+    if( !next_token(ps) )
+    {
+        parse_error(ps, "expected a value");
+        return NULL;
+    }
+
+    if( fields[field].width == 16 )
+    {
+        if( op != OP_EQ && op != OP_NE )
+        {
+            parse_error(ps, "addresses only compare with == and !=");
+            return NULL;
+        }
+
+        node = prefix_test(ps, (FIELD)field, ps->token);
+        return op == OP_NE && node ? node_new(ps, NODE_NOT, node, NULL) : node;
+    }
+
+    node = node_new(ps, NODE_TEST, NULL, NULL);
+    if( node == NULL )
+        return NULL;
+
+    node->test.op = (uint8_t)op;
+    node->test.field = (uint8_t)field;
+    if( parse_number(ps->token, &node->test.a) )
+    {
+        parse_error(ps, "bad number");
+    }
+
+    return node;
+}
+
+static Node *parse_expr(Parser *ps);
+
+static Node *parse_factor(Parser *ps)
+{
+    Node *node;
+
+    if( !next_token(ps) )
+    {
+        parse_error(ps, "unexpected end");
+        return NULL;
+    }
+
+    if( strcmp(ps->token, "not") == 0 || strcmp(ps->token, "!") == 0 )
+    {
+        node = parse_factor(ps);
+        return node ? node_new(ps, NODE_NOT, node, NULL) : NULL;
+    }
+
+    if( strcmp(ps->token, "(") == 0 )
+    {
+        node = parse_expr(ps);
+        if( !ps->failed && !accept_token(ps, ")") )
+        {
+            parse_error(ps, "expected )");
+        }
+        return node;
+    }
+
+    return parse_test(ps);
+}
+
+static Node *parse_term(Parser *ps)
+{
+    Node *node = parse_factor(ps);
+
+    while( !ps->failed && (accept_token(ps, "and") || accept_token(ps, "&&")) )
+    {
+        node = node_new(ps, NODE_AND, node, parse_factor(ps));
+    }
+
+    return node;
+}
+
+static Node *parse_expr(Parser *ps)
+{
+    Node *node = parse_term(ps);
+
+    while( !ps->failed && (accept_token(ps, "or") || accept_token(ps, "||")) )
+    {
+        node = node_new(ps, NODE_OR, node, parse_term(ps));
+    }
+
+    return node;
+}
+
+/** CODE GENERATION ************************************************************/
+
+/* Function: emit
+ *
+ * Purpose: Generate the code of a node so that it ends up at t when the node
+ * is true and at f when it is false. Code is emitted back to front: the
+ * successors exist before the tests that jump to them.
+ *
+ * Arguements:
+ *      Unified2Filter *
+ *      const Node *
+ *      int32_t
+ *      int32_t
+ *
+ * Returns:
+ *      int32_t     entry point of the node, or REJECT - 1 when out of memory
+ */
+static int32_t emit(Unified2Filter *filter, const Node *node, int32_t t,
+    int32_t f)
+{
+    int32_t right;
+    Insn *insns;
+
+    switch( node->type )
+    {
+        case NODE_AND:
+        right = emit(filter, node->right, t, f);
+        return right < REJECT ? right : emit(filter, node->left, right, f);
+
+        case NODE_OR:
+        right = emit(filter, node->right, t, f);
+        return right < REJECT ? right : emit(filter, node->left, t, right);
+
+        case NODE_NOT:
+        return emit(filter, node->left, f, t);
+
+        case NODE_TEST:
+        default:
+        insns = (Insn *)_Unified2Realloc(filter->insns,
+            (filter->ninsns + 1) * sizeof(Insn), UNIFIED2_ALLOC_ANALYSIS);
+        if( insns == NULL )
+        {
+            return REJECT - 1;
+        }
+        filter->insns = insns;
+        insns[filter->ninsns] = node->test;
+        insns[filter->ninsns].jt = t;
+        insns[filter->ninsns].jf = f;
+
+        return (int32_t)filter->ninsns++;
+    }
+}
+
+/* Function: Unified2FilterCompile
+ *
+ * Purpose: Compile a filter expression, see the top of this file
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      Unified2Filter *    NULL after warning about the error
+ */
+Unified2Filter * Unified2FilterCompile(const char *expression)
+{
+    Unified2Filter *filter;
+    Parser ps;
+    Node *root;
+
+    if( expression == NULL )
+    {
+        return NULL;
+    }
+
+    filter = (Unified2Filter *)_Unified2Calloc(1, sizeof(Unified2Filter),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( filter == NULL )
+    {
+        warn("Unified2FilterCompile: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(&ps, 0x0, sizeof(ps));
+    ps.text = ps.p = expression;
+    ps.filter = filter;
+
+    skip_space(&ps);
+    if( *ps.p == '\0' )
+    {
+        /* The empty filter matches everything */
+        filter->entry = ACCEPT;
+        return filter;
+    }
+
+    root = parse_expr(&ps);
+    if( !ps.failed && next_token(&ps) )
+    {
+        parse_error(&ps, "unexpected token");
+    }
+
+    if( !ps.failed && root != NULL )
+    {
+        filter->entry = emit(filter, root, ACCEPT, REJECT);
+        if( filter->entry < REJECT )
+        {
+            warn("Unified2FilterCompile: failed to malloc: %s\n",
+            strerror(errno));
+            ps.failed = 1;
+        }
+    }
+
+    node_free(root);
+
+    if( ps.failed || root == NULL )
+    {
+        Unified2FilterFree(filter);
+        return NULL;
+    }
+
+    return filter;
+}
+
+/* Function: Unified2FilterFree
+ *
+ * Purpose: Release a compiled filter
+ *
+ * Arguements:
+ *      Unified2Filter *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2FilterFree(Unified2Filter *filter)
+{
+    if( filter != NULL )
+    {
+        _Unified2Free(filter->insns, UNIFIED2_ALLOC_ANALYSIS);
+        _Unified2Free(filter->ranges, UNIFIED2_ALLOC_ANALYSIS);
+        _Unified2Free(filter->prefixes, UNIFIED2_ALLOC_ANALYSIS);
+        _Unified2Free(filter, UNIFIED2_ALLOC_ANALYSIS);
+    }
+}
+
+/** MATCHING *******************************************************************/
+
+static LAYOUT record_layout(uint32_t type)
+{
+    switch( type )
+    {
+        case UNIFIED2_IDS_EVENT:            return LAYOUT_EVENT;
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:         return LAYOUT_EVENT_V2;
+        case UNIFIED2_IDS_EVENT_IPV6:       return LAYOUT_EVENT6;
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:    return LAYOUT_EVENT6_V2;
+        case UNIFIED2_PACKET:               return LAYOUT_PACKET;
+        case UNIFIED2_EXTRA_DATA:           return LAYOUT_EXTRA;
+        default:                            return LAYOUT_OTHER;
+    }
+}
+
+static int in_ranges(const Range *ranges, uint32_t n, uint32_t value)
+{
+    uint32_t lo = 0;
+    uint32_t hi = n;
+    uint32_t mid;
+
+    while( lo < hi )
+    {
+        mid = (lo + hi) / 2;
+        if( value < ranges[mid].lo )
+            hi = mid;
+        else if( value > ranges[mid].hi )
+            lo = mid + 1;
+        else
+            return 1;
+    }
+
+    return 0;
+}
+
+static int in_prefix(const Prefix *prefix, const uint8_t *addr)
+{
+    int bytes = prefix->bits / 8;
+    int bits = prefix->bits % 8;
+
+    if( memcmp(prefix->addr, addr, bytes) )
+        return 0;
+
+    return bits == 0 ||
+        ((prefix->addr[bytes] ^ addr[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+/* Function: run_test
+ *
+ * Purpose: Evaluate one test against a raw record
+ *
+ * Arguements:
+ *      const Unified2Filter *
+ *      const Insn *
+ *      const uint8_t *
+ *      uint32_t
+ *      LAYOUT
+ *
+ * Returns:
+ *      int
+ */
+static int run_test(const Unified2Filter *filter, const Insn *insn,
+    const uint8_t *record, uint32_t length, LAYOUT layout)
+{
+    const FieldInfo *info = &fields[insn->field];
+    int offset = info->offset[layout];
+    int width = info->width;
+    const Prefix *prefix;
+    uint32_t value;
+    uint16_t v16;
+
+    if( offset < 0 )
+        return 0;
+
+    if( width == 16 )
+    {
+        prefix = &filter->prefixes[insn->a];
+
+        /* An IPv4 event carries four bytes of address */
+        if( prefix->ipv6 != (layout == LAYOUT_EVENT6 ||
+            layout == LAYOUT_EVENT6_V2) )
+            return 0;
+        if( !prefix->ipv6 )
+            width = 4;
+        if( (uint32_t)offset + width > length )
+            return 0;
+
+        return in_prefix(prefix, record + offset);
+    }
+
+    if( (uint32_t)offset + width > length )
+        return 0;
+
+    switch( width )
+    {
+        case 1:
+        value = record[offset];
+        break;
+
+        case 2:
+        memcpy(&v16, record + offset, sizeof(v16));
+        value = ntohs(v16);
+        break;
+
+        default:
+        memcpy(&value, record + offset, sizeof(value));
+        value = ntohl(value);
+        break;
+    }
+
+    switch( insn->op )
+    {
+        case OP_EQ:     return value == insn->a;
+        case OP_NE:     return value != insn->a;
+        case OP_LT:     return value < insn->a;
+        case OP_LE:     return value <= insn->a;
+        case OP_GT:     return value > insn->a;
+        case OP_GE:     return value >= insn->a;
+        case OP_SET:    return in_ranges(filter->ranges + insn->a, insn->b, value);
+        default:        return 0;
+    }
+}
+
+/* Function: Unified2FilterMatch
+ *
+ * Purpose: Run a compiled filter over a raw record, header included
+ *
+ * Arguements:
+ *      const Unified2Filter *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      int         1 when the record matches
+ */
+int Unified2FilterMatch(const Unified2Filter *filter, const uint8_t *record,
+    uint32_t length)
+{
+    const Insn *insn;
+    uint32_t type;
+    LAYOUT layout;
+    int32_t pc;
+
+    if( filter == NULL || record == NULL ||
+        length < sizeof(Unified2RecordHeader) )
+    {
+        return 0;
+    }
+
+    memcpy(&type, record, sizeof(type));
+    layout = record_layout(ntohl(type));
+
+    for( pc = filter->entry; pc >= 0; )
+    {
+        insn = &filter->insns[pc];
+        pc = run_test(filter, insn, record, length, layout) ? insn->jt : insn->jf;
+    }
+
+    return pc == ACCEPT;
+}
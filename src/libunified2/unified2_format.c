@@ -0,0 +1,1241 @@
+/*******************************************************************************
+ * Text formatters.
+ *
+ * printf() parses its format string and goes through locale aware conversion
+ * for every field of every record, which at millions of events costs far more
+ * than reading them. The formatters here append straight into a
+ * Unified2Buffer with hand rolled number conversion and lookup tables for
+ * address octets, protocols and actions, and the buffer reaches the file
+ * descriptor in large writes.
+ *
+ * The CSV and dump output is byte for byte what the printf() based code
+ * produced, including signed signature ids and inet_ntop()'s IPv6 notation.
+ * JSON is written one object per line (NDJSON) with unsigned numbers and
+ * packet and extra data payloads in base64 or hex.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unified2.h"
+
+#define BUFFER_DEFAULT_SIZE (1 << 20)
+
+/* Longest CSV line: two IPv6 addresses plus the numeric fields */
+#define CSV_MAX_LINE        256
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char octets[256][4] = {
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11",
+    "12", "13", "14", "15", "16", "17", "18", "19", "20", "21", "22", "23",
+    "24", "25", "26", "27", "28", "29", "30", "31", "32", "33", "34", "35",
+    "36", "37", "38", "39", "40", "41", "42", "43", "44", "45", "46", "47",
+    "48", "49", "50", "51", "52", "53", "54", "55", "56", "57", "58", "59",
+    "60", "61", "62", "63", "64", "65", "66", "67", "68", "69", "70", "71",
+    "72", "73", "74", "75", "76", "77", "78", "79", "80", "81", "82", "83",
+    "84", "85", "86", "87", "88", "89", "90", "91", "92", "93", "94", "95",
+    "96", "97", "98", "99", "100", "101", "102", "103", "104", "105", "106", "107",
+    "108", "109", "110", "111", "112", "113", "114", "115", "116", "117", "118", "119",
+    "120", "121", "122", "123", "124", "125", "126", "127", "128", "129", "130", "131",
+    "132", "133", "134", "135", "136", "137", "138", "139", "140", "141", "142", "143",
+    "144", "145", "146", "147", "148", "149", "150", "151", "152", "153", "154", "155",
+    "156", "157", "158", "159", "160", "161", "162", "163", "164", "165", "166", "167",
+    "168", "169", "170", "171", "172", "173", "174", "175", "176", "177", "178", "179",
+    "180", "181", "182", "183", "184", "185", "186", "187", "188", "189", "190", "191",
+    "192", "193", "194", "195", "196", "197", "198", "199", "200", "201", "202", "203",
+    "204", "205", "206", "207", "208", "209", "210", "211", "212", "213", "214", "215",
+    "216", "217", "218", "219", "220", "221", "222", "223", "224", "225", "226", "227",
+    "228", "229", "230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
+    "240", "241", "242", "243", "244", "245", "246", "247", "248", "249", "250", "251",
+    "252", "253", "254", "255",
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+typedef struct _Label {
+    const char *text;
+    uint32_t length;
+} Label;
+
+#define LABEL(s) { s, sizeof(s) - 1 }
+
+static const Label action_labels[2] = { LABEL("Alert"), LABEL("Drop") };
+
+/* Everything that is not ICMP, TCP or UDP is "IP" */
+static const Label protocol_labels[256] = {
+    [0 ... 255] = LABEL("IP"),
+    [1] = LABEL("ICMP"),
+    [6] = LABEL("TCP"),
+    [17] = LABEL("UDP"),
+};
+
+/* Function: _Unified2FormatU32
+ *
+ * Purpose: Write a number in decimal, two digits at a time
+ *
+ * Arguements:
+ *      char *
+ *      uint32_t
+ *
+ * Returns:
+ *      char *      end of the number
+ */
+char * _Unified2FormatU32(char *p, uint32_t value)
+{
+    char tmp[10];
+    char *t = tmp + sizeof(tmp);
+    uint32_t pair;
+    int n;
+
+    while( value >= 100 )
+    {
+        pair = (value % 100) * 2;
+        value /= 100;
+        *--t = digit_pairs[pair + 1];
+        *--t = digit_pairs[pair];
+    }
+
+    if( value >= 10 )
+    {
+        *--t = digit_pairs[value * 2 + 1];
+        *--t = digit_pairs[value * 2];
+    }
+    else
+    {
+        *--t = '0' + value;
+    }
+
+    n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+
+    return p + n;
+}
+
+/* Function: _Unified2FormatI32
+ *
+ * Purpose: Write a number in decimal the way %d does
+ *
+ * Arguements:
+ *      char *
+ *      int32_t
+ *
+ * Returns:
+ *      char *
+ */
+char * _Unified2FormatI32(char *p, int32_t value)
+{
+    if( value < 0 )
+    {
+        *p++ = '-';
+        return _Unified2FormatU32(p, 0U - (uint32_t)value);
+    }
+
+    return _Unified2FormatU32(p, value);
+}
+
+/* Function: _Unified2FormatIPv4
+ *
+ * Purpose: Write a dotted quad. The address is taken as the integer the
+ * reader left in the event, most significant octet first.
+ *
+ * Arguements:
+ *      char *
+ *      uint32_t
+ *
+ * Returns:
+ *      char *
+ */
+char * _Unified2FormatIPv4(char *p, uint32_t address)
+{
+    const char *octet;
+    int shift;
+
+    for( shift = 24; shift >= 0; shift -= 8 )
+    {
+        octet = octets[(address >> shift) & 0xff];
+        p[0] = octet[0];
+        p[1] = octet[1];
+        p[2] = octet[2];
+        p += 1 + (octet[1] != '\0') + (octet[2] != '\0');
+
+        if( shift )
+        {
+            *p++ = '.';
+        }
+    }
+
+    return p;
+}
+
+static char *format_hex16(char *p, uint32_t value)
+{
+    if( value >= 0x1000 )
+        *p++ = hex_digits[value >> 12];
+    if( value >= 0x100 )
+        *p++ = hex_digits[(value >> 8) & 0xf];
+    if( value >= 0x10 )
+        *p++ = hex_digits[(value >> 4) & 0xf];
+    *p++ = hex_digits[value & 0xf];
+
+    return p;
+}
+
+/* Function: _Unified2FormatIPv6
+ *
+ * Purpose: Write an IPv6 address exactly like glibc's inet_ntop(): the
+ * longest run of two or more zero groups (the first one on a tie) becomes
+ * "::", and IPv4 compatible and mapped addresses end in a dotted quad.
+ *
+ * Arguements:
+ *      char *
+ *      const struct in6_addr *
+ *
+ * Returns:
+ *      char *
+ */
+char * _Unified2FormatIPv6(char *p, const struct in6_addr *address)
+{
+    const uint8_t *b = (const uint8_t *)address;
+    uint32_t words[8];
+    int best_base = -1, best_len = 0;
+    int cur_base = -1, cur_len = 0;
+    int i;
+
+    for( i = 0; i < 8; i++ )
+    {
+        words[i] = (b[i * 2] << 8) | b[i * 2 + 1];
+
+        if( words[i] == 0 )
+        {
+            if( cur_base == -1 )
+            {
+                cur_base = i;
+                cur_len = 0;
+            }
+            cur_len++;
+        }
+        else if( cur_base != -1 )
+        {
+            if( cur_len > best_len )
+            {
+                best_base = cur_base;
+                best_len = cur_len;
+            }
+            cur_base = -1;
+        }
+    }
+
+    if( cur_base != -1 && cur_len > best_len )
+    {
+        best_base = cur_base;
+        best_len = cur_len;
+    }
+
+    if( best_len < 2 )
+    {
+        best_base = -1;
+    }
+
+    for( i = 0; i < 8; i++ )
+    {
+        if( best_base != -1 && i >= best_base && i < best_base + best_len )
+        {
+            if( i == best_base )
+            {
+                *p++ = ':';
+            }
+            continue;
+        }
+
+        if( i != 0 )
+        {
+            *p++ = ':';
+        }
+
+        if( i == 6 && best_base == 0 &&
+            (best_len == 6 || (best_len == 5 && words[5] == 0xffff)) )
+        {
+            return _Unified2FormatIPv4(p,
+                ((uint32_t)b[12] << 24) | (b[13] << 16) | (b[14] << 8) | b[15]);
+        }
+
+        p = format_hex16(p, words[i]);
+    }
+
+    if( best_base != -1 && best_base + best_len == 8 )
+    {
+        *p++ = ':';
+    }
+
+    return p;
+}
+
+/* Function: Unified2BufferInit
+ *
+ * Purpose: Set up an output buffer. With a file descriptor it is written out
+ * whenever it fills up; with -1 it grows instead and the caller takes the
+ * data from it.
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      int
+ *      uint32_t    0 for the default of 1MB
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2BufferInit(Unified2Buffer *buffer, int fd, uint32_t size)
+{
+    if( buffer == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( size < CSV_MAX_LINE * 4 )
+    {
+        size = size ? CSV_MAX_LINE * 4 : BUFFER_DEFAULT_SIZE;
+    }
+
+    buffer->data = (char *)_Unified2Malloc(size, UNIFIED2_ALLOC_BUFFER);
+    if( buffer->data == NULL )
+    {
+        warn("Unified2BufferInit: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    buffer->used = 0;
+    buffer->size = size;
+    buffer->fd = fd;
+    buffer->fixed = 0;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2BufferWrap
+ *
+ * Purpose: Format into memory the caller provides. The buffer is never grown
+ * or written anywhere; formatting fails once a record no longer fits and the
+ * caller is expected to take the data out and reset used.
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      void *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2BufferWrap(Unified2Buffer *buffer, void *data, uint32_t size)
+{
+    if( buffer == NULL || data == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    buffer->data = (char *)data;
+    buffer->used = 0;
+    buffer->size = size;
+    buffer->fd = -1;
+    buffer->fixed = 1;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2BufferFlush
+ *
+ * Purpose: Write everything buffered so far to the file descriptor
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2BufferFlush(Unified2Buffer *buffer)
+{
+    uint32_t done = 0;
+    ssize_t n;
+
+    if( buffer->fd == -1 )
+    {
+        return UNIFIED2_OK;
+    }
+
+    while( done < buffer->used )
+    {
+        n = write(buffer->fd, buffer->data + done, buffer->used - done);
+        if( n == -1 )
+        {
+            if( errno == EINTR || errno == EAGAIN )
+                continue;
+            warn("Unified2BufferFlush: write failed: %s\n", strerror(errno));
+            return UNIFIED2_ERROR;
+        }
+        done += n;
+    }
+    buffer->used = 0;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2BufferReserve
+ *
+ * Purpose: Make room for at least size more bytes, flushing or growing the
+ * buffer as needed
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      uint32_t
+ *
+ * Returns:
+ *      char *      where to write, NULL on error
+ */
+char * Unified2BufferReserve(Unified2Buffer *buffer, uint32_t size)
+{
+    uint32_t grow;
+    char *data;
+
+    if( buffer->size - buffer->used >= size )
+    {
+        return buffer->data + buffer->used;
+    }
+
+    if( buffer->fixed )
+    {
+        return NULL;
+    }
+
+    if( buffer->fd != -1 )
+    {
+        if( Unified2BufferFlush(buffer) != UNIFIED2_OK )
+        {
+            return NULL;
+        }
+        if( buffer->size >= size )
+        {
+            return buffer->data;
+        }
+    }
+
+    grow = buffer->size * 2;
+    while( grow - buffer->used < size )
+    {
+        grow *= 2;
+    }
+
+    data = (char *)_Unified2Realloc(buffer->data, grow, UNIFIED2_ALLOC_BUFFER);
+    if( data == NULL )
+    {
+        warn("Unified2BufferReserve: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    buffer->data = data;
+    buffer->size = grow;
+
+    return buffer->data + buffer->used;
+}
+
+/* Function: Unified2BufferAppend
+ *
+ * Purpose: Append raw bytes
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const void *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2BufferAppend(Unified2Buffer *buffer, const void *data,
+    uint32_t size)
+{
+    char *p = Unified2BufferReserve(buffer, size);
+
+    if( p == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    memcpy(p, data, size);
+    buffer->used += size;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2BufferFree
+ *
+ * Purpose: Flush and release an output buffer
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2BufferFree(Unified2Buffer *buffer)
+{
+    HRESULT r;
+
+    if( buffer == NULL || buffer->data == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    r = Unified2BufferFlush(buffer);
+    if( !buffer->fixed )
+    {
+        _Unified2Free(buffer->data, UNIFIED2_ALLOC_BUFFER);
+    }
+    buffer->data = NULL;
+    buffer->used = buffer->size = 0;
+
+    return r;
+}
+
+static char *format_label(char *p, const Label *label)
+{
+    memcpy(p, label->text, label->length);
+
+    return p + label->length;
+}
+
+/* Function: format_csv_tail
+ *
+ * Purpose: The fields every event type shares after the addresses
+ *
+ * Arguements:
+ *      char *
+ *      ...
+ *
+ * Returns:
+ *      char *
+ */
+static char *format_csv_tail(char *p, uint16_t dport_icode, uint8_t protocol,
+    uint8_t packet_action)
+{
+    *p++ = ',';
+    p = _Unified2FormatU32(p, dport_icode);
+    *p++ = ',';
+    p = format_label(p, &protocol_labels[protocol]);
+    *p++ = ',';
+    p = format_label(p, &action_labels[packet_action == 0x20]);
+    *p++ = '\n';
+
+    return p;
+}
+
+static char *format_csv_head(char *p, uint32_t sid, uint32_t gid, uint32_t rev)
+{
+    p = _Unified2FormatI32(p, sid);
+    *p++ = ',';
+    p = _Unified2FormatI32(p, gid);
+    *p++ = ',';
+    p = _Unified2FormatI32(p, rev);
+    *p++ = ',';
+
+    return p;
+}
+
+/* Function: format_csv_address
+ *
+ * Purpose: An address of a normalized event, IPv4 ones as the dotted quad of
+ * the integer the reader leaves in a Unified2Event, as u2csv always printed
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2NormalizedEvent *
+ *      const struct in6_addr *
+ *
+ * Returns:
+ *      char *
+ */
+static char *format_csv_address(char *p, const Unified2NormalizedEvent *event,
+    const struct in6_addr *address)
+{
+    uint32_t ipv4;
+
+    if( event->flags & UNIFIED2_EVENT_IPV6 )
+    {
+        return _Unified2FormatIPv6(p, address);
+    }
+
+    memcpy(&ipv4, address->s6_addr + 12, sizeof(ipv4));
+
+    return _Unified2FormatIPv4(p, ipv4);
+}
+
+/* Function: Unified2FormatCsvEvent
+ *
+ * Purpose: Append a normalized event as a line of u2csv output
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2NormalizedEvent *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatCsvEvent(Unified2Buffer *buffer,
+    const Unified2NormalizedEvent *event)
+{
+    char *start, *p;
+
+    start = p = Unified2BufferReserve(buffer, CSV_MAX_LINE);
+    if( p == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    p = format_csv_head(p, event->signature_id, event->generator_id,
+        event->signature_revision);
+    p = format_csv_address(p, event, &event->ip_source);
+    *p++ = ',';
+    p = _Unified2FormatU32(p, event->sport_itype);
+    *p++ = ',';
+    p = format_csv_address(p, event, &event->ip_destination);
+    p = format_csv_tail(p, event->dport_icode, event->protocol,
+        event->packet_action);
+
+    buffer->used += p - start;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2FormatCsv
+ *
+ * Purpose: Append an event as a line of u2csv output. Records that are not
+ * events produce nothing.
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatCsv(Unified2Buffer *buffer, const Unified2Entry *entry)
+{
+    Unified2NormalizedEvent event;
+
+    switch( Unified2EventFromEntry(&event, entry) )
+    {
+        case UNIFIED2_OK:
+        return Unified2FormatCsvEvent(buffer, &event);
+
+        case UNIFIED2_WARN:
+        return UNIFIED2_OK;
+
+        default:
+        return UNIFIED2_ERROR;
+    }
+}
+
+#define LINE(p, s) (memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static char *dump_i32(char *p, const char *label, int32_t value)
+{
+    memcpy(p, label, 20);
+    p = _Unified2FormatI32(p + 20, value);
+    *p++ = '\n';
+
+    return p;
+}
+
+static char *dump_ipv4(char *p, const char *label, uint32_t address)
+{
+    memcpy(p, label, 20);
+    p = _Unified2FormatIPv4(p + 20, address);
+    *p++ = '\n';
+
+    return p;
+}
+
+static char *dump_ipv6(char *p, const char *label,
+    const struct in6_addr *address)
+{
+    memcpy(p, label, 20);
+    p = _Unified2FormatIPv6(p + 20, address);
+    *p++ = '\n';
+
+    return p;
+}
+
+/* Function: dump_event_head
+ *
+ * Purpose: The fields every event type starts with, up to the addresses
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2Event *
+ *
+ * Returns:
+ *      char *
+ */
+static char *dump_event_head(char *p, const Unified2Event *event)
+{
+    p = dump_i32(p, "Sensor id           ", event->sensor_id);
+    p = dump_i32(p, "Event id            ", event->event_id);
+    p = dump_i32(p, "Event second        ", event->event_second);
+    p = dump_i32(p, "Event microsecond   ", event->event_microsecond);
+    p = dump_i32(p, "Signature id        ", event->signature_id);
+    p = dump_i32(p, "Generator id        ", event->generator_id);
+    p = dump_i32(p, "Signature rev       ", event->signature_revision);
+    p = dump_i32(p, "Classification id   ", event->classification_id);
+    p = dump_i32(p, "Priority id         ", event->priority_id);
+
+    return p;
+}
+
+static char *dump_event_tail(char *p, uint16_t sport_itype,
+    uint16_t dport_icode, uint8_t protocol, uint8_t packet_action)
+{
+    p = dump_i32(p, "Source port         ", sport_itype);
+    p = dump_i32(p, "Desintation port    ", dport_icode);
+    p = dump_i32(p, "Protocol            ", protocol);
+    p = dump_i32(p, "Packet action       ", packet_action);
+
+    return p;
+}
+
+static char *dump_event_v2(char *p, uint32_t mpls_label, uint16_t vlan_id,
+    uint16_t policy_id)
+{
+    p = dump_i32(p, "MPLS Label          ", mpls_label);
+    p = dump_i32(p, "Vlan ID             ", vlan_id);
+    p = dump_i32(p, "Policy ID           ", policy_id);
+
+    return p;
+}
+
+/* Function: dump_hex
+ *
+ * Purpose: The hex and ASCII table Unified2PrintPacketData() prints: an
+ * offset, sixteen bytes in hex padded out to full width, then the printable
+ * characters.
+ *
+ * Arguements:
+ *      char *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      char *
+ */
+static char *dump_hex(char *p, const uint8_t *data, uint32_t length)
+{
+    static const char upper[] = "0123456789ABCDEF";
+    uint32_t offset, c, j;
+    char digits[16];
+    char *d;
+
+    for( offset = 0; offset < length; offset += 16 )
+    {
+        c = length - offset >= 16 ? 16 : length - offset;
+
+        /* %04X: at least four digits */
+        d = digits + sizeof(digits);
+        j = offset;
+        do {
+            *--d = upper[j & 0xf];
+            j >>= 4;
+        } while( j );
+        while( digits + sizeof(digits) - d < 4 )
+            *--d = '0';
+        memcpy(p, d, digits + sizeof(digits) - d);
+        p += digits + sizeof(digits) - d;
+        *p++ = ' ';
+        *p++ = ' ';
+
+        for( j = 0; j < c; j++ )
+        {
+            p[0] = upper[data[offset + j] >> 4];
+            p[1] = upper[data[offset + j] & 0xf];
+            p[2] = ' ';
+            p += 3;
+        }
+
+        for( j = c; j < 16; j++ )
+        {
+            p = LINE(p, "   ");
+        }
+
+        *p++ = ' ';
+        for( j = 0; j < c; j++ )
+        {
+            /* isprint() in the C locale */
+            *p++ = data[offset + j] >= 0x20 && data[offset + j] < 0x7f ?
+                data[offset + j] : '.';
+        }
+        *p++ = '\n';
+    }
+
+    return p;
+}
+
+/* Function: Unified2FormatDump
+ *
+ * Purpose: Append a record in the layout of Unified2PrintRecord(), which is
+ * what u2dump prints
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatDump(Unified2Buffer *buffer, const Unified2Entry *entry)
+{
+    const Unified2Event *event;
+    const Unified2Event6 *event6;
+    const Unified2Packet *packet;
+    uint32_t size = 1024;
+    char *start, *p;
+
+    if( entry == NULL || entry->record == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( entry->record->type == UNIFIED2_PACKET )
+    {
+        /* 72 bytes per line of sixteen, plus the offset growing past 4 digits */
+        size += (entry->packet->packet_length / 16 + 1) * 80;
+    }
+
+    start = p = Unified2BufferReserve(buffer, size);
+    if( p == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    switch( entry->record->type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        event = entry->event;
+        p = LINE(p, "\n__ Event __________________________________________________________\n");
+        p = dump_event_head(p, event);
+        p = dump_ipv4(p, "IP source           ", event->ip_source);
+        p = dump_ipv4(p, "IP destination      ", event->ip_destination);
+        p = dump_event_tail(p, event->sport_itype, event->dport_icode,
+            event->protocol, event->packet_action);
+        break;
+
+        case UNIFIED2_IDS_EVENT_V2:
+        event = (const Unified2Event *)entry->event_v2;
+        p = LINE(p, "\n__ Event v2 _______________________________________________________\n");
+        p = dump_event_head(p, event);
+        p = dump_ipv4(p, "IP source           ", event->ip_source);
+        p = dump_ipv4(p, "IP destination      ", event->ip_destination);
+        p = dump_event_tail(p, event->sport_itype, event->dport_icode,
+            event->protocol, event->packet_action);
+        p = dump_event_v2(p, entry->event_v2->mpls_label,
+            entry->event_v2->vlan_id, entry->event_v2->policy_id);
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        event6 = entry->event6;
+        p = LINE(p, "\n__ Event6 _________________________________________________________\n");
+        p = dump_event_head(p, (const Unified2Event *)event6);
+        p = dump_ipv6(p, "IP source           ", &event6->ip_source);
+        p = dump_ipv6(p, "IP destination      ", &event6->ip_destination);
+        p = dump_event_tail(p, event6->sport_itype, event6->dport_icode,
+            event6->protocol, event6->packet_action);
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        event6 = (const Unified2Event6 *)entry->event6_v2;
+        p = LINE(p, "\n__ Event6 v2 ______________________________________________________\n");
+        p = dump_event_head(p, (const Unified2Event *)event6);
+        p = dump_ipv6(p, "IP source           ", &event6->ip_source);
+        p = dump_ipv6(p, "IP destination      ", &event6->ip_destination);
+        p = dump_event_tail(p, event6->sport_itype, event6->dport_icode,
+            event6->protocol, event6->packet_action);
+        p = dump_event_v2(p, entry->event6_v2->mpls_label,
+            entry->event6_v2->vlan_id, entry->event6_v2->policy_id);
+        break;
+
+        case UNIFIED2_PACKET:
+        packet = entry->packet;
+        p = LINE(p, "\n__ Packet _________________________________________________________\n");
+        p = dump_i32(p, "Sensor id           ", packet->sensor_id);
+        p = dump_i32(p, "Event id            ", packet->event_id);
+        p = dump_i32(p, "Event second        ", packet->event_second);
+        p = dump_i32(p, "Packet second       ", packet->packet_second);
+        p = dump_i32(p, "Packet microsecond  ", packet->packet_microsecond);
+        p = dump_i32(p, "Packet linktype     ", packet->linktype);
+        p = dump_i32(p, "Packet length       ", packet->packet_length);
+        *p++ = '\n';
+        p = dump_hex(p, entry->packet_data, packet->packet_length);
+        break;
+    }
+
+    buffer->used += p - start;
+
+    return UNIFIED2_OK;
+}
+
+typedef enum _PAYLOAD_ENCODING {
+    PAYLOAD_BASE64,
+    PAYLOAD_HEX,
+} PAYLOAD_ENCODING;
+
+#define JSON_KEY(p, key) LINE(p, ",\"" key "\":")
+
+static char *json_u32(char *p, const char *key, uint32_t length, uint32_t value)
+{
+    p[0] = ',';
+    p[1] = '"';
+    memcpy(p + 2, key, length);
+    p += 2 + length;
+    p[0] = '"';
+    p[1] = ':';
+
+    return _Unified2FormatU32(p + 2, value);
+}
+
+#define JSON_U32(p, key, value) json_u32(p, key, sizeof(key) - 1, value)
+
+/* Addresses were left in network byte order by the reader */
+static char *json_ipv4(char *p, uint32_t address)
+{
+    const uint8_t *b = (const uint8_t *)&address;
+
+    *p++ = '"';
+    p = _Unified2FormatIPv4(p,
+        ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]);
+    *p++ = '"';
+
+    return p;
+}
+
+static char *json_ipv6(char *p, const struct in6_addr *address)
+{
+    *p++ = '"';
+    p = _Unified2FormatIPv6(p, address);
+    *p++ = '"';
+
+    return p;
+}
+
+/* Function: json_payload
+ *
+ * Purpose: Write binary data as a JSON string, base64 (with padding) or
+ * lower case hex
+ *
+ * Arguements:
+ *      char *
+ *      const uint8_t *
+ *      uint32_t
+ *      PAYLOAD_ENCODING
+ *
+ * Returns:
+ *      char *
+ */
+static char *json_payload(char *p, const uint8_t *data, uint32_t length,
+    PAYLOAD_ENCODING encoding)
+{
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t i, v;
+
+    *p++ = '"';
+
+    if( encoding == PAYLOAD_HEX )
+    {
+        for( i = 0; i < length; i++ )
+        {
+            p[0] = hex_digits[data[i] >> 4];
+            p[1] = hex_digits[data[i] & 0xf];
+            p += 2;
+        }
+    }
+    else
+    {
+        for( i = 0; i + 3 <= length; i += 3 )
+        {
+            v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+            p[0] = base64[v >> 18];
+            p[1] = base64[(v >> 12) & 0x3f];
+            p[2] = base64[(v >> 6) & 0x3f];
+            p[3] = base64[v & 0x3f];
+            p += 4;
+        }
+
+        if( i < length )
+        {
+            v = data[i] << 16;
+            if( i + 1 < length )
+                v |= data[i + 1] << 8;
+
+            p[0] = base64[v >> 18];
+            p[1] = base64[(v >> 12) & 0x3f];
+            p[2] = i + 1 < length ? base64[(v >> 6) & 0x3f] : '=';
+            p[3] = '=';
+            p += 4;
+        }
+    }
+
+    *p++ = '"';
+
+    return p;
+}
+
+/* Function: json_event_head
+ *
+ * Purpose: The fields every event type starts with, up to the addresses
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2Event *
+ *
+ * Returns:
+ *      char *
+ */
+static char *json_event_head(char *p, const Unified2Event *event)
+{
+    p = JSON_U32(p, "sensor_id", event->sensor_id);
+    p = JSON_U32(p, "event_id", event->event_id);
+    p = JSON_U32(p, "event_second", event->event_second);
+    p = JSON_U32(p, "event_microsecond", event->event_microsecond);
+    p = JSON_U32(p, "signature_id", event->signature_id);
+    p = JSON_U32(p, "generator_id", event->generator_id);
+    p = JSON_U32(p, "signature_revision", event->signature_revision);
+    p = JSON_U32(p, "classification_id", event->classification_id);
+    p = JSON_U32(p, "priority_id", event->priority_id);
+
+    return p;
+}
+
+static char *json_event_tail(char *p, uint16_t sport_itype,
+    uint16_t dport_icode, uint8_t protocol, uint8_t packet_action)
+{
+    p = JSON_U32(p, "sport_itype", sport_itype);
+    p = JSON_U32(p, "dport_icode", dport_icode);
+    p = JSON_U32(p, "protocol", protocol);
+    p = JSON_U32(p, "packet_action", packet_action);
+
+    return p;
+}
+
+static char *json_event_v2(char *p, uint32_t mpls_label, uint16_t vlan_id,
+    uint16_t policy_id)
+{
+    p = JSON_U32(p, "mpls_label", mpls_label);
+    p = JSON_U32(p, "vlan_id", vlan_id);
+    p = JSON_U32(p, "policy_id", policy_id);
+
+    return p;
+}
+
+/* Function: json_extra_data
+ *
+ * Purpose: Extra data: addresses are written as such, everything else as an
+ * encoded payload since nothing guarantees it is text
+ *
+ * Arguements:
+ *      char *
+ *      const Unified2ExtraData *
+ *      PAYLOAD_ENCODING
+ *
+ * Returns:
+ *      char *
+ */
+static char *json_extra_data(char *p, const Unified2ExtraData *extra,
+    PAYLOAD_ENCODING encoding)
+{
+    const uint8_t *blob = UNIFIED2_EXTRA_DATA_BLOB(extra);
+    uint32_t length = UNIFIED2_EXTRA_DATA_LENGTH(extra);
+    uint32_t address;
+
+    p = JSON_U32(p, "sensor_id", extra->sensor_id);
+    p = JSON_U32(p, "event_id", extra->event_id);
+    p = JSON_U32(p, "event_second", extra->event_second);
+    p = JSON_U32(p, "extra_type", extra->type);
+    p = JSON_U32(p, "data_type", extra->data_type);
+
+    if( extra->type == UNIFIED2_EXTRA_XFF_IPV4 && length == 4 )
+    {
+        memcpy(&address, blob, sizeof(address));
+        p = JSON_KEY(p, "address");
+        return json_ipv4(p, address);
+    }
+
+    if( (extra->type == UNIFIED2_EXTRA_XFF_IPV6 ||
+         extra->type == UNIFIED2_EXTRA_IPV6_SRC ||
+         extra->type == UNIFIED2_EXTRA_IPV6_DST) && length == 16 )
+    {
+        p = JSON_KEY(p, "address");
+        return json_ipv6(p, (const struct in6_addr *)blob);
+    }
+
+    p = JSON_KEY(p, "data");
+
+    return json_payload(p, blob, length, encoding);
+}
+
+/* Function: format_json
+ *
+ * Purpose: Append a record as one line of JSON
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Entry *
+ *      PAYLOAD_ENCODING
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT format_json(Unified2Buffer *buffer, const Unified2Entry *entry,
+    PAYLOAD_ENCODING encoding)
+{
+    const Unified2Event *event;
+    const Unified2Event6 *event6;
+    const Unified2Packet *packet;
+    uint32_t payload = 0;
+    char *start, *p;
+
+    if( entry == NULL || entry->record == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( entry->record->type == UNIFIED2_PACKET )
+    {
+        payload = entry->packet->packet_length;
+    }
+    else if( entry->record->type == UNIFIED2_EXTRA_DATA )
+    {
+        payload = UNIFIED2_EXTRA_DATA_LENGTH(entry->extra_data);
+    }
+
+    /* Hex doubles the payload, base64 needs 4 bytes for every 3 */
+    start = p = Unified2BufferReserve(buffer, 1024 + payload * 2);
+    if( p == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    p = LINE(p, "{\"record_type\":");
+    p = _Unified2FormatU32(p, entry->record->type);
+
+    switch( entry->record->type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_V2:
+        event = entry->record->type == UNIFIED2_IDS_EVENT ?
+            entry->event : (const Unified2Event *)entry->event_v2;
+
+        p = LINE(p, ",\"type\":\"event\"");
+        p = json_event_head(p, event);
+        p = JSON_KEY(p, "ip_source");
+        p = json_ipv4(p, event->ip_source);
+        p = JSON_KEY(p, "ip_destination");
+        p = json_ipv4(p, event->ip_destination);
+        p = json_event_tail(p, event->sport_itype, event->dport_icode,
+            event->protocol, event->packet_action);
+        if( entry->record->type == UNIFIED2_IDS_EVENT_V2 )
+        {
+            p = json_event_v2(p, entry->event_v2->mpls_label,
+                entry->event_v2->vlan_id, entry->event_v2->policy_id);
+        }
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        event6 = entry->record->type == UNIFIED2_IDS_EVENT_IPV6 ?
+            entry->event6 : (const Unified2Event6 *)entry->event6_v2;
+
+        p = LINE(p, ",\"type\":\"event\"");
+        p = json_event_head(p, (const Unified2Event *)event6);
+        p = JSON_KEY(p, "ip_source");
+        p = json_ipv6(p, &event6->ip_source);
+        p = JSON_KEY(p, "ip_destination");
+        p = json_ipv6(p, &event6->ip_destination);
+        p = json_event_tail(p, event6->sport_itype, event6->dport_icode,
+            event6->protocol, event6->packet_action);
+        if( entry->record->type == UNIFIED2_IDS_EVENT_IPV6_V2 )
+        {
+            p = json_event_v2(p, entry->event6_v2->mpls_label,
+                entry->event6_v2->vlan_id, entry->event6_v2->policy_id);
+        }
+        break;
+
+        case UNIFIED2_PACKET:
+        packet = entry->packet;
+        p = LINE(p, ",\"type\":\"packet\"");
+        p = JSON_U32(p, "sensor_id", packet->sensor_id);
+        p = JSON_U32(p, "event_id", packet->event_id);
+        p = JSON_U32(p, "event_second", packet->event_second);
+        p = JSON_U32(p, "packet_second", packet->packet_second);
+        p = JSON_U32(p, "packet_microsecond", packet->packet_microsecond);
+        p = JSON_U32(p, "linktype", packet->linktype);
+        p = JSON_U32(p, "packet_length", packet->packet_length);
+        p = JSON_KEY(p, "packet_data");
+        p = json_payload(p, entry->packet_data, packet->packet_length,
+            encoding);
+        break;
+
+        case UNIFIED2_EXTRA_DATA:
+        p = LINE(p, ",\"type\":\"extra_data\"");
+        p = json_extra_data(p, entry->extra_data, encoding);
+        break;
+    }
+
+    p = LINE(p, "}\n");
+    buffer->used += p - start;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2FormatJson
+ *
+ * Purpose: Append a record as a line of JSON, payloads in base64
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatJson(Unified2Buffer *buffer, const Unified2Entry *entry)
+{
+    return format_json(buffer, entry, PAYLOAD_BASE64);
+}
+
+/* Function: Unified2FormatJsonHex
+ *
+ * Purpose: Append a record as a line of JSON, payloads in hex
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatJsonHex(Unified2Buffer *buffer, const Unified2Entry *entry)
+{
+    return format_json(buffer, entry, PAYLOAD_HEX);
+}
@@ -0,0 +1,840 @@
+/*******************************************************************************
+ * Synthetic workload generator.
+ *
+ * Produces a stream of events, each followed by some packets and perhaps
+ * extra data, the way a sensor would log them. The mix of event types, the
+ * packet sizes, how skewed signatures and hosts are, the event rate and how
+ * much of the output is deliberately damaged are all configurable, see
+ * Unified2GeneratorDefaults().
+ *
+ * Records are encoded with Unified2SerializeRecord() straight into the
+ * caller's buffer. Everything random comes from one xoshiro256** stream
+ * seeded from the configuration, so a seed always yields the same bytes, and
+ * skewed choices are drawn from alias tables in constant time. Packet data is
+ * cut from a pool of random bytes made once up front.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include "unified2.h"
+
+/* Packet data is cut from this much random data, at random offsets */
+#define PAYLOAD_POOL    (1 << 16)
+
+/* Largest extra data blob generated */
+#define EXTRA_MAX       64
+
+/* Buffer Unified2GeneratorWrite() fills and writes out */
+#define WRITE_CHUNK     (1 << 20)
+
+/* Constant time sampling from a discrete distribution, Vose's alias method */
+typedef struct _Alias {
+    uint32_t n;
+    uint32_t *threshold;        /* keep i below this, scaled to 2^32 */
+    uint32_t *alias;
+} Alias;
+
+struct _Unified2Generator {
+    Unified2GeneratorConfig config;
+    uint64_t state[4];
+
+    Alias event_types;
+    Alias signatures;
+    Alias hosts;
+
+    uint8_t *payload;
+    uint32_t max_record;
+
+    /* a record made but not yet handed out, see Unified2GeneratorFill() */
+    uint8_t *scratch;
+    uint32_t scratch_length;
+
+    /* the event being written and what is still to follow it */
+    uint64_t events;
+    uint32_t event_id;
+    uint32_t sensor_id;
+    uint32_t second;
+    uint32_t microsecond;
+    uint32_t packets_left;
+    int extra_left;
+    double clock;
+
+    Unified2ExtraData *extra;   /* with EXTRA_MAX bytes of blob after it */
+};
+
+static const uint32_t event_types[4] = {
+    UNIFIED2_IDS_EVENT,
+    UNIFIED2_IDS_EVENT_V2,
+    UNIFIED2_IDS_EVENT_IPV6,
+    UNIFIED2_IDS_EVENT_IPV6_V2,
+};
+
+static const uint16_t service_ports[] = {
+    80, 443, 53, 25, 22, 445, 3389, 8080, 123, 110, 143, 21,
+};
+
+/** RANDOMNESS *****************************************************************/
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t next_random(Unified2Generator *gen)
+{
+    uint64_t *s = gen->state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n) */
+static inline uint32_t uniform(Unified2Generator *gen, uint32_t n)
+{
+    return (uint32_t)(((next_random(gen) >> 32) * n) >> 32);
+}
+
+/* Uniform in [0, 1) */
+static inline double unit(Unified2Generator *gen)
+{
+    return (next_random(gen) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint32_t alias_sample(Unified2Generator *gen, const Alias *a)
+{
+    uint64_t r = next_random(gen);
+    uint32_t i = (uint32_t)(((r >> 32) * a->n) >> 32);
+
+    return (uint32_t)r < a->threshold[i] ? i : a->alias[i];
+}
+
+/* Function: alias_init
+ *
+ * Purpose: Build an alias table over n weights, or a Zipf distribution of
+ * exponent skew over n ranks when weights is NULL.
+ *
+ * Arguements:
+ *      Alias *
+ *      uint32_t
+ *      const uint32_t *
+ *      double
+ *
+ * Returns:
+ *      int
+ */
+static int alias_init(Alias *a, uint32_t n, const uint32_t *weights,
+    double skew)
+{
+    double *p = NULL;
+    uint32_t *small = NULL;
+    uint32_t *large = NULL;
+    uint32_t ns = 0, nl = 0;
+    uint32_t i, s, l;
+    double total = 0;
+
+    a->n = n;
+    a->threshold = (uint32_t *)_Unified2Malloc(n * sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    a->alias = (uint32_t *)_Unified2Malloc(n * sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    p = (double *)_Unified2Malloc(n * sizeof(double), UNIFIED2_ALLOC_ANALYSIS);
+    small = (uint32_t *)_Unified2Malloc(n * sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    large = (uint32_t *)_Unified2Malloc(n * sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( a->threshold == NULL || a->alias == NULL || p == NULL ||
+        small == NULL || large == NULL )
+    {
+        _Unified2Free(p, UNIFIED2_ALLOC_ANALYSIS);
+        _Unified2Free(small, UNIFIED2_ALLOC_ANALYSIS);
+        _Unified2Free(large, UNIFIED2_ALLOC_ANALYSIS);
+        return -1;
+    }
+
+    for( i = 0; i < n; i++ )
+    {
+        p[i] = weights ? weights[i] : (skew > 0 ? pow(i + 1, -skew) : 1.0);
+        total += p[i];
+    }
+
+    for( i = 0; i < n; i++ )
+    {
+        p[i] = total > 0 ? p[i] * n / total : 1.0;
+        if( p[i] < 1.0 )
+            small[ns++] = i;
+        else
+            large[nl++] = i;
+    }
+
+    while( ns && nl )
+    {
+        s = small[--ns];
+        l = large[nl - 1];
+        a->threshold[s] = (uint32_t)(p[s] * 4294967296.0);
+        a->alias[s] = l;
+
+        p[l] -= 1.0 - p[s];
+        if( p[l] < 1.0 )
+        {
+            nl--;
+            small[ns++] = l;
+        }
+    }
+
+    /* What is left is 1 up to rounding */
+    while( nl )
+    {
+        l = large[--nl];
+        a->threshold[l] = UINT32_MAX;
+        a->alias[l] = l;
+    }
+
+    while( ns )
+    {
+        s = small[--ns];
+        a->threshold[s] = UINT32_MAX;
+        a->alias[s] = s;
+    }
+
+    _Unified2Free(p, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(small, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(large, UNIFIED2_ALLOC_ANALYSIS);
+
+    return 0;
+}
+
+static void alias_free(Alias *a)
+{
+    _Unified2Free(a->threshold, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(a->alias, UNIFIED2_ALLOC_ANALYSIS);
+}
+
+/* Spread host ranks over the address space, the same rank always being the
+ * same address */
+static uint32_t host_mix(uint32_t rank, uint32_t salt)
+{
+    uint32_t x = rank * 0x9e3779b1U + salt;
+
+    x ^= x >> 16;
+    x *= 0x85ebca6bU;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35U;
+    x ^= x >> 16;
+
+    return x;
+}
+
+/** SETUP **********************************************************************/
+
+/* Function: Unified2GeneratorDefaults
+ *
+ * Purpose: Fill in a workload that looks like a busy sensor: mostly v2
+ * events, one or two packets each, skewed signatures and hosts, no damage.
+ *
+ * Arguements:
+ *      Unified2GeneratorConfig *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2GeneratorDefaults(Unified2GeneratorConfig *config)
+{
+    if( config == NULL )
+    {
+        return;
+    }
+
+    memset(config, 0x0, sizeof(Unified2GeneratorConfig));
+    config->seed = 1;
+    config->events = 1000000;
+    config->mix[0] = 10;
+    config->mix[1] = 60;
+    config->mix[2] = 5;
+    config->mix[3] = 25;
+    config->packets = 1.5;
+    config->sizes = UNIFIED2_SIZES_IMIX;
+    config->packet_min = 60;
+    config->packet_max = 1514;
+    config->packet_mean = 400;
+    config->extra = 0.1;
+    config->sensors = 4;
+    config->signatures = 2000;
+    config->signature_skew = 1.1;
+    config->hosts = 100000;
+    config->host_skew = 0.9;
+    config->start = 1300000000;
+    config->rate = 1000.0;
+    config->corrupt = 0.0;
+    config->corrupt_framing = 0;
+}
+
+/* Function: Unified2GeneratorNew
+ *
+ * Purpose: Create a generator for a workload
+ *
+ * Arguements:
+ *      const Unified2GeneratorConfig *
+ *
+ * Returns:
+ *      Unified2Generator *
+ */
+Unified2Generator * Unified2GeneratorNew(const Unified2GeneratorConfig *config)
+{
+    Unified2Generator *gen;
+    uint64_t seed;
+    uint32_t i;
+
+    if( config == NULL || config->packet_min > config->packet_max ||
+        config->packet_max > UINT16_MAX || config->sensors == 0 ||
+        config->signatures == 0 || config->hosts == 0 || config->rate <= 0 ||
+        config->packets < 0 || config->extra < 0 || config->corrupt < 0 ||
+        config->mix[0] + config->mix[1] + config->mix[2] + config->mix[3] == 0 )
+    {
+        warn("Unified2GeneratorNew: invalid configuration\n");
+        return NULL;
+    }
+
+    gen = (Unified2Generator *)_Unified2Calloc(1, sizeof(Unified2Generator),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( gen == NULL )
+    {
+        warn("Unified2GeneratorNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    gen->config = *config;
+
+    seed = config->seed;
+    for( i = 0; i < 4; i++ )
+        gen->state[i] = splitmix64(&seed);
+
+    gen->max_record = sizeof(Unified2RecordHeader) + sizeof(Unified2Packet) +
+        config->packet_max;
+    if( gen->max_record < sizeof(Unified2RecordHeader) +
+        sizeof(Unified2ExtraDataHdr) + sizeof(Unified2ExtraData) + EXTRA_MAX )
+    {
+        gen->max_record = sizeof(Unified2RecordHeader) +
+            sizeof(Unified2ExtraDataHdr) + sizeof(Unified2ExtraData) + EXTRA_MAX;
+    }
+
+    gen->payload = (uint8_t *)_Unified2Malloc(PAYLOAD_POOL + config->packet_max,
+        UNIFIED2_ALLOC_ANALYSIS);
+    gen->scratch = (uint8_t *)_Unified2Malloc(gen->max_record,
+        UNIFIED2_ALLOC_ANALYSIS);
+    gen->extra = (Unified2ExtraData *)_Unified2Malloc(
+        sizeof(Unified2ExtraData) + EXTRA_MAX, UNIFIED2_ALLOC_ANALYSIS);
+    if( gen->payload == NULL || gen->scratch == NULL || gen->extra == NULL ||
+        alias_init(&gen->event_types, 4, config->mix, 0) ||
+        alias_init(&gen->signatures, config->signatures, NULL,
+        config->signature_skew) ||
+        alias_init(&gen->hosts, config->hosts, NULL, config->host_skew) )
+    {
+        warn("Unified2GeneratorNew: failed to malloc: %s\n", strerror(errno));
+        Unified2GeneratorFree(gen);
+        return NULL;
+    }
+
+    for( i = 0; i + 8 <= PAYLOAD_POOL + config->packet_max; i += 8 )
+    {
+        seed = next_random(gen);
+        memcpy(gen->payload + i, &seed, 8);
+    }
+
+    return gen;
+}
+
+/* Function: Unified2GeneratorFree
+ *
+ * Purpose: Release a generator
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2GeneratorFree(Unified2Generator *gen)
+{
+    if( gen == NULL )
+    {
+        return;
+    }
+
+    alias_free(&gen->event_types);
+    alias_free(&gen->signatures);
+    alias_free(&gen->hosts);
+    _Unified2Free(gen->payload, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(gen->scratch, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(gen->extra, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(gen, UNIFIED2_ALLOC_ANALYSIS);
+}
+
+/** RECORDS ********************************************************************/
+
+static uint32_t packet_size(Unified2Generator *gen)
+{
+    const Unified2GeneratorConfig *c = &gen->config;
+    uint32_t r, size;
+    double mean;
+
+    switch( c->sizes )
+    {
+        case UNIFIED2_SIZES_IMIX:
+        r = uniform(gen, 12);
+        size = r < 7 ? 64 : r < 11 ? 576 : 1500;
+        break;
+
+        case UNIFIED2_SIZES_EXPONENTIAL:
+        mean = c->packet_mean ? c->packet_mean : 1;
+        size = (uint32_t)(-mean * log(1.0 - unit(gen)));
+        break;
+
+        case UNIFIED2_SIZES_UNIFORM:
+        default:
+        size = c->packet_min + uniform(gen, c->packet_max - c->packet_min + 1);
+        break;
+    }
+
+    if( size < c->packet_min )
+        size = c->packet_min;
+    if( size > c->packet_max )
+        size = c->packet_max;
+
+    return size;
+}
+
+static void host_address(Unified2Generator *gen, int ipv6, uint8_t *addr)
+{
+    uint32_t rank = alias_sample(gen, &gen->hosts);
+    uint32_t word;
+
+    if( !ipv6 )
+    {
+        word = htonl(host_mix(rank, 0x1234567));
+        memcpy(addr, &word, 4);
+        return;
+    }
+
+    /* 2001:db8::/32 */
+    word = htonl(0x20010db8);
+    memcpy(addr, &word, 4);
+    word = htonl(host_mix(rank, 0x89abcdef));
+    memcpy(addr + 4, &word, 4);
+    word = 0;
+    memcpy(addr + 8, &word, 4);
+    word = htonl(host_mix(rank, 0x2468ace));
+    memcpy(addr + 12, &word, 4);
+}
+
+/* Function: make_event
+ *
+ * Purpose: Start the next event and encode it
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *      uint8_t *
+ *
+ * Returns:
+ *      int         bytes used
+ */
+static int make_event(Unified2Generator *gen, uint8_t *buf)
+{
+    const Unified2GeneratorConfig *c = &gen->config;
+    Unified2RecordHeader record;
+    Unified2Event6_v2 event;
+    Unified2Event_v2 event4;
+    Unified2Entry entry;
+    uint8_t src[16], dst[16];
+    uint32_t type, rank, r;
+    int ipv6;
+
+    type = event_types[alias_sample(gen, &gen->event_types)];
+    ipv6 = type == UNIFIED2_IDS_EVENT_IPV6 || type == UNIFIED2_IDS_EVENT_IPV6_V2;
+
+    gen->clock += -log(1.0 - unit(gen)) / c->rate;
+    gen->second = c->start + (uint32_t)gen->clock;
+    gen->microsecond = (uint32_t)((gen->clock - floor(gen->clock)) * 1000000.0);
+    gen->event_id++;
+    gen->sensor_id = 1 + uniform(gen, c->sensors);
+    gen->events++;
+
+    memset(&event, 0x0, sizeof(event));
+    event.sensor_id = gen->sensor_id;
+    event.event_id = gen->event_id;
+    event.event_second = gen->second;
+    event.event_microsecond = gen->microsecond;
+
+    /* A signature always has the same metadata */
+    rank = alias_sample(gen, &gen->signatures);
+    event.signature_id = 1000000 + rank;
+    event.generator_id = 1;
+    event.signature_revision = 1 + rank % 5;
+    event.classification_id = 1 + rank % 38;
+    event.priority_id = 1 + rank % 4;
+
+    r = uniform(gen, 100);
+    event.protocol = r < 70 ? 6 : r < 95 ? 17 : ipv6 ? 58 : 1;
+    if( event.protocol == 1 || event.protocol == 58 )
+    {
+        event.sport_itype = 8;
+        event.dport_icode = 0;
+    }
+    else
+    {
+        event.sport_itype = 1024 + uniform(gen, 64512);
+        r = uniform(gen, 16);
+        event.dport_icode = r < sizeof(service_ports) / sizeof(service_ports[0]) ?
+            service_ports[r] : uniform(gen, 65536);
+    }
+    event.packet_action = uniform(gen, 100) == 0 ? 0x20 : 0;
+    event.mpls_label = uniform(gen, 10) == 0 ? uniform(gen, 1 << 20) : 0;
+    event.vlan_id = uniform(gen, 4) == 0 ? 0 : 1 + uniform(gen, 16);
+    event.policy_id = uniform(gen, 4);
+
+    host_address(gen, ipv6, src);
+    host_address(gen, ipv6, dst);
+
+    /* What follows */
+    gen->packets_left = (uint32_t)c->packets;
+    if( unit(gen) < c->packets - floor(c->packets) )
+        gen->packets_left++;
+    gen->extra_left = unit(gen) < c->extra;
+
+    memset(&entry, 0x0, sizeof(entry));
+    record.type = type;
+    entry.record = &record;
+
+    if( ipv6 )
+    {
+        memcpy(&event.ip_source, src, 16);
+        memcpy(&event.ip_destination, dst, 16);
+        record.length = type == UNIFIED2_IDS_EVENT_IPV6 ?
+            sizeof(Unified2Event6) : sizeof(Unified2Event6_v2);
+        /* Event6 is a prefix of Event6_v2 */
+        entry.event6 = (Unified2Event6 *)&event;
+        entry.event6_v2 = &event;
+    }
+    else
+    {
+        memset(&event4, 0x0, sizeof(event4));
+        memcpy(&event4, &event, offsetof(Unified2Event_v2, ip_source));
+        memcpy(&event4.ip_source, src, 4);
+        memcpy(&event4.ip_destination, dst, 4);
+        event4.sport_itype = event.sport_itype;
+        event4.dport_icode = event.dport_icode;
+        event4.protocol = event.protocol;
+        event4.packet_action = event.packet_action;
+        event4.mpls_label = event.mpls_label;
+        event4.vlan_id = event.vlan_id;
+        event4.policy_id = event.policy_id;
+        record.length = type == UNIFIED2_IDS_EVENT ?
+            sizeof(Unified2Event) : sizeof(Unified2Event_v2);
+        entry.event = (Unified2Event *)&event4;
+        entry.event_v2 = &event4;
+    }
+
+    return Unified2SerializeRecord(&entry, buf, gen->max_record);
+}
+
+static int make_packet(Unified2Generator *gen, uint8_t *buf)
+{
+    Unified2RecordHeader record;
+    Unified2Packet packet;
+    Unified2Entry entry;
+
+    packet.sensor_id = gen->sensor_id;
+    packet.event_id = gen->event_id;
+    packet.event_second = gen->second;
+    packet.packet_second = gen->second;
+    packet.packet_microsecond = gen->microsecond;
+    packet.linktype = 1;
+    packet.packet_length = packet_size(gen);
+
+    memset(&entry, 0x0, sizeof(entry));
+    record.type = UNIFIED2_PACKET;
+    record.length = sizeof(Unified2Packet) + packet.packet_length;
+    entry.record = &record;
+    entry.packet = &packet;
+    entry.packet_data = gen->payload + uniform(gen, PAYLOAD_POOL);
+
+    gen->packets_left--;
+
+    return Unified2SerializeRecord(&entry, buf, gen->max_record);
+}
+
+static int make_extra(Unified2Generator *gen, uint8_t *buf)
+{
+    Unified2RecordHeader record;
+    Unified2ExtraData *extra = gen->extra;
+    Unified2Entry entry;
+    char *blob = (char *)(extra + 1);
+    uint32_t host, length;
+
+    extra->sensor_id = gen->sensor_id;
+    extra->event_id = gen->event_id;
+    extra->event_second = gen->second;
+    extra->data_type = 1;
+
+    switch( uniform(gen, 3) )
+    {
+        case 0:
+        extra->type = UNIFIED2_EXTRA_HTTP_URI;
+        length = snprintf(blob, EXTRA_MAX, "/index.php?id=%u",
+            uniform(gen, 100000));
+        break;
+
+        case 1:
+        extra->type = UNIFIED2_EXTRA_HTTP_HOSTNAME;
+        length = snprintf(blob, EXTRA_MAX, "host%u.example.com",
+            alias_sample(gen, &gen->hosts));
+        break;
+
+        default:
+        extra->type = UNIFIED2_EXTRA_XFF_IPV4;
+        host = htonl(host_mix(alias_sample(gen, &gen->hosts), 0x1234567));
+        memcpy(blob, &host, 4);
+        length = 4;
+        break;
+    }
+
+    extra->blob_length = length + 8;
+
+    memset(&entry, 0x0, sizeof(entry));
+    record.type = UNIFIED2_EXTRA_DATA;
+    record.length = sizeof(Unified2ExtraDataHdr) + sizeof(Unified2ExtraData) +
+        length;
+    entry.record = &record;
+    entry.extra_data = extra;
+
+    gen->extra_left = 0;
+
+    return Unified2SerializeRecord(&entry, buf, gen->max_record);
+}
+
+/* Function: corrupt
+ *
+ * Purpose: Damage an encoded record: flip bytes, give it a type nobody
+ * knows, or, when framing damage is allowed, lie about its length or cut it
+ * short.
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *      uint8_t *
+ *      int
+ *
+ * Returns:
+ *      int         bytes of the record left
+ */
+static int corrupt(Unified2Generator *gen, uint8_t *buf, int length)
+{
+    uint32_t value;
+    int body = length - sizeof(Unified2RecordHeader);
+    int i, n;
+
+    switch( uniform(gen, gen->config.corrupt_framing ? 4 : 2) )
+    {
+        case 0:
+        n = 1 + uniform(gen, 4);
+        for( i = 0; i < n && body > 0; i++ )
+            buf[sizeof(Unified2RecordHeader) + uniform(gen, body)] ^=
+                1 + uniform(gen, 255);
+        return length;
+
+        case 1:
+        value = htonl(200 + uniform(gen, 50));
+        memcpy(buf, &value, sizeof(value));
+        return length;
+
+        case 2:
+        memcpy(&value, buf + 4, sizeof(value));
+        value = htonl(ntohl(value) + 1 + uniform(gen, 64));
+        memcpy(buf + 4, &value, sizeof(value));
+        return length;
+
+        default:
+        return body > 1 ? length - 1 - uniform(gen, body - 1) : length;
+    }
+}
+
+/* Function: make_record
+ *
+ * Purpose: Encode whatever comes next
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *      uint8_t *           at least max_record bytes
+ *
+ * Returns:
+ *      int         bytes used, 0 when the workload is done
+ */
+static int make_record(Unified2Generator *gen, uint8_t *buf)
+{
+    int length;
+
+    if( gen->packets_left )
+        length = make_packet(gen, buf);
+    else if( gen->extra_left )
+        length = make_extra(gen, buf);
+    else if( gen->config.events && gen->events >= gen->config.events )
+        return 0;
+    else
+        length = make_event(gen, buf);
+
+    if( length > 0 && gen->config.corrupt > 0 && unit(gen) < gen->config.corrupt )
+        length = corrupt(gen, buf, length);
+
+    return length;
+}
+
+/* Function: Unified2GeneratorFill
+ *
+ * Purpose: Fill a buffer with as many whole records as fit
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *      uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      uint32_t    bytes used, 0 once the workload is done or when the next
+ *                  record is larger than the whole buffer
+ */
+uint32_t Unified2GeneratorFill(Unified2Generator *gen, uint8_t *buf,
+    uint32_t size)
+{
+    uint32_t used = 0;
+    int length;
+
+    if( gen == NULL || buf == NULL )
+    {
+        return 0;
+    }
+
+    if( gen->scratch_length )
+    {
+        if( gen->scratch_length > size )
+            return 0;
+
+        memcpy(buf, gen->scratch, gen->scratch_length);
+        used = gen->scratch_length;
+        gen->scratch_length = 0;
+    }
+
+    for( ;; )
+    {
+        if( size - used >= gen->max_record )
+        {
+            length = make_record(gen, buf + used);
+            if( length <= 0 )
+                break;
+            used += length;
+            continue;
+        }
+
+        /* Might not fit, make it on the side */
+        length = make_record(gen, gen->scratch);
+        if( length <= 0 )
+            break;
+
+        if( (uint32_t)length > size - used )
+        {
+            gen->scratch_length = length;
+            break;
+        }
+
+        memcpy(buf + used, gen->scratch, length);
+        used += length;
+    }
+
+    return used;
+}
+
+/* Function: Unified2GeneratorWrite
+ *
+ * Purpose: Write the workload through a writer opened with any of the
+ * Unified2WriteOpen functions
+ *
+ * Arguements:
+ *      Unified2Generator *
+ *      Unified2 *
+ *      uint64_t            most bytes to write, 0 for the whole workload
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2GeneratorWrite(Unified2Generator *gen, Unified2 *u2,
+    uint64_t bytes)
+{
+    uint8_t *buf;
+    uint32_t chunk, used;
+    HRESULT r = UNIFIED2_OK;
+
+    if( gen == NULL || u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    buf = (uint8_t *)_Unified2Malloc(WRITE_CHUNK, UNIFIED2_ALLOC_ANALYSIS);
+    if( buf == NULL )
+    {
+        warn("Unified2GeneratorWrite: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    for( ;; )
+    {
+        chunk = WRITE_CHUNK;
+        if( bytes && bytes < chunk )
+            chunk = (uint32_t)bytes;
+
+        used = Unified2GeneratorFill(gen, buf, chunk);
+        if( used == 0 )
+            break;
+
+        if( Unified2Write(u2, buf, used) != (int)used )
+        {
+            r = UNIFIED2_ERROR;
+            break;
+        }
+
+        if( bytes )
+        {
+            bytes -= used;
+            if( bytes == 0 )
+                break;
+        }
+    }
+
+    _Unified2Free(buf, UNIFIED2_ALLOC_ANALYSIS);
+
+    return r;
+}
@@ -0,0 +1,236 @@
+/*******************************************************************************
+ * Log-linear latency histograms.
+ *
+ * Values below 8 each get a bucket of their own. Above that every power of two
+ * is split into 8 equally sized sub buckets, so any recorded value is within
+ * 12.5% of the bucket it is reported as. Recording is a couple of shifts and an
+ * increment; there is no allocation and the structure can be copied freely.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "unified2.h"
+
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+
+static int bucket_index(uint64_t value)
+{
+    int msb;
+
+    if( value < SUB_BUCKETS )
+    {
+        return (int)value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+
+    return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+        (int)((value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_upper(int index)
+{
+    int msb;
+    uint64_t sub;
+
+    if( index < SUB_BUCKETS )
+    {
+        return index;
+    }
+
+    msb = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    sub = index % SUB_BUCKETS;
+
+    return ((SUB_BUCKETS + sub + 1) << (msb - SUB_BUCKET_BITS)) - 1;
+}
+
+/* Function: Unified2HistogramReset
+ *
+ * Purpose: Empty a histogram
+ *
+ * Arguements:
+ *      Unified2Histogram *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2HistogramReset(Unified2Histogram *h)
+{
+    memset(h, 0x0, sizeof(Unified2Histogram));
+}
+
+/* Function: Unified2HistogramRecord
+ *
+ * Purpose: Count one value
+ *
+ * Arguements:
+ *      Unified2Histogram *
+ *      uint64_t
+ *
+ * Returns:
+ *      void
+ */
+void Unified2HistogramRecord(Unified2Histogram *h, uint64_t value)
+{
+    if( h->count == 0 || value < h->min )
+    {
+        h->min = value;
+    }
+
+    if( value > h->max )
+    {
+        h->max = value;
+    }
+
+    h->count++;
+    h->total += value;
+    h->buckets[bucket_index(value)]++;
+}
+
+/* Function: _Unified2HistogramRecordShared
+ *
+ * Purpose: Count one value in a histogram other threads count in at the same
+ * time. A min of 0 is taken as not set yet, which only matters for values of
+ * 0.
+ *
+ * Arguements:
+ *      Unified2Histogram *
+ *      uint64_t
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2HistogramRecordShared(Unified2Histogram *h, uint64_t value)
+{
+    uint64_t seen;
+
+    seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while( (seen == 0 || value < seen) &&
+           !__atomic_compare_exchange_n(&h->min, &seen, value, 1,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        ;
+
+    seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while( value > seen &&
+           !__atomic_compare_exchange_n(&h->max, &seen, value, 1,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+        ;
+
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->total, value, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->buckets[bucket_index(value)], 1, __ATOMIC_RELAXED);
+}
+
+/* Function: Unified2HistogramMerge
+ *
+ * Purpose: Add every value counted by src to dst
+ *
+ * Arguements:
+ *      Unified2Histogram *
+ *      const Unified2Histogram *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2HistogramMerge(Unified2Histogram *dst, const Unified2Histogram *src)
+{
+    int i;
+
+    if( src->count == 0 )
+    {
+        return;
+    }
+
+    if( dst->count == 0 || src->min < dst->min )
+    {
+        dst->min = src->min;
+    }
+
+    if( src->max > dst->max )
+    {
+        dst->max = src->max;
+    }
+
+    dst->count += src->count;
+    dst->total += src->total;
+
+    for( i = 0; i < UNIFIED2_HISTOGRAM_BUCKETS; i++ )
+    {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* Function: Unified2HistogramPercentile
+ *
+ * Purpose: Estimate the value below which the given percentage of the
+ * recorded values fall. The estimate never exceeds the largest value seen.
+ *
+ * Arguements:
+ *      const Unified2Histogram *
+ *      double          percentile, 0.0 - 100.0
+ *
+ * Returns:
+ *      uint64_t
+ */
+uint64_t Unified2HistogramPercentile(const Unified2Histogram *h, double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t value;
+    int i;
+
+    if( h->count == 0 )
+    {
+        return 0;
+    }
+
+    if( percentile <= 0.0 )
+    {
+        return h->min;
+    }
+
+    rank = (uint64_t)((percentile / 100.0) * h->count + 0.5);
+    if( rank == 0 )
+    {
+        rank = 1;
+    }
+
+    for( i = 0; i < UNIFIED2_HISTOGRAM_BUCKETS; i++ )
+    {
+        seen += h->buckets[i];
+        if( seen >= rank )
+        {
+            value = bucket_upper(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+
+    return h->max;
+}
+
+/* Function: _Unified2Now
+ *
+ * Purpose: Monotonic clock in nanoseconds, for latency measurements
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      uint64_t
+ */
+uint64_t _Unified2Now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
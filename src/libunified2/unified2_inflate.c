@@ -0,0 +1,607 @@
+/*******************************************************************************
+ * Transparent gzip/zstd input.
+ *
+ * Rotated logs are usually gzip or zstd compressed. Rather than piping them
+ * through zcat, the openers recognise the compressed formats by their magic
+ * bytes and hand the file to a helper thread that decompresses into a ring of
+ * buffers. Decompression of the next buffers then overlaps with record decoding
+ * in Unified2ReadNextEntry(), which reads from the ring through Unified2Read().
+ *
+ * The stream can only be read forward: Unified2Seek() supports skipping ahead
+ * with SEEK_CUR, which is all the record reader needs.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#define USE_ZLIB 1
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#define USE_ZSTD 1
+#include <zstd.h>
+#endif
+
+#include "unified2.h"
+
+#define RING_BUFFERS    4
+#define RING_BUFFER_SIZE (256 << 10)
+#define INPUT_SIZE      (128 << 10)
+
+typedef struct _RingBuffer {
+    uint8_t *data;
+    size_t length;
+} RingBuffer;
+
+struct _Unified2Decompressor {
+    int format;
+    int fd;
+    FILE *fh;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    RingBuffer ring[RING_BUFFERS];
+    unsigned head;          /* next buffer the helper fills */
+    unsigned tail;          /* buffer the reader is consuming */
+    size_t offset;          /* read offset inside the tail buffer */
+
+    int done;
+    int error;
+    int stopping;
+
+    uint8_t *input;
+};
+
+/* Function: _Unified2CompressedFormat
+ *
+ * Purpose: Recognise gzip and zstd streams by their magic bytes
+ *
+ * Arguements:
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int         UNIFIED2_CODEC_ZLIB for gzip, UNIFIED2_CODEC_ZSTD, or 0
+ */
+int _Unified2CompressedFormat(const void *buf, int size)
+{
+    const uint8_t *magic = buf;
+
+    if( size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b )
+    {
+        return UNIFIED2_CODEC_ZLIB;
+    }
+
+    if( size >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+        magic[2] == 0x2f && magic[3] == 0xfd )
+    {
+        return UNIFIED2_CODEC_ZSTD;
+    }
+
+    return 0;
+}
+
+static ssize_t read_input(Unified2Decompressor *d)
+{
+    ssize_t r;
+
+    if( d->fh != NULL )
+    {
+        r = fread(d->input, 1, INPUT_SIZE, d->fh);
+        return (r == 0 && ferror(d->fh)) ? -1 : r;
+    }
+
+    do {
+        r = read(d->fd, d->input, INPUT_SIZE);
+    } while( r == -1 && errno == EINTR );
+
+    return r;
+}
+
+/* Function: claim_buffer
+ *
+ * Purpose: Wait for a free ring buffer to decompress into
+ *
+ * Arguements:
+ *      Unified2Decompressor *
+ *
+ * Returns:
+ *      RingBuffer *    NULL when the reader is going away
+ */
+static RingBuffer *claim_buffer(Unified2Decompressor *d)
+{
+    RingBuffer *buffer = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    while( d->head - d->tail == RING_BUFFERS && !d->stopping )
+    {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+
+    if( !d->stopping )
+    {
+        buffer = &d->ring[d->head % RING_BUFFERS];
+        buffer->length = 0;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return buffer;
+}
+
+static void publish_buffer(Unified2Decompressor *d)
+{
+    pthread_mutex_lock(&d->lock);
+    __atomic_store_n(&d->head, d->head + 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void finish(Unified2Decompressor *d, int error)
+{
+    pthread_mutex_lock(&d->lock);
+    d->done = 1;
+    d->error = error;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+#ifdef USE_ZLIB
+static int inflate_gzip(Unified2Decompressor *d)
+{
+    RingBuffer *buffer;
+    z_stream z;
+    ssize_t in;
+    int eof = 0;
+    int r = Z_OK;
+
+    memset(&z, 0x0, sizeof(z));
+    if( inflateInit2(&z, 15 + 32) != Z_OK )
+    {
+        return -1;
+    }
+
+    while( (buffer = claim_buffer(d)) != NULL )
+    {
+        z.next_out = buffer->data;
+        z.avail_out = RING_BUFFER_SIZE;
+
+        while( z.avail_out > 0 )
+        {
+            if( z.avail_in == 0 && !eof )
+            {
+                in = read_input(d);
+                if( in == -1 )
+                {
+                    inflateEnd(&z);
+                    return -1;
+                }
+                eof = in == 0;
+                z.next_in = d->input;
+                z.avail_in = in;
+            }
+
+            if( z.avail_in == 0 && eof )
+            {
+                break;
+            }
+
+            r = inflate(&z, Z_NO_FLUSH);
+            if( r == Z_STREAM_END )
+            {
+                /* Concatenated members, as produced by appending to a .gz */
+                inflateReset(&z);
+            }
+            else if( r != Z_OK && r != Z_BUF_ERROR )
+            {
+                inflateEnd(&z);
+                return -1;
+            }
+        }
+
+        buffer->length = RING_BUFFER_SIZE - z.avail_out;
+        if( buffer->length == 0 )
+        {
+            break;
+        }
+        publish_buffer(d);
+
+        if( eof && z.avail_in == 0 && z.avail_out > 0 )
+        {
+            break;
+        }
+    }
+
+    inflateEnd(&z);
+
+    /* Running out of input in the middle of a member means truncation */
+    return (eof && r != Z_STREAM_END) ? -1 : 0;
+}
+#endif
+
+#ifdef USE_ZSTD
+static int inflate_zstd(Unified2Decompressor *d)
+{
+    RingBuffer *buffer;
+    ZSTD_DStream *z;
+    ZSTD_inBuffer zin = { NULL, 0, 0 };
+    ZSTD_outBuffer zout;
+    ssize_t in;
+    size_t r = 0;
+    int eof = 0;
+
+    z = ZSTD_createDStream();
+    if( z == NULL )
+    {
+        return -1;
+    }
+    ZSTD_initDStream(z);
+
+    while( (buffer = claim_buffer(d)) != NULL )
+    {
+        zout.dst = buffer->data;
+        zout.size = RING_BUFFER_SIZE;
+        zout.pos = 0;
+
+        while( zout.pos < zout.size )
+        {
+            if( zin.pos == zin.size && !eof )
+            {
+                in = read_input(d);
+                if( in == -1 )
+                {
+                    ZSTD_freeDStream(z);
+                    return -1;
+                }
+                eof = in == 0;
+                zin.src = d->input;
+                zin.size = in;
+                zin.pos = 0;
+            }
+
+            if( zin.pos == zin.size && eof )
+            {
+                break;
+            }
+
+            r = ZSTD_decompressStream(z, &zout, &zin);
+            if( ZSTD_isError(r) )
+            {
+                ZSTD_freeDStream(z);
+                return -1;
+            }
+        }
+
+        buffer->length = zout.pos;
+        if( buffer->length == 0 )
+        {
+            break;
+        }
+        publish_buffer(d);
+
+        if( eof && zin.pos == zin.size && zout.pos < zout.size )
+        {
+            break;
+        }
+    }
+
+    ZSTD_freeDStream(z);
+
+    /* A non zero hint at the end of input means a frame was cut short */
+    return (eof && r != 0) ? -1 : 0;
+}
+#endif
+
+static void *decompress_thread(void *arg)
+{
+    Unified2Decompressor *d = arg;
+    int r = -1;
+
+    switch( d->format )
+    {
+#ifdef USE_ZLIB
+        case UNIFIED2_CODEC_ZLIB:
+        r = inflate_gzip(d);
+        break;
+#endif
+#ifdef USE_ZSTD
+        case UNIFIED2_CODEC_ZSTD:
+        r = inflate_zstd(d);
+        break;
+#endif
+        default:
+        break;
+    }
+
+    finish(d, r == -1);
+
+    return NULL;
+}
+
+static void decompressor_free(Unified2Decompressor *d)
+{
+    int i;
+
+    for( i = 0; i < RING_BUFFERS; i++ )
+    {
+        _Unified2Free(d->ring[i].data, UNIFIED2_ALLOC_BUFFER);
+    }
+
+    _Unified2Free(d->input, UNIFIED2_ALLOC_BUFFER);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    _Unified2Free(d, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: _Unified2DecompressOpen
+ *
+ * Purpose: Start decompressing a gzip or zstd stream from either a descriptor
+ * or a FILE, both of which the handle takes ownership of.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int         descriptor, or -1 to read from the FILE
+ *      FILE *
+ *      int         format, as returned by _Unified2CompressedFormat()
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2DecompressOpen(Unified2 *u2, int fd, FILE *fh, int format)
+{
+    Unified2Decompressor *d;
+    int i;
+
+    switch( format )
+    {
+#ifdef USE_ZLIB
+        case UNIFIED2_CODEC_ZLIB:
+        break;
+#endif
+#ifdef USE_ZSTD
+        case UNIFIED2_CODEC_ZSTD:
+        break;
+#endif
+        default:
+        warn("Unified2ReadOpen: %s is compressed with an unsupported codec\n",
+        u2->filename ? u2->filename : "input");
+        return UNIFIED2_ERROR;
+    }
+
+    d = (Unified2Decompressor *)_Unified2Malloc(sizeof(Unified2Decompressor),
+        UNIFIED2_ALLOC_HANDLE);
+    if( d == NULL )
+    {
+        warn("Unified2ReadOpen: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    memset(d, 0x0, sizeof(Unified2Decompressor));
+
+    d->format = format;
+    d->fd = fd;
+    d->fh = fh;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    d->input = (uint8_t *)_Unified2Malloc(INPUT_SIZE, UNIFIED2_ALLOC_BUFFER);
+    for( i = 0; i < RING_BUFFERS; i++ )
+    {
+        d->ring[i].data = (uint8_t *)_Unified2Malloc(RING_BUFFER_SIZE,
+            UNIFIED2_ALLOC_BUFFER);
+        if( d->ring[i].data == NULL )
+            break;
+    }
+
+    if( d->input == NULL || i < RING_BUFFERS )
+    {
+        warn("Unified2ReadOpen: failed to malloc: %s\n", strerror(errno));
+        decompressor_free(d);
+        return UNIFIED2_ERROR;
+    }
+
+    if( pthread_create(&d->thread, NULL, decompress_thread, d) != 0 )
+    {
+        warn("Unified2ReadOpen: failed to start the decompression thread\n");
+        decompressor_free(d);
+        return UNIFIED2_ERROR;
+    }
+
+    u2->mode = DECOMPRESS;
+    u2->fd = fd;
+    u2->fh = fh;
+    u2->decompressor = d;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: next_buffer
+ *
+ * Purpose: Make sure the tail buffer has unread data, waiting for the helper
+ * thread if need be.
+ *
+ * Arguements:
+ *      Unified2Decompressor *
+ *
+ * Returns:
+ *      RingBuffer *    NULL at the end of the stream
+ */
+static RingBuffer *next_buffer(Unified2Decompressor *d)
+{
+    RingBuffer *buffer;
+
+    /* Fast path without the lock while the tail buffer has data left */
+    if( __atomic_load_n(&d->head, __ATOMIC_ACQUIRE) != d->tail )
+    {
+        buffer = &d->ring[d->tail % RING_BUFFERS];
+        if( d->offset < buffer->length )
+        {
+            return buffer;
+        }
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for( ;; )
+    {
+        if( d->head != d->tail )
+        {
+            buffer = &d->ring[d->tail % RING_BUFFERS];
+            if( d->offset < buffer->length )
+            {
+                break;
+            }
+
+            /* Hand the used up buffer back to the helper */
+            d->tail++;
+            d->offset = 0;
+            pthread_cond_broadcast(&d->cond);
+            continue;
+        }
+
+        if( d->done )
+        {
+            buffer = NULL;
+            break;
+        }
+
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return buffer;
+}
+
+/* Function: _Unified2DecompressRead
+ *
+ * Purpose: Copy decompressed data out of the ring
+ *
+ * Arguements:
+ *      Unified2 *
+ *      void *      NULL to skip the data
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2DecompressRead(Unified2 *u2, void *buf, int size)
+{
+    Unified2Decompressor *d = u2->decompressor;
+    RingBuffer *buffer;
+    uint8_t *out = buf;
+    size_t chunk;
+    int total = 0;
+
+    while( total < size && (buffer = next_buffer(d)) != NULL )
+    {
+        chunk = buffer->length - d->offset;
+        if( chunk > (size_t)(size - total) )
+        {
+            chunk = size - total;
+        }
+
+        if( out != NULL )
+        {
+            memcpy(out + total, buffer->data + d->offset, chunk);
+        }
+        d->offset += chunk;
+        total += chunk;
+    }
+
+    if( total < size && d->error )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, 0, 0);
+        d->error = 0;
+    }
+
+    return total;
+}
+
+/* Function: _Unified2DecompressSeek
+ *
+ * Purpose: Skip forward in the decompressed stream
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2DecompressSeek(Unified2 *u2, int offset, int whence)
+{
+    if( whence != SEEK_CUR || offset < 0 )
+    {
+        return -1;
+    }
+
+    return _Unified2DecompressRead(u2, NULL, offset) == offset ? 0 : -1;
+}
+
+/* Function: _Unified2DecompressEof
+ *
+ * Purpose: Check whether the decompressed stream is exhausted
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2DecompressEof(Unified2 *u2)
+{
+    return next_buffer(u2->decompressor) == NULL;
+}
+
+/* Function: _Unified2DecompressClose
+ *
+ * Purpose: Stop the helper thread and close the input
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2DecompressClose(Unified2 *u2)
+{
+    Unified2Decompressor *d = u2->decompressor;
+
+    if( d == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->stopping = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    if( d->fh != NULL )
+    {
+        fclose(d->fh);
+    }
+    else
+    {
+        close(d->fd);
+    }
+
+    u2->decompressor = NULL;
+    u2->fh = NULL;
+    u2->fd = -1;
+    decompressor_free(d);
+
+    return UNIFIED2_OK;
+}
@@ -0,0 +1,352 @@
+/*******************************************************************************
+ * Memory mapped reader and raw record copies.
+ *
+ * A plain unified2 file can be mapped instead of read, after which
+ * Unified2ReadRawRecord() hands out records in place and walking the record
+ * headers of a file costs no system calls and no copies at all.
+ *
+ * Unified2CopyRecords() moves a run of such records to another file. Runs
+ * that come from a mapping are copied by the kernel, with copy_file_range()
+ * where it exists and sendfile() otherwise, so the data never passes through
+ * user space; everything else is written out from memory.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "unified2.h"
+
+/* Largest single request to the kernel, keeps every call well inside ssize_t
+ * on 32 bit systems */
+#define COPY_CHUNK  (1U << 30)
+
+/* Function: Unified2ReadOpenMapped
+ *
+ * Purpose: Read a Unified2 file through a read only memory mapping. Files
+ * that can not be mapped, compressed files included, are opened as
+ * Unified2ReadOpenFd() would open them, check u2->mode to tell.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      char *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ReadOpenMapped(Unified2 *u2, char *filename)
+{
+    struct stat st;
+    void *map = NULL;
+
+    if( Unified2ReadOpenFd(u2, filename) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( u2->mode != DESCRIPTOR )
+    {
+        return UNIFIED2_OK;
+    }
+
+    if( fstat(u2->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != (uint64_t)(size_t)st.st_size )
+    {
+        return UNIFIED2_OK;
+    }
+
+    if( st.st_size > 0 )
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, u2->fd, 0);
+        if( map == MAP_FAILED )
+        {
+            return UNIFIED2_OK;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    u2->mode = MAPPED;
+    u2->map = map;
+    u2->map_size = st.st_size;
+    u2->map_offset = 0;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ReadOpenMappedRange
+ *
+ * Purpose: Read length bytes from offset of a log another handle mapped,
+ * sharing its mapping rather than mapping the file again. The range must
+ * start at a record and the other handle must stay open until this one is
+ * freed.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2 *      opened with Unified2ReadOpenMapped()
+ *      uint64_t
+ *      uint64_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ReadOpenMappedRange(Unified2 *u2, Unified2 *mapped,
+    uint64_t offset, uint64_t length)
+{
+    if( u2 == NULL || mapped == NULL || mapped->mode != MAPPED ||
+        offset > mapped->map_size || length > mapped->map_size - offset )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( mapped->filename != NULL )
+    {
+        u2->filename = _Unified2Strdup(mapped->filename, UNIFIED2_ALLOC_HANDLE);
+        if( u2->filename == NULL )
+        {
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    /* No descriptor: the mapping is borrowed, not closed with this handle */
+    u2->mode = MAPPED;
+    u2->fd = -1;
+    u2->map = mapped->map + offset;
+    u2->map_size = length;
+    u2->map_offset = 0;
+    u2->offset = offset;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2MappedRead
+ *
+ * Purpose: Copy the next bytes out of the mapping
+ *
+ * Arguements:
+ *      Unified2 *
+ *      void *
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2MappedRead(Unified2 *u2, void *buf, int size)
+{
+    uint64_t left = u2->map_size - u2->map_offset;
+
+    if( size < 0 )
+    {
+        return -1;
+    }
+
+    if( (uint64_t)size > left )
+    {
+        size = (int)left;
+    }
+
+    memcpy(buf, u2->map + u2->map_offset, size);
+    u2->map_offset += size;
+
+    return size;
+}
+
+/* Function: _Unified2MappedSeek
+ *
+ * Purpose: Move the read position within the mapping
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2MappedSeek(Unified2 *u2, int offset, int whence)
+{
+    int64_t position;
+
+    switch( whence )
+    {
+        case SEEK_SET:
+        position = offset;
+        break;
+
+        case SEEK_CUR:
+        position = (int64_t)u2->map_offset + offset;
+        break;
+
+        case SEEK_END:
+        position = (int64_t)u2->map_size + offset;
+        break;
+
+        default:
+        return -1;
+    }
+
+    if( position < 0 || (uint64_t)position > u2->map_size )
+    {
+        return -1;
+    }
+
+    u2->map_offset = position;
+
+    return 0;
+}
+
+/* Function: _Unified2MappedEof
+ *
+ * Purpose: Check if the whole mapping has been read
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2MappedEof(Unified2 *u2)
+{
+    return u2->map_offset == u2->map_size;
+}
+
+/* Function: _Unified2MappedClose
+ *
+ * Purpose: Unmap and close the file
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2MappedClose(Unified2 *u2)
+{
+    if( u2->fd == -1 )
+    {
+        u2->map = NULL;
+        return UNIFIED2_OK;
+    }
+
+    if( u2->map != NULL )
+    {
+        munmap(u2->map, u2->map_size);
+        u2->map = NULL;
+    }
+
+    close(u2->fd);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: copy_in_kernel
+ *
+ * Purpose: Copy a range of the input file to the current position of the
+ * output file without mapping it into user space.
+ *
+ * Arguements:
+ *      int
+ *      uint64_t
+ *      uint64_t
+ *      int
+ *
+ * Returns:
+ *      uint64_t    bytes copied; anything short of length is left for the
+ *                  caller to write itself
+ */
+static uint64_t copy_in_kernel(int in, uint64_t offset, uint64_t length,
+    int out)
+{
+    uint64_t copied = 0;
+    uint64_t chunk;
+    off_t position;
+    ssize_t n;
+
+#if defined(HAVE_COPY_FILE_RANGE)
+    while( copied < length )
+    {
+        chunk = length - copied > COPY_CHUNK ? COPY_CHUNK : length - copied;
+        position = offset + copied;
+        n = copy_file_range(in, &position, out, NULL, chunk, 0);
+        if( n == -1 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            break;
+        copied += n;
+    }
+#endif
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+    /* Cross filesystem copies and older kernels */
+    while( copied < length )
+    {
+        chunk = length - copied > COPY_CHUNK ? COPY_CHUNK : length - copied;
+        position = offset + copied;
+        n = sendfile(out, in, &position, chunk);
+        if( n == -1 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            break;
+        copied += n;
+    }
+#endif
+
+    (void)in; (void)offset; (void)out; (void)chunk; (void)position; (void)n;
+
+    return copied;
+}
+
+/* Function: Unified2CopyRecords
+ *
+ * Purpose: Write records exactly as they were read to a file descriptor.
+ * The data must have come from Unified2ReadRawRecord() on in. When in is
+ * mapped, consecutive records are adjacent in memory and a whole run of them
+ * can be copied in one call, by the kernel when it knows how.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const uint8_t *
+ *      uint64_t
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2CopyRecords(Unified2 *in, const uint8_t *data,
+    uint64_t length, int fd)
+{
+    uint64_t copied = 0;
+
+    if( in == NULL || (data == NULL && length) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( in->mode == MAPPED && data >= in->map &&
+        data + length <= in->map + in->map_size )
+    {
+        copied = copy_in_kernel(in->fd, data - in->map, length, fd);
+    }
+
+    if( _Unified2WriteAll(fd, data + copied, length - copied) == -1 )
+    {
+        warn("Unified2CopyRecords: failed to write: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
@@ -0,0 +1,373 @@
+/*******************************************************************************
+ * Parallel ordered formatting.
+ *
+ * The calling thread reads entries into batches, worker threads format whole
+ * batches into private buffers, and a writer thread puts the buffers out in
+ * the order the batches were read. Output is identical to formatting the
+ * entries one after the other.
+ *
+ * Batches live in a fixed ring indexed by sequence number. A batch goes from
+ * FREE to FILLED (reader), FORMATTED (worker) and back to FREE once the
+ * writer has written it, so the reader can never run more than the ring
+ * ahead of the writer and memory stays bounded.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "unified2.h"
+
+#define BATCH_ENTRIES   512
+#define BATCH_BUFFER    (256 << 10)
+
+typedef enum _BATCH_STATE {
+    BATCH_FREE,
+    BATCH_FILLED,
+    BATCH_FORMATTED,
+} BATCH_STATE;
+
+typedef struct _Batch {
+    BATCH_STATE state;
+    int count;
+    Unified2Entry entries[BATCH_ENTRIES];
+    Unified2Buffer output;
+} Batch;
+
+typedef struct _Pipeline {
+    Unified2FormatFunc format;
+    int fd;
+
+    Batch *batches;
+    int nbatches;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;      /* workers wait for work */
+    pthread_cond_t formatted;   /* writer waits for the next batch */
+    pthread_cond_t freed;       /* reader waits for a free batch */
+
+    uint64_t next_fill;         /* reader: sequence of the next batch */
+    uint64_t next_format;       /* workers: next batch to take */
+    uint64_t next_write;        /* writer: next batch to write */
+    int done;                   /* reader has queued its last batch */
+    int failed;
+} Pipeline;
+
+static void *format_thread(void *arg)
+{
+    Pipeline *pl = arg;
+    Batch *batch;
+    HRESULT r;
+    int i;
+
+    pthread_mutex_lock(&pl->lock);
+    for( ;; )
+    {
+        while( pl->next_format == pl->next_fill && !pl->done && !pl->failed )
+        {
+            pthread_cond_wait(&pl->filled, &pl->lock);
+        }
+
+        if( pl->next_format == pl->next_fill || pl->failed )
+        {
+            break;
+        }
+
+        batch = &pl->batches[pl->next_format++ % pl->nbatches];
+        pthread_mutex_unlock(&pl->lock);
+
+        r = UNIFIED2_OK;
+        for( i = 0; i < batch->count; i++ )
+        {
+            if( pl->format(&batch->output, &batch->entries[i]) == UNIFIED2_ERROR )
+            {
+                r = UNIFIED2_ERROR;
+            }
+            Unified2EntrySparseCleanup(&batch->entries[i]);
+        }
+        batch->count = 0;
+
+        pthread_mutex_lock(&pl->lock);
+        if( r != UNIFIED2_OK )
+        {
+            pl->failed = 1;
+            pthread_cond_broadcast(&pl->filled);
+            pthread_cond_broadcast(&pl->freed);
+        }
+        batch->state = BATCH_FORMATTED;
+        pthread_cond_broadcast(&pl->formatted);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+static void *write_thread(void *arg)
+{
+    Pipeline *pl = arg;
+    Batch *batch;
+    HRESULT r;
+
+    pthread_mutex_lock(&pl->lock);
+    for( ;; )
+    {
+        batch = &pl->batches[pl->next_write % pl->nbatches];
+
+        while( !pl->failed && !(pl->next_write < pl->next_fill &&
+               batch->state == BATCH_FORMATTED) &&
+               !(pl->done && pl->next_write == pl->next_fill) )
+        {
+            pthread_cond_wait(&pl->formatted, &pl->lock);
+        }
+
+        if( pl->failed || pl->next_write == pl->next_fill )
+        {
+            break;
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        batch->output.fd = pl->fd;
+        r = Unified2BufferFlush(&batch->output);
+        batch->output.fd = -1;
+
+        pthread_mutex_lock(&pl->lock);
+        if( r != UNIFIED2_OK )
+        {
+            pl->failed = 1;
+            pthread_cond_broadcast(&pl->filled);
+            pthread_cond_broadcast(&pl->freed);
+            break;
+        }
+
+        batch->state = BATCH_FREE;
+        pl->next_write++;
+        pthread_cond_signal(&pl->freed);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/* Function: read_batch
+ *
+ * Purpose: Fill a batch the way the serial loops read: stop at EOF or at a
+ * packet without data, dropping the entry that came with either.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Batch *
+ *      int *       records left to read, negative for all
+ *
+ * Returns:
+ *      int         0 once the input is exhausted
+ */
+static int read_batch(Unified2 *u2, Batch *batch, int *count)
+{
+    Unified2Entry *entry;
+    HRESULT r;
+
+    batch->count = 0;
+    while( batch->count < BATCH_ENTRIES && *count )
+    {
+        if( *count > 0 )
+        {
+            (*count)--;
+        }
+
+        entry = &batch->entries[batch->count];
+        memset(entry, 0x0, sizeof(Unified2Entry));
+
+        r = Unified2ReadNextEntry(u2, entry);
+        if( r == UNIFIED2_OK )
+        {
+            batch->count++;
+            continue;
+        }
+
+        if( entry->record != NULL )
+        {
+            Unified2EntrySparseCleanup(entry);
+        }
+
+        if( r == UNIFIED2_EOF || r == UNIFIED2_WARN )
+        {
+            return 0;
+        }
+    }
+
+    return *count != 0;
+}
+
+/* Function: Unified2FormatParallel
+ *
+ * Purpose: Read every entry left in u2, up to count (negative for all),
+ * format them with workers threads and write the result to the output
+ * buffer's file descriptor in the original order. Whatever the output buffer
+ * holds is flushed first.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Buffer *
+ *      Unified2FormatFunc
+ *      int
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatParallel(Unified2 *u2, Unified2Buffer *output,
+    Unified2FormatFunc format, int workers, int count)
+{
+    pthread_t threads[UNIFIED2_MAX_THREADS];
+    pthread_t writer;
+    Pipeline pl;
+    Batch *batch;
+    int started = 0;
+    int more = 1;
+    int i;
+
+    if( u2 == NULL || output == NULL || output->fd == -1 || format == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( workers < 1 )
+        workers = 1;
+    if( workers > UNIFIED2_MAX_THREADS )
+        workers = UNIFIED2_MAX_THREADS;
+
+    if( Unified2BufferFlush(output) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    memset(&pl, 0x0, sizeof(Pipeline));
+    pl.format = format;
+    pl.fd = output->fd;
+    pl.nbatches = workers * 2 + 2;
+    pl.batches = (Batch *)_Unified2Calloc(pl.nbatches, sizeof(Batch),
+        UNIFIED2_ALLOC_BUFFER);
+    if( pl.batches == NULL )
+    {
+        warn("Unified2FormatParallel: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0; i < pl.nbatches; i++ )
+    {
+        if( Unified2BufferInit(&pl.batches[i].output, -1, BATCH_BUFFER)
+            != UNIFIED2_OK )
+        {
+            pl.nbatches = i;
+            pl.failed = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.filled, NULL);
+    pthread_cond_init(&pl.formatted, NULL);
+    pthread_cond_init(&pl.freed, NULL);
+
+    if( !pl.failed && pthread_create(&writer, NULL, write_thread, &pl) != 0 )
+    {
+        pl.failed = 1;
+    }
+
+    for( started = 0; started < workers && !pl.failed; started++ )
+    {
+        if( pthread_create(&threads[started], NULL, format_thread, &pl) != 0 )
+        {
+            warn("Unified2FormatParallel: failed to start a worker\n");
+            break;
+        }
+    }
+
+    if( started == 0 && !pl.failed )
+    {
+        /* Nobody to format: tell the writer to stop */
+        pthread_mutex_lock(&pl.lock);
+        pl.failed = 1;
+        pthread_cond_broadcast(&pl.formatted);
+        pthread_mutex_unlock(&pl.lock);
+        pthread_join(writer, NULL);
+    }
+
+    while( more && started )
+    {
+        pthread_mutex_lock(&pl.lock);
+        batch = &pl.batches[pl.next_fill % pl.nbatches];
+        while( batch->state != BATCH_FREE && !pl.failed )
+        {
+            pthread_cond_wait(&pl.freed, &pl.lock);
+        }
+        pthread_mutex_unlock(&pl.lock);
+
+        if( pl.failed )
+        {
+            break;
+        }
+
+        batch->output.used = 0;
+        more = read_batch(u2, batch, &count);
+
+        pthread_mutex_lock(&pl.lock);
+        if( batch->count )
+        {
+            batch->state = BATCH_FILLED;
+            pl.next_fill++;
+        }
+        if( !more )
+        {
+            pl.done = 1;
+            pthread_cond_broadcast(&pl.formatted);
+        }
+        pthread_cond_broadcast(&pl.filled);
+        pthread_mutex_unlock(&pl.lock);
+    }
+
+    if( started )
+    {
+        pthread_mutex_lock(&pl.lock);
+        pl.done = 1;
+        pthread_cond_broadcast(&pl.filled);
+        pthread_cond_broadcast(&pl.formatted);
+        pthread_mutex_unlock(&pl.lock);
+
+        for( i = 0; i < started; i++ )
+        {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_join(writer, NULL);
+    }
+
+    /* Batches that never made it out after a failure still own entries */
+    for( i = 0; i < pl.nbatches; i++ )
+    {
+        batch = &pl.batches[i];
+        if( batch->state == BATCH_FILLED )
+        {
+            while( batch->count )
+            {
+                Unified2EntrySparseCleanup(&batch->entries[--batch->count]);
+            }
+        }
+        _Unified2Free(batch->output.data, UNIFIED2_ALLOC_BUFFER);
+    }
+
+    pthread_cond_destroy(&pl.freed);
+    pthread_cond_destroy(&pl.formatted);
+    pthread_cond_destroy(&pl.filled);
+    pthread_mutex_destroy(&pl.lock);
+    _Unified2Free(pl.batches, UNIFIED2_ALLOC_BUFFER);
+
+    return pl.failed ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
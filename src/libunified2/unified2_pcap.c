@@ -0,0 +1,398 @@
+/*******************************************************************************
+ * Capture file writer.
+ *
+ * Writes the packets carried by unified2 packet records to a classic pcap or a
+ * pcapng file. Packets are staged in one large buffer and handed to the
+ * kernel a megabyte at a time; nothing is allocated per packet.
+ *
+ * A classic pcap file has a single link type, taken from the first packet;
+ * packets with any other link type are dropped with a warning. pcapng gets an
+ * interface description block for every link type seen instead.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "unified2.h"
+
+#define PCAP_BUFFER         (1 << 20)
+#define PCAP_SNAPLEN        262144
+#define PCAP_MAX_LINKTYPES  16
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4d
+
+#define PAD4(x)             (((x) + 3) & ~3U)
+
+/* All blocks are written in host byte order, readers use the magic numbers
+ * to tell which one that was */
+typedef struct _PcapFileHeader {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} PcapFileHeader;
+
+typedef struct _PcapngSectionHeader {
+    uint32_t type;
+    uint32_t length;
+    uint32_t byte_order;
+    uint16_t version_major;
+    uint16_t version_minor;
+    uint32_t section_length[2];
+    uint32_t trailer;
+} PcapngSectionHeader;
+
+typedef struct _PcapngInterface {
+    uint32_t type;
+    uint32_t length;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+    uint32_t trailer;
+} PcapngInterface;
+
+struct _Unified2PcapWriter {
+    UNIFIED2_PCAP_FORMAT format;
+    int fd;
+    char *filename;
+
+    uint8_t *buffer;
+    uint32_t used;
+
+    /* classic pcap: link type of the file header, once written */
+    int header_written;
+    uint32_t linktype;
+    uint64_t dropped;
+
+    /* pcapng: interface id is the index of the link type */
+    uint32_t linktypes[PCAP_MAX_LINKTYPES];
+    int interfaces;
+};
+
+static HRESULT flush(Unified2PcapWriter *w)
+{
+    if( w->used && _Unified2WriteAll(w->fd, w->buffer, w->used) == -1 )
+    {
+        warn("Unified2Pcap: failed to write %s: %s\n", w->filename,
+        strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    w->used = 0;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: put
+ *
+ * Purpose: Append to the output buffer, flushing first when it would
+ * overflow. Data that is larger than the buffer goes straight to the file.
+ *
+ * Arguements:
+ *      Unified2PcapWriter *
+ *      const void *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT put(Unified2PcapWriter *w, const void *data, uint32_t size)
+{
+    if( w->used + size > PCAP_BUFFER && flush(w) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( size > PCAP_BUFFER )
+    {
+        if( _Unified2WriteAll(w->fd, data, size) == -1 )
+        {
+            warn("Unified2Pcap: failed to write %s: %s\n", w->filename,
+            strerror(errno));
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+
+    memcpy(w->buffer + w->used, data, size);
+    w->used += size;
+
+    return UNIFIED2_OK;
+}
+
+static HRESULT put_zeroes(Unified2PcapWriter *w, uint32_t size)
+{
+    static const uint8_t zero[4];
+
+    return size ? put(w, zero, size) : UNIFIED2_OK;
+}
+
+/* Function: pcapng_interface
+ *
+ * Purpose: Look up the interface for a link type, describing a new one the
+ * first time the link type is seen.
+ *
+ * Arguements:
+ *      Unified2PcapWriter *
+ *      uint32_t
+ *
+ * Returns:
+ *      int         interface id, or -1 when out of interfaces
+ */
+static int pcapng_interface(Unified2PcapWriter *w, uint32_t linktype)
+{
+    PcapngInterface idb;
+    int i;
+
+    for( i = 0; i < w->interfaces; i++ )
+    {
+        if( w->linktypes[i] == linktype )
+        {
+            return i;
+        }
+    }
+
+    if( w->interfaces == PCAP_MAX_LINKTYPES )
+    {
+        return -1;
+    }
+
+    idb.type = PCAPNG_IDB;
+    idb.length = sizeof(idb);
+    idb.linktype = linktype;
+    idb.reserved = 0;
+    idb.snaplen = PCAP_SNAPLEN;
+    idb.trailer = sizeof(idb);
+
+    if( put(w, &idb, sizeof(idb)) != UNIFIED2_OK )
+    {
+        return -1;
+    }
+
+    w->linktypes[w->interfaces] = linktype;
+
+    return w->interfaces++;
+}
+
+/* Function: Unified2PcapOpen
+ *
+ * Purpose: Create a capture file, NULL or "-" writes to stdout
+ *
+ * Arguements:
+ *      char *
+ *      UNIFIED2_PCAP_FORMAT
+ *
+ * Returns:
+ *      Unified2PcapWriter *
+ */
+Unified2PcapWriter * Unified2PcapOpen(char *filename, UNIFIED2_PCAP_FORMAT format)
+{
+    Unified2PcapWriter *w;
+    PcapngSectionHeader shb;
+
+    w = (Unified2PcapWriter *)_Unified2Malloc(sizeof(Unified2PcapWriter),
+        UNIFIED2_ALLOC_HANDLE);
+    if( w == NULL )
+    {
+        warn("Unified2PcapOpen: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+    memset(w, 0x0, sizeof(Unified2PcapWriter));
+
+    w->format = format;
+    w->buffer = (uint8_t *)_Unified2Malloc(PCAP_BUFFER, UNIFIED2_ALLOC_BUFFER);
+    if( w->buffer == NULL )
+    {
+        warn("Unified2PcapOpen: failed to malloc: %s\n", strerror(errno));
+        _Unified2Free(w, UNIFIED2_ALLOC_HANDLE);
+        return NULL;
+    }
+
+    if( filename == NULL || strcmp(filename, "-") == 0 )
+    {
+        w->fd = STDOUT_FILENO;
+        w->filename = _Unified2Strdup("(stdout)", UNIFIED2_ALLOC_HANDLE);
+    }
+    else
+    {
+        w->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if( w->fd == -1 )
+        {
+            warn("Unified2PcapOpen: failed to open the file %s: %s\n",
+            filename, strerror(errno));
+            _Unified2Free(w->buffer, UNIFIED2_ALLOC_BUFFER);
+            _Unified2Free(w, UNIFIED2_ALLOC_HANDLE);
+            return NULL;
+        }
+        w->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+    }
+
+    if( format == UNIFIED2_PCAPNG )
+    {
+        shb.type = PCAPNG_SHB;
+        shb.length = sizeof(shb);
+        shb.byte_order = PCAPNG_BYTE_ORDER;
+        shb.version_major = 1;
+        shb.version_minor = 0;
+        shb.section_length[0] = 0xffffffff;     /* unknown */
+        shb.section_length[1] = 0xffffffff;
+        shb.trailer = sizeof(shb);
+
+        put(w, &shb, sizeof(shb));
+    }
+
+    return w;
+}
+
+/* Function: Unified2PcapWritePacket
+ *
+ * Purpose: Append one packet, using the packet time stamp and link type
+ *
+ * Arguements:
+ *      Unified2PcapWriter *
+ *      const Unified2Packet *  in host byte order
+ *      const void *            packet_length bytes of packet data
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when the packet had to be dropped
+ */
+HRESULT Unified2PcapWritePacket(Unified2PcapWriter *w,
+    const Unified2Packet *packet, const void *data)
+{
+    PcapFileHeader file;
+    uint32_t hdr[7];
+    uint32_t caplen;
+    uint64_t ts;
+    int id;
+
+    if( w == NULL || packet == NULL || (data == NULL && packet->packet_length) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    caplen = packet->packet_length;
+
+    if( w->format == UNIFIED2_PCAPNG )
+    {
+        id = pcapng_interface(w, packet->linktype);
+        if( id == -1 )
+        {
+            w->dropped++;
+            return UNIFIED2_WARN;
+        }
+
+        ts = (uint64_t)packet->packet_second * 1000000 +
+            packet->packet_microsecond;
+
+        hdr[0] = PCAPNG_EPB;
+        hdr[1] = 32 + PAD4(caplen);
+        hdr[2] = id;
+        hdr[3] = (uint32_t)(ts >> 32);
+        hdr[4] = (uint32_t)ts;
+        hdr[5] = caplen;
+        hdr[6] = caplen;
+
+        if( put(w, hdr, sizeof(hdr)) != UNIFIED2_OK ||
+            put(w, data, caplen) != UNIFIED2_OK ||
+            put_zeroes(w, PAD4(caplen) - caplen) != UNIFIED2_OK ||
+            put(w, &hdr[1], sizeof(hdr[1])) != UNIFIED2_OK )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        return UNIFIED2_OK;
+    }
+
+    if( !w->header_written )
+    {
+        file.magic = PCAP_MAGIC;
+        file.version_major = 2;
+        file.version_minor = 4;
+        file.thiszone = 0;
+        file.sigfigs = 0;
+        file.snaplen = PCAP_SNAPLEN;
+        file.linktype = packet->linktype;
+
+        if( put(w, &file, sizeof(file)) != UNIFIED2_OK )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        w->header_written = 1;
+        w->linktype = packet->linktype;
+    }
+
+    if( packet->linktype != w->linktype )
+    {
+        if( w->dropped++ == 0 )
+        {
+            warn("Unified2PcapWritePacket: dropping packets with link type %u, "
+            "%s has link type %u (use pcapng to keep them)\n",
+            packet->linktype, w->filename, w->linktype);
+        }
+        return UNIFIED2_WARN;
+    }
+
+    hdr[0] = packet->packet_second;
+    hdr[1] = packet->packet_microsecond;
+    hdr[2] = caplen;
+    hdr[3] = caplen;
+
+    if( put(w, hdr, 4 * sizeof(uint32_t)) != UNIFIED2_OK ||
+        put(w, data, caplen) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2PcapClose
+ *
+ * Purpose: Flush and close the capture file
+ *
+ * Arguements:
+ *      Unified2PcapWriter *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2PcapClose(Unified2PcapWriter *w)
+{
+    HRESULT r;
+
+    if( w == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    r = flush(w);
+
+    if( w->fd != STDOUT_FILENO && close(w->fd) == -1 )
+    {
+        warn("Unified2PcapClose: failed to close %s: %s\n", w->filename,
+        strerror(errno));
+        r = UNIFIED2_ERROR;
+    }
+
+    _Unified2Free(w->filename, UNIFIED2_ALLOC_HANDLE);
+    _Unified2Free(w->buffer, UNIFIED2_ALLOC_BUFFER);
+    _Unified2Free(w, UNIFIED2_ALLOC_HANDLE);
+
+    return r;
+}
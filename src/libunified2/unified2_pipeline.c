@@ -0,0 +1,498 @@
+/*******************************************************************************
+ * Pipelines: sources in front of a dispatcher.
+ *
+ * A pipeline reads its sources one after the other into a single dispatcher
+ * (see unified2_dispatch.c), which does the rest: stages to filter, sample,
+ * enrich or correlate, and sinks to write unified2, CSV, JSON, pcap or
+ * summaries, on as many workers as it is given. Sources are files opened with
+ * any of the read opens (stdio, descriptor, mapped, shared memory), handles
+ * the caller opened (memory, or a socket through Unified2ReadOpenFILE_2()),
+ * or a snort spool: every file of a directory named prefix.timestamp, in
+ * timestamp order.
+ *
+ * The sinks see one stream, so event ids and filters carry across sources.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "unified2.h"
+
+typedef struct _Source {
+    Unified2OpenFunc open;
+    char *name;
+    Unified2 *handle;           /* the caller's, instead of open and name */
+} Source;
+
+struct _Unified2Pipeline {
+    Unified2Dispatcher *dispatcher;
+
+    Source *sources;
+    int nsources;
+    int size;
+
+    /* for the handles the pipeline opens */
+    Unified2DiagFunc diag;
+    void *diag_context;
+    uint32_t diag_interval;
+};
+
+/* Spool file found by Unified2PipelineSpool() */
+typedef struct _SpoolFile {
+    uint64_t timestamp;
+    char *name;
+} SpoolFile;
+
+/* Function: Unified2PipelineNew
+ *
+ * Purpose: Allocate a pipeline without sources, stages or sinks
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      Unified2Pipeline *
+ */
+Unified2Pipeline * Unified2PipelineNew()
+{
+    Unified2Pipeline *pl;
+
+    pl = (Unified2Pipeline *)_Unified2Calloc(1, sizeof(Unified2Pipeline),
+        UNIFIED2_ALLOC_HANDLE);
+    if( pl == NULL )
+    {
+        warn("Unified2PipelineNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pl->dispatcher = Unified2DispatcherNew();
+    if( pl->dispatcher == NULL )
+    {
+        _Unified2Free(pl, UNIFIED2_ALLOC_HANDLE);
+        return NULL;
+    }
+
+    return pl;
+}
+
+/* Function: Unified2PipelineFree
+ *
+ * Purpose: Release a pipeline. Handles given with Unified2PipelineHandle()
+ * and what the sinks write to are left alone.
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2PipelineFree(Unified2Pipeline *pl)
+{
+    int i;
+
+    if( pl == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < pl->nsources; i++ )
+    {
+        _Unified2Free(pl->sources[i].name, UNIFIED2_ALLOC_HANDLE);
+    }
+
+    _Unified2Free(pl->sources, UNIFIED2_ALLOC_HANDLE);
+    Unified2DispatcherFree(pl->dispatcher);
+    _Unified2Free(pl, UNIFIED2_ALLOC_HANDLE);
+}
+
+/* Function: Unified2PipelineDispatcher
+ *
+ * Purpose: Get the dispatcher of a pipeline, to add its stages and sinks
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *
+ * Returns:
+ *      Unified2Dispatcher *
+ */
+Unified2Dispatcher * Unified2PipelineDispatcher(Unified2Pipeline *pl)
+{
+    return pl == NULL ? NULL : pl->dispatcher;
+}
+
+/* Function: Unified2PipelineDiagnostics
+ *
+ * Purpose: Report the problems of the sources the pipeline opens, see
+ * Unified2SetDiagnostics()
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *      Unified2DiagFunc
+ *      void *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2PipelineDiagnostics(Unified2Pipeline *pl, Unified2DiagFunc func,
+    void *context, uint32_t interval)
+{
+    if( pl == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    pl->diag = func;
+    pl->diag_context = context;
+    pl->diag_interval = interval;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: add_source
+ *
+ * Purpose: Append a source
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *
+ * Returns:
+ *      Source *
+ */
+static Source *add_source(Unified2Pipeline *pl)
+{
+    Source *grown;
+    int size;
+
+    if( pl->nsources == pl->size )
+    {
+        size = pl->size ? pl->size * 2 : 16;
+        grown = (Source *)_Unified2Realloc(pl->sources, size * sizeof(Source),
+            UNIFIED2_ALLOC_HANDLE);
+        if( grown == NULL )
+        {
+            warn("Unified2Pipeline: failed to malloc: %s\n", strerror(errno));
+            return NULL;
+        }
+        pl->sources = grown;
+        pl->size = size;
+    }
+
+    grown = &pl->sources[pl->nsources++];
+    memset(grown, 0x0, sizeof(Source));
+
+    return grown;
+}
+
+/* Function: Unified2PipelineSource
+ *
+ * Purpose: Add a file to read, opened when its turn comes
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *      Unified2OpenFunc    e.g. Unified2ReadOpenMapped
+ *      const char *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2PipelineSource(Unified2Pipeline *pl, Unified2OpenFunc open,
+    const char *name)
+{
+    Source *source;
+
+    if( pl == NULL || open == NULL || name == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    source = add_source(pl);
+    if( source == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    source->name = _Unified2Strdup(name, UNIFIED2_ALLOC_HANDLE);
+    if( source->name == NULL )
+    {
+        pl->nsources--;
+        return UNIFIED2_ERROR;
+    }
+    source->open = open;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2PipelineHandle
+ *
+ * Purpose: Add a handle the caller opened to read. It is read from where it
+ * is and not closed.
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2PipelineHandle(Unified2Pipeline *pl, Unified2 *u2)
+{
+    Source *source;
+
+    if( pl == NULL || u2 == NULL || (source = add_source(pl)) == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    source->handle = u2;
+
+    return UNIFIED2_OK;
+}
+
+static int timestamp_order(const void *a, const void *b)
+{
+    const SpoolFile *x = a;
+    const SpoolFile *y = b;
+
+    if( x->timestamp != y->timestamp )
+    {
+        return x->timestamp < y->timestamp ? -1 : 1;
+    }
+
+    return strcmp(x->name, y->name);
+}
+
+/* Function: spool_timestamp
+ *
+ * Purpose: Take the timestamp off a spool file name, prefix.timestamp or
+ * prefix followed by the digits directly
+ *
+ * Arguements:
+ *      const char *
+ *      const char *
+ *      uint64_t *
+ *
+ * Returns:
+ *      int         0 when it is not a file of the spool
+ */
+static int spool_timestamp(const char *name, const char *prefix,
+    uint64_t *timestamp)
+{
+    size_t length = strlen(prefix);
+    char *end;
+
+    if( strncmp(name, prefix, length) != 0 )
+    {
+        return 0;
+    }
+
+    name += length;
+    if( *name == '.' )
+    {
+        name++;
+    }
+
+    if( *name < '0' || *name > '9' )
+    {
+        return 0;
+    }
+
+    *timestamp = strtoull(name, &end, 10);
+
+    return *end == '\0';
+}
+
+/* Function: Unified2PipelineSpool
+ *
+ * Purpose: Add every file of a snort spool directory, prefix.timestamp, in
+ * timestamp order
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *      Unified2OpenFunc
+ *      const char *        the directory
+ *      const char *        the file name prefix, e.g. snort.u2
+ *
+ * Returns:
+ *      int                 the files added, -1 on error
+ */
+int Unified2PipelineSpool(Unified2Pipeline *pl, Unified2OpenFunc open,
+    const char *directory, const char *prefix)
+{
+    SpoolFile *files = NULL;
+    SpoolFile *grown;
+    struct dirent *de;
+    uint64_t timestamp;
+    size_t path_size;
+    char *path;
+    DIR *dir;
+    int nfiles = 0;
+    int size = 0;
+    int added = 0;
+    int i;
+
+    if( pl == NULL || open == NULL || directory == NULL || prefix == NULL )
+    {
+        return -1;
+    }
+
+    dir = opendir(directory);
+    if( dir == NULL )
+    {
+        warn("Unified2PipelineSpool: failed to open %s: %s\n", directory,
+            strerror(errno));
+        return -1;
+    }
+
+    while( (de = readdir(dir)) != NULL )
+    {
+        if( !spool_timestamp(de->d_name, prefix, &timestamp) )
+        {
+            continue;
+        }
+
+        if( nfiles == size )
+        {
+            size = size ? size * 2 : 64;
+            grown = (SpoolFile *)_Unified2Realloc(files,
+                size * sizeof(SpoolFile), UNIFIED2_ALLOC_HANDLE);
+            if( grown == NULL )
+            {
+                warn("Unified2PipelineSpool: failed to malloc: %s\n",
+                    strerror(errno));
+                added = -1;
+                break;
+            }
+            files = grown;
+        }
+
+        files[nfiles].timestamp = timestamp;
+        files[nfiles].name = _Unified2Strdup(de->d_name,
+            UNIFIED2_ALLOC_HANDLE);
+        if( files[nfiles].name == NULL )
+        {
+            added = -1;
+            break;
+        }
+        nfiles++;
+    }
+    closedir(dir);
+
+    if( added != -1 && nfiles )
+    {
+        qsort(files, nfiles, sizeof(SpoolFile), timestamp_order);
+    }
+
+    for( i = 0; i < nfiles; i++ )
+    {
+        path_size = strlen(directory) + strlen(files[i].name) + 2;
+        path = (char *)_Unified2Malloc(path_size, UNIFIED2_ALLOC_HANDLE);
+
+        if( added != -1 && path != NULL )
+        {
+            snprintf(path, path_size, "%s/%s", directory, files[i].name);
+            if( Unified2PipelineSource(pl, open, path) == UNIFIED2_OK )
+            {
+                added++;
+            }
+            else
+            {
+                added = -1;
+            }
+        }
+        else
+        {
+            added = -1;
+        }
+
+        _Unified2Free(path, UNIFIED2_ALLOC_HANDLE);
+        _Unified2Free(files[i].name, UNIFIED2_ALLOC_HANDLE);
+    }
+    _Unified2Free(files, UNIFIED2_ALLOC_HANDLE);
+
+    return added;
+}
+
+/* Function: Unified2PipelineRun
+ *
+ * Purpose: Read the sources in the order they were added, up to count records
+ * in all (negative for all), through the stages into the sinks. A source that
+ * does not open or is damaged is reported and the next one read; a sink or
+ * stage that fails stops the run.
+ *
+ * Arguements:
+ *      Unified2Pipeline *
+ *      int
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_WARN when a source could not be read in full
+ */
+HRESULT Unified2PipelineRun(Unified2Pipeline *pl, int count)
+{
+    HRESULT result = UNIFIED2_OK;
+    Source *source;
+    Unified2 *u2;
+    HRESULT r;
+    int i;
+
+    if( pl == NULL || pl->nsources == 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0; i < pl->nsources && count; i++ )
+    {
+        source = &pl->sources[i];
+        u2 = source->handle;
+
+        if( u2 == NULL )
+        {
+            u2 = Unified2New();
+            if( u2 == NULL )
+            {
+                return UNIFIED2_ERROR;
+            }
+
+            if( pl->diag != NULL )
+            {
+                Unified2SetDiagnostics(u2, pl->diag, pl->diag_context,
+                    pl->diag_interval);
+            }
+
+            if( source->open(u2, source->name) != UNIFIED2_OK )
+            {
+                warn("Unified2PipelineRun: failed to open %s\n", source->name);
+                Unified2Free(u2);
+                result = UNIFIED2_WARN;
+                continue;
+            }
+        }
+
+        r = _Unified2DispatchRecords(pl->dispatcher, u2, &count);
+
+        if( u2 != source->handle )
+        {
+            Unified2Free(u2);
+        }
+
+        if( r == UNIFIED2_ERROR )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        if( r == UNIFIED2_WARN )
+        {
+            result = UNIFIED2_WARN;
+        }
+    }
+
+    return result;
+}
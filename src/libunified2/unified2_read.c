@@ -66,11 +66,13 @@ Unified2RecordHeader * Unified2ReadRecordHeader(Unified2 *u2) {
         return NULL;
     }
 
-    record = (Unified2RecordHeader *)malloc(sizeof(Unified2RecordHeader));
+    record = (Unified2RecordHeader *)_Unified2Malloc(
+        sizeof(Unified2RecordHeader), UNIFIED2_ALLOC_RECORD);
     if(record == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, record, sizeof(Unified2RecordHeader));
  
@@ -105,11 +107,13 @@ Unified2Event * Unified2ReadEvent(Unified2 *u2) {
         return NULL;
     }
 
-    event = (Unified2Event *)malloc(sizeof(Unified2Event));
+    event = (Unified2Event *)_Unified2Malloc(sizeof(Unified2Event),
+        UNIFIED2_ALLOC_RECORD);
     if(event == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, event, sizeof(Unified2Event));
 
@@ -160,11 +164,13 @@ Unified2Event_v2 * Unified2ReadEvent_v2(Unified2 *u2) {
         return NULL;
     }
 
-    event_v2 = (Unified2Event_v2 *)malloc(sizeof(Unified2Event_v2));
+    event_v2 = (Unified2Event_v2 *)_Unified2Malloc(sizeof(Unified2Event_v2),
+        UNIFIED2_ALLOC_RECORD);
     if(event_v2 == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, event_v2, sizeof(Unified2Event_v2));
 
@@ -217,11 +223,13 @@ Unified2Event6 * Unified2ReadEvent6(Unified2 *u2) {
         return NULL;
     }
 
-    event = (Unified2Event6 *)malloc(sizeof(Unified2Event6));
+    event = (Unified2Event6 *)_Unified2Malloc(sizeof(Unified2Event6),
+        UNIFIED2_ALLOC_RECORD);
     if(event == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, event, sizeof(Unified2Event6));
 
@@ -271,11 +279,13 @@ Unified2Event6_v2 * Unified2ReadEvent6_v2(Unified2 *u2) {
         return NULL;
     }
 
-    event_v2 = (Unified2Event6_v2 *)malloc(sizeof(Unified2Event6_v2));
+    event_v2 = (Unified2Event6_v2 *)_Unified2Malloc(sizeof(Unified2Event6_v2),
+        UNIFIED2_ALLOC_RECORD);
     if(event_v2 == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, event_v2, sizeof(Unified2Event6_v2));
 
@@ -326,11 +336,13 @@ Unified2Packet * Unified2ReadPacket(Unified2 *u2) {
         return NULL;
     }
 
-    packet = (Unified2Packet *)malloc(sizeof(Unified2Packet));
+    packet = (Unified2Packet *)_Unified2Malloc(sizeof(Unified2Packet),
+        UNIFIED2_ALLOC_RECORD);
     if(packet == NULL)
     {
         return NULL;
     }
+    _UNIFIED2_COUNT(u2, allocations, 1);
 
     bytes_read = Unified2Read(u2, packet, sizeof(Unified2Packet));
 
@@ -385,7 +397,9 @@ void * Unified2ReadPacketData(Unified2 *u2, Unified2Packet *packet) {
         return NULL;
     }
 
-    packet_data = (void *)malloc(packet->packet_length);
+    packet_data = (void *)_Unified2Malloc(packet->packet_length,
+        UNIFIED2_ALLOC_RECORD);
+    _UNIFIED2_COUNT(u2, allocations, 1);
     bytes_read = Unified2Read(u2, packet_data, packet->packet_length);
 
     if(!bytes_read || bytes_read != packet->packet_length)
@@ -393,31 +407,105 @@ void * Unified2ReadPacketData(Unified2 *u2, Unified2Packet *packet) {
         return NULL;
     }
 
+    _UNIFIED2_PROBE2(packet__data, packet->packet_length, u2->offset);
+
     return packet_data;
 }
 
-/* Function: Unifiled2ReadNextEntry
+/* Function: Unified2ReadExtraData
  *
- * Purpose: Read the next Unified2Entry from the Unified2 data
+ * Purpose: Read the body of an extra data record, its header and the data it
+ * carries, into one allocation with the data right after the structure.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint32_t    record length
+ *
+ * Returns:
+ *      Unified2ExtraData *
+ */
+Unified2ExtraData * Unified2ReadExtraData(Unified2 *u2, uint32_t length) {
+    Unified2ExtraDataHdr header;
+    Unified2ExtraData *extra;
+    uint32_t data_length;
+    int bytes_read;
+
+    if(u2 == NULL)
+    {
+        return NULL;
+    }
+
+    if(length < sizeof(Unified2ExtraDataHdr) + sizeof(Unified2ExtraData))
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_SHORT_RECORD, UNIFIED2_EXTRA_DATA, 0);
+        Unified2Seek(u2, length, SEEK_CUR);
+        _UNIFIED2_COUNT(u2, resyncs, 1);
+        return NULL;
+    }
+
+    /* The record length is what is really on disk, size the data from it */
+    data_length = length - sizeof(Unified2ExtraDataHdr) - sizeof(Unified2ExtraData);
+
+    extra = (Unified2ExtraData *)_Unified2Malloc(
+        sizeof(Unified2ExtraData) + data_length, UNIFIED2_ALLOC_RECORD);
+    if(extra == NULL)
+    {
+        return NULL;
+    }
+    _UNIFIED2_COUNT(u2, allocations, 1);
+
+    bytes_read = Unified2Read(u2, &header, sizeof(Unified2ExtraDataHdr));
+    if(bytes_read != sizeof(Unified2ExtraDataHdr))
+    {
+        _Unified2Free(extra, UNIFIED2_ALLOC_RECORD);
+        return NULL;
+    }
+
+    bytes_read = Unified2Read(u2, extra, sizeof(Unified2ExtraData) + data_length);
+    if(bytes_read != (int)(sizeof(Unified2ExtraData) + data_length))
+    {
+        _Unified2Free(extra, UNIFIED2_ALLOC_RECORD);
+        return NULL;
+    }
+
+    extra->sensor_id = ntohl(extra->sensor_id);
+    extra->event_id = ntohl(extra->event_id);
+    extra->event_second = ntohl(extra->event_second);
+    extra->type = ntohl(extra->type);
+    extra->data_type = ntohl(extra->data_type);
+    extra->blob_length = data_length + 8;
+
+    return extra;
+}
+
+/* Function: read_next_entry
+ *
+ * Purpose: Read and decode the next record, skipping the ones not asked for
  *
  * Arguements:
  *      Unifiled2 *
  *      Unified2Entry *
  *
  * Returns:
- *      void *
+ *      HRESULT
  */
-HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
-    if( u2 == NULL || entry == NULL )
-        return UNIFIED2_ERROR;
+static HRESULT read_next_entry(Unified2 *u2, Unified2Entry *entry) {
+    const void *next;
+    uint32_t length;
 
     READ_AGAIN:
 
+    /* A ring has no end to test for, wait for its next record instead */
+    if( u2->mode == SHARED_MEMORY &&
+        Unified2ShmPeek(u2, &next, &length) != UNIFIED2_OK )
+        return UNIFIED2_EOF;
+
     /* TODO: need to have the option to poll continuously from a unified2 log,
      * when that happens this will need to be turned off. */
     if( Unified2Eof(u2) )
         return UNIFIED2_EOF;
 
+    _UNIFIED2_PROBE1(read__start, u2->offset);
 
     entry->record = Unified2ReadRecordHeader(u2);
     if( entry->record == NULL )
@@ -432,8 +520,10 @@ HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
             entry->event = Unified2ReadEvent(u2);
             if( entry->event == NULL )
             {
+                _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, entry->record->type, 0);
                 return UNIFIED2_ERROR;
             }
+            _UNIFIED2_PROBE2(event, entry->record->length, u2->offset);
 
             break;
 
@@ -442,8 +532,10 @@ HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
             entry->event_v2 = Unified2ReadEvent_v2(u2);
             if( entry->event_v2 == NULL )
             {
+                _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, entry->record->type, 0);
                 return UNIFIED2_ERROR;
             }
+            _UNIFIED2_PROBE2(event_v2, entry->record->length, u2->offset);
             break;
 
         /* IPv6 Event */
@@ -451,8 +543,10 @@ HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
             entry->event6 = Unified2ReadEvent6(u2);
             if( entry->event6 == NULL )
             {
+                _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, entry->record->type, 0);
                 return UNIFIED2_ERROR;
             }
+            _UNIFIED2_PROBE2(event6, entry->record->length, u2->offset);
             break;
 
         /* IPv6 Event with MPLS, VLAN, or Policy ID info */
@@ -460,8 +554,10 @@ HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
             entry->event6_v2 = Unified2ReadEvent6_v2(u2);
             if( entry->event6_v2 == NULL )
             {
+                _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, entry->record->type, 0);
                 return UNIFIED2_ERROR;
             }
+            _UNIFIED2_PROBE2(event6_v2, entry->record->length, u2->offset);
             break;
 
         /* Packet Data */
@@ -470,22 +566,333 @@ HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
             entry->packet_data = Unified2ReadPacketData(u2, entry->packet);
             if( entry->packet == NULL )
             {
+                _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, entry->record->type, 0);
                 return UNIFIED2_ERROR;
             }
             if( entry->packet_data == NULL )
             {
+                if( entry->packet->packet_length )
+                {
+                    _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, UNIFIED2_PACKET, 0);
+                }
                 return UNIFIED2_WARN;
             }
+            _UNIFIED2_PROBE2(packet, entry->record->length, u2->offset);
+            break;
+
+        /* Extra data, when asked for */
+        case UNIFIED2_EXTRA_DATA:
+            if( !(u2->read_flags & UNIFIED2_READ_EXTRA_DATA) )
+            {
+                goto SKIP;
+            }
+            entry->extra_data = Unified2ReadExtraData(u2, entry->record->length);
+            if( entry->extra_data == NULL )
+            {
+                return UNIFIED2_ERROR;
+            }
+            _UNIFIED2_PROBE2(extra_data, entry->record->length, u2->offset);
             break;
 
         default:
-            warn("Unknown record type (%d)! ... skipping.\n", entry->record->type);
+        SKIP:
+            _Unified2Diag(u2, UNIFIED2_DIAG_SKIPPED, entry->record->type, 0);
+            _UNIFIED2_PROBE3(skip, entry->record->type, entry->record->length,
+                u2->offset);
             Unified2Seek(u2, entry->record->length, SEEK_CUR);
+            _UNIFIED2_COUNT(u2, skipped, 1);
             goto READ_AGAIN;
     }
 
-    if( Unified2Eof(u2) )
+    _UNIFIED2_RECORD(u2, entry->record->type);
+
+    /* A ring only ends once its writers leave, which is no reason to hold
+     * back the record just read */
+    if( u2->mode != SHARED_MEMORY && Unified2Eof(u2) )
+        return UNIFIED2_EOF;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unifiled2ReadNextEntry
+ *
+ * Purpose: Read the next Unified2Entry from the Unified2 data
+ *
+ * Arguements:
+ *      Unifiled2 *
+ *      Unified2Entry *
+ *
+ * Returns:
+ *      void *
+ */
+HRESULT Unified2ReadNextEntry(Unified2 *u2, Unified2Entry *entry) {
+#ifdef UNIFIED2_STATS
+    uint64_t start = 0;
+    uint64_t reading = 0;
+#endif
+    HRESULT r;
+
+    if( u2 == NULL || entry == NULL )
+        return UNIFIED2_ERROR;
+
+#ifdef UNIFIED2_STATS
+    /* Decode time is what is left once the reads are taken out */
+    if( u2->stats_flags & UNIFIED2_STATS_LATENCY )
+    {
+        start = _Unified2Now();
+        reading = u2->stats->read.total;
+    }
+#endif
+
+    r = read_next_entry(u2, entry);
+
+#ifdef UNIFIED2_STATS
+    if( start )
+    {
+        reading = u2->stats->read.total - reading;
+        Unified2HistogramRecord(&u2->stats->decode,
+            _Unified2Now() - start - reading);
+    }
+#endif
+
+    if( r == UNIFIED2_ERROR )
+    {
+        _UNIFIED2_COUNT(u2, errors, 1);
+    }
+
+    _UNIFIED2_PROBE4(read__end, entry->record ? entry->record->type : 0,
+        entry->record ? entry->record->length : 0, u2->offset, r);
+
+    return r;
+}
+
+/* Function: raw_in_place
+ *
+ * Purpose: Find the record at the start of memory that is already in place,
+ * for memory buffers and mapped files
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const uint8_t *
+ *      uint64_t        bytes left
+ *      const uint8_t **
+ *      uint32_t *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT raw_in_place(Unified2 *u2, const uint8_t *data, uint64_t left,
+    const uint8_t **record, uint32_t *length)
+{
+    Unified2RecordHeader header;
+    uint64_t total;
+
+    if( left == 0 )
+    {
         return UNIFIED2_EOF;
+    }
+
+    if( left < sizeof(header) )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, 0, 0);
+        return UNIFIED2_ERROR;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    total = (uint64_t)ntohl(header.length) + sizeof(header);
+    if( total > left || total > UINT32_MAX )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, ntohl(header.type), 0);
+        return UNIFIED2_ERROR;
+    }
+
+    *record = data;
+    *length = (uint32_t)total;
 
     return UNIFIED2_OK;
 }
+
+/* Function: _Unified2RawReserve
+ *
+ * Purpose: Grow the handle's record buffer to at least size bytes
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint32_t
+ *
+ * Returns:
+ *      uint8_t *   NULL when out of memory
+ */
+uint8_t * _Unified2RawReserve(Unified2 *u2, uint32_t size)
+{
+    uint8_t *raw;
+
+    if( size > u2->raw_size )
+    {
+        raw = (uint8_t *)_Unified2Realloc(u2->raw, size,
+            UNIFIED2_ALLOC_BUFFER);
+        if( raw == NULL )
+        {
+            return NULL;
+        }
+        u2->raw = raw;
+        u2->raw_size = size;
+        _UNIFIED2_COUNT(u2, allocations, 1);
+    }
+
+    return u2->raw;
+}
+
+/* Function: read_raw_record
+ *
+ * Purpose: Find or read the next raw record, see Unified2ReadRawRecord()
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const uint8_t **
+ *      uint32_t *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT read_raw_record(Unified2 *u2, const uint8_t **record,
+    uint32_t *length)
+{
+    Unified2RecordHeader header;
+    uint32_t total;
+    uint8_t *raw;
+    int bytes_read;
+    HRESULT r;
+
+    if( u2->mode == MEMORY )
+    {
+        r = raw_in_place(u2, (uint8_t *)u2->memory + u2->memory_offset,
+            u2->memory_size - u2->memory_offset, record, length);
+        if( r == UNIFIED2_OK )
+        {
+            u2->memory_offset += *length;
+            u2->offset += *length;
+        }
+        return r;
+    }
+
+    if( u2->mode == MAPPED )
+    {
+        r = raw_in_place(u2, u2->map + u2->map_offset,
+            u2->map_size - u2->map_offset, record, length);
+        if( r == UNIFIED2_OK )
+        {
+            u2->map_offset += *length;
+            u2->offset += *length;
+        }
+        return r;
+    }
+
+    bytes_read = Unified2Read(u2, &header, sizeof(header));
+    if( bytes_read == 0 )
+    {
+        return UNIFIED2_EOF;
+    }
+
+    if( bytes_read != sizeof(header) )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, 0, 0);
+        return UNIFIED2_ERROR;
+    }
+
+    total = ntohl(header.length);
+    if( total > UINT32_MAX - sizeof(header) )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_BAD_LENGTH, ntohl(header.type), 0);
+        return UNIFIED2_ERROR;
+    }
+    total += sizeof(header);
+
+    raw = _Unified2RawReserve(u2, total);
+    if( raw == NULL )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_NOMEM, ntohl(header.type), errno);
+        return UNIFIED2_ERROR;
+    }
+
+    memcpy(raw, &header, sizeof(header));
+    if( total > sizeof(header) )
+    {
+        bytes_read = Unified2Read(u2, u2->raw + sizeof(header),
+            total - sizeof(header));
+        if( bytes_read != (int)(total - sizeof(header)) )
+        {
+            _Unified2Diag(u2, UNIFIED2_DIAG_TRUNCATED, ntohl(header.type), 0);
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    *record = u2->raw;
+    *length = total;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ReadRawRecord
+ *
+ * Purpose: Read the next record of any type without decoding it. The record
+ * is returned as it is stored, header included and in network byte order, in
+ * a buffer owned by the handle (or in place for memory buffers and mapped
+ * files) that stays valid until the next call. Nothing is allocated once the
+ * buffer has grown to the largest record seen.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const uint8_t **
+ *      uint32_t *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_EOF at the end, UNIFIED2_ERROR on a short record
+ */
+HRESULT Unified2ReadRawRecord(Unified2 *u2, const uint8_t **record,
+    uint32_t *length)
+{
+    HRESULT r;
+
+    if( u2 == NULL || record == NULL || length == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    r = read_raw_record(u2, record, length);
+
+#ifdef UNIFIED2_USDT
+    if( r == UNIFIED2_OK )
+    {
+        uint32_t type;
+
+        memcpy(&type, *record, sizeof(type));
+        _UNIFIED2_PROBE3(raw, ntohl(type), *length, u2->offset);
+    }
+#endif
+
+#ifdef UNIFIED2_STATS
+    if( u2->stats != NULL )
+    {
+        Unified2RecordHeader header;
+
+        if( r == UNIFIED2_OK )
+        {
+            memcpy(&header, *record, sizeof(header));
+            _Unified2StatsRecord(u2, ntohl(header.type));
+
+            /* Records found in place never went through Unified2Read() */
+            if( u2->mode == MEMORY || u2->mode == MAPPED )
+            {
+                u2->stats->bytes_read += *length;
+            }
+        }
+        else if( r == UNIFIED2_ERROR )
+        {
+            u2->stats->errors++;
+        }
+    }
+#endif
+
+    return r;
+}
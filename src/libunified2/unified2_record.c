@@ -0,0 +1,514 @@
+/*******************************************************************************
+ * Records with inline storage.
+ *
+ * Unified2ReadNextEntry() allocates the header, the body and the packet data
+ * of every record separately, so one alert is spread over three or four
+ * unrelated cache lines and costs as many frees. Unified2ReadNextRecord()
+ * decodes into a Unified2Record instead: the header and the fixed body inline
+ * in a union tagged by the record type, and packet data and extra data left
+ * where Unified2ReadRawRecord() found them, referenced by pointer and length.
+ * A caller reuses one Unified2Record for a whole log and allocates nothing.
+ *
+ * The accessors hand out a body only when the record is of that type and long
+ * enough to hold it. Unified2RecordEntry() points the fields of an old style
+ * Unified2Entry into a record, for the formatters and writers that take one.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "unified2.h"
+
+/* Function: decode_event
+ *
+ * Purpose: Convert the fields every event type starts with, up to the
+ * addresses, to host order
+ *
+ * Arguements:
+ *      Unified2Event *
+ *
+ * Returns:
+ *      void
+ */
+static void decode_event(Unified2Event *event)
+{
+    event->sensor_id = ntohl(event->sensor_id);
+    event->event_id = ntohl(event->event_id);
+    event->event_second = ntohl(event->event_second);
+    event->event_microsecond = ntohl(event->event_microsecond);
+    event->signature_id = ntohl(event->signature_id);
+    event->generator_id = ntohl(event->generator_id);
+    event->signature_revision = ntohl(event->signature_revision);
+    event->classification_id = ntohl(event->classification_id);
+    event->priority_id = ntohl(event->priority_id);
+}
+
+/* Function: decode_body
+ *
+ * Purpose: Copy the fixed body of a record inline and convert it
+ *
+ * Arguements:
+ *      Unified2Record *
+ *      const uint8_t *     body as stored
+ *      uint32_t            body length
+ *
+ * Returns:
+ *      uint32_t            bytes of the body used, 0 when too short
+ */
+static uint32_t decode_body(Unified2Record *r, const uint8_t *body,
+    uint32_t length)
+{
+    switch( r->record.type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        if( length < sizeof(Unified2Event) )
+            return 0;
+        memcpy(&r->body.event, body, sizeof(Unified2Event));
+        decode_event(&r->body.event);
+        r->body.event.sport_itype = ntohs(r->body.event.sport_itype);
+        r->body.event.dport_icode = ntohs(r->body.event.dport_icode);
+        r->body.event.pad = ntohs(r->body.event.pad);
+        return sizeof(Unified2Event);
+
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        if( length < sizeof(Unified2Event_v2) )
+            return 0;
+        memcpy(&r->body.event_v2, body, sizeof(Unified2Event_v2));
+        decode_event(&r->body.event);
+        r->body.event_v2.sport_itype = ntohs(r->body.event_v2.sport_itype);
+        r->body.event_v2.dport_icode = ntohs(r->body.event_v2.dport_icode);
+        r->body.event_v2.pad = ntohs(r->body.event_v2.pad);
+        r->body.event_v2.mpls_label = ntohl(r->body.event_v2.mpls_label);
+        r->body.event_v2.vlan_id = ntohs(r->body.event_v2.vlan_id);
+        r->body.event_v2.policy_id = ntohs(r->body.event_v2.policy_id);
+        return sizeof(Unified2Event_v2);
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        if( length < sizeof(Unified2Event6) )
+            return 0;
+        memcpy(&r->body.event6, body, sizeof(Unified2Event6));
+        decode_event(&r->body.event);
+        r->body.event6.sport_itype = ntohs(r->body.event6.sport_itype);
+        r->body.event6.dport_icode = ntohs(r->body.event6.dport_icode);
+        r->body.event6.pad = ntohs(r->body.event6.pad);
+        return sizeof(Unified2Event6);
+
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        if( length < sizeof(Unified2Event6_v2) )
+            return 0;
+        memcpy(&r->body.event6_v2, body, sizeof(Unified2Event6_v2));
+        decode_event(&r->body.event);
+        r->body.event6_v2.sport_itype = ntohs(r->body.event6_v2.sport_itype);
+        r->body.event6_v2.dport_icode = ntohs(r->body.event6_v2.dport_icode);
+        r->body.event6_v2.pad = ntohs(r->body.event6_v2.pad);
+        r->body.event6_v2.mpls_label = ntohl(r->body.event6_v2.mpls_label);
+        r->body.event6_v2.vlan_id = ntohs(r->body.event6_v2.vlan_id);
+        r->body.event6_v2.policy_id = ntohs(r->body.event6_v2.policy_id);
+        return sizeof(Unified2Event6_v2);
+
+        case UNIFIED2_PACKET:
+        if( length < sizeof(Unified2Packet) )
+            return 0;
+        memcpy(&r->body.packet, body, sizeof(Unified2Packet));
+        r->body.packet.sensor_id = ntohl(r->body.packet.sensor_id);
+        r->body.packet.event_id = ntohl(r->body.packet.event_id);
+        r->body.packet.event_second = ntohl(r->body.packet.event_second);
+        r->body.packet.packet_second = ntohl(r->body.packet.packet_second);
+        r->body.packet.packet_microsecond =
+            ntohl(r->body.packet.packet_microsecond);
+        r->body.packet.linktype = ntohl(r->body.packet.linktype);
+        r->body.packet.packet_length = ntohl(r->body.packet.packet_length);
+        return sizeof(Unified2Packet);
+    }
+
+    return 0;
+}
+
+/* Function: decode_extra_data
+ *
+ * Purpose: Convert the header of an extra data record where it lies, so the
+ * blob stays right after it
+ *
+ * Arguements:
+ *      Unified2Record *
+ *      uint8_t *           the record, header included
+ *      uint32_t            its length
+ *
+ * Returns:
+ *      HRESULT             UNIFIED2_WARN when too short
+ */
+static HRESULT decode_extra_data(Unified2Record *r, uint8_t *record,
+    uint32_t length)
+{
+    Unified2ExtraData *extra;
+
+    if( length < sizeof(Unified2RecordHeader) + sizeof(Unified2ExtraDataHdr) +
+        sizeof(Unified2ExtraData) )
+    {
+        r->data = record + sizeof(Unified2RecordHeader);
+        r->data_length = length - sizeof(Unified2RecordHeader);
+        return UNIFIED2_WARN;
+    }
+
+    extra = (Unified2ExtraData *)(record + sizeof(Unified2RecordHeader) +
+        sizeof(Unified2ExtraDataHdr));
+    extra->sensor_id = ntohl(extra->sensor_id);
+    extra->event_id = ntohl(extra->event_id);
+    extra->event_second = ntohl(extra->event_second);
+    extra->type = ntohl(extra->type);
+    extra->data_type = ntohl(extra->data_type);
+
+    /* Sized from the record length, like Unified2ReadExtraData() */
+    r->data = (const uint8_t *)(extra + 1);
+    r->data_length = length - ((const uint8_t *)(extra + 1) - record);
+    extra->blob_length = r->data_length + 8;
+    r->extra_data = extra;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2DecodeRecord
+ *
+ * Purpose: Decode a raw record into a Unified2Record. Only extra data records
+ * are written to, their header is converted where it lies.
+ *
+ * Arguements:
+ *      Unified2Record *
+ *      uint8_t *           the record, header included
+ *      uint32_t            its length
+ *      UNIFIED2_DIAG *     what was wrong when it returns UNIFIED2_WARN
+ *
+ * Returns:
+ *      HRESULT             UNIFIED2_WARN when too short for its type, only
+ *                          data is set then; or when a packet claims more
+ *                          data than there is, packet_length is cut down
+ */
+HRESULT _Unified2DecodeRecord(Unified2Record *r, uint8_t *record,
+    uint32_t length, UNIFIED2_DIAG *problem)
+{
+    const uint8_t *body;
+    uint32_t used;
+
+    memcpy(&r->record, record, sizeof(Unified2RecordHeader));
+    r->record.type = ntohl(r->record.type);
+    r->record.length = ntohl(r->record.length);
+    r->extra_data = NULL;
+    *problem = UNIFIED2_DIAG_SHORT_RECORD;
+
+    if( r->record.type == UNIFIED2_EXTRA_DATA )
+    {
+        return decode_extra_data(r, record, length);
+    }
+
+    body = record + sizeof(Unified2RecordHeader);
+    length -= sizeof(Unified2RecordHeader);
+
+    used = decode_body(r, body, length);
+    r->data = body + used;
+    r->data_length = length - used;
+
+    switch( r->record.type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_V2:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_PACKET:
+        if( used == 0 )
+        {
+            return UNIFIED2_WARN;
+        }
+        break;
+    }
+
+    if( r->record.type == UNIFIED2_PACKET )
+    {
+        /* Never let a consumer walk past the data that is there */
+        if( r->body.packet.packet_length > r->data_length )
+        {
+            *problem = UNIFIED2_DIAG_BAD_LENGTH;
+            r->body.packet.packet_length = r->data_length;
+            return UNIFIED2_WARN;
+        }
+        r->data_length = r->body.packet.packet_length;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ReadNextRecord
+ *
+ * Purpose: Read the next record of any type into inline storage, see
+ * Unified2Record. Nothing is allocated once the handle's buffer has grown to
+ * the largest record.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Record *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_EOF at the end, UNIFIED2_WARN when a record is
+ *                  too short for its type and only data is set, UNIFIED2_ERROR
+ *                  when the input is damaged
+ */
+HRESULT Unified2ReadNextRecord(Unified2 *u2, Unified2Record *r)
+{
+    Unified2RecordHeader header;
+    UNIFIED2_DIAG problem;
+    const uint8_t *record;
+    uint8_t *raw;
+    uint32_t length;
+    HRESULT ret;
+
+    if( u2 == NULL || r == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    ret = Unified2ReadRawRecord(u2, &record, &length);
+    if( ret != UNIFIED2_OK )
+    {
+        return ret;
+    }
+
+    /* Extra data is converted in place, which memory the handle found the
+     * record in, the caller's or a read only mapping, must not see */
+    raw = (uint8_t *)record;
+    memcpy(&header, record, sizeof(header));
+    if( ntohl(header.type) == UNIFIED2_EXTRA_DATA && record != u2->raw )
+    {
+        raw = _Unified2RawReserve(u2, length);
+        if( raw == NULL )
+        {
+            _Unified2Diag(u2, UNIFIED2_DIAG_NOMEM, UNIFIED2_EXTRA_DATA, errno);
+            return UNIFIED2_ERROR;
+        }
+        memcpy(raw, record, length);
+    }
+
+    ret = _Unified2DecodeRecord(r, raw, length, &problem);
+    if( ret == UNIFIED2_WARN )
+    {
+        _Unified2Diag(u2, problem, r->record.type, 0);
+    }
+
+    return ret;
+}
+
+/* Function: Unified2RecordType
+ *
+ * Purpose: The type of a record, host order
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      uint32_t
+ */
+uint32_t Unified2RecordType(const Unified2Record *r)
+{
+    return r->record.type;
+}
+
+/* Function: Unified2RecordEvent
+ *
+ * Purpose: The body of an IPv4 event record
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2Event *   NULL when it is not one
+ */
+const Unified2Event * Unified2RecordEvent(const Unified2Record *r)
+{
+    if( r->record.type != UNIFIED2_IDS_EVENT ||
+        r->record.length < sizeof(Unified2Event) )
+    {
+        return NULL;
+    }
+
+    return &r->body.event;
+}
+
+/* Function: Unified2RecordEvent_v2
+ *
+ * Purpose: The body of an IPv4 event v2 record, or an MPLS one
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2Event_v2 *    NULL when it is not one
+ */
+const Unified2Event_v2 * Unified2RecordEvent_v2(const Unified2Record *r)
+{
+    if( (r->record.type != UNIFIED2_IDS_EVENT_V2 &&
+        r->record.type != UNIFIED2_IDS_EVENT_MPLS) ||
+        r->record.length < sizeof(Unified2Event_v2) )
+    {
+        return NULL;
+    }
+
+    return &r->body.event_v2;
+}
+
+/* Function: Unified2RecordEvent6
+ *
+ * Purpose: The body of an IPv6 event record
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2Event6 *  NULL when it is not one
+ */
+const Unified2Event6 * Unified2RecordEvent6(const Unified2Record *r)
+{
+    if( r->record.type != UNIFIED2_IDS_EVENT_IPV6 ||
+        r->record.length < sizeof(Unified2Event6) )
+    {
+        return NULL;
+    }
+
+    return &r->body.event6;
+}
+
+/* Function: Unified2RecordEvent6_v2
+ *
+ * Purpose: The body of an IPv6 event v2 record, or an MPLS one
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2Event6_v2 *   NULL when it is not one
+ */
+const Unified2Event6_v2 * Unified2RecordEvent6_v2(const Unified2Record *r)
+{
+    if( (r->record.type != UNIFIED2_IDS_EVENT_IPV6_V2 &&
+        r->record.type != UNIFIED2_IDS_EVENT_IPV6_MPLS) ||
+        r->record.length < sizeof(Unified2Event6_v2) )
+    {
+        return NULL;
+    }
+
+    return &r->body.event6_v2;
+}
+
+/* Function: Unified2RecordPacket
+ *
+ * Purpose: The body of a packet record
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2Packet *  NULL when it is not one
+ */
+const Unified2Packet * Unified2RecordPacket(const Unified2Record *r)
+{
+    if( r->record.type != UNIFIED2_PACKET ||
+        r->record.length < sizeof(Unified2Packet) )
+    {
+        return NULL;
+    }
+
+    return &r->body.packet;
+}
+
+/* Function: Unified2RecordPacketData
+ *
+ * Purpose: The packet data of a packet record, in the reader's buffer
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *      uint32_t *          its length
+ *
+ * Returns:
+ *      const uint8_t *     NULL when it is not a packet
+ */
+const uint8_t * Unified2RecordPacketData(const Unified2Record *r,
+    uint32_t *length)
+{
+    if( Unified2RecordPacket(r) == NULL )
+    {
+        *length = 0;
+        return NULL;
+    }
+
+    *length = r->data_length;
+
+    return r->data;
+}
+
+/* Function: Unified2RecordExtraData
+ *
+ * Purpose: The extra data of an extra data record, UNIFIED2_EXTRA_DATA_BLOB()
+ * works on it
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *
+ * Returns:
+ *      const Unified2ExtraData *   NULL when it is not one
+ */
+const Unified2ExtraData * Unified2RecordExtraData(const Unified2Record *r)
+{
+    if( r->record.type != UNIFIED2_EXTRA_DATA )
+    {
+        return NULL;
+    }
+
+    return r->extra_data;
+}
+
+/* Function: Unified2RecordEntry
+ *
+ * Purpose: Point an old style entry into a record, for the functions that take
+ * a Unified2Entry. The entry borrows everything: it is valid as long as the
+ * record and its data are, and must not be given to
+ * Unified2EntrySparseCleanup().
+ *
+ * Arguements:
+ *      const Unified2Record *
+ *      Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2RecordEntry(const Unified2Record *r, Unified2Entry *entry)
+{
+    if( r == NULL || entry == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    memset(entry, 0x0, sizeof(Unified2Entry));
+    entry->record = (Unified2RecordHeader *)&r->record;
+    entry->event = (Unified2Event *)Unified2RecordEvent(r);
+    entry->event_v2 = (Unified2Event_v2 *)Unified2RecordEvent_v2(r);
+    entry->event6 = (Unified2Event6 *)Unified2RecordEvent6(r);
+    entry->event6_v2 = (Unified2Event6_v2 *)Unified2RecordEvent6_v2(r);
+    entry->packet = (Unified2Packet *)Unified2RecordPacket(r);
+    entry->extra_data = (Unified2ExtraData *)Unified2RecordExtraData(r);
+
+    if( entry->packet != NULL )
+    {
+        entry->packet_data = (void *)r->data;
+    }
+
+    return UNIFIED2_OK;
+}
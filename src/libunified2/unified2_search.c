@@ -0,0 +1,590 @@
+/*******************************************************************************
+ * Multi-pattern payload search.
+ *
+ * Any number of literal patterns are compiled into one Aho-Corasick automaton
+ * and packet data is scanned once for all of them. The automaton is a full
+ * transition table, so every byte costs one lookup, over an alphabet of only
+ * the byte values the patterns use; all other bytes share one class.
+ *
+ * Most payload bytes lead straight back to the start state. While the scan
+ * sits there, the bytes that could begin a pattern are looked for sixteen at
+ * a time with SSE2 when there are few enough of them, and by table otherwise.
+ *
+ * Patterns are written the way snort writes content, text with hex bytes
+ * between pipes: "GET |2f 2e 2e|/etc/passwd". A backslash escapes a pipe or
+ * itself.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "unified2.h"
+
+/* Most start bytes compared sixteen at a time */
+#define PREFILTER_BYTES 8
+
+typedef struct _SearchPattern {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t id;
+} SearchPattern;
+
+struct _Unified2Search {
+    int nocase;
+
+    SearchPattern *patterns;
+    uint32_t npatterns;
+
+    /* byte value to alphabet class, class 0 is every byte no pattern has */
+    uint8_t classes[256];
+    uint32_t nclasses;
+
+    /* next[state * nclasses + class], state 0 is the start */
+    uint32_t *next;
+    uint32_t nstates;
+
+    /* pattern ids ending in a state, matches[first[s]] to [first[s + 1]] */
+    uint32_t *first;
+    uint32_t *matches;
+
+    /* bytes that leave the start state */
+    uint8_t start[256];
+    uint8_t prefilter[PREFILTER_BYTES];
+    uint32_t nprefilter;
+
+    int compiled;
+};
+
+/* Function: Unified2SearchNew
+ *
+ * Purpose: Create an empty pattern set
+ *
+ * Arguements:
+ *      int         match without regard to ASCII case
+ *
+ * Returns:
+ *      Unified2Search *
+ */
+Unified2Search * Unified2SearchNew(int nocase)
+{
+    Unified2Search *search;
+
+    search = (Unified2Search *)_Unified2Calloc(1, sizeof(Unified2Search),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( search == NULL )
+    {
+        warn("Unified2SearchNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    search->nocase = nocase;
+
+    return search;
+}
+
+/* Function: Unified2SearchFree
+ *
+ * Purpose: Release a pattern set
+ *
+ * Arguements:
+ *      Unified2Search *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2SearchFree(Unified2Search *search)
+{
+    uint32_t i;
+
+    if( search == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < search->npatterns; i++ )
+        _Unified2Free(search->patterns[i].data, UNIFIED2_ALLOC_ANALYSIS);
+
+    _Unified2Free(search->patterns, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search->next, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search->first, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search->matches, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search, UNIFIED2_ALLOC_ANALYSIS);
+}
+
+/* Function: Unified2SearchAdd
+ *
+ * Purpose: Add a pattern of raw bytes to the set
+ *
+ * Arguements:
+ *      Unified2Search *
+ *      const uint8_t *
+ *      uint32_t
+ *      uint32_t        id reported on a match
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SearchAdd(Unified2Search *search, const uint8_t *data,
+    uint32_t length, uint32_t id)
+{
+    SearchPattern *patterns;
+    uint8_t *copy;
+    uint32_t i;
+
+    if( search == NULL || data == NULL || length == 0 || search->compiled )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    patterns = (SearchPattern *)_Unified2Realloc(search->patterns,
+        (search->npatterns + 1) * sizeof(SearchPattern),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( patterns == NULL )
+    {
+        warn("Unified2SearchAdd: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    search->patterns = patterns;
+
+    copy = (uint8_t *)_Unified2Malloc(length, UNIFIED2_ALLOC_ANALYSIS);
+    if( copy == NULL )
+    {
+        warn("Unified2SearchAdd: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0; i < length; i++ )
+        copy[i] = search->nocase ? tolower(data[i]) : data[i];
+
+    patterns[search->npatterns].data = copy;
+    patterns[search->npatterns].length = length;
+    patterns[search->npatterns].id = id;
+    search->npatterns++;
+
+    return UNIFIED2_OK;
+}
+
+static int hex_value(int c)
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+/* Function: Unified2SearchAddPattern
+ *
+ * Purpose: Add a pattern written as snort content, "text|0d 0a|text"
+ *
+ * Arguements:
+ *      Unified2Search *
+ *      const char *
+ *      uint32_t        id reported on a match
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SearchAddPattern(Unified2Search *search, const char *text,
+    uint32_t id)
+{
+    const char *p = text;
+    uint8_t *data;
+    uint32_t length = 0;
+    int hex = 0;
+    int hi, lo;
+    HRESULT r;
+
+    if( text == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    /* Never longer than the text */
+    data = (uint8_t *)_Unified2Malloc(strlen(text) + 1,
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( data == NULL )
+    {
+        warn("Unified2SearchAddPattern: failed to malloc: %s\n",
+        strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    while( *p )
+    {
+        if( *p == '|' )
+        {
+            hex = !hex;
+            p++;
+        }
+        else if( hex )
+        {
+            if( isspace((unsigned char)*p) )
+            {
+                p++;
+                continue;
+            }
+
+            hi = hex_value(p[0]);
+            lo = hi == -1 ? -1 : hex_value(p[1]);
+            if( lo == -1 )
+            {
+                break;
+            }
+            data[length++] = (uint8_t)(hi << 4 | lo);
+            p += 2;
+        }
+        else
+        {
+            if( *p == '\\' && (p[1] == '|' || p[1] == '\\') )
+                p++;
+            data[length++] = (uint8_t)*p++;
+        }
+    }
+
+    if( *p || hex || length == 0 )
+    {
+        warn("Unified2SearchAddPattern: bad pattern at offset %d: %s\n",
+        (int)(p - text), text);
+        _Unified2Free(data, UNIFIED2_ALLOC_ANALYSIS);
+        return UNIFIED2_ERROR;
+    }
+
+    r = Unified2SearchAdd(search, data, length, id);
+    _Unified2Free(data, UNIFIED2_ALLOC_ANALYSIS);
+
+    return r;
+}
+
+/* Function: Unified2SearchCompile
+ *
+ * Purpose: Build the automaton, after which no more patterns can be added
+ *
+ * Arguements:
+ *      Unified2Search *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SearchCompile(Unified2Search *search)
+{
+    uint32_t *fail = NULL;
+    uint32_t *queue = NULL;
+    uint32_t *own = NULL;       /* per state, first pattern ending there */
+    uint32_t *chain = NULL;     /* per pattern, the next one ending there */
+    uint32_t max_states = 1;
+    uint32_t nc, head, tail;
+    uint32_t i, j, s, u, c, nmatches;
+    int b;
+
+    if( search == NULL || search->compiled )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    /* Alphabet */
+    memset(search->classes, 0x0, sizeof(search->classes));
+    nc = 1;
+    for( i = 0; i < search->npatterns; i++ )
+    {
+        max_states += search->patterns[i].length;
+        for( j = 0; j < search->patterns[i].length; j++ )
+        {
+            b = search->patterns[i].data[j];
+            if( search->classes[b] == 0 )
+            {
+                search->classes[b] = nc;
+                if( search->nocase )
+                    search->classes[toupper(b)] = nc;
+                nc++;
+            }
+        }
+    }
+    search->nclasses = nc;
+
+    search->next = (uint32_t *)_Unified2Calloc(
+        (size_t)max_states * nc, sizeof(uint32_t), UNIFIED2_ALLOC_ANALYSIS);
+    fail = (uint32_t *)_Unified2Calloc(max_states, sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    queue = (uint32_t *)_Unified2Calloc(max_states, sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    own = (uint32_t *)_Unified2Malloc(max_states * sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    chain = (uint32_t *)_Unified2Malloc(
+        (search->npatterns + 1) * sizeof(uint32_t), UNIFIED2_ALLOC_ANALYSIS);
+    search->first = (uint32_t *)_Unified2Calloc(
+        max_states + 1, sizeof(uint32_t), UNIFIED2_ALLOC_ANALYSIS);
+    if( search->next == NULL || fail == NULL || queue == NULL ||
+        own == NULL || chain == NULL || search->first == NULL )
+    {
+        warn("Unified2SearchCompile: failed to malloc: %s\n", strerror(errno));
+        goto error;
+    }
+    memset(own, 0xff, max_states * sizeof(uint32_t));
+
+    /* Trie, an edge to state 0 means no edge */
+    search->nstates = 1;
+    for( i = 0; i < search->npatterns; i++ )
+    {
+        s = 0;
+        for( j = 0; j < search->patterns[i].length; j++ )
+        {
+            c = search->classes[search->patterns[i].data[j]];
+            if( search->next[s * nc + c] == 0 )
+                search->next[s * nc + c] = search->nstates++;
+            s = search->next[s * nc + c];
+        }
+        chain[i] = own[s];
+        own[s] = i;
+    }
+
+    /* Breadth first, turning missing edges into failure transitions */
+    head = tail = 0;
+    for( c = 0; c < nc; c++ )
+    {
+        if( search->next[c] )
+            queue[tail++] = search->next[c];
+    }
+
+    while( head < tail )
+    {
+        s = queue[head++];
+        for( c = 0; c < nc; c++ )
+        {
+            u = search->next[s * nc + c];
+            if( u )
+            {
+                fail[u] = search->next[fail[s] * nc + c];
+                queue[tail++] = u;
+            }
+            else
+            {
+                search->next[s * nc + c] = search->next[fail[s] * nc + c];
+            }
+        }
+    }
+
+    /* Matches of a state are its own and those of its failure state, which
+     * comes earlier in breadth first order */
+    for( i = 0; i < tail; i++ )
+    {
+        /* first[s + 1] holds the count of s until the sums below */
+        s = queue[i];
+        for( j = own[s]; j != UINT32_MAX; j = chain[j] )
+            search->first[s + 1]++;
+        search->first[s + 1] += search->first[fail[s] + 1];
+    }
+
+    for( s = 0; s < search->nstates; s++ )
+        search->first[s + 1] += search->first[s];
+    nmatches = search->first[search->nstates];
+
+    search->matches = (uint32_t *)_Unified2Malloc(
+        (nmatches + 1) * sizeof(uint32_t), UNIFIED2_ALLOC_ANALYSIS);
+    if( search->matches == NULL )
+    {
+        warn("Unified2SearchCompile: failed to malloc: %s\n", strerror(errno));
+        goto error;
+    }
+
+    for( i = 0; i < tail; i++ )
+    {
+        s = queue[i];
+        u = search->first[s];
+        for( j = own[s]; j != UINT32_MAX; j = chain[j] )
+            search->matches[u++] = search->patterns[j].id;
+        for( j = search->first[fail[s]]; j < search->first[fail[s] + 1]; j++ )
+            search->matches[u++] = search->matches[j];
+    }
+
+    /* Start bytes for the prefilter */
+    search->nprefilter = 0;
+    for( b = 0; b < 256; b++ )
+    {
+        search->start[b] = search->next[search->classes[b]] != 0;
+        if( search->start[b] && search->nprefilter <= PREFILTER_BYTES )
+        {
+            if( search->nprefilter < PREFILTER_BYTES )
+                search->prefilter[search->nprefilter] = b;
+            search->nprefilter++;
+        }
+    }
+
+    search->compiled = 1;
+
+    _Unified2Free(fail, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(queue, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(own, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(chain, UNIFIED2_ALLOC_ANALYSIS);
+
+    return UNIFIED2_OK;
+
+error:
+    _Unified2Free(fail, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(queue, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(own, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(chain, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search->next, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(search->first, UNIFIED2_ALLOC_ANALYSIS);
+    search->next = NULL;
+    search->first = NULL;
+
+    return UNIFIED2_ERROR;
+}
+
+/* Function: skip_to_start
+ *
+ * Purpose: Find the next byte that can begin a pattern
+ *
+ * Arguements:
+ *      const Unified2Search *
+ *      const uint8_t *
+ *      uint32_t
+ *      uint32_t
+ *
+ * Returns:
+ *      uint32_t    its offset, or length when there is none
+ */
+static uint32_t skip_to_start(const Unified2Search *search,
+    const uint8_t *data, uint32_t i, uint32_t length)
+{
+#ifdef __SSE2__
+    __m128i bytes[PREFILTER_BYTES];
+    __m128i block, hit;
+    uint32_t k, n = search->nprefilter;
+    int mask;
+
+    if( n <= PREFILTER_BYTES && length - i >= 16 )
+    {
+        for( k = 0; k < n; k++ )
+            bytes[k] = _mm_set1_epi8((char)search->prefilter[k]);
+
+        for( ; i + 16 <= length; i += 16 )
+        {
+            block = _mm_loadu_si128((const __m128i *)(data + i));
+            hit = _mm_cmpeq_epi8(block, bytes[0]);
+            for( k = 1; k < n; k++ )
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, bytes[k]));
+
+            mask = _mm_movemask_epi8(hit);
+            if( mask )
+                return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+
+    while( i < length && !search->start[data[i]] )
+        i++;
+
+    return i;
+}
+
+/* Function: Unified2SearchScan
+ *
+ * Purpose: Report every occurance of every pattern in a buffer. The callback
+ * gets the pattern id and the offset just past the match, and stops the scan
+ * by returning non zero.
+ *
+ * Arguements:
+ *      const Unified2Search *
+ *      const uint8_t *
+ *      uint32_t
+ *      Unified2SearchFunc
+ *      void *
+ *
+ * Returns:
+ *      int         number of matches reported
+ */
+int Unified2SearchScan(const Unified2Search *search, const uint8_t *data,
+    uint32_t length, Unified2SearchFunc func, void *arg)
+{
+    const uint32_t *next;
+    uint32_t nc;
+    uint32_t s = 0;
+    uint32_t i, m;
+    int found = 0;
+
+    if( search == NULL || !search->compiled || search->npatterns == 0 ||
+        data == NULL )
+    {
+        return 0;
+    }
+
+    next = search->next;
+    nc = search->nclasses;
+
+    for( i = 0; i < length; i++ )
+    {
+        if( s == 0 )
+        {
+            i = skip_to_start(search, data, i, length);
+            if( i == length )
+                break;
+        }
+
+        s = next[s * nc + search->classes[data[i]]];
+
+        for( m = search->first[s]; m < search->first[s + 1]; m++ )
+        {
+            found++;
+            if( func != NULL && func(search->matches[m], i + 1, arg) )
+                return found;
+        }
+    }
+
+    return found;
+}
+
+/* Function: Unified2SearchPacket
+ *
+ * Purpose: Scan the packet data of a raw UNIFIED2_PACKET record, header
+ * included. Other records have no packet data and never match.
+ *
+ * Arguements:
+ *      const Unified2Search *
+ *      const uint8_t *
+ *      uint32_t
+ *      Unified2SearchFunc
+ *      void *
+ *
+ * Returns:
+ *      int         number of matches reported
+ */
+int Unified2SearchPacket(const Unified2Search *search, const uint8_t *record,
+    uint32_t length, Unified2SearchFunc func, void *arg)
+{
+    const uint32_t offset = sizeof(Unified2RecordHeader) + 28;
+    uint32_t type, packet_length;
+
+    if( record == NULL || length < offset )
+    {
+        return 0;
+    }
+
+    memcpy(&type, record, sizeof(type));
+    if( ntohl(type) != UNIFIED2_PACKET )
+    {
+        return 0;
+    }
+
+    memcpy(&packet_length, record + offset - 4, sizeof(packet_length));
+    packet_length = ntohl(packet_length);
+    if( packet_length > length - offset )
+    {
+        packet_length = length - offset;
+    }
+
+    return Unified2SearchScan(search, record + offset, packet_length, func, arg);
+}
@@ -0,0 +1,705 @@
+/*******************************************************************************
+ * Shared memory ring transport.
+ *
+ * A unified2 writer can publish records into a ring buffer in /dev/shm instead
+ * of a file, and a reader opened on the same ring consumes them in place, so
+ * real time consumers see an alert microseconds after it is written without a
+ * round trip through the filesystem.
+ *
+ * Any number of writers, in any number of processes, can share a ring; space
+ * is reserved with a compare and swap on the reservation counter and each
+ * record is published by storing its length word last. There is one consumer
+ * per ring. Records are never split: one that does not fit before the end of
+ * the ring is preceded by a pad slot and starts over at the beginning.
+ *
+ * The consumer zeroes what it has consumed before handing the space back, so a
+ * reserved but not yet published slot always reads as zero. Both sides sleep
+ * on futexes when the ring is empty or full, and only issue a wake up system
+ * call when somebody is actually waiting.
+ *
+ * The consumer cannot tell a slot that is still being filled in from one whose
+ * writer died after reserving it: neither has a length word yet. A writer that
+ * is killed between the two leaves the ring stuck at that slot, and the writer
+ * count never drops to zero, so the consumer waits for it forever. Rings whose
+ * writers may crash should be unlinked with Unified2UnlinkShm() and created
+ * again once the writers restart.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef LINUX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "unified2.h"
+
+#define RING_MAGIC          "U2RING1"
+#define RING_DATA_OFFSET    4096
+#define RING_MIN_SIZE       (64 << 10)
+#define RING_DEFAULT_SIZE   (16 << 20)
+
+#define SLOT_HEADER         8
+#define SLOT_COMMITTED      0x80000000U
+#define SLOT_PAD            0x40000000U
+#define SLOT_LENGTH         0x3fffffffU
+
+#define WAIT_TIMEOUT_NS     100000000L
+
+#define ALIGN8(x)           (((x) + 7) & ~(uint64_t)7)
+
+/* Shared between processes, every hot counter on a cache line of its own */
+typedef struct _RingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+
+    uint64_t reserve __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+
+    uint32_t data_seq __attribute__((aligned(64)));
+    uint32_t readers_waiting;
+
+    uint32_t space_seq __attribute__((aligned(64)));
+    uint32_t writers_waiting;
+
+    uint32_t writers __attribute__((aligned(64)));
+    uint32_t closed;
+} RingHeader;
+
+struct _Unified2Ring {
+    RingHeader *header;
+    uint8_t *data;
+    size_t map_size;
+    uint64_t mask;
+    int writer;
+
+    /* consumer: record currently being read */
+    int current;
+    uint64_t current_pos;
+    uint32_t current_len;
+    uint32_t current_off;
+};
+
+static void futex_wait(uint32_t *addr, uint32_t value)
+{
+#ifdef LINUX
+    struct timespec timeout = { 0, WAIT_TIMEOUT_NS };
+
+    syscall(SYS_futex, addr, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+    struct timespec nap = { 0, 100000 };
+
+    if( __atomic_load_n(addr, __ATOMIC_ACQUIRE) == value )
+    {
+        nanosleep(&nap, NULL);
+    }
+#endif
+}
+
+static void futex_wake(uint32_t *addr)
+{
+#ifdef LINUX
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+static void notify(uint32_t *seq, uint32_t *waiting)
+{
+    __atomic_add_fetch(seq, 1, __ATOMIC_RELEASE);
+    if( __atomic_load_n(waiting, __ATOMIC_ACQUIRE) )
+    {
+        futex_wake(seq);
+    }
+}
+
+static char *shm_name(const char *name)
+{
+    char *full;
+
+    if( name[0] == '/' )
+    {
+        return _Unified2Strdup(name, UNIFIED2_ALLOC_HANDLE);
+    }
+
+    full = (char *)_Unified2Malloc(strlen(name) + 2, UNIFIED2_ALLOC_HANDLE);
+    if( full != NULL )
+    {
+        full[0] = '/';
+        strcpy(full + 1, name);
+    }
+
+    return full;
+}
+
+/* Function: ring_map
+ *
+ * Purpose: Create or open a ring and map it
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const char *
+ *      uint32_t    data size, 0 to open an existing ring
+ *
+ * Returns:
+ *      Unified2Ring *
+ */
+static Unified2Ring *ring_map(Unified2 *u2, const char *name, uint32_t size)
+{
+    Unified2Ring *ring;
+    RingHeader *header;
+    struct stat st;
+    char *path;
+    size_t map_size;
+    int fd;
+
+    path = shm_name(name);
+    if( path == NULL )
+    {
+        return NULL;
+    }
+
+    fd = shm_open(path, size ? O_RDWR|O_CREAT : O_RDWR, 0600);
+    _Unified2Free(path, UNIFIED2_ALLOC_HANDLE);
+    if( fd == -1 || fstat(fd, &st) == -1 )
+    {
+        warn("Unified2OpenShm: failed to open the ring %s: %s\n", name,
+        strerror(errno));
+        if( fd != -1 )
+            close(fd);
+        return NULL;
+    }
+
+    if( st.st_size == 0 && size )
+    {
+        /* Fresh ring: a zero filled file is an empty ring */
+        if( ftruncate(fd, RING_DATA_OFFSET + (off_t)size) == -1 )
+        {
+            warn("Unified2OpenShm: failed to size the ring %s: %s\n", name,
+            strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        map_size = RING_DATA_OFFSET + (size_t)size;
+    }
+    else
+    {
+        map_size = st.st_size;
+    }
+
+    if( map_size < RING_DATA_OFFSET + RING_MIN_SIZE )
+    {
+        warn("Unified2OpenShm: %s is not a unified2 ring\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    header = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( header == MAP_FAILED )
+    {
+        warn("Unified2OpenShm: failed to map the ring %s: %s\n", name,
+        strerror(errno));
+        return NULL;
+    }
+
+    if( header->magic[0] == '\0' && size )
+    {
+        header->size = map_size - RING_DATA_OFFSET;
+        header->version = 1;
+        memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+    }
+
+    if( memcmp(header->magic, RING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->size != map_size - RING_DATA_OFFSET ||
+        (header->size & (header->size - 1)) != 0 )
+    {
+        warn("Unified2OpenShm: %s is not a unified2 ring\n", name);
+        munmap(header, map_size);
+        return NULL;
+    }
+
+    ring = (Unified2Ring *)_Unified2Malloc(sizeof(Unified2Ring),
+        UNIFIED2_ALLOC_HANDLE);
+    if( ring == NULL )
+    {
+        munmap(header, map_size);
+        return NULL;
+    }
+    memset(ring, 0x0, sizeof(Unified2Ring));
+
+    ring->header = header;
+    ring->data = (uint8_t *)header + RING_DATA_OFFSET;
+    ring->map_size = map_size;
+    ring->mask = header->size - 1;
+
+    u2->ring = ring;
+    u2->mode = SHARED_MEMORY;
+    u2->filename = _Unified2Strdup(name, UNIFIED2_ALLOC_HANDLE);
+
+    return ring;
+}
+
+/* Function: Unified2WriteOpenShm
+ *
+ * Purpose: Open, creating it if need be, a shared memory ring to write
+ * records to. size is the ring's data size, rounded up to a power of two; 0
+ * picks 16MB. An existing ring keeps the size it was created with.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      char *      ring name, in /dev/shm
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2WriteOpenShm(Unified2 *u2, char *name, int size)
+{
+    Unified2Ring *ring;
+    uint32_t ring_size = RING_MIN_SIZE;
+
+    if( u2 == NULL || name == NULL || size < 0 )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( size == 0 )
+    {
+        size = RING_DEFAULT_SIZE;
+    }
+
+    while( ring_size < (uint32_t)size && ring_size < (1U << 30) )
+    {
+        ring_size <<= 1;
+    }
+
+    ring = ring_map(u2, name, ring_size);
+    if( ring == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    ring->writer = 1;
+    __atomic_add_fetch(&ring->header->writers, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&ring->header->closed, 0, __ATOMIC_RELEASE);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ReadOpenShm
+ *
+ * Purpose: Consume records from a shared memory ring. Reads block until a
+ * writer publishes something; the end of the stream is reached once every
+ * writer has closed and the ring is drained.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      char *      ring name, in /dev/shm
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ReadOpenShm(Unified2 *u2, char *name)
+{
+    if( u2 == NULL || name == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return ring_map(u2, name, 0) == NULL ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
+
+/* Function: _Unified2ShmWrite
+ *
+ * Purpose: Publish one record. Every Unified2Write() on a ring must carry a
+ * whole record, which Unified2WriteRecord() always does.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int         bytes written, or UNIFIED2_ERROR
+ */
+int _Unified2ShmWrite(Unified2 *u2, const void *buf, int size)
+{
+    Unified2Ring *ring = u2->ring;
+    RingHeader *h = ring->header;
+    uint64_t slot = ALIGN8(SLOT_HEADER + (uint64_t)size);
+    uint64_t head, tail, pos, contiguous, need;
+    uint32_t seq;
+    uint32_t *word;
+
+    if( !ring->writer || slot > h->size / 2 )
+    {
+        warn("Unified2Write: record of %d bytes does not fit the ring %s\n",
+        size, u2->filename);
+        return UNIFIED2_ERROR;
+    }
+
+    for( ;; )
+    {
+        head = __atomic_load_n(&h->reserve, __ATOMIC_ACQUIRE);
+        tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+
+        pos = head & ring->mask;
+        contiguous = h->size - pos;
+        need = slot <= contiguous ? slot : contiguous + slot;
+
+        if( head + need - tail > h->size )
+        {
+            /* Full: sleep until the consumer frees some space */
+            seq = __atomic_load_n(&h->space_seq, __ATOMIC_ACQUIRE);
+            __atomic_add_fetch(&h->writers_waiting, 1, __ATOMIC_ACQ_REL);
+            if( __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) == tail )
+            {
+                futex_wait(&h->space_seq, seq);
+            }
+            __atomic_sub_fetch(&h->writers_waiting, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+
+        if( __atomic_compare_exchange_n(&h->reserve, &head, head + need, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+        {
+            break;
+        }
+    }
+
+    if( need != slot )
+    {
+        word = (uint32_t *)(ring->data + pos);
+        __atomic_store_n(word, SLOT_COMMITTED | SLOT_PAD | (uint32_t)contiguous,
+            __ATOMIC_RELEASE);
+        pos = 0;
+    }
+
+    memcpy(ring->data + pos + SLOT_HEADER, buf, size);
+    word = (uint32_t *)(ring->data + pos);
+    __atomic_store_n(word, SLOT_COMMITTED | (uint32_t)size, __ATOMIC_RELEASE);
+
+    notify(&h->data_seq, &h->readers_waiting);
+
+    return size;
+}
+
+/* Function: Unified2ShmPeek
+ *
+ * Purpose: Wait for the next record and return it in place, still in network
+ * byte order and starting with its Unified2RecordHeader. The record stays
+ * valid, and the ring space reserved, until Unified2ShmRelease().
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const void **
+ *      uint32_t *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_EOF once all writers are gone and the ring is empty;
+ *                  blocks for as long as a writer that died holds a reserved
+ *                  slot (see above)
+ */
+HRESULT Unified2ShmPeek(Unified2 *u2, const void **record, uint32_t *length)
+{
+    Unified2Ring *ring;
+    RingHeader *h;
+    uint64_t tail;
+    uint32_t word;
+    uint32_t seq;
+    uint32_t *slot;
+
+    if( u2 == NULL || u2->mode != SHARED_MEMORY || u2->ring->writer )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    ring = u2->ring;
+    h = ring->header;
+
+    if( ring->current )
+    {
+        *record = ring->data + (ring->current_pos & ring->mask) + SLOT_HEADER;
+        *length = ring->current_len;
+        return UNIFIED2_OK;
+    }
+
+    tail = h->tail;
+    for( ;; )
+    {
+        slot = (uint32_t *)(ring->data + (tail & ring->mask));
+        word = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+        if( word & SLOT_PAD )
+        {
+            memset(slot, 0x0, word & SLOT_LENGTH);
+            tail += word & SLOT_LENGTH;
+            __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+            notify(&h->space_seq, &h->writers_waiting);
+            continue;
+        }
+
+        if( word & SLOT_COMMITTED )
+        {
+            break;
+        }
+
+        if( __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&h->reserve, __ATOMIC_ACQUIRE) == tail )
+        {
+            return UNIFIED2_EOF;
+        }
+
+        /* Empty: sleep until a writer publishes */
+        seq = __atomic_load_n(&h->data_seq, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&h->readers_waiting, 1, __ATOMIC_ACQ_REL);
+        if( __atomic_load_n(slot, __ATOMIC_ACQUIRE) == 0 &&
+            !__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) )
+        {
+            futex_wait(&h->data_seq, seq);
+        }
+        __atomic_sub_fetch(&h->readers_waiting, 1, __ATOMIC_ACQ_REL);
+    }
+
+    ring->current = 1;
+    ring->current_pos = tail;
+    ring->current_len = word & SLOT_LENGTH;
+    ring->current_off = 0;
+
+    *record = (uint8_t *)slot + SLOT_HEADER;
+    *length = ring->current_len;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ShmRelease
+ *
+ * Purpose: Give the space of the record returned by Unified2ShmPeek() back to
+ * the writers.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ShmRelease(Unified2 *u2)
+{
+    Unified2Ring *ring;
+    uint64_t slot;
+
+    if( u2 == NULL || u2->mode != SHARED_MEMORY || !u2->ring->current )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    ring = u2->ring;
+    slot = ALIGN8(SLOT_HEADER + (uint64_t)ring->current_len);
+
+    memset(ring->data + (ring->current_pos & ring->mask), 0x0, slot);
+    __atomic_store_n(&ring->header->tail, ring->current_pos + slot,
+        __ATOMIC_RELEASE);
+    ring->current = 0;
+
+    notify(&ring->header->space_seq, &ring->header->writers_waiting);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2ShmRead
+ *
+ * Purpose: Stream view of the ring for Unified2Read(): copies out of the
+ * current record, moving on to the next one as each is used up.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      void *      NULL to skip the data
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2ShmRead(Unified2 *u2, void *buf, int size)
+{
+    Unified2Ring *ring = u2->ring;
+    const void *record;
+    uint32_t length;
+    uint32_t chunk;
+    int total = 0;
+
+    while( total < size )
+    {
+        if( Unified2ShmPeek(u2, &record, &length) != UNIFIED2_OK )
+        {
+            break;
+        }
+
+        chunk = length - ring->current_off;
+        if( chunk > (uint32_t)(size - total) )
+        {
+            chunk = size - total;
+        }
+
+        if( buf != NULL )
+        {
+            memcpy((uint8_t *)buf + total,
+                (const uint8_t *)record + ring->current_off, chunk);
+        }
+        ring->current_off += chunk;
+        total += chunk;
+
+        if( ring->current_off == length )
+        {
+            Unified2ShmRelease(u2);
+        }
+    }
+
+    return total;
+}
+
+/* Function: _Unified2ShmSeek
+ *
+ * Purpose: Skip forward through the ring
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2ShmSeek(Unified2 *u2, int offset, int whence)
+{
+    if( u2->ring->writer || whence != SEEK_CUR || offset < 0 )
+    {
+        return -1;
+    }
+
+    return _Unified2ShmRead(u2, NULL, offset) == offset ? 0 : -1;
+}
+
+/* Function: _Unified2ShmEof
+ *
+ * Purpose: Test, without waiting, whether the stream has ended: every writer
+ * is gone and the ring is drained. An empty ring that still has writers is not
+ * the end; the next read waits for them.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      int
+ */
+int _Unified2ShmEof(Unified2 *u2)
+{
+    Unified2Ring *ring = u2->ring;
+    RingHeader *h;
+    uint64_t tail;
+    uint32_t word;
+
+    if( ring->writer )
+    {
+        return 1;
+    }
+
+    if( ring->current )
+    {
+        return 0;
+    }
+
+    h = ring->header;
+    tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    word = __atomic_load_n((uint32_t *)(ring->data + (tail & ring->mask)),
+        __ATOMIC_ACQUIRE);
+
+    /* A published record, or a pad slot Unified2ShmPeek() steps over */
+    if( word & SLOT_COMMITTED )
+    {
+        return 0;
+    }
+
+    return __atomic_load_n(&h->closed, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&h->reserve, __ATOMIC_ACQUIRE) == tail;
+}
+
+/* Function: _Unified2ShmClose
+ *
+ * Purpose: Unmap the ring. The last writer to leave marks the stream closed
+ * and wakes the consumer so it can see the end.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2ShmClose(Unified2 *u2)
+{
+    Unified2Ring *ring = u2->ring;
+    RingHeader *h;
+
+    if( ring == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    h = ring->header;
+    if( ring->writer &&
+        __atomic_sub_fetch(&h->writers, 1, __ATOMIC_ACQ_REL) == 0 )
+    {
+        __atomic_store_n(&h->closed, 1, __ATOMIC_RELEASE);
+        notify(&h->data_seq, &h->readers_waiting);
+    }
+
+    munmap(h, ring->map_size);
+    _Unified2Free(ring, UNIFIED2_ALLOC_HANDLE);
+    u2->ring = NULL;
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2UnlinkShm
+ *
+ * Purpose: Remove a ring from /dev/shm once nobody needs it any more
+ *
+ * Arguements:
+ *      char *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2UnlinkShm(char *name)
+{
+    char *path;
+    int r;
+
+    if( name == NULL || (path = shm_name(name)) == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    r = shm_unlink(path);
+    _Unified2Free(path, UNIFIED2_ALLOC_HANDLE);
+
+    return r == -1 ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
@@ -0,0 +1,284 @@
+/*******************************************************************************
+ * Per-handle runtime statistics.
+ *
+ * A handle counts nothing until Unified2EnableStats() is called on it. From
+ * then on the readers and writers count records by type, bytes, syscalls,
+ * allocations, skipped and damaged records and errors, and with
+ * UNIFIED2_STATS_LATENCY also time every read, decode and write into
+ * histograms, which tells a run blocked on I/O from one busy decoding.
+ *
+ * Counting is done by the _UNIFIED2_* macros in unified2.h. Configured with
+ * --disable-stats they expand to nothing and the handle can not be asked for
+ * statistics at all.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "unified2.h"
+
+/* Function: Unified2EnableStats
+ *
+ * Purpose: Start or stop keeping statistics for a handle. Starting again
+ * keeps what was counted so far.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int         UNIFIED2_STATS_* flags, 0 to stop and forget
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2EnableStats(Unified2 *u2, int flags)
+{
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+#ifdef UNIFIED2_STATS
+    if( flags == 0 )
+    {
+        _Unified2StatsFree(u2);
+        return UNIFIED2_OK;
+    }
+
+    if( u2->stats == NULL )
+    {
+        u2->stats = (Unified2Stats *)_Unified2Calloc(1, sizeof(Unified2Stats),
+            UNIFIED2_ALLOC_HANDLE);
+        if( u2->stats == NULL )
+        {
+            warn("Unified2EnableStats: failed to malloc: %s\n", strerror(errno));
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    u2->stats_flags = flags | UNIFIED2_STATS_COUNTERS;
+
+    return UNIFIED2_OK;
+#else
+    if( flags == 0 )
+    {
+        return UNIFIED2_OK;
+    }
+
+    warn("Unified2EnableStats: built with --disable-stats\n");
+
+    return UNIFIED2_ERROR;
+#endif
+}
+
+/* Function: Unified2GetStats
+ *
+ * Purpose: Copy out a handle's statistics, all zero when it keeps none
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Stats *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2GetStats(Unified2 *u2, Unified2Stats *stats)
+{
+    if( u2 == NULL || stats == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( u2->stats == NULL )
+    {
+        memset(stats, 0x0, sizeof(Unified2Stats));
+        return UNIFIED2_OK;
+    }
+
+    memcpy(stats, u2->stats, sizeof(Unified2Stats));
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2ResetStats
+ *
+ * Purpose: Zero a handle's statistics, e.g. between reporting intervals
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2ResetStats(Unified2 *u2)
+{
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( u2->stats != NULL )
+    {
+        memset(u2->stats, 0x0, sizeof(Unified2Stats));
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: format_latency
+ *
+ * Purpose: One line of percentiles for a histogram that counted something
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const char *
+ *      const Unified2Histogram *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT format_latency(Unified2Buffer *out, const char *name,
+    const Unified2Histogram *h)
+{
+    char line[256];
+    int n;
+
+    if( h->count == 0 )
+    {
+        return UNIFIED2_OK;
+    }
+
+    n = snprintf(line, sizeof(line), "%-16s %llu calls, %llu ns total, "
+        "p50 %llu p99 %llu max %llu ns\n", name,
+        (unsigned long long)h->count, (unsigned long long)h->total,
+        (unsigned long long)Unified2HistogramPercentile(h, 50.0),
+        (unsigned long long)Unified2HistogramPercentile(h, 99.0),
+        (unsigned long long)h->max);
+
+    return Unified2BufferAppend(out, line, n);
+}
+
+/* Function: Unified2FormatStats
+ *
+ * Purpose: Append statistics as text, one counter per line
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Stats *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2FormatStats(Unified2Buffer *out, const Unified2Stats *stats)
+{
+    const struct {
+        const char *name;
+        uint64_t value;
+    } counters[] = {
+        { "events", stats->events },
+        { "events_v2", stats->events_v2 },
+        { "events6", stats->events6 },
+        { "events6_v2", stats->events6_v2 },
+        { "packets", stats->packets },
+        { "extra_data", stats->extra_data },
+        { "skipped", stats->skipped },
+        { "records_written", stats->records_written },
+        { "bytes_read", stats->bytes_read },
+        { "bytes_written", stats->bytes_written },
+        { "syscalls", stats->syscalls },
+        { "allocations", stats->allocations },
+        { "resyncs", stats->resyncs },
+        { "errors", stats->errors },
+    };
+    char line[64];
+    size_t i;
+    int n;
+
+    for( i = 0; i < sizeof(counters) / sizeof(counters[0]); i++ )
+    {
+        n = snprintf(line, sizeof(line), "%-16s %llu\n", counters[i].name,
+            (unsigned long long)counters[i].value);
+        if( Unified2BufferAppend(out, line, n) != UNIFIED2_OK )
+        {
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    if( format_latency(out, "read", &stats->read) != UNIFIED2_OK ||
+        format_latency(out, "decode", &stats->decode) != UNIFIED2_OK ||
+        format_latency(out, "write", &stats->write) != UNIFIED2_OK )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2StatsRecord
+ *
+ * Purpose: Count a record read, by its type. Unknown types are only counted
+ * when the reader skips them.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      uint32_t    record type, host order
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2StatsRecord(Unified2 *u2, uint32_t type)
+{
+    Unified2Stats *stats = u2->stats;
+
+    switch( type )
+    {
+        case UNIFIED2_IDS_EVENT:
+        stats->events++;
+        break;
+
+        case UNIFIED2_IDS_EVENT_V2:
+        stats->events_v2++;
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6:
+        stats->events6++;
+        break;
+
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        stats->events6_v2++;
+        break;
+
+        case UNIFIED2_PACKET:
+        stats->packets++;
+        break;
+
+        case UNIFIED2_EXTRA_DATA:
+        stats->extra_data++;
+        break;
+
+        default:
+        break;
+    }
+}
+
+/* Function: _Unified2StatsFree
+ *
+ * Purpose: Release a handle's statistics
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2StatsFree(Unified2 *u2)
+{
+    _Unified2Free(u2->stats, UNIFIED2_ALLOC_HANDLE);
+    u2->stats = NULL;
+    u2->stats_flags = 0;
+}
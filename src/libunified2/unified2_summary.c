@@ -0,0 +1,1519 @@
+/*******************************************************************************
+ * One pass summaries of unified2 logs.
+ *
+ * A summary counts records by type and keeps, for the events among them, the
+ * heaviest signatures, sources, destinations and sensors, distinct counts and
+ * a histogram of events per minute. Everything but the per minute histogram
+ * takes a fixed amount of memory whatever the size of the input:
+ *
+ *  - heavy hitters are tracked with space saving: a fixed set of counters, the
+ *    smallest of which is handed to a new key when all are taken. Counts are
+ *    never under estimated and over estimated by at most the error reported.
+ *  - a count-min sketch per dimension tightens those estimates; a key's count
+ *    is reported as the smaller of the two.
+ *  - distinct counts come from HyperLogLog, about 0.8% standard error.
+ *
+ * All three merge, so Unified2SummaryParallel() gives every worker thread a
+ * summary of its own and folds them together once the input is exhausted.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "unified2.h"
+
+#define SUMMARY_COUNTERS    4096    /* space saving counters per dimension */
+#define SENSOR_COUNTERS     1024
+#define CM_DEPTH            4
+#define CM_WIDTH            8192    /* power of two */
+#define HLL_BITS            14
+#define HLL_REGISTERS       (1 << HLL_BITS)
+
+#define CHUNK_BYTES         (1 << 20)
+
+typedef struct _Key {
+    uint64_t hi;
+    uint64_t lo;
+} Key;
+
+typedef struct _Counter {
+    Key key;
+    uint64_t count;
+    uint64_t error;
+    uint32_t first;         /* event seconds, for the sensor rates */
+    uint32_t last;
+    uint32_t heap;          /* position in the min heap */
+} Counter;
+
+typedef struct _SpaceSaving {
+    Counter *counters;
+    uint32_t used;
+    uint32_t capacity;
+
+    /* linear probing, counter index plus one */
+    uint32_t *index;
+    uint32_t index_mask;
+
+    /* counter indices ordered by count, smallest first */
+    uint32_t *heap;
+} SpaceSaving;
+
+typedef struct _CountMin {
+    uint64_t cells[CM_DEPTH][CM_WIDTH];
+} CountMin;
+
+typedef struct _HyperLogLog {
+    uint8_t registers[HLL_REGISTERS];
+} HyperLogLog;
+
+typedef struct _Minute {
+    uint32_t minute;        /* minutes since the epoch plus one, 0 is empty */
+    uint64_t events;
+} Minute;
+
+typedef enum _DIMENSION {
+    DIMENSION_SIGNATURE,
+    DIMENSION_SOURCE,
+    DIMENSION_DESTINATION,
+    DIMENSIONS,
+} DIMENSION;
+
+struct _Unified2Summary {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t events;
+    uint64_t types[256];
+    uint64_t other_types;   /* record types above 255 */
+    uint32_t first_second;
+    uint32_t last_second;
+
+    SpaceSaving top[DIMENSIONS];
+    CountMin *sketch[DIMENSIONS];
+    HyperLogLog distinct[DIMENSIONS];
+    SpaceSaving sensors;
+
+    Minute *minutes;
+    uint32_t minutes_used;
+    uint32_t minutes_mask;
+};
+
+static uint64_t mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t key_hash(const Key *key)
+{
+    return mix(key->hi ^ mix(key->lo + 0x9e3779b97f4a7c15ULL));
+}
+
+static int key_equal(const Key *a, const Key *b)
+{
+    return a->hi == b->hi && a->lo == b->lo;
+}
+
+/** SPACE SAVING ***************************************************************/
+
+static int ss_init(SpaceSaving *ss, uint32_t capacity)
+{
+    uint32_t size = 1;
+
+    while( size < capacity * 2 )
+    {
+        size <<= 1;
+    }
+
+    ss->counters = (Counter *)_Unified2Calloc(capacity, sizeof(Counter),
+        UNIFIED2_ALLOC_ANALYSIS);
+    ss->index = (uint32_t *)_Unified2Calloc(size, sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    ss->heap = (uint32_t *)_Unified2Calloc(capacity, sizeof(uint32_t),
+        UNIFIED2_ALLOC_ANALYSIS);
+    ss->used = 0;
+    ss->capacity = capacity;
+    ss->index_mask = size - 1;
+
+    if( ss->counters == NULL || ss->index == NULL || ss->heap == NULL )
+    {
+        warn("Unified2SummaryNew: failed to malloc: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void ss_free(SpaceSaving *ss)
+{
+    _Unified2Free(ss->counters, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(ss->index, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(ss->heap, UNIFIED2_ALLOC_ANALYSIS);
+}
+
+static Counter *ss_lookup(const SpaceSaving *ss, const Key *key, uint32_t *slot)
+{
+    uint32_t i = (uint32_t)key_hash(key) & ss->index_mask;
+    Counter *c;
+
+    while( ss->index[i] )
+    {
+        c = &ss->counters[ss->index[i] - 1];
+        if( key_equal(&c->key, key) )
+        {
+            if( slot )
+                *slot = i;
+            return c;
+        }
+        i = (i + 1) & ss->index_mask;
+    }
+
+    if( slot )
+        *slot = i;
+
+    return NULL;
+}
+
+/* Backward shift deletion keeps probe sequences intact without tombstones */
+static void ss_unindex(SpaceSaving *ss, uint32_t slot)
+{
+    uint32_t i = slot;
+    uint32_t j = slot;
+    uint32_t home;
+
+    for( ;; )
+    {
+        j = (j + 1) & ss->index_mask;
+        if( ss->index[j] == 0 )
+        {
+            break;
+        }
+
+        home = (uint32_t)key_hash(&ss->counters[ss->index[j] - 1].key) &
+            ss->index_mask;
+
+        /* j may move to i unless its home lies cyclically in (i, j] */
+        if( ((j - home) & ss->index_mask) >= ((j - i) & ss->index_mask) )
+        {
+            ss->index[i] = ss->index[j];
+            i = j;
+        }
+    }
+
+    ss->index[i] = 0;
+}
+
+static void ss_swap(SpaceSaving *ss, uint32_t a, uint32_t b)
+{
+    uint32_t t = ss->heap[a];
+
+    ss->heap[a] = ss->heap[b];
+    ss->heap[b] = t;
+    ss->counters[ss->heap[a]].heap = a;
+    ss->counters[ss->heap[b]].heap = b;
+}
+
+static void ss_sift_up(SpaceSaving *ss, uint32_t i)
+{
+    uint32_t parent;
+
+    while( i > 0 )
+    {
+        parent = (i - 1) / 2;
+        if( ss->counters[ss->heap[parent]].count <=
+            ss->counters[ss->heap[i]].count )
+        {
+            break;
+        }
+        ss_swap(ss, i, parent);
+        i = parent;
+    }
+}
+
+static void ss_sift_down(SpaceSaving *ss, uint32_t i)
+{
+    uint32_t child;
+
+    for( ;; )
+    {
+        child = i * 2 + 1;
+        if( child >= ss->used )
+        {
+            break;
+        }
+
+        if( child + 1 < ss->used && ss->counters[ss->heap[child + 1]].count <
+            ss->counters[ss->heap[child]].count )
+        {
+            child++;
+        }
+
+        if( ss->counters[ss->heap[i]].count <=
+            ss->counters[ss->heap[child]].count )
+        {
+            break;
+        }
+
+        ss_swap(ss, i, child);
+        i = child;
+    }
+}
+
+static uint64_t ss_min(const SpaceSaving *ss)
+{
+    if( ss->used < ss->capacity )
+    {
+        return 0;
+    }
+
+    return ss->counters[ss->heap[0]].count;
+}
+
+/* Function: ss_add
+ *
+ * Purpose: Count a key, taking over the smallest counter when the key is new
+ * and every counter is in use
+ *
+ * Arguements:
+ *      SpaceSaving *
+ *      const Key *
+ *      uint64_t        count
+ *      uint64_t        error already in count
+ *      uint32_t        first second
+ *      uint32_t        last second
+ *
+ * Returns:
+ *      void
+ */
+static void ss_add(SpaceSaving *ss, const Key *key, uint64_t count,
+    uint64_t error, uint32_t first, uint32_t last)
+{
+    uint32_t slot;
+    uint32_t i;
+    Counter *c;
+
+    c = ss_lookup(ss, key, &slot);
+    if( c != NULL )
+    {
+        c->count += count;
+        c->error += error;
+        if( first < c->first )
+            c->first = first;
+        if( last > c->last )
+            c->last = last;
+        ss_sift_down(ss, c->heap);
+        return;
+    }
+
+    if( ss->used < ss->capacity )
+    {
+        i = ss->used++;
+        c = &ss->counters[i];
+        c->key = *key;
+        c->count = count;
+        c->error = error;
+        c->first = first;
+        c->last = last;
+        c->heap = i;
+        ss->heap[i] = i;
+        ss->index[slot] = i + 1;
+        ss_sift_up(ss, i);
+        return;
+    }
+
+    /* Evict the minimum; its count becomes the newcomer's error */
+    i = ss->heap[0];
+    c = &ss->counters[i];
+    ss_lookup(ss, &c->key, &slot);
+    ss_unindex(ss, slot);
+
+    c->key = *key;
+    c->error = c->count + error;
+    c->count += count;
+    c->first = first;
+    c->last = last;
+
+    ss_lookup(ss, key, &slot);
+    ss->index[slot] = i + 1;
+    ss_sift_down(ss, 0);
+}
+
+static int counter_by_count(const void *a, const void *b)
+{
+    const Counter *x = a;
+    const Counter *y = b;
+
+    if( x->count != y->count )
+        return x->count > y->count ? -1 : 1;
+    if( x->key.hi != y->key.hi )
+        return x->key.hi < y->key.hi ? -1 : 1;
+    if( x->key.lo != y->key.lo )
+        return x->key.lo < y->key.lo ? -1 : 1;
+
+    return 0;
+}
+
+/* Function: ss_merge
+ *
+ * Purpose: Fold one space saving summary into another. A key missing from a
+ * full summary may still have been seen up to its minimum count times, so
+ * that much is added to both its count and its error.
+ *
+ * Arguements:
+ *      SpaceSaving *
+ *      const SpaceSaving *
+ *
+ * Returns:
+ *      int
+ */
+static int ss_merge(SpaceSaving *into, const SpaceSaving *from)
+{
+    uint64_t into_min = ss_min(into);
+    uint64_t from_min = ss_min(from);
+    const Counter *other;
+    Counter *all;
+    Counter *c;
+    uint32_t n = 0;
+    uint32_t i;
+
+    all = (Counter *)_Unified2Malloc((into->used + from->used) *
+        sizeof(Counter) + 1, UNIFIED2_ALLOC_ANALYSIS);
+    if( all == NULL )
+    {
+        warn("Unified2SummaryMerge: failed to malloc: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for( i = 0; i < into->used; i++ )
+    {
+        c = &all[n++];
+        *c = into->counters[i];
+        other = ss_lookup(from, &c->key, NULL);
+        if( other != NULL )
+        {
+            c->count += other->count;
+            c->error += other->error;
+            if( other->first < c->first )
+                c->first = other->first;
+            if( other->last > c->last )
+                c->last = other->last;
+        }
+        else
+        {
+            c->count += from_min;
+            c->error += from_min;
+        }
+    }
+
+    for( i = 0; i < from->used; i++ )
+    {
+        if( ss_lookup(into, &from->counters[i].key, NULL) != NULL )
+        {
+            continue;
+        }
+        c = &all[n++];
+        *c = from->counters[i];
+        c->count += into_min;
+        c->error += into_min;
+    }
+
+    qsort(all, n, sizeof(Counter), counter_by_count);
+    if( n > into->capacity )
+    {
+        n = into->capacity;
+    }
+
+    memset(into->index, 0x0, (into->index_mask + 1) * sizeof(uint32_t));
+    into->used = 0;
+    for( i = 0; i < n; i++ )
+    {
+        ss_add(into, &all[i].key, all[i].count, all[i].error, all[i].first,
+            all[i].last);
+    }
+
+    _Unified2Free(all, UNIFIED2_ALLOC_ANALYSIS);
+
+    return 0;
+}
+
+/** COUNT-MIN AND HYPERLOGLOG **************************************************/
+
+static void cm_add(CountMin *cm, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    int i;
+
+    for( i = 0; i < CM_DEPTH; i++ )
+    {
+        cm->cells[i][(h1 + i * h2) & (CM_WIDTH - 1)]++;
+    }
+}
+
+static uint64_t cm_estimate(const CountMin *cm, uint64_t hash)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    uint64_t estimate = UINT64_MAX;
+    uint64_t cell;
+    int i;
+
+    for( i = 0; i < CM_DEPTH; i++ )
+    {
+        cell = cm->cells[i][(h1 + i * h2) & (CM_WIDTH - 1)];
+        if( cell < estimate )
+            estimate = cell;
+    }
+
+    return estimate;
+}
+
+static void hll_add(HyperLogLog *hll, uint64_t hash)
+{
+    uint32_t index = (uint32_t)(hash >> (64 - HLL_BITS));
+    uint64_t rest = (hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+    uint8_t rank = (uint8_t)__builtin_clzll(rest) + 1;
+
+    if( rank > hll->registers[index] )
+    {
+        hll->registers[index] = rank;
+    }
+}
+
+static uint64_t hll_estimate(const HyperLogLog *hll)
+{
+    double m = HLL_REGISTERS;
+    double sum = 0;
+    double estimate;
+    int zeros = 0;
+    int i;
+
+    for( i = 0; i < HLL_REGISTERS; i++ )
+    {
+        sum += ldexp(1.0, -hll->registers[i]);
+        if( hll->registers[i] == 0 )
+            zeros++;
+    }
+
+    estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+    /* Linear counting is more accurate while registers are still empty */
+    if( estimate <= 2.5 * m && zeros )
+    {
+        estimate = m * log(m / zeros);
+    }
+
+    return (uint64_t)(estimate + 0.5);
+}
+
+/** PER MINUTE COUNTS **********************************************************/
+
+static int minute_add(Unified2Summary *s, uint32_t minute, uint64_t events)
+{
+    Minute *table;
+    uint32_t size;
+    uint32_t i, j;
+
+    minute++;
+
+    if( (s->minutes_used + 1) * 2 > s->minutes_mask + 1 )
+    {
+        size = s->minutes ? (s->minutes_mask + 1) * 2 : 1024;
+        table = (Minute *)_Unified2Calloc(size, sizeof(Minute),
+            UNIFIED2_ALLOC_ANALYSIS);
+        if( table == NULL )
+        {
+            warn("Unified2SummaryAdd: failed to malloc: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for( i = 0; s->minutes && i <= s->minutes_mask; i++ )
+        {
+            if( s->minutes[i].minute == 0 )
+                continue;
+            j = (uint32_t)mix(s->minutes[i].minute) & (size - 1);
+            while( table[j].minute )
+                j = (j + 1) & (size - 1);
+            table[j] = s->minutes[i];
+        }
+
+        _Unified2Free(s->minutes, UNIFIED2_ALLOC_ANALYSIS);
+        s->minutes = table;
+        s->minutes_mask = size - 1;
+    }
+
+    i = (uint32_t)mix(minute) & s->minutes_mask;
+    while( s->minutes[i].minute && s->minutes[i].minute != minute )
+    {
+        i = (i + 1) & s->minutes_mask;
+    }
+
+    if( s->minutes[i].minute == 0 )
+    {
+        s->minutes[i].minute = minute;
+        s->minutes_used++;
+    }
+    s->minutes[i].events += events;
+
+    return 0;
+}
+
+/** SUMMARIES ******************************************************************/
+
+/* Function: Unified2SummaryNew
+ *
+ * Purpose: Create an empty summary
+ *
+ * Arguements:
+ *      void
+ *
+ * Returns:
+ *      Unified2Summary *
+ */
+Unified2Summary * Unified2SummaryNew()
+{
+    Unified2Summary *s;
+    int i;
+
+    s = (Unified2Summary *)_Unified2Calloc(1, sizeof(Unified2Summary),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( s == NULL )
+    {
+        warn("Unified2SummaryNew: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    s->first_second = UINT32_MAX;
+
+    for( i = 0; i < DIMENSIONS; i++ )
+    {
+        s->sketch[i] = (CountMin *)_Unified2Calloc(1, sizeof(CountMin),
+            UNIFIED2_ALLOC_ANALYSIS);
+        if( s->sketch[i] == NULL || ss_init(&s->top[i], SUMMARY_COUNTERS) )
+        {
+            Unified2SummaryFree(s);
+            return NULL;
+        }
+    }
+
+    if( ss_init(&s->sensors, SENSOR_COUNTERS) )
+    {
+        Unified2SummaryFree(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/* Function: Unified2SummaryFree
+ *
+ * Purpose: Release a summary
+ *
+ * Arguements:
+ *      Unified2Summary *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2SummaryFree(Unified2Summary *s)
+{
+    int i;
+
+    if( s == NULL )
+    {
+        return;
+    }
+
+    for( i = 0; i < DIMENSIONS; i++ )
+    {
+        ss_free(&s->top[i]);
+        _Unified2Free(s->sketch[i], UNIFIED2_ALLOC_ANALYSIS);
+    }
+    ss_free(&s->sensors);
+    _Unified2Free(s->minutes, UNIFIED2_ALLOC_ANALYSIS);
+    _Unified2Free(s, UNIFIED2_ALLOC_ANALYSIS);
+}
+
+static void address_key(Key *key, const uint8_t *body, int offset, int ipv6)
+{
+    int i;
+
+    if( !ipv6 )
+    {
+        /* IPv4 as the IPv4 mapped IPv6 address */
+        key->hi = 0;
+        key->lo = 0xffff00000000ULL | _Unified2Field32(body, offset);
+        return;
+    }
+
+    key->hi = key->lo = 0;
+    for( i = 0; i < 8; i++ )
+    {
+        key->hi = key->hi << 8 | body[offset + i];
+        key->lo = key->lo << 8 | body[offset + 8 + i];
+    }
+}
+
+static void count_key(Unified2Summary *s, DIMENSION d, const Key *key)
+{
+    uint64_t hash = key_hash(key);
+
+    ss_add(&s->top[d], key, 1, 0, 0, 0);
+    cm_add(s->sketch[d], hash);
+    hll_add(&s->distinct[d], hash);
+}
+
+/* Function: Unified2SummaryAdd
+ *
+ * Purpose: Count one raw record, as returned by Unified2ReadRawRecord()
+ *
+ * Arguements:
+ *      Unified2Summary *
+ *      const uint8_t *
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SummaryAdd(Unified2Summary *s, const uint8_t *record,
+    uint32_t length)
+{
+    const uint8_t *body = record + sizeof(Unified2RecordHeader);
+    uint32_t type;
+    uint32_t second;
+    int ipv6 = 0;
+    Key key;
+
+    if( s == NULL || record == NULL || length < sizeof(Unified2RecordHeader) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    type = _Unified2Field32(record, 0);
+    length -= sizeof(Unified2RecordHeader);
+
+    s->records++;
+    s->bytes += length + sizeof(Unified2RecordHeader);
+    if( type < 256 )
+        s->types[type]++;
+    else
+        s->other_types++;
+
+    switch( type )
+    {
+        case UNIFIED2_IDS_EVENT_IPV6:
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:
+        case UNIFIED2_IDS_EVENT_IPV6_V2:
+        if( length < sizeof(Unified2Event6) )
+            return UNIFIED2_WARN;
+        ipv6 = 1;
+        break;
+
+        case UNIFIED2_IDS_EVENT:
+        case UNIFIED2_IDS_EVENT_MPLS:
+        case UNIFIED2_IDS_EVENT_V2:
+        if( length < sizeof(Unified2Event) )
+            return UNIFIED2_WARN;
+        break;
+
+        default:
+        return UNIFIED2_OK;
+    }
+
+    s->events++;
+    second = _Unified2Field32(body, 8);
+    if( second < s->first_second )
+        s->first_second = second;
+    if( second > s->last_second )
+        s->last_second = second;
+
+    key.hi = 0;
+    key.lo = (uint64_t)_Unified2Field32(body, 20) << 32 |
+        _Unified2Field32(body, 16);
+    count_key(s, DIMENSION_SIGNATURE, &key);
+
+    address_key(&key, body, 36, ipv6);
+    count_key(s, DIMENSION_SOURCE, &key);
+
+    address_key(&key, body, ipv6 ? 52 : 40, ipv6);
+    count_key(s, DIMENSION_DESTINATION, &key);
+
+    key.hi = 0;
+    key.lo = _Unified2Field32(body, 0);
+    ss_add(&s->sensors, &key, 1, 0, second, second);
+
+    if( minute_add(s, second / 60, 1) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2SummaryMerge
+ *
+ * Purpose: Fold one summary into another
+ *
+ * Arguements:
+ *      Unified2Summary *
+ *      const Unified2Summary *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SummaryMerge(Unified2Summary *into, const Unified2Summary *from)
+{
+    uint32_t i;
+    int d, j;
+
+    if( into == NULL || from == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    into->records += from->records;
+    into->bytes += from->bytes;
+    into->events += from->events;
+    into->other_types += from->other_types;
+    for( i = 0; i < 256; i++ )
+    {
+        into->types[i] += from->types[i];
+    }
+
+    if( from->first_second < into->first_second )
+        into->first_second = from->first_second;
+    if( from->last_second > into->last_second )
+        into->last_second = from->last_second;
+
+    for( d = 0; d < DIMENSIONS; d++ )
+    {
+        if( ss_merge(&into->top[d], &from->top[d]) )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        for( j = 0; j < CM_DEPTH; j++ )
+        {
+            for( i = 0; i < CM_WIDTH; i++ )
+            {
+                into->sketch[d]->cells[j][i] += from->sketch[d]->cells[j][i];
+            }
+        }
+
+        for( i = 0; i < HLL_REGISTERS; i++ )
+        {
+            if( from->distinct[d].registers[i] > into->distinct[d].registers[i] )
+            {
+                into->distinct[d].registers[i] = from->distinct[d].registers[i];
+            }
+        }
+    }
+
+    if( ss_merge(&into->sensors, &from->sensors) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0; from->minutes && i <= from->minutes_mask; i++ )
+    {
+        if( from->minutes[i].minute &&
+            minute_add(into, from->minutes[i].minute - 1, from->minutes[i].events) )
+        {
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    return UNIFIED2_OK;
+}
+
+/** OUTPUT *********************************************************************/
+
+static HRESULT put(Unified2Buffer *out, const char *fmt, ...)
+{
+    va_list ap;
+    char *p;
+    int n;
+
+    p = Unified2BufferReserve(out, 512);
+    if( p == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(p, 512, fmt, ap);
+    va_end(ap);
+
+    if( n < 0 || n >= 512 )
+    {
+        return UNIFIED2_ERROR;
+    }
+    out->used += n;
+
+    return UNIFIED2_OK;
+}
+
+static const char *type_name(uint32_t type)
+{
+    switch( type )
+    {
+        case UNIFIED2_PACKET:               return "packet";
+        case UNIFIED2_IDS_EVENT:            return "event";
+        case UNIFIED2_IDS_EVENT_IPV6:       return "event ipv6";
+        case UNIFIED2_IDS_EVENT_MPLS:       return "event mpls";
+        case UNIFIED2_IDS_EVENT_IPV6_MPLS:  return "event ipv6 mpls";
+        case UNIFIED2_IDS_EVENT_V2:         return "event v2";
+        case UNIFIED2_IDS_EVENT_IPV6_V2:    return "event ipv6 v2";
+        case UNIFIED2_EXTRA_DATA:           return "extra data";
+        default:                            return "unknown";
+    }
+}
+
+static void address_string(const Key *key, char *buf, size_t size)
+{
+    uint8_t addr[16];
+    int i;
+
+    for( i = 0; i < 8; i++ )
+    {
+        addr[i] = key->hi >> (56 - i * 8);
+        addr[8 + i] = key->lo >> (56 - i * 8);
+    }
+
+    if( key->hi == 0 && (key->lo >> 32) == 0xffff )
+        inet_ntop(AF_INET, addr + 12, buf, size);
+    else
+        inet_ntop(AF_INET6, addr, buf, size);
+}
+
+static void time_string(uint32_t second, const char *fmt, char *buf,
+    size_t size)
+{
+    time_t t = second;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, size, fmt, &tm);
+}
+
+/* Function: sorted_counters
+ *
+ * Purpose: Copy the counters of a dimension, counts tightened with the
+ * count-min sketch when there is one, largest first
+ *
+ * Arguements:
+ *      const SpaceSaving *
+ *      const CountMin *
+ *
+ * Returns:
+ *      Counter *
+ */
+static Counter *sorted_counters(const SpaceSaving *ss, const CountMin *cm)
+{
+    Counter *sorted;
+    uint64_t estimate;
+    uint32_t i;
+
+    sorted = (Counter *)_Unified2Malloc(ss->used * sizeof(Counter) + 1,
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( sorted == NULL )
+    {
+        warn("Unified2SummaryFormat: failed to malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memcpy(sorted, ss->counters, ss->used * sizeof(Counter));
+
+    for( i = 0; cm && i < ss->used; i++ )
+    {
+        estimate = cm_estimate(cm, key_hash(&sorted[i].key));
+        if( estimate < sorted[i].count )
+        {
+            /* The guaranteed part of the count does not change */
+            sorted[i].error -= sorted[i].count - estimate > sorted[i].error ?
+                sorted[i].error : sorted[i].count - estimate;
+            sorted[i].count = estimate;
+        }
+    }
+
+    qsort(sorted, ss->used, sizeof(Counter), counter_by_count);
+
+    return sorted;
+}
+
+static int minute_by_time(const void *a, const void *b)
+{
+    const Minute *x = a;
+    const Minute *y = b;
+
+    return x->minute < y->minute ? -1 : x->minute > y->minute;
+}
+
+static int sensor_by_id(const void *a, const void *b)
+{
+    const Counter *x = a;
+    const Counter *y = b;
+
+    return x->key.lo < y->key.lo ? -1 : x->key.lo > y->key.lo;
+}
+
+static const char *dimension_names[DIMENSIONS] = {
+    "signatures", "sources", "destinations"
+};
+
+/* Function: Unified2SummaryFormat
+ *
+ * Purpose: Append a report of a summary, as text or as one JSON object
+ *
+ * Arguements:
+ *      Unified2Buffer *
+ *      const Unified2Summary *
+ *      int             entries per top list
+ *      int             JSON
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SummaryFormat(Unified2Buffer *out, const Unified2Summary *s,
+    int top, int json)
+{
+    char first[32], last[32];
+    char name[INET6_ADDRSTRLEN + 32];
+    Counter *sorted;
+    Minute *minutes;
+    uint32_t seconds;
+    uint32_t i, n, t;
+    HRESULT r = UNIFIED2_OK;
+    int d;
+
+    if( out == NULL || s == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( s->events == 0 )
+    {
+        first[0] = last[0] = '\0';
+    }
+    else
+    {
+        time_string(s->first_second, "%Y-%m-%d %H:%M:%S", first, sizeof(first));
+        time_string(s->last_second, "%Y-%m-%d %H:%M:%S", last, sizeof(last));
+    }
+
+    if( json )
+    {
+        r |= put(out, "{\"records\":%llu,\"bytes\":%llu,\"events\":%llu",
+            (unsigned long long)s->records, (unsigned long long)s->bytes,
+            (unsigned long long)s->events);
+        if( s->events )
+            r |= put(out, ",\"first_second\":%u,\"last_second\":%u",
+                s->first_second, s->last_second);
+
+        r |= put(out, ",\"types\":{");
+        for( t = 0, n = 0; t < 256; t++ )
+        {
+            if( s->types[t] )
+                r |= put(out, "%s\"%u\":%llu", n++ ? "," : "", t,
+                    (unsigned long long)s->types[t]);
+        }
+        if( s->other_types )
+            r |= put(out, "%s\"other\":%llu", n ? "," : "",
+                (unsigned long long)s->other_types);
+
+        r |= put(out, "},\"distinct\":{");
+        for( d = 0; d < DIMENSIONS; d++ )
+        {
+            r |= put(out, "%s\"%s\":%llu", d ? "," : "", dimension_names[d],
+                (unsigned long long)hll_estimate(&s->distinct[d]));
+        }
+        r |= put(out, "}");
+    }
+    else
+    {
+        r |= put(out, "records         %llu\n", (unsigned long long)s->records);
+        r |= put(out, "bytes           %llu\n", (unsigned long long)s->bytes);
+        r |= put(out, "events          %llu\n", (unsigned long long)s->events);
+        if( s->events )
+            r |= put(out, "time            %s - %s UTC\n", first, last);
+
+        r |= put(out, "\nrecord types\n");
+        for( t = 0; t < 256; t++ )
+        {
+            if( s->types[t] )
+            {
+                snprintf(name, sizeof(name), "%s (%u)", type_name(t), t);
+                r |= put(out, "    %-28s %12llu\n", name,
+                    (unsigned long long)s->types[t]);
+            }
+        }
+        if( s->other_types )
+            r |= put(out, "    %-28s %12llu\n", "other",
+                (unsigned long long)s->other_types);
+
+        r |= put(out, "\ndistinct (estimated)\n");
+        for( d = 0; d < DIMENSIONS; d++ )
+        {
+            r |= put(out, "    %-28s %12llu\n", dimension_names[d],
+                (unsigned long long)hll_estimate(&s->distinct[d]));
+        }
+    }
+
+    for( d = 0; d < DIMENSIONS && r == UNIFIED2_OK; d++ )
+    {
+        sorted = sorted_counters(&s->top[d], s->sketch[d]);
+        if( sorted == NULL )
+        {
+            return UNIFIED2_ERROR;
+        }
+
+        n = s->top[d].used < (uint32_t)top ? s->top[d].used : (uint32_t)top;
+
+        if( json )
+            r |= put(out, ",\"top_%s\":[", dimension_names[d]);
+        else
+            r |= put(out, "\ntop %-35s %12s %12s\n", dimension_names[d],
+                "count", "error");
+
+        for( i = 0; i < n; i++ )
+        {
+            if( d == DIMENSION_SIGNATURE )
+            {
+                snprintf(name, sizeof(name), "%u:%u",
+                    (uint32_t)(sorted[i].key.lo >> 32), (uint32_t)sorted[i].key.lo);
+                if( json )
+                {
+                    r |= put(out, "%s{\"generator_id\":%u,\"signature_id\":%u,",
+                        i ? "," : "", (uint32_t)(sorted[i].key.lo >> 32),
+                        (uint32_t)sorted[i].key.lo);
+                }
+            }
+            else
+            {
+                address_string(&sorted[i].key, name, sizeof(name));
+                if( json )
+                    r |= put(out, "%s{\"address\":\"%s\",", i ? "," : "", name);
+            }
+
+            if( json )
+                r |= put(out, "\"count\":%llu,\"error\":%llu}",
+                    (unsigned long long)sorted[i].count,
+                    (unsigned long long)sorted[i].error);
+            else
+                r |= put(out, "    %-39s %12llu %12llu\n", name,
+                    (unsigned long long)sorted[i].count,
+                    (unsigned long long)sorted[i].error);
+        }
+
+        if( json )
+            r |= put(out, "]");
+
+        _Unified2Free(sorted, UNIFIED2_ALLOC_ANALYSIS);
+    }
+
+    /* Sensors, by id */
+    sorted = sorted_counters(&s->sensors, NULL);
+    if( sorted == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+    qsort(sorted, s->sensors.used, sizeof(Counter), sensor_by_id);
+
+    if( json )
+        r |= put(out, ",\"sensors\":[");
+    else
+        r |= put(out, "\n%-12s %12s %12s  %-19s  %s\n", "sensor", "events",
+            "events/s", "first", "last");
+
+    for( i = 0; i < s->sensors.used; i++ )
+    {
+        seconds = sorted[i].last - sorted[i].first + 1;
+        if( json )
+        {
+            r |= put(out, "%s{\"sensor_id\":%u,\"events\":%llu,\"error\":%llu,"
+                "\"first_second\":%u,\"last_second\":%u,\"rate\":%.3f}",
+                i ? "," : "", (uint32_t)sorted[i].key.lo,
+                (unsigned long long)sorted[i].count,
+                (unsigned long long)sorted[i].error, sorted[i].first,
+                sorted[i].last, (double)sorted[i].count / seconds);
+        }
+        else
+        {
+            time_string(sorted[i].first, "%Y-%m-%d %H:%M:%S", first,
+                sizeof(first));
+            time_string(sorted[i].last, "%Y-%m-%d %H:%M:%S", last,
+                sizeof(last));
+            r |= put(out, "%-12u %12llu %12.3f  %s  %s\n",
+                (uint32_t)sorted[i].key.lo, (unsigned long long)sorted[i].count,
+                (double)sorted[i].count / seconds, first, last);
+        }
+    }
+    _Unified2Free(sorted, UNIFIED2_ALLOC_ANALYSIS);
+
+    /* Events per minute, in time order */
+    minutes = (Minute *)_Unified2Malloc(s->minutes_used * sizeof(Minute) + 1,
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( minutes == NULL )
+    {
+        warn("Unified2SummaryFormat: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    for( i = 0, n = 0; s->minutes && i <= s->minutes_mask; i++ )
+    {
+        if( s->minutes[i].minute )
+            minutes[n++] = s->minutes[i];
+    }
+    qsort(minutes, n, sizeof(Minute), minute_by_time);
+
+    if( json )
+        r |= put(out, "],\"minutes\":[");
+    else
+        r |= put(out, "\n%-16s  %12s\n", "minute", "events");
+
+    for( i = 0; i < n; i++ )
+    {
+        if( json )
+        {
+            r |= put(out, "%s{\"minute\":%u,\"events\":%llu}", i ? "," : "",
+                (minutes[i].minute - 1) * 60,
+                (unsigned long long)minutes[i].events);
+        }
+        else
+        {
+            time_string((minutes[i].minute - 1) * 60, "%Y-%m-%d %H:%M", first,
+                sizeof(first));
+            r |= put(out, "%-16s  %12llu\n", first,
+                (unsigned long long)minutes[i].events);
+        }
+    }
+    _Unified2Free(minutes, UNIFIED2_ALLOC_ANALYSIS);
+
+    if( json )
+        r |= put(out, "]}\n");
+
+    return r == UNIFIED2_OK ? UNIFIED2_OK : UNIFIED2_ERROR;
+}
+
+/** PARALLEL DRIVER ************************************************************/
+
+typedef struct _Chunk {
+    const uint8_t *data;
+    uint64_t length;
+
+    /* copies of the records when they are not mapped */
+    uint8_t *buffer;
+    uint64_t size;
+} Chunk;
+
+typedef struct _SummaryPool {
+    Chunk *chunks;
+    int nchunks;
+    int head;               /* next chunk for a worker */
+    int tail;               /* next chunk for the reader */
+    int queued;
+    int done;
+    int failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t freed;
+} SummaryPool;
+
+typedef struct _SummaryWorker {
+    SummaryPool *pool;
+    Unified2Summary *summary;
+    pthread_t thread;
+} SummaryWorker;
+
+static HRESULT summarize_chunk(Unified2Summary *s, const Chunk *chunk)
+{
+    const uint8_t *p = chunk->data;
+    const uint8_t *end = chunk->data + chunk->length;
+    uint32_t length;
+
+    while( p < end )
+    {
+        length = _Unified2Field32(p, 4) + sizeof(Unified2RecordHeader);
+        if( Unified2SummaryAdd(s, p, length) == UNIFIED2_ERROR )
+        {
+            return UNIFIED2_ERROR;
+        }
+        p += length;
+    }
+
+    return UNIFIED2_OK;
+}
+
+static void *summary_thread(void *arg)
+{
+    SummaryWorker *worker = arg;
+    SummaryPool *pool = worker->pool;
+    Chunk *chunk;
+    HRESULT r;
+
+    pthread_mutex_lock(&pool->lock);
+    for( ;; )
+    {
+        while( pool->queued == 0 && !pool->done && !pool->failed )
+        {
+            pthread_cond_wait(&pool->filled, &pool->lock);
+        }
+
+        if( pool->queued == 0 || pool->failed )
+        {
+            break;
+        }
+
+        /* Chunks may finish in any order, the reader waits for data to be
+         * cleared before it fills one again */
+        chunk = &pool->chunks[pool->head];
+        pool->head = (pool->head + 1) % pool->nchunks;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        r = summarize_chunk(worker->summary, chunk);
+
+        pthread_mutex_lock(&pool->lock);
+        chunk->length = 0;
+        chunk->data = NULL;
+        if( r != UNIFIED2_OK )
+        {
+            pool->failed = 1;
+        }
+        pthread_cond_broadcast(&pool->freed);
+    }
+    pthread_cond_broadcast(&pool->filled);
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Function: fill_chunk
+ *
+ * Purpose: Collect about a megabyte of whole records. Mapped records are
+ * referenced where they are, anything else is copied.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Chunk *
+ *
+ * Returns:
+ *      HRESULT     UNIFIED2_EOF once the input is exhausted
+ */
+static HRESULT fill_chunk(Unified2 *u2, Chunk *chunk)
+{
+    const uint8_t *record;
+    uint32_t length;
+    uint8_t *buffer;
+    uint64_t size;
+    HRESULT r;
+
+    chunk->data = NULL;
+    chunk->length = 0;
+
+    while( chunk->length < CHUNK_BYTES )
+    {
+        r = Unified2ReadRawRecord(u2, &record, &length);
+        if( r != UNIFIED2_OK )
+        {
+            return r;
+        }
+
+        if( u2->mode == MAPPED || u2->mode == MEMORY )
+        {
+            if( chunk->data == NULL )
+                chunk->data = record;
+            chunk->length += length;
+            continue;
+        }
+
+        if( chunk->length + length > chunk->size )
+        {
+            size = chunk->size ? chunk->size : CHUNK_BYTES;
+            while( size < chunk->length + length )
+                size *= 2;
+
+            buffer = (uint8_t *)_Unified2Realloc(chunk->buffer, size,
+                UNIFIED2_ALLOC_ANALYSIS);
+            if( buffer == NULL )
+            {
+                warn("Unified2SummaryParallel: failed to malloc: %s\n",
+                strerror(errno));
+                return UNIFIED2_ERROR;
+            }
+            chunk->buffer = buffer;
+            chunk->size = size;
+        }
+
+        memcpy(chunk->buffer + chunk->length, record, length);
+        chunk->length += length;
+        chunk->data = chunk->buffer;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2SummaryParallel
+ *
+ * Purpose: Summarize every record left in u2 into s. The calling thread reads
+ * chunks of records and workers summarize them into summaries of their own,
+ * which are merged into s at the end.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Summary *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SummaryParallel(Unified2 *u2, Unified2Summary *s, int workers)
+{
+    SummaryWorker threads[UNIFIED2_MAX_THREADS];
+    SummaryPool pool;
+    Chunk single;
+    Chunk *chunk;
+    int started = 0;
+    HRESULT r;
+    int i;
+
+    if( u2 == NULL || s == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( workers > UNIFIED2_MAX_THREADS )
+        workers = UNIFIED2_MAX_THREADS;
+
+    if( workers <= 1 )
+    {
+        memset(&single, 0x0, sizeof(single));
+        do
+        {
+            r = fill_chunk(u2, &single);
+            if( r != UNIFIED2_ERROR &&
+                summarize_chunk(s, &single) != UNIFIED2_OK )
+            {
+                r = UNIFIED2_ERROR;
+            }
+        } while( r == UNIFIED2_OK );
+
+        _Unified2Free(single.buffer, UNIFIED2_ALLOC_ANALYSIS);
+
+        return r == UNIFIED2_EOF ? UNIFIED2_OK : UNIFIED2_ERROR;
+    }
+
+    memset(&pool, 0x0, sizeof(pool));
+    pool.nchunks = workers * 2 + 2;
+    pool.chunks = (Chunk *)_Unified2Calloc(pool.nchunks, sizeof(Chunk),
+        UNIFIED2_ALLOC_ANALYSIS);
+    if( pool.chunks == NULL )
+    {
+        warn("Unified2SummaryParallel: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.filled, NULL);
+    pthread_cond_init(&pool.freed, NULL);
+
+    for( started = 0; started < workers; started++ )
+    {
+        threads[started].pool = &pool;
+        threads[started].summary = Unified2SummaryNew();
+        if( threads[started].summary == NULL )
+        {
+            break;
+        }
+
+        if( pthread_create(&threads[started].thread, NULL, summary_thread,
+            &threads[started]) != 0 )
+        {
+            warn("Unified2SummaryParallel: failed to start a worker\n");
+            Unified2SummaryFree(threads[started].summary);
+            break;
+        }
+    }
+
+    r = started ? UNIFIED2_OK : UNIFIED2_ERROR;
+    while( r == UNIFIED2_OK )
+    {
+        chunk = &pool.chunks[pool.tail];
+
+        /* Wait for the chunk to be both dequeued and finished with */
+        pthread_mutex_lock(&pool.lock);
+        while( (pool.queued == pool.nchunks || chunk->data != NULL) &&
+               !pool.failed )
+        {
+            pthread_cond_wait(&pool.freed, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if( pool.failed )
+        {
+            r = UNIFIED2_ERROR;
+            break;
+        }
+
+        r = fill_chunk(u2, chunk);
+        if( r == UNIFIED2_ERROR || chunk->length == 0 )
+        {
+            chunk->data = NULL;
+            break;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.tail = (pool.tail + 1) % pool.nchunks;
+        pool.queued++;
+        pthread_cond_signal(&pool.filled);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.done = 1;
+    if( r == UNIFIED2_ERROR )
+        pool.failed = 1;
+    pthread_cond_broadcast(&pool.filled);
+    pthread_mutex_unlock(&pool.lock);
+
+    for( i = 0; i < started; i++ )
+    {
+        pthread_join(threads[i].thread, NULL);
+        if( !pool.failed &&
+            Unified2SummaryMerge(s, threads[i].summary) != UNIFIED2_OK )
+        {
+            pool.failed = 1;
+        }
+        Unified2SummaryFree(threads[i].summary);
+    }
+
+    for( i = 0; i < pool.nchunks; i++ )
+    {
+        _Unified2Free(pool.chunks[i].buffer, UNIFIED2_ALLOC_ANALYSIS);
+    }
+
+    pthread_cond_destroy(&pool.freed);
+    pthread_cond_destroy(&pool.filled);
+    pthread_mutex_destroy(&pool.lock);
+    _Unified2Free(pool.chunks, UNIFIED2_ALLOC_ANALYSIS);
+
+    return pool.failed ? UNIFIED2_ERROR : UNIFIED2_OK;
+}
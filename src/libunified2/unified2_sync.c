@@ -0,0 +1,485 @@
+/*******************************************************************************
+ * Writer durability policies.
+ *
+ * By default a unified2 writer never syncs and a power failure loses whatever
+ * the page cache was holding. Unified2SetDurability() lets the caller bound
+ * that loss:
+ *
+ *  SYNC_RECORDS    fdatasync once N records have been written since the last
+ *  SYNC_BYTES      fdatasync once N bytes have been written since the last
+ *  SYNC_INTERVAL   a helper thread fdatasyncs pending writes every N ms
+ *  SYNC_GROUP      a record is durable before the write returns; writers that
+ *                  commit while a sync is in flight wait for the next one and
+ *                  share it instead of issuing one each
+ *
+ * Group commit uses a write sequence: every commit takes a ticket after its
+ * data reached the file, the thread that starts a sync remembers the highest
+ * ticket handed out so far and, once fdatasync returns, every waiter holding a
+ * ticket at or below it is released.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "unified2.h"
+
+struct _Unified2Durability {
+    SYNC_MODE mode;
+    uint32_t threshold;
+
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+
+    /* accounting since the last sync */
+    uint64_t pending_records;
+    uint64_t pending_bytes;
+
+    /* group commit tickets */
+    uint64_t write_seq;
+    uint64_t synced_seq;
+    int syncing;
+
+    /* SYNC_INTERVAL helper */
+    pthread_t timer;
+    pthread_cond_t wakeup;
+    int timer_running;
+    int stopping;
+
+    /* Failed syncs are reported on the writer's thread, the helper thread
+     * must not touch the handle's diagnostics */
+    uint64_t reported;
+    int error;
+
+    Unified2SyncStats stats;
+};
+
+static int datasync(Unified2 *u2)
+{
+    /* The direct writer stages data in user space, push that out first */
+    if( u2->mode == DIRECT && _Unified2DirectFlush(u2) != UNIFIED2_OK )
+    {
+        return -1;
+    }
+
+    /* Compressed containers end the current frame early so it can be synced */
+    if( u2->mode == COMPRESSED && _Unified2CompressedFlush(u2) != UNIFIED2_OK )
+    {
+        return -1;
+    }
+
+#ifdef HAVE_FDATASYNC
+    return fdatasync(u2->fd);
+#else
+    return fsync(u2->fd);
+#endif
+}
+
+/* Function: sync_locked
+ *
+ * Purpose: Become the syncing thread, call fdatasync with the lock dropped and
+ * publish the result. Must be entered with the lock held and no sync running.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Durability *
+ *
+ * Returns:
+ *      HRESULT
+ */
+static HRESULT sync_locked(Unified2 *u2, Unified2Durability *d)
+{
+    uint64_t target;
+    uint64_t start;
+    int r;
+
+    d->syncing = 1;
+    target = d->write_seq;
+    d->pending_records = 0;
+    d->pending_bytes = 0;
+    pthread_mutex_unlock(&d->lock);
+
+    _UNIFIED2_PROBE1(sync__start, target);
+    start = _Unified2Now();
+    r = datasync(u2);
+    start = _Unified2Now() - start;
+    _UNIFIED2_PROBE2(sync__end, r, start);
+
+    pthread_mutex_lock(&d->lock);
+    Unified2HistogramRecord(&d->stats.latency, start);
+    d->stats.syncs++;
+    d->syncing = 0;
+
+    if( r == -1 )
+    {
+        d->error = errno;
+        d->stats.failures++;
+        pthread_cond_broadcast(&d->synced);
+        return UNIFIED2_ERROR;
+    }
+
+    if( target > d->synced_seq )
+    {
+        d->synced_seq = target;
+    }
+    pthread_cond_broadcast(&d->synced);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: report_failures
+ *
+ * Purpose: Report the syncs that failed since the last call, rate limited by
+ * the handle's diagnostics. Must be called with the lock held, from the thread
+ * writing to the handle.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Durability *
+ *
+ * Returns:
+ *      void
+ */
+static void report_failures(Unified2 *u2, Unified2Durability *d)
+{
+    for( ; d->reported < d->stats.failures; d->reported++ )
+    {
+        _Unified2Diag(u2, UNIFIED2_DIAG_WRITE, 0, d->error);
+    }
+}
+
+/* Function: interval_thread
+ *
+ * Purpose: Sync pending writes every threshold milliseconds until the handle
+ * is freed.
+ *
+ * Arguements:
+ *      void *      Unified2 *
+ *
+ * Returns:
+ *      void *
+ */
+static void *interval_thread(void *arg)
+{
+    Unified2 *u2 = arg;
+    Unified2Durability *d = u2->durability;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&d->lock);
+    while( !d->stopping )
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += d->threshold / 1000;
+        deadline.tv_nsec += (long)(d->threshold % 1000) * 1000000L;
+        if( deadline.tv_nsec >= 1000000000L )
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while( !d->stopping &&
+               pthread_cond_timedwait(&d->wakeup, &d->lock, &deadline) != ETIMEDOUT )
+            ;
+
+        if( d->stopping )
+        {
+            break;
+        }
+
+        if( d->write_seq > d->synced_seq && !d->syncing )
+        {
+            sync_locked(u2, d);
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+/* Function: Unified2SetDurability
+ *
+ * Purpose: Choose how often a writer forces its data to stable storage. The
+ * threshold is a record count, byte count or interval in milliseconds
+ * depending on the mode, and is ignored for SYNC_NONE and SYNC_GROUP.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      SYNC_MODE
+ *      uint32_t
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SetDurability(Unified2 *u2, SYNC_MODE mode, uint32_t threshold)
+{
+    Unified2Durability *d;
+
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    if( (mode == SYNC_RECORDS || mode == SYNC_BYTES || mode == SYNC_INTERVAL)
+        && threshold == 0 )
+    {
+        warn("Unified2SetDurability: threshold must be larger than 0\n");
+        return UNIFIED2_ERROR;
+    }
+
+    /* Changing policy: flush what the old one was holding back */
+    if( u2->durability != NULL )
+    {
+        _Unified2SyncFree(u2);
+    }
+
+    if( mode == SYNC_NONE )
+    {
+        return UNIFIED2_OK;
+    }
+
+    d = (Unified2Durability *)_Unified2Malloc(sizeof(Unified2Durability),
+        UNIFIED2_ALLOC_HANDLE);
+    if( d == NULL )
+    {
+        warn("Unified2SetDurability: failed to malloc: %s\n", strerror(errno));
+        return UNIFIED2_ERROR;
+    }
+    memset(d, 0x0, sizeof(Unified2Durability));
+
+    d->mode = mode;
+    d->threshold = threshold;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->synced, NULL);
+    pthread_cond_init(&d->wakeup, NULL);
+    Unified2HistogramReset(&d->stats.latency);
+
+    u2->durability = d;
+
+    if( mode == SYNC_INTERVAL )
+    {
+        if( pthread_create(&d->timer, NULL, interval_thread, u2) != 0 )
+        {
+            warn("Unified2SetDurability: failed to start the sync thread\n");
+            u2->durability = NULL;
+            pthread_cond_destroy(&d->wakeup);
+            pthread_cond_destroy(&d->synced);
+            pthread_mutex_destroy(&d->lock);
+            _Unified2Free(d, UNIFIED2_ALLOC_HANDLE);
+            return UNIFIED2_ERROR;
+        }
+        d->timer_running = 1;
+    }
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2SyncCommit
+ *
+ * Purpose: Account for data that has been handed to the kernel and sync if
+ * the policy says so. Called by the writer after every successful write.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int         records written
+ *      int         bytes written
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT _Unified2SyncCommit(Unified2 *u2, int records, int bytes)
+{
+    Unified2Durability *d = u2->durability;
+    HRESULT r = UNIFIED2_OK;
+    uint64_t ticket;
+
+    if( d == NULL )
+    {
+        return UNIFIED2_OK;
+    }
+
+    pthread_mutex_lock(&d->lock);
+
+    ticket = ++d->write_seq;
+    d->pending_records += records;
+    d->pending_bytes += bytes;
+    d->stats.commits++;
+
+    switch( d->mode )
+    {
+        case SYNC_RECORDS:
+        if( d->pending_records >= d->threshold && !d->syncing )
+        {
+            r = sync_locked(u2, d);
+        }
+        break;
+
+        case SYNC_BYTES:
+        if( d->pending_bytes >= d->threshold && !d->syncing )
+        {
+            r = sync_locked(u2, d);
+        }
+        break;
+
+        case SYNC_GROUP:
+        while( d->synced_seq < ticket )
+        {
+            if( d->syncing )
+            {
+                pthread_cond_wait(&d->synced, &d->lock);
+                if( d->synced_seq >= ticket )
+                {
+                    d->stats.shared++;
+                }
+                continue;
+            }
+
+            r = sync_locked(u2, d);
+            if( r != UNIFIED2_OK )
+            {
+                break;
+            }
+        }
+        break;
+
+        default:
+        break;
+    }
+
+    report_failures(u2, d);
+    pthread_mutex_unlock(&d->lock);
+
+    return r;
+}
+
+/* Function: Unified2Sync
+ *
+ * Purpose: Force everything written so far to stable storage, sharing a sync
+ * already in flight when there is one.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2Sync(Unified2 *u2)
+{
+    Unified2Durability *d;
+    HRESULT r = UNIFIED2_OK;
+    uint64_t ticket;
+
+    if( u2 == NULL ||
+        (u2->mode != DESCRIPTOR && u2->mode != DIRECT && u2->mode != COMPRESSED) )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    d = u2->durability;
+    if( d == NULL )
+    {
+        if( datasync(u2) == -1 )
+        {
+            _Unified2Diag(u2, UNIFIED2_DIAG_WRITE, 0, errno);
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    ticket = d->write_seq;
+    while( d->synced_seq < ticket && r == UNIFIED2_OK )
+    {
+        if( d->syncing )
+        {
+            pthread_cond_wait(&d->synced, &d->lock);
+        }
+        else
+        {
+            r = sync_locked(u2, d);
+        }
+    }
+    report_failures(u2, d);
+    pthread_mutex_unlock(&d->lock);
+
+    return r;
+}
+
+/* Function: Unified2GetSyncStats
+ *
+ * Purpose: Copy out the sync counters and latency histogram
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2SyncStats *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2GetSyncStats(Unified2 *u2, Unified2SyncStats *stats)
+{
+    Unified2Durability *d;
+
+    if( u2 == NULL || stats == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    d = u2->durability;
+    if( d == NULL )
+    {
+        memset(stats, 0x0, sizeof(Unified2SyncStats));
+        return UNIFIED2_OK;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    memcpy(stats, &d->stats, sizeof(Unified2SyncStats));
+    pthread_mutex_unlock(&d->lock);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: _Unified2SyncFree
+ *
+ * Purpose: Stop the policy, syncing anything it still owes, and release it.
+ *
+ * Arguements:
+ *      Unified2 *
+ *
+ * Returns:
+ *      void
+ */
+void _Unified2SyncFree(Unified2 *u2)
+{
+    Unified2Durability *d = u2->durability;
+
+    if( d == NULL )
+    {
+        return;
+    }
+
+    if( d->timer_running )
+    {
+        pthread_mutex_lock(&d->lock);
+        d->stopping = 1;
+        pthread_cond_signal(&d->wakeup);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->timer, NULL);
+    }
+
+    Unified2Sync(u2);
+
+    u2->durability = NULL;
+    pthread_cond_destroy(&d->wakeup);
+    pthread_cond_destroy(&d->synced);
+    pthread_mutex_destroy(&d->lock);
+    _Unified2Free(d, UNIFIED2_ALLOC_HANDLE);
+}
@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <poll.h>
 
 #ifdef LINUX
 #include <sys/stat.h>
@@ -27,6 +28,9 @@
 
 #include "unified2.h"
 
+#define UNIFIED2_STREAM_BUFFER (256 << 10)
+#define UNIFIED2_WRITE_CHUNK (1U << 30)
+
 /* Function: Unified2EntryNew
  *
  * Purpose: Allocate a new entry
@@ -41,7 +45,8 @@ Unified2Entry *Unified2EntryNew()
 {
     Unified2Entry *entry;
 
-    entry = (Unified2Entry *)malloc(sizeof(Unified2Entry));
+    entry = (Unified2Entry *)_Unified2Malloc(sizeof(Unified2Entry),
+        UNIFIED2_ALLOC_RECORD);
     if(entry == NULL)
     {
         warn("Unified2New: failed to malloc the u2: %s\n", strerror(errno));
@@ -73,39 +78,66 @@ HRESULT Unified2EntrySparseCleanup(Unified2Entry *entry )
     switch(entry->record->type)
     {
         case UNIFIED2_IDS_EVENT:
-        free(entry->event);
+        _Unified2Free(entry->event, UNIFIED2_ALLOC_RECORD);
         entry->event = NULL;
         break;
 
         case UNIFIED2_IDS_EVENT_V2:
-        free(entry->event_v2);
+        _Unified2Free(entry->event_v2, UNIFIED2_ALLOC_RECORD);
         entry->event_v2 = NULL;
         break;
 
         case UNIFIED2_IDS_EVENT_IPV6:
-        free(entry->event6);
+        _Unified2Free(entry->event6, UNIFIED2_ALLOC_RECORD);
         entry->event6 = NULL;
         break;
 
         case UNIFIED2_IDS_EVENT_IPV6_V2:
-        free(entry->event6_v2);
+        _Unified2Free(entry->event6_v2, UNIFIED2_ALLOC_RECORD);
         entry->event6_v2 = NULL;
         break;
 
         case UNIFIED2_PACKET:
-        free(entry->packet);
-        free(entry->packet_data);
+        _Unified2Free(entry->packet, UNIFIED2_ALLOC_RECORD);
+        _Unified2Free(entry->packet_data, UNIFIED2_ALLOC_RECORD);
         entry->packet = NULL;
         entry->packet_data = NULL;
         break;
+
+        case UNIFIED2_EXTRA_DATA:
+        _Unified2Free(entry->extra_data, UNIFIED2_ALLOC_RECORD);
+        entry->extra_data = NULL;
+        break;
     }
 
-    free(entry->record);
+    _Unified2Free(entry->record, UNIFIED2_ALLOC_RECORD);
     entry->record = NULL;
 
     return UNIFIED2_OK;
 }
 
+/* Function: Unified2EntryFree
+ *
+ * Purpose: Release an entry from Unified2EntryNew() and what it points at.
+ * With Unified2SetAllocator() in use this, rather than free(), has to be it.
+ *
+ * Arguements:
+ *      Unified2Entry *
+ *
+ * Returns:
+ *      void
+ */
+void Unified2EntryFree(Unified2Entry *entry)
+{
+    if( entry == NULL )
+    {
+        return;
+    }
+
+    Unified2EntrySparseCleanup(entry);
+    _Unified2Free(entry, UNIFIED2_ALLOC_RECORD);
+}
+
 /* Function: Unifiled2New
  *
  * Purpose: Allocate a new Unified2 structure.
@@ -120,7 +152,7 @@ Unified2 * Unified2New()
 {
     Unified2 *u2;
 
-    u2 = (Unified2 *)malloc(sizeof(Unified2));
+    u2 = (Unified2 *)_Unified2Malloc(sizeof(Unified2), UNIFIED2_ALLOC_HANDLE);
     if(u2 == NULL)
     {
         warn("Unified2New: failed to malloc the u2: %s\n", strerror(errno));
@@ -146,6 +178,10 @@ Unified2 * Unified2New()
 HRESULT Unified2ReadOpenFILE(Unified2 *u2, char *filename)
 {
     FILE *fh;
+    uint8_t magic[4];
+    int format;
+    int fd;
+    int n;
 
     if(u2 == NULL)
     {
@@ -166,15 +202,62 @@ HRESULT Unified2ReadOpenFILE(Unified2 *u2, char *filename)
         return UNIFIED2_ERROR;
     }
 
+    /* Records are read a few bytes at a time, make each refill count. The
+     * buffer has to be in place before the first read. */
+    u2->stream_buffer = _Unified2Malloc(UNIFIED2_STREAM_BUFFER,
+        UNIFIED2_ALLOC_BUFFER);
+    if( u2->stream_buffer != NULL )
+    {
+        setvbuf(fh, u2->stream_buffer, _IOFBF, UNIFIED2_STREAM_BUFFER);
+    }
+
+    /* Compressed containers are read through their descriptor, gzip and
+     * zstd streams are decompressed on a helper thread, which keeps reading
+     * through the buffer */
+    n = fread(magic, 1, sizeof(magic), fh);
+    format = _Unified2CompressedFormat(magic, n);
+    if( format )
+    {
+        rewind(fh);
+        u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+        if( _Unified2DecompressOpen(u2, -1, fh, format) != UNIFIED2_OK )
+        {
+            fclose(fh);
+            _Unified2Free(u2->stream_buffer, UNIFIED2_ALLOC_BUFFER);
+            u2->stream_buffer = NULL;
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+
+    if( _Unified2IsCompressed(magic, n) )
+    {
+        fd = dup(fileno(fh));
+        fclose(fh);
+        _Unified2Free(u2->stream_buffer, UNIFIED2_ALLOC_BUFFER);
+        u2->stream_buffer = NULL;
+        u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+        if( fd == -1 || _Unified2CompressedOpen(u2, fd) != UNIFIED2_OK )
+        {
+            if( fd != -1 )
+                close(fd);
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+    rewind(fh);
+
     u2->mode = STREAM;
     u2->fh = fh;
-    u2->filename = strdup(filename);
+    u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
 
     return UNIFIED2_OK;
 }
 
 HRESULT Unified2ReadOpenFILE_2(Unified2 *u2, FILE *file)
 {
+    int c;
+
     if(u2 == NULL)
     {
         return UNIFIED2_ERROR;
@@ -186,6 +269,20 @@ HRESULT Unified2ReadOpenFILE_2(Unified2 *u2, FILE *file)
         return UNIFIED2_ERROR;
     }
 
+    /* Only a single byte can be pushed back portably. Every record type
+     * starts with a zero byte, so the first one tells compressed input apart. */
+    c = getc(file);
+    if( c != EOF )
+    {
+        ungetc(c, file);
+
+        if( c == 0x1f || c == 0x28 )
+        {
+            return _Unified2DecompressOpen(u2, -1, file,
+                c == 0x1f ? UNIFIED2_CODEC_ZLIB : UNIFIED2_CODEC_ZSTD);
+        }
+    }
+
     u2->mode = STREAM;
     u2->fh = file;
 
@@ -204,7 +301,10 @@ HRESULT Unified2ReadOpenFILE_2(Unified2 *u2, FILE *file)
  */
 HRESULT Unified2ReadOpenFd(Unified2 *u2, char *filename)
 {
+    uint8_t magic[4];
+    int format;
     int fd;
+    int n;
 
     if(u2 == NULL)
     {
@@ -224,16 +324,41 @@ HRESULT Unified2ReadOpenFd(Unified2 *u2, char *filename)
         return UNIFIED2_ERROR;
     }
 
+    n = pread(fd, magic, sizeof(magic), 0);
+    format = _Unified2CompressedFormat(magic, n);
+    if( format )
+    {
+        u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+        if( _Unified2DecompressOpen(u2, fd, NULL, format) != UNIFIED2_OK )
+        {
+            close(fd);
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+
+    if( _Unified2IsCompressed(magic, n) )
+    {
+        u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
+        if( _Unified2CompressedOpen(u2, fd) != UNIFIED2_OK )
+        {
+            close(fd);
+            return UNIFIED2_ERROR;
+        }
+        return UNIFIED2_OK;
+    }
+
     u2->mode = DESCRIPTOR;
     u2->fd = fd;
-    u2->filename = strdup(filename);
+    u2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
 
     return UNIFIED2_OK;
 }
 
 /* Function: Unifiled2ReadOpenMemory
  *
- * Purpose: Read a Unified2 file from a memory buffer.
+ * Purpose: Read a Unified2 file from a memory buffer. The handle takes the
+ * buffer and frees it with free(), so it must come from malloc().
  *
  * Arguements:
  *      HRESULT
@@ -267,7 +392,32 @@ HRESULT Unified2ReadOpenMemory(Unified2 *u2, void *buf, int buf_size)
     u2->memory = buf;
     u2->memory_size = buf_size;
     u2->memory_offset = 0;
-    u2->filename = strdup("(memory buffer)");
+    u2->filename = _Unified2Strdup("(memory buffer)", UNIFIED2_ALLOC_HANDLE);
+
+    return UNIFIED2_OK;
+}
+
+/* Function: Unified2SetReadFlags
+ *
+ * Purpose: Choose which optional record types Unified2ReadNextEntry() decodes.
+ * Without UNIFIED2_READ_EXTRA_DATA extra data records are skipped, as they
+ * always were.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2SetReadFlags(Unified2 *u2, int flags)
+{
+    if( u2 == NULL )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    u2->read_flags = flags;
 
     return UNIFIED2_OK;
 }
@@ -288,6 +438,10 @@ HRESULT Unified2Free(Unified2 *u2)
 
     if( u2 != NULL )
     {
+        /* Pay off whatever the durability policy still owes before closing */
+        _Unified2SyncFree(u2);
+        _Unified2DiagFree(u2);
+
         switch( u2->mode )
         {
             case STREAM:
@@ -299,9 +453,30 @@ HRESULT Unified2Free(Unified2 *u2)
             break;
 
             case MEMORY:
+            /* The caller's, malloc()ed before it was handed over */
             free(u2->memory);
             break;
 
+            case DIRECT:
+            r = _Unified2DirectClose(u2);
+            break;
+
+            case COMPRESSED:
+            r = _Unified2CompressedClose(u2);
+            break;
+
+            case DECOMPRESS:
+            r = _Unified2DecompressClose(u2);
+            break;
+
+            case SHARED_MEMORY:
+            r = _Unified2ShmClose(u2);
+            break;
+
+            case MAPPED:
+            r = _Unified2MappedClose(u2);
+            break;
+
             case NONE:
             r = UNIFIED2_ERROR;
             break;
@@ -309,10 +484,14 @@ HRESULT Unified2Free(Unified2 *u2)
 
         if(u2->filename)
         {
-            free(u2->filename);
+            _Unified2Free(u2->filename, UNIFIED2_ALLOC_HANDLE);
         }
 
-        free(u2);
+        _Unified2Free(u2->stream_buffer, UNIFIED2_ALLOC_BUFFER);
+        _Unified2Free(u2->raw, UNIFIED2_ALLOC_BUFFER);
+        _Unified2StatsFree(u2);
+
+        _Unified2Free(u2, UNIFIED2_ALLOC_HANDLE);
         u2 = NULL;
     }
     else
@@ -334,6 +513,7 @@ HRESULT Unified2Free(Unified2 *u2)
  *      Unified2 *
  */
 int Unified2Eof(Unified2 *u2) {
+    uint64_t start;
     int r; 
     char *buf[4];
 
@@ -354,7 +534,9 @@ int Unified2Eof(Unified2 *u2) {
         break;
 
         case DESCRIPTOR:
+        start = _UNIFIED2_CLOCK(u2);
         r = read(u2->fd, buf, 4);
+        _UNIFIED2_COUNT(u2, syscalls, 1);
         if( r == 0 )
         {
             r = 1;
@@ -363,7 +545,9 @@ int Unified2Eof(Unified2 *u2) {
         {
             r = 0;
             lseek(u2->fd, -4, SEEK_CUR);
+            _UNIFIED2_COUNT(u2, syscalls, 1);
         }
+        _UNIFIED2_LATENCY(u2, read, start);
         break;
 
         case MEMORY:
@@ -377,22 +561,44 @@ int Unified2Eof(Unified2 *u2) {
         }
         break;
 
+        case COMPRESSED:
+        r = _Unified2CompressedEof(u2);
+        break;
+
+        case DECOMPRESS:
+        r = _Unified2DecompressEof(u2);
+        break;
+
+        case SHARED_MEMORY:
+        r = _Unified2ShmEof(u2);
+        break;
+
+        case MAPPED:
+        r = _Unified2MappedEof(u2);
+        break;
+
         default:
         case NONE:
         r = 1;
     }
 
+    if( r )
+    {
+        _UNIFIED2_PROBE1(eof, u2->offset);
+    }
+
     return r;
 }
 
 static ssize_t
-Read(int fildes, uint8_t * buf, uint32_t nbytes)
+Read(Unified2 *u2, uint8_t * buf, uint32_t nbytes)
 {
     ssize_t numread;
     unsigned total = 0;
 
     do {
-        numread = read(fildes, buf+total, nbytes-total);
+        numread = read(u2->fd, buf+total, nbytes-total);
+        _UNIFIED2_COUNT(u2, syscalls, 1);
         if (!numread)
             return 0;
         else if (numread > 0)
@@ -421,6 +627,7 @@ Read(int fildes, uint8_t * buf, uint32_t nbytes)
  */
 int Unified2Read(Unified2 *u2, void *buf, int size)
 {
+    uint64_t start = _UNIFIED2_CLOCK(u2);
     int bytes_read;
 
     switch( u2->mode )
@@ -430,7 +637,7 @@ int Unified2Read(Unified2 *u2, void *buf, int size)
         break;
 
         case DESCRIPTOR:
-        bytes_read = Read(u2->fd, buf, size);
+        bytes_read = Read(u2, buf, size);
         break;
 
         case MEMORY:
@@ -447,11 +654,34 @@ int Unified2Read(Unified2 *u2, void *buf, int size)
         u2->memory_offset += bytes_read;
         break;
 
+        case COMPRESSED:
+        bytes_read = _Unified2CompressedRead(u2, buf, size);
+        break;
+
+        case DECOMPRESS:
+        bytes_read = _Unified2DecompressRead(u2, buf, size);
+        break;
+
+        case SHARED_MEMORY:
+        bytes_read = _Unified2ShmRead(u2, buf, size);
+        break;
+
+        case MAPPED:
+        bytes_read = _Unified2MappedRead(u2, buf, size);
+        break;
+
         default:
         case NONE:
         bytes_read = 0;
     }
 
+    if( bytes_read > 0 )
+    {
+        u2->offset += bytes_read;
+        _UNIFIED2_COUNT(u2, bytes_read, bytes_read);
+    }
+    _UNIFIED2_LATENCY(u2, read, start);
+
     return bytes_read;
 
 }
@@ -501,7 +731,8 @@ int _Unified2MemSeek(Unified2 *u2, int offset, int whence) {
 
 /* Function: Unified2Seek
  *
- * Purpose: Seek through the Unified2 file
+ * Purpose: Seek through the Unified2 file and move u2->offset to the new
+ *          position, whichever whence was given
  *
  * Arguements:
  *      Unified2 *
@@ -509,24 +740,54 @@ int _Unified2MemSeek(Unified2 *u2, int offset, int whence) {
  *      int
  *
  * Returns:
- *      int
+ *      int 0 on success, -1 on failure
  */
 int Unified2Seek(Unified2 *u2, int offset, int whence)
 {
     int r;
+    off_t position = -1;
+    uint64_t base = 0;
 
     switch( u2->mode )
     {
         case STREAM:
         r = fseek(u2->fh, offset, whence);
+        if( r != -1 )
+            position = ftello(u2->fh);
         break;
 
         case DESCRIPTOR:
-        r = lseek(u2->fd, offset, whence);
+        position = lseek(u2->fd, offset, whence);
+        r = position == -1 ? -1 : 0;
+        _UNIFIED2_COUNT(u2, syscalls, 1);
         break;
 
         case MEMORY:
+        base = u2->offset - u2->memory_offset;
         r = _Unified2MemSeek(u2, offset, whence);
+        position = base + u2->memory_offset;
+        break;
+
+        case COMPRESSED:
+        r = _Unified2CompressedSeek(u2, offset, whence);
+        position = _Unified2CompressedTell(u2);
+        break;
+
+        case DECOMPRESS:
+        r = _Unified2DecompressSeek(u2, offset, whence);
+        position = u2->offset + offset;
+        break;
+
+        case SHARED_MEMORY:
+        r = _Unified2ShmSeek(u2, offset, whence);
+        position = u2->offset + offset;
+        break;
+
+        case MAPPED:
+        /* range handles start u2->offset at the range, not at 0 */
+        base = u2->offset - u2->map_offset;
+        r = _Unified2MappedSeek(u2, offset, whence);
+        position = base + u2->map_offset;
         break;
 
         default:
@@ -535,6 +796,12 @@ int Unified2Seek(Unified2 *u2, int offset, int whence)
  
     }
 
+    if( r != -1 && position != -1 )
+    {
+        u2->offset = position;
+    }
+    _UNIFIED2_PROBE3(seek, u2->offset, whence, r);
+
     return r;
 }
 
@@ -557,3 +824,69 @@ void warn(char *fmt, ...)
     va_end(ap);
 }
 
+
+/* Function: _Unified2WriteAll
+ *
+ * Purpose: Write the whole buffer to a descriptor, retrying short writes and
+ *          EINTR. A non-blocking descriptor that is full is waited on with
+ *          poll() instead of being retried in a loop.
+ *
+ * Arguements:
+ *      int
+ *      const void *
+ *      size_t
+ *
+ * Returns:
+ *      int 0 on success, -1 with errno set on failure
+ */
+int _Unified2WriteAll(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    struct pollfd pfd;
+    ssize_t n;
+
+    while( len > 0 )
+    {
+        n = write(fd, p,
+            len > UNIFIED2_WRITE_CHUNK ? UNIFIED2_WRITE_CHUNK : len);
+        if( n == -1 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+                return -1;
+
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if( poll(&pfd, 1, -1) == -1 && errno != EINTR )
+                return -1;
+            continue;
+        }
+        if( n == 0 )
+            return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Function: _Unified2Field32
+ *
+ * Purpose: Read a big-endian 32 bit field of a record, aligned or not
+ *
+ * Arguements:
+ *      const uint8_t *
+ *      int
+ *
+ * Returns:
+ *      uint32_t
+ */
+uint32_t _Unified2Field32(const uint8_t *body, int offset)
+{
+    uint32_t value;
+
+    memcpy(&value, body + offset, sizeof(value));
+
+    return ntohl(value);
+}
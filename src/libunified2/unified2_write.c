@@ -55,50 +55,134 @@ HRESULT Unified2WriteOpenFd(Unified2 *unified2, char *filename)
     }
 
     unified2->mode = DESCRIPTOR;
-    unified2->filename = strdup(filename);
+    unified2->filename = _Unified2Strdup(filename, UNIFIED2_ALLOC_HANDLE);
 
     return UNIFIED2_OK;
 }
 
-/* Function: Unified2Write
+static ssize_t
+Write(Unified2 *unified2, const uint8_t *buf, uint32_t nbytes)
+{
+    ssize_t numwrote;
+    unsigned total = 0;
+
+    do {
+        numwrote = write(unified2->fd, buf+total, nbytes-total);
+        _UNIFIED2_COUNT_SHARED(unified2, syscalls, 1);
+        if (numwrote > 0)
+            total += numwrote;
+        else if (numwrote == 0 || (errno != EINTR && errno != EAGAIN))
+            return -1;
+    } while (total < nbytes);
+
+    return total;
+}
+
+/* Function: write_data
  *
- * Purpose: Write to the unified2 file
+ * Purpose: Hand a buffer to whatever the handle writes to
  *
  * Arguements:
  *      Unified2 *
- *      void *
+ *      const void *
  *      int
  *
  * Returns:
- *      HRESULT
+ *      int
  */
-int Unified2Write(Unified2 *unified2, void *buf, int size)
+static int write_data(Unified2 *unified2, const void *buf, int size)
 {
     int bytes_wrote;
-    
+
+    if( unified2->mode == DIRECT && buf != NULL && size > 0 )
+    {
+        return _Unified2DirectWrite(unified2, buf, size);
+    }
+
+    if( unified2->mode == COMPRESSED && buf != NULL && size > 0 )
+    {
+        return _Unified2CompressedWrite(unified2, buf, size);
+    }
+
+    if( unified2->mode == SHARED_MEMORY && buf != NULL && size > 0 )
+    {
+        return _Unified2ShmWrite(unified2, buf, size);
+    }
+
     if( !unified2->fd || unified2->fd == -1 )
     {
-        warn("Unified2Write: invalid file descriptor\n");
+        errno = EBADF;
         return UNIFIED2_ERROR;
     }
 
-    if( buf == NULL )
+    if( buf == NULL || size <= 0 )
     {
-        warn("Unfiied2Write: buffer is null\n");
+        errno = EINVAL;
         return UNIFIED2_ERROR;
     }
 
-    if( size <= 0 )
+    bytes_wrote = Write(unified2, buf, size);
+    if( bytes_wrote == -1 )
     {
-        warn("Unified2Write: invalid size\n");
         return UNIFIED2_ERROR;
     }
 
-    bytes_wrote = write(unified2->fd, buf, size);
-    if( bytes_wrote == -1 )
+    return bytes_wrote;
+}
+
+/* Function: Unified2WriteData
+ *
+ * Purpose: Hand a buffer to the kernel without any durability accounting
+ *
+ * Arguements:
+ *      Unified2 *
+ *      const void *
+ *      int
+ *
+ * Returns:
+ *      int
+ */
+static int Unified2WriteData(Unified2 *unified2, const void *buf, int size)
+{
+    uint64_t start = _UNIFIED2_CLOCK(unified2);
+    int bytes_wrote;
+
+    bytes_wrote = write_data(unified2, buf, size);
+    _UNIFIED2_PROBE2(write, size, bytes_wrote);
+    if( bytes_wrote > 0 )
+    {
+        _UNIFIED2_COUNT_SHARED(unified2, bytes_written, bytes_wrote);
+    }
+
+    if( bytes_wrote != size )
+    {
+        _UNIFIED2_COUNT_SHARED(unified2, errors, 1);
+        _Unified2Diag(unified2, UNIFIED2_DIAG_WRITE, 0, errno);
+    }
+    _UNIFIED2_LATENCY_SHARED(unified2, write, start);
+
+    return bytes_wrote;
+}
+
+/* Function: Unified2Write
+ *
+ * Purpose: Write to the unified2 file
+ *
+ * Arguements:
+ *      Unified2 *
+ *      void *
+ *      int
+ *
+ * Returns:
+ *      HRESULT
+ */
+int Unified2Write(Unified2 *unified2, void *buf, int size)
+{
+    int bytes_wrote;
+
+    bytes_wrote = Unified2WriteData(unified2, buf, size);
+    if( bytes_wrote > 0 && _Unified2SyncCommit(unified2, 0, bytes_wrote) != UNIFIED2_OK )
     {
-        warn("Unified2Write: failed to write to the file %s: %s\n",
-        unified2->filename, strerror(errno));
         return UNIFIED2_ERROR;
     }
 
@@ -138,10 +222,12 @@ HRESULT Unified2WriteRecordHeader(Unified2 *unified2, Unified2RecordHeader *reco
     bytes_wrote = Unified2Write(unified2, record, sizeof(Unified2RecordHeader));
     if(bytes_wrote != sizeof(Unified2RecordHeader))
     {
-        warn("Unified2WriteRecord: failed to write Unified2RecordHeader\n");
         return UNIFIED2_ERROR;
     }
 
+    _UNIFIED2_COUNT_SHARED(unified2, records_written, 1);
+    _UNIFIED2_PROBE2(record__write, ntohl(record->type), ntohl(record->length));
+
     return UNIFIED2_OK;
 }
 
@@ -191,7 +277,6 @@ HRESULT Unified2WriteEvent(Unified2 *unified2, Unified2Event *event)
     bytes_wrote = Unified2Write(unified2, event, sizeof(Unified2Event));
     if(bytes_wrote != sizeof(Unified2Event))
     {
-        warn("Unified2WriteEvent: failed to write Unified2Event\n");
         return UNIFIED2_ERROR;
     }
 
@@ -247,7 +332,6 @@ HRESULT Unified2WriteEvent_v2(Unified2 *unified2, Unified2Event_v2 *event)
     bytes_wrote = Unified2Write(unified2, event, sizeof(Unified2Event_v2));
     if(bytes_wrote != sizeof(Unified2Event_v2))
     {
-        warn("Unified2WriteEvent_v2: failed to write Unified2Event_v2\n");
         return UNIFIED2_ERROR;
     }
 
@@ -298,7 +382,6 @@ HRESULT Unified2WriteEvent6(Unified2 *unified2, Unified2Event6 *event)
     bytes_wrote = Unified2Write(unified2, event, sizeof(Unified2Event6));
     if(bytes_wrote != sizeof(Unified2Event6))
     {
-        warn("Unified2WriteEvent6: failed to write Unified2Event6\n");
         return UNIFIED2_ERROR;
     }
 
@@ -352,7 +435,6 @@ HRESULT Unified2WriteEvent6_v2(Unified2 *unified2, Unified2Event6_v2 *event)
     bytes_wrote = Unified2Write(unified2, event, sizeof(Unified2Event6_v2));
     if(bytes_wrote != sizeof(Unified2Event6_v2))
     {
-        warn("Unified2WriteEvent6_v2: failed to write Unified2Event6_v2\n");
         return UNIFIED2_ERROR;
     }
 
@@ -396,7 +478,6 @@ HRESULT Unified2WritePacket(Unified2 *unified2, Unified2Packet *packet) {
     bytes_wrote = Unified2Write(unified2, packet, sizeof(Unified2Packet));
     if(bytes_wrote != sizeof(Unified2Packet))
     {
-        warn("Unified2WritePacket: failed to write Unified2Packet\n");
         return UNIFIED2_ERROR;
     }
 
@@ -434,71 +515,292 @@ HRESULT Unified2WritePacketData(Unified2 *unified2, void *packet_data, int packe
     bytes_wrote = Unified2Write(unified2, packet_data, packet_length);
     if(bytes_wrote != packet_length)
     {
-        warn("Unified2WritePacketData: failed to write packet data\n");
         return UNIFIED2_ERROR;
     }
 
     return UNIFIED2_OK;
 }
 
-/* Function: Unified2WriteRecord
+/* Function: Unified2SerializeRecord
  *
- * Purpose: Write the packet record
+ * Purpose: Encode an entry, record header included, into its network byte
+ * order wire format. The entry is left untouched. IPv4 addresses are kept in
+ * network order by the reader, so they are copied as they are.
  *
  * Arguements:
- *      Unified2 *
- *      Unified2Entry *
+ *      const Unified2Entry *
+ *      uint8_t *       destination buffer
+ *      int             size of the destination buffer
  *
  * Returns:
- *      HRESULT
+ *      int             bytes used, or -1 if the entry is unknown or does not
+ *                      fit in the buffer
  */
-HRESULT Unified2WriteRecord(Unified2 *unified2, const Unified2Entry *entry)
+int Unified2SerializeRecord(const Unified2Entry *entry, uint8_t *buf, int size)
 {
-    Unified2Entry *local;
-
-    local = (Unified2Entry *) malloc(sizeof(Unified2Entry));
-    memcpy(local, entry, sizeof(Unified2Entry));
-
-    if( unified2->fd == -1 )
+    Unified2RecordHeader record;
+    Unified2Event event;
+    Unified2Event_v2 event_v2;
+    Unified2Event6 event6;
+    Unified2Event6_v2 event6_v2;
+    Unified2Packet packet;
+    Unified2ExtraDataHdr extra_header;
+    Unified2ExtraData extra;
+    const void *body;
+    const void *data = NULL;
+    uint32_t data_length = 0;
+    int body_size;
+    int length;
+
+    if( entry == NULL || entry->record == NULL || buf == NULL )
     {
-        warn("Unified2WriteRecord: Invalid file descriptor\n");
-        return UNIFIED2_ERROR;
+        return -1;
     }
 
-    switch(entry->record->type)
+    switch( entry->record->type )
     {
         case UNIFIED2_IDS_EVENT:
-        Unified2WriteRecordHeader(unified2, local->record);
-        Unified2WriteEvent(unified2, local->event);
+        if( entry->event == NULL )
+            return -1;
+        event = *entry->event;
+        event.sensor_id = htonl(event.sensor_id);
+        event.event_id = htonl(event.event_id);
+        event.event_second = htonl(event.event_second);
+        event.event_microsecond = htonl(event.event_microsecond);
+        event.signature_id = htonl(event.signature_id);
+        event.generator_id = htonl(event.generator_id);
+        event.signature_revision = htonl(event.signature_revision);
+        event.classification_id = htonl(event.classification_id);
+        event.priority_id = htonl(event.priority_id);
+        event.sport_itype = htons(event.sport_itype);
+        event.dport_icode = htons(event.dport_icode);
+        event.pad = htons(event.pad);
+        body = &event;
+        body_size = sizeof(Unified2Event);
         break;
 
         case UNIFIED2_IDS_EVENT_V2:
-        Unified2WriteRecordHeader(unified2, local->record);
-        Unified2WriteEvent_v2(unified2, local->event_v2);
+        if( entry->event_v2 == NULL )
+            return -1;
+        event_v2 = *entry->event_v2;
+        event_v2.sensor_id = htonl(event_v2.sensor_id);
+        event_v2.event_id = htonl(event_v2.event_id);
+        event_v2.event_second = htonl(event_v2.event_second);
+        event_v2.event_microsecond = htonl(event_v2.event_microsecond);
+        event_v2.signature_id = htonl(event_v2.signature_id);
+        event_v2.generator_id = htonl(event_v2.generator_id);
+        event_v2.signature_revision = htonl(event_v2.signature_revision);
+        event_v2.classification_id = htonl(event_v2.classification_id);
+        event_v2.priority_id = htonl(event_v2.priority_id);
+        event_v2.sport_itype = htons(event_v2.sport_itype);
+        event_v2.dport_icode = htons(event_v2.dport_icode);
+        event_v2.pad = htons(event_v2.pad);
+        event_v2.mpls_label = htonl(event_v2.mpls_label);
+        event_v2.vlan_id = htons(event_v2.vlan_id);
+        event_v2.policy_id = htons(event_v2.policy_id);
+        body = &event_v2;
+        body_size = sizeof(Unified2Event_v2);
         break;
 
         case UNIFIED2_IDS_EVENT_IPV6:
-        Unified2WriteRecordHeader(unified2, local->record);
-        Unified2WriteEvent6(unified2, local->event6);
+        if( entry->event6 == NULL )
+            return -1;
+        event6 = *entry->event6;
+        event6.sensor_id = htonl(event6.sensor_id);
+        event6.event_id = htonl(event6.event_id);
+        event6.event_second = htonl(event6.event_second);
+        event6.event_microsecond = htonl(event6.event_microsecond);
+        event6.signature_id = htonl(event6.signature_id);
+        event6.generator_id = htonl(event6.generator_id);
+        event6.signature_revision = htonl(event6.signature_revision);
+        event6.classification_id = htonl(event6.classification_id);
+        event6.priority_id = htonl(event6.priority_id);
+        event6.sport_itype = htons(event6.sport_itype);
+        event6.dport_icode = htons(event6.dport_icode);
+        event6.pad = htons(event6.pad);
+        body = &event6;
+        body_size = sizeof(Unified2Event6);
         break;
 
         case UNIFIED2_IDS_EVENT_IPV6_V2:
-        Unified2WriteRecordHeader(unified2, local->record);
-        Unified2WriteEvent6_v2(unified2, local->event6_v2);
+        if( entry->event6_v2 == NULL )
+            return -1;
+        event6_v2 = *entry->event6_v2;
+        event6_v2.sensor_id = htonl(event6_v2.sensor_id);
+        event6_v2.event_id = htonl(event6_v2.event_id);
+        event6_v2.event_second = htonl(event6_v2.event_second);
+        event6_v2.event_microsecond = htonl(event6_v2.event_microsecond);
+        event6_v2.signature_id = htonl(event6_v2.signature_id);
+        event6_v2.generator_id = htonl(event6_v2.generator_id);
+        event6_v2.signature_revision = htonl(event6_v2.signature_revision);
+        event6_v2.classification_id = htonl(event6_v2.classification_id);
+        event6_v2.priority_id = htonl(event6_v2.priority_id);
+        event6_v2.sport_itype = htons(event6_v2.sport_itype);
+        event6_v2.dport_icode = htons(event6_v2.dport_icode);
+        event6_v2.pad = htons(event6_v2.pad);
+        event6_v2.mpls_label = htonl(event6_v2.mpls_label);
+        event6_v2.vlan_id = htons(event6_v2.vlan_id);
+        event6_v2.policy_id = htons(event6_v2.policy_id);
+        body = &event6_v2;
+        body_size = sizeof(Unified2Event6_v2);
         break;
 
         case UNIFIED2_PACKET:
-        /* XXX: Need to save off the packet_length while the value is still in
-         * host byte order because the write functions will change them to
-         * network byte order. */
-        //packet_length = entry->packet->packet_length;
-        Unified2WriteRecordHeader(unified2, local->record);
-        Unified2WritePacket(unified2, local->packet); 
-        Unified2WritePacketData(unified2, local->packet_data, entry->packet->packet_length);
+        if( entry->packet == NULL )
+            return -1;
+        if( entry->packet->packet_length && entry->packet_data == NULL )
+            return -1;
+        packet = *entry->packet;
+        packet.sensor_id = htonl(packet.sensor_id);
+        packet.event_id = htonl(packet.event_id);
+        packet.event_second = htonl(packet.event_second);
+        packet.packet_second = htonl(packet.packet_second);
+        packet.packet_microsecond = htonl(packet.packet_microsecond);
+        packet.linktype = htonl(packet.linktype);
+        packet.packet_length = htonl(packet.packet_length);
+        body = &packet;
+        body_size = sizeof(Unified2Packet);
+        data = entry->packet_data;
+        data_length = entry->packet->packet_length;
         break;
+
+        case UNIFIED2_EXTRA_DATA:
+        if( entry->extra_data == NULL || entry->extra_data->blob_length < 8 )
+            return -1;
+        data = UNIFIED2_EXTRA_DATA_BLOB(entry->extra_data);
+        data_length = UNIFIED2_EXTRA_DATA_LENGTH(entry->extra_data);
+        /* Snort's event type for extra data, and the length of the body */
+        extra_header.event_type = htonl(4);
+        extra_header.event_length = htonl(sizeof(Unified2ExtraDataHdr) +
+            sizeof(Unified2ExtraData) + data_length);
+        extra = *entry->extra_data;
+        extra.sensor_id = htonl(extra.sensor_id);
+        extra.event_id = htonl(extra.event_id);
+        extra.event_second = htonl(extra.event_second);
+        extra.type = htonl(extra.type);
+        extra.data_type = htonl(extra.data_type);
+        extra.blob_length = htonl(extra.blob_length);
+        body = &extra;
+        body_size = sizeof(Unified2ExtraData);
+        break;
+
         default:
-        warn("Unknown record type\n");
+        return -1;
     }
 
-    return UNIFIED2_OK;
+    length = sizeof(Unified2RecordHeader) + body_size + data_length;
+    if( entry->record->type == UNIFIED2_EXTRA_DATA )
+    {
+        length += sizeof(Unified2ExtraDataHdr);
+    }
+
+    if( length > size )
+    {
+        return -1;
+    }
+
+    record.type = htonl(entry->record->type);
+    record.length = htonl(entry->record->length);
+    memcpy(buf, &record, sizeof(Unified2RecordHeader));
+    buf += sizeof(Unified2RecordHeader);
+
+    if( entry->record->type == UNIFIED2_EXTRA_DATA )
+    {
+        memcpy(buf, &extra_header, sizeof(Unified2ExtraDataHdr));
+        buf += sizeof(Unified2ExtraDataHdr);
+    }
+
+    memcpy(buf, body, body_size);
+
+    if( data_length )
+    {
+        memcpy(buf + body_size, data, data_length);
+    }
+
+    return length;
+}
+
+/* Function: Unified2WriteRecord
+ *
+ * Purpose: Write a whole record with a single write, so that concurrent
+ * writers never interleave and the durability policy sees whole records.
+ *
+ * Arguements:
+ *      Unified2 *
+ *      Unified2Entry *
+ *
+ * Returns:
+ *      HRESULT
+ */
+HRESULT Unified2WriteRecord(Unified2 *unified2, const Unified2Entry *entry)
+{
+    uint8_t stack[512];
+    uint8_t *buf = stack;
+    int size = sizeof(stack);
+    int length;
+    int bytes_wrote;
+
+    if( unified2 == NULL || entry == NULL || entry->record == NULL )
+    {
+        warn("Unified2WriteRecord: NULL argument\n");
+        return UNIFIED2_ERROR;
+    }
+
+    if( unified2->fd == -1 )
+    {
+        warn("Unified2WriteRecord: Invalid file descriptor\n");
+        return UNIFIED2_ERROR;
+    }
+
+    /* Packets and extra data larger than the stack buffer get a heap one */
+    if( entry->record->type == UNIFIED2_PACKET && entry->packet != NULL &&
+        entry->packet->packet_length > size - sizeof(Unified2RecordHeader) - sizeof(Unified2Packet) )
+    {
+        size = sizeof(Unified2RecordHeader) + sizeof(Unified2Packet) +
+            entry->packet->packet_length;
+    }
+    else if( entry->record->type == UNIFIED2_EXTRA_DATA &&
+        entry->extra_data != NULL && entry->extra_data->blob_length > 8 &&
+        UNIFIED2_EXTRA_DATA_LENGTH(entry->extra_data) > size -
+        sizeof(Unified2RecordHeader) - sizeof(Unified2ExtraDataHdr) - sizeof(Unified2ExtraData) )
+    {
+        size = sizeof(Unified2RecordHeader) + sizeof(Unified2ExtraDataHdr) +
+            sizeof(Unified2ExtraData) + UNIFIED2_EXTRA_DATA_LENGTH(entry->extra_data);
+    }
+
+    if( size > (int)sizeof(stack) )
+    {
+        buf = (uint8_t *)_Unified2Malloc(size, UNIFIED2_ALLOC_BUFFER);
+        if( buf == NULL )
+        {
+            _Unified2Diag(unified2, UNIFIED2_DIAG_NOMEM, entry->record->type, errno);
+            return UNIFIED2_ERROR;
+        }
+    }
+
+    length = Unified2SerializeRecord(entry, buf, size);
+    if( length == -1 )
+    {
+        _Unified2Diag(unified2, UNIFIED2_DIAG_INVALID, entry->record->type, 0);
+        if( buf != stack )
+            _Unified2Free(buf, UNIFIED2_ALLOC_BUFFER);
+        return UNIFIED2_ERROR;
+    }
+
+    bytes_wrote = Unified2WriteData(unified2, buf, length);
+
+    if( buf != stack )
+    {
+        _Unified2Free(buf, UNIFIED2_ALLOC_BUFFER);
+    }
+
+    if( bytes_wrote != length )
+    {
+        return UNIFIED2_ERROR;
+    }
+
+    _UNIFIED2_COUNT_SHARED(unified2, records_written, 1);
+    _UNIFIED2_PROBE2(record__write, entry->record->type, length);
+
+    return _Unified2SyncCommit(unified2, 1, length);
 }
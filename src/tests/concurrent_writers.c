@@ -0,0 +1,215 @@
+/*******************************************************************************
+ * Several threads writing to one handle.
+ *
+ * SYNC_INTERVAL syncs from a helper thread and SYNC_GROUP lets any number of
+ * threads share a handle, so every writer has to take whole records from
+ * several threads at once. Each case writes WRITERS * RECORDS event records,
+ * one Unified2Write() per record, and reads the log back to check that every
+ * one of them made it and that the handle's statistics counted every write.
+ ******************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+
+#include "unified2.h"
+
+#define WRITERS 4
+#define RECORDS 20000
+
+typedef struct _Case {
+    const char *name;
+    int compressed;
+    SYNC_MODE sync;
+    uint32_t threshold;
+} Case;
+
+static const Case cases[] = {
+    { "descriptor/interval", 0, SYNC_INTERVAL, 1 },
+    { "descriptor/group", 0, SYNC_GROUP, 0 },
+    { "compressed/interval", 1, SYNC_INTERVAL, 1 },
+    { "compressed/group", 1, SYNC_GROUP, 0 },
+};
+
+typedef struct _Writer {
+    Unified2 *u2;
+    uint32_t id;
+    int failed;
+} Writer;
+
+/* Function: write_records
+ *
+ * Purpose: Writer thread, writes RECORDS event records of its own
+ *
+ * Arguements:
+ *      void *      Writer *
+ *
+ * Returns:
+ *      void *
+ */
+static void * write_records( void *arg ) {
+    Writer *w = (Writer *)arg;
+    struct {
+        Unified2RecordHeader header;
+        Unified2Event_v2 event;
+    } record;
+    uint32_t i;
+
+    memset(&record, 0x0, sizeof(record));
+    record.header.type = htonl(UNIFIED2_IDS_EVENT_V2);
+    record.header.length = htonl(sizeof(record.event));
+    record.event.sensor_id = htonl(w->id);
+
+    for( i = 0; i < RECORDS; i++ ) {
+        record.event.event_id = htonl(i);
+        if( Unified2Write(w->u2, &record, sizeof(record)) != sizeof(record) )
+            w->failed++;
+    }
+
+    return NULL;
+}
+
+/* Function: count_records
+ *
+ * Purpose: Count the records that read back from a log
+ *
+ * Arguements:
+ *      const char *
+ *
+ * Returns:
+ *      uint64_t
+ */
+static uint64_t count_records( const char *name ) {
+    const uint8_t *record;
+    uint32_t length;
+    uint64_t count = 0;
+    Unified2 *u2;
+
+    u2 = Unified2New();
+    if( u2 == NULL || Unified2ReadOpenFd(u2, (char *)name) != UNIFIED2_OK ) {
+        Unified2Free(u2);
+        return 0;
+    }
+
+    while( Unified2ReadRawRecord(u2, &record, &length) == UNIFIED2_OK )
+        count++;
+
+    Unified2Free(u2);
+
+    return count;
+}
+
+/* Function: run_case
+ *
+ * Purpose: Write from WRITERS threads at once and check what reads back
+ *
+ * Arguements:
+ *      const Case *
+ *
+ * Returns:
+ *      int         0 when every record was read back
+ */
+static int run_case( const Case *c ) {
+    static const char name[] = "concurrent_writers.u2";
+    pthread_t threads[WRITERS];
+    Writer writers[WRITERS];
+    Unified2Stats stats;
+    int counted = 0;
+    uint64_t count;
+    HRESULT r;
+    Unified2 *u2;
+    int failed = 0;
+    int i;
+
+    u2 = Unified2New();
+    if( u2 == NULL )
+        return -1;
+
+    if( c->compressed )
+        r = Unified2WriteOpenCompressed(u2, (char *)name,
+            UNIFIED2_CODEC_DEFAULT, 0);
+    else
+        r = Unified2WriteOpenFd(u2, (char *)name);
+
+    /* Not built with a codec */
+    if( r != UNIFIED2_OK && c->compressed ) {
+        printf("%-24s skipped\n", c->name);
+        Unified2Free(u2);
+        return 0;
+    }
+
+    if( r != UNIFIED2_OK ||
+        Unified2SetDurability(u2, c->sync, c->threshold) != UNIFIED2_OK ) {
+        printf("%-24s failed to open\n", c->name);
+        Unified2Free(u2);
+        return -1;
+    }
+
+    /* Not built with statistics */
+    counted = Unified2EnableStats(u2, UNIFIED2_STATS_LATENCY) == UNIFIED2_OK;
+
+    for( i = 0; i < WRITERS; i++ ) {
+        writers[i].u2 = u2;
+        writers[i].id = i;
+        writers[i].failed = 0;
+        pthread_create(&threads[i], NULL, write_records, &writers[i]);
+    }
+
+    for( i = 0; i < WRITERS; i++ ) {
+        pthread_join(threads[i], NULL);
+        failed += writers[i].failed;
+    }
+
+    if( counted && Unified2GetStats(u2, &stats) == UNIFIED2_OK &&
+        (stats.bytes_written != (uint64_t)WRITERS * RECORDS *
+            (sizeof(Unified2RecordHeader) + sizeof(Unified2Event_v2)) ||
+         stats.write.count != (uint64_t)WRITERS * RECORDS) ) {
+        printf("%-24s counted %llu writes of %llu bytes\n", c->name,
+            (unsigned long long)stats.write.count,
+            (unsigned long long)stats.bytes_written);
+        failed++;
+    }
+
+    if( Unified2Free(u2) != UNIFIED2_OK )
+        failed++;
+
+    count = count_records(name);
+    unlink(name);
+
+    printf("%-24s %llu of %d records, %d failed writes\n", c->name,
+        (unsigned long long)count, WRITERS * RECORDS, failed);
+
+    return count == WRITERS * RECORDS && failed == 0 ? 0 : -1;
+}
+
+/* Function: main
+ *
+ * Purpose: Its main yo!
+ *
+ * Arguements:
+ *      int
+ *      char **
+ *
+ * Returns:
+ *      int
+ */
+int main( int argc, char *argv[] ) {
+    size_t i;
+    int rc = 0;
+
+    for( i = 0; i < sizeof(cases) / sizeof(cases[0]); i++ ) {
+        if( run_case(&cases[i]) != 0 )
+            rc = 1;
+    }
+
+    return rc;
+}